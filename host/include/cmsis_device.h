@@ -0,0 +1,246 @@
+/*
+ * cmsis_device.h
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Host (Linux) stand-in for the STM32F7 CMSIS device header. It provides
+ * only the subset used by the QSPI driver: the QUADSPI register block, the
+ * DMA stream registers, the memory map constants and no-op cache maintenance
+ * functions.
+ *
+ * In C++, the QUADSPI registers that start or stop an operation on the
+ * controller (CR, FCR, CCR, AR) are seen by the host HAL when they are
+ * written by the driver itself, so that commands written at register level
+ * are executed like on the controller (see qspi-host-hal.cpp).
+ */
+
+#ifndef HOST_CMSIS_DEVICE_H_
+#define HOST_CMSIS_DEVICE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef  __cplusplus
+extern "C"
+{
+#endif
+
+  typedef enum
+  {
+    HAL_OK = 0x00U,
+    HAL_ERROR = 0x01U,
+    HAL_BUSY = 0x02U,
+    HAL_TIMEOUT = 0x03U
+  } HAL_StatusTypeDef;
+
+  typedef enum
+  {
+    HAL_UNLOCKED = 0x00U,
+    HAL_LOCKED = 0x01U
+  } HAL_LockTypeDef;
+
+#if defined (__cplusplus)
+  class qspi_host_register;
+
+  void
+  qspi_host_register_written (qspi_host_register* reg);
+
+  // A register whose writes are passed to the host controller
+  class qspi_host_register
+  {
+  public:
+    qspi_host_register&
+    operator= (uint32_t value)
+    {
+      value_ = value;
+      qspi_host_register_written (this);
+      return *this;
+    }
+
+    qspi_host_register&
+    operator= (const qspi_host_register& reg)
+    {
+      return *this = (uint32_t) reg;
+    }
+
+    qspi_host_register&
+    operator|= (uint32_t value)
+    {
+      return *this = value_ | value;
+    }
+
+    qspi_host_register&
+    operator&= (uint32_t value)
+    {
+      return *this = value_ & value;
+    }
+
+    operator uint32_t (void) const
+    {
+      return value_;
+    }
+
+  private:
+    volatile uint32_t value_;
+  };
+
+#define QSPI_HOST_REGISTER qspi_host_register
+#else
+#define QSPI_HOST_REGISTER volatile uint32_t
+#endif
+
+  typedef struct
+  {
+    QSPI_HOST_REGISTER CR;      // control register
+    volatile uint32_t DCR;      // device configuration register
+    volatile uint32_t SR;       // status register
+    QSPI_HOST_REGISTER FCR;     // flag clear register
+    volatile uint32_t DLR;      // data length register
+    QSPI_HOST_REGISTER CCR;     // communication configuration register
+    QSPI_HOST_REGISTER AR;      // address register
+    volatile uint32_t ABR;      // alternate bytes register
+    volatile uint32_t DR;       // data register
+    volatile uint32_t PSMKR;    // polling status mask register
+    volatile uint32_t PSMAR;    // polling status match register
+    volatile uint32_t PIR;      // polling interval register
+    volatile uint32_t LPTR;     // low-power timeout register
+  } QUADSPI_TypeDef;
+
+#define QUADSPI_CR_EN           (1U << 0)
+#define QUADSPI_CR_ABORT        (1U << 1)
+#define QUADSPI_CR_DMAEN        (1U << 2)
+#define QUADSPI_CR_TCEN         (1U << 3)
+#define QUADSPI_CR_SSHIFT       (1U << 4)
+#define QUADSPI_CR_TEIE         (1U << 16)
+#define QUADSPI_CR_TCIE         (1U << 17)
+#define QUADSPI_CR_FTIE         (1U << 18)
+#define QUADSPI_CR_SMIE         (1U << 19)
+#define QUADSPI_CR_TOIE         (1U << 20)
+#define QUADSPI_CR_APMS         (1U << 22)
+#define QUADSPI_CR_PMM          (1U << 23)
+
+#define QUADSPI_SR_TEF          (1U << 0)
+#define QUADSPI_SR_TCF          (1U << 1)
+#define QUADSPI_SR_FTF          (1U << 2)
+#define QUADSPI_SR_SMF          (1U << 3)
+#define QUADSPI_SR_TOF          (1U << 4)
+#define QUADSPI_SR_BUSY         (1U << 5)
+
+#define QUADSPI_FCR_CTEF        (1U << 0)
+#define QUADSPI_FCR_CTCF        (1U << 1)
+#define QUADSPI_FCR_CSMF        (1U << 3)
+#define QUADSPI_FCR_CTOF        (1U << 4)
+
+#define QUADSPI_CCR_DCYC_Pos    18U
+#define QUADSPI_CCR_ADMODE      (3U << 10)
+#define QUADSPI_CCR_DMODE       (3U << 24)
+#define QUADSPI_CCR_FMODE       (3U << 26)
+#define QUADSPI_CCR_FMODE_0     (1U << 26)
+#define QUADSPI_CCR_FMODE_1     (2U << 26)
+
+  // DMA stream registers; the address registers hold host pointers
+  typedef struct
+  {
+    volatile uint32_t CR;       // configuration register
+    volatile uint32_t NDTR;     // number of data register
+    volatile uintptr_t PAR;     // peripheral address register
+    volatile uintptr_t M0AR;    // memory 0 address register
+    volatile uintptr_t M1AR;    // memory 1 address register
+    volatile uint32_t FCR;      // FIFO control register
+  } DMA_Stream_TypeDef;
+
+#define DMA_SxCR_EN             (1U << 0)
+#define DMA_SxCR_DMEIE          (1U << 1)
+#define DMA_SxCR_TEIE           (1U << 2)
+#define DMA_SxCR_HTIE           (1U << 3)
+#define DMA_SxCR_TCIE           (1U << 4)
+#define DMA_SxCR_DIR            (3U << 6)
+#define DMA_SxCR_DIR_0          (1U << 6)
+#define DMA_SxCR_CIRC           (1U << 8)
+
+  // The host QUADSPI register block and memory-mapped window
+  QUADSPI_TypeDef*
+  qspi_host_registers (void);
+
+  uint8_t*
+  qspi_host_mapped_base (void);
+
+  // The host DMA stream serving the QUADSPI (stream 7 of DMA2 on the target)
+  DMA_Stream_TypeDef*
+  qspi_host_dma_stream (void);
+
+#define QUADSPI                 (qspi_host_registers ())
+#define DMA2_Stream7            (qspi_host_dma_stream ())
+#define QSPI_BASE               ((uintptr_t) qspi_host_mapped_base ())
+
+  // Anything located above this address is considered cacheable
+#define SRAM1_BASE              ((uintptr_t) 0)
+
+  extern uint32_t SystemCoreClock;
+
+  // Interrupt numbers of the peripherals used by the driver
+  typedef enum
+  {
+    DMA2_Stream7_IRQn = 70,
+    QUADSPI_IRQn = 92
+  } IRQn_Type;
+
+  static inline void
+  SCB_CleanDCache_by_Addr (uint32_t* addr, int32_t dsize)
+  {
+    (void) addr;
+    (void) dsize;
+  }
+
+  static inline void
+  SCB_InvalidateDCache_by_Addr (uint32_t* addr, int32_t dsize)
+  {
+    (void) addr;
+    (void) dsize;
+  }
+
+  static inline void
+  SCB_CleanInvalidateDCache_by_Addr (uint32_t* addr, int32_t dsize)
+  {
+    (void) addr;
+    (void) dsize;
+  }
+
+  static inline void
+  __DSB (void)
+  {
+  }
+
+  static inline void
+  __ISB (void)
+  {
+  }
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* HOST_CMSIS_DEVICE_H_ */
@@ -0,0 +1,304 @@
+/*
+ * quadspi.h
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Host (Linux) stand-in for the CubeMX generated quadspi.h header. It
+ * declares the subset of the STM32F7 HAL QSPI and DMA API used by the driver,
+ * with the same type layouts and constant values as the ST HAL. The functions
+ * are implemented in host/qspi-host-hal.cpp on top of an in-RAM NOR flash model.
+ */
+
+#ifndef HOST_QUADSPI_H_
+#define HOST_QUADSPI_H_
+
+#include "cmsis_device.h"
+
+#ifdef  __cplusplus
+extern "C"
+{
+#endif
+
+  typedef struct
+  {
+    uint32_t ClockPrescaler;
+    uint32_t FifoThreshold;
+    uint32_t SampleShifting;
+    uint32_t FlashSize;
+    uint32_t ChipSelectHighTime;
+    uint32_t ClockMode;
+    uint32_t FlashID;
+    uint32_t DualFlash;
+  } QSPI_InitTypeDef;
+
+  typedef enum
+  {
+    HAL_QSPI_STATE_RESET = 0x00U,
+    HAL_QSPI_STATE_READY = 0x01U,
+    HAL_QSPI_STATE_BUSY = 0x02U,
+    HAL_QSPI_STATE_BUSY_INDIRECT_TX = 0x12U,
+    HAL_QSPI_STATE_BUSY_INDIRECT_RX = 0x22U,
+    HAL_QSPI_STATE_BUSY_AUTO_POLLING = 0x42U,
+    HAL_QSPI_STATE_BUSY_MEM_MAPPED = 0x82U,
+    HAL_QSPI_STATE_ABORT = 0x08U,
+    HAL_QSPI_STATE_ERROR = 0x04U
+  } HAL_QSPI_StateTypeDef;
+
+  // The DMA handle fields used by the driver and the host HAL
+  typedef struct __DMA_HandleTypeDef
+  {
+    DMA_Stream_TypeDef* Instance;
+    void* Parent;
+    void
+    (*XferCpltCallback) (struct __DMA_HandleTypeDef* hdma);
+    void
+    (*XferErrorCallback) (struct __DMA_HandleTypeDef* hdma);
+    uintptr_t StreamBaseAddress;
+    uint32_t StreamIndex;
+  } DMA_HandleTypeDef;
+
+#define __HAL_LINKDMA(__HANDLE__, __PPP_DMA_FIELD__, __DMA_HANDLE__) \
+  do { \
+    (__HANDLE__)->__PPP_DMA_FIELD__ = &(__DMA_HANDLE__); \
+    (__DMA_HANDLE__).Parent = (__HANDLE__); \
+  } while (0)
+
+  typedef struct
+  {
+    QUADSPI_TypeDef* Instance;
+    QSPI_InitTypeDef Init;
+    uint8_t* pTxBuffPtr;
+    volatile uint32_t TxXferSize;
+    volatile uint32_t TxXferCount;
+    uint8_t* pRxBuffPtr;
+    volatile uint32_t RxXferSize;
+    volatile uint32_t RxXferCount;
+    DMA_HandleTypeDef* hdma;
+    volatile HAL_LockTypeDef Lock;
+    volatile HAL_QSPI_StateTypeDef State;
+    volatile uint32_t ErrorCode;
+    uint32_t Timeout;
+  } QSPI_HandleTypeDef;
+
+  typedef struct
+  {
+    uint32_t Instruction;
+    uint32_t Address;
+    uint32_t AlternateBytes;
+    uint32_t AddressSize;
+    uint32_t AlternateBytesSize;
+    uint32_t DummyCycles;
+    uint32_t InstructionMode;
+    uint32_t AddressMode;
+    uint32_t AlternateByteMode;
+    uint32_t DataMode;
+    uint32_t NbData;
+    uint32_t DdrMode;
+    uint32_t DdrHoldHalfCycle;
+    uint32_t SIOOMode;
+  } QSPI_CommandTypeDef;
+
+  typedef struct
+  {
+    uint32_t Match;
+    uint32_t Mask;
+    uint32_t Interval;
+    uint32_t StatusBytesSize;
+    uint32_t MatchMode;
+    uint32_t AutomaticStop;
+  } QSPI_AutoPollingTypeDef;
+
+  typedef struct
+  {
+    uint32_t TimeOutPeriod;
+    uint32_t TimeOutActivation;
+  } QSPI_MemoryMappedTypeDef;
+
+#define HAL_QSPI_ERROR_NONE             0x00000000U
+#define HAL_QSPI_ERROR_TIMEOUT          0x00000001U
+#define HAL_QSPI_ERROR_TRANSFER         0x00000002U
+#define HAL_QSPI_ERROR_DMA              0x00000004U
+#define HAL_QSPI_ERROR_INVALID_PARAM    0x00000008U
+
+#define QSPI_SAMPLE_SHIFTING_NONE       0x00000000U
+#define QSPI_SAMPLE_SHIFTING_HALFCYCLE  (1U << 4)
+
+#define QSPI_CS_HIGH_TIME_1_CYCLE       0x00000000U
+#define QSPI_CS_HIGH_TIME_2_CYCLE       (1U << 8)
+#define QSPI_CS_HIGH_TIME_3_CYCLE       (2U << 8)
+#define QSPI_CS_HIGH_TIME_4_CYCLE       (3U << 8)
+
+#define QSPI_CLOCK_MODE_0               0x00000000U
+#define QSPI_CLOCK_MODE_3               (1U << 0)
+
+#define QSPI_FLASH_ID_1                 0x00000000U
+#define QSPI_FLASH_ID_2                 (1U << 7)
+
+#define QSPI_DUALFLASH_ENABLE           (1U << 6)
+#define QSPI_DUALFLASH_DISABLE          0x00000000U
+
+#define QSPI_ADDRESS_8_BITS             0x00000000U
+#define QSPI_ADDRESS_16_BITS            (1U << 12)
+#define QSPI_ADDRESS_24_BITS            (2U << 12)
+#define QSPI_ADDRESS_32_BITS            (3U << 12)
+
+#define QSPI_ALTERNATE_BYTES_8_BITS     0x00000000U
+#define QSPI_ALTERNATE_BYTES_16_BITS    (1U << 16)
+#define QSPI_ALTERNATE_BYTES_24_BITS    (2U << 16)
+#define QSPI_ALTERNATE_BYTES_32_BITS    (3U << 16)
+
+#define QSPI_INSTRUCTION_NONE           0x00000000U
+#define QSPI_INSTRUCTION_1_LINE         (1U << 8)
+#define QSPI_INSTRUCTION_2_LINES        (2U << 8)
+#define QSPI_INSTRUCTION_4_LINES        (3U << 8)
+
+#define QSPI_ADDRESS_NONE               0x00000000U
+#define QSPI_ADDRESS_1_LINE             (1U << 10)
+#define QSPI_ADDRESS_2_LINES            (2U << 10)
+#define QSPI_ADDRESS_4_LINES            (3U << 10)
+
+#define QSPI_ALTERNATE_BYTES_NONE       0x00000000U
+#define QSPI_ALTERNATE_BYTES_1_LINE     (1U << 14)
+#define QSPI_ALTERNATE_BYTES_2_LINES    (2U << 14)
+#define QSPI_ALTERNATE_BYTES_4_LINES    (3U << 14)
+
+#define QSPI_DATA_NONE                  0x00000000U
+#define QSPI_DATA_1_LINE                (1U << 24)
+#define QSPI_DATA_2_LINES               (2U << 24)
+#define QSPI_DATA_4_LINES               (3U << 24)
+
+#define QSPI_DDR_MODE_DISABLE           0x00000000U
+#define QSPI_DDR_MODE_ENABLE            (1U << 31)
+
+#define QSPI_DDR_HHC_ANALOG_DELAY       0x00000000U
+#define QSPI_DDR_HHC_HALF_CLK_DELAY     (1U << 30)
+
+#define QSPI_SIOO_INST_EVERY_CMD        0x00000000U
+#define QSPI_SIOO_INST_ONLY_FIRST_CMD   (1U << 28)
+
+#define QSPI_MATCH_MODE_AND             0x00000000U
+#define QSPI_MATCH_MODE_OR              QUADSPI_CR_PMM
+
+#define QSPI_AUTOMATIC_STOP_DISABLE     0x00000000U
+#define QSPI_AUTOMATIC_STOP_ENABLE      QUADSPI_CR_APMS
+
+#define QSPI_TIMEOUT_COUNTER_DISABLE    0x00000000U
+#define QSPI_TIMEOUT_COUNTER_ENABLE     QUADSPI_CR_TCEN
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Init (QSPI_HandleTypeDef* hqspi);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_DeInit (QSPI_HandleTypeDef* hqspi);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Command (QSPI_HandleTypeDef* hqspi, QSPI_CommandTypeDef* cmd,
+                    uint32_t Timeout);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Transmit (QSPI_HandleTypeDef* hqspi, uint8_t* pData,
+                     uint32_t Timeout);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Receive (QSPI_HandleTypeDef* hqspi, uint8_t* pData,
+                    uint32_t Timeout);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Transmit_IT (QSPI_HandleTypeDef* hqspi, uint8_t* pData);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Receive_IT (QSPI_HandleTypeDef* hqspi, uint8_t* pData);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Transmit_DMA (QSPI_HandleTypeDef* hqspi, uint8_t* pData);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Receive_DMA (QSPI_HandleTypeDef* hqspi, uint8_t* pData);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_AutoPolling (QSPI_HandleTypeDef* hqspi, QSPI_CommandTypeDef* cmd,
+                        QSPI_AutoPollingTypeDef* cfg, uint32_t Timeout);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_AutoPolling_IT (QSPI_HandleTypeDef* hqspi,
+                           QSPI_CommandTypeDef* cmd,
+                           QSPI_AutoPollingTypeDef* cfg);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_MemoryMapped (QSPI_HandleTypeDef* hqspi, QSPI_CommandTypeDef* cmd,
+                         QSPI_MemoryMappedTypeDef* cfg);
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Abort (QSPI_HandleTypeDef* hqspi);
+
+  void
+  HAL_QSPI_IRQHandler (QSPI_HandleTypeDef* hqspi);
+
+  HAL_StatusTypeDef
+  HAL_DMA_Init (DMA_HandleTypeDef* hdma);
+
+  void
+  HAL_DMA_IRQHandler (DMA_HandleTypeDef* hdma);
+
+  void
+  HAL_NVIC_EnableIRQ (IRQn_Type irqn);
+
+  void
+  HAL_NVIC_DisableIRQ (IRQn_Type irqn);
+
+  HAL_QSPI_StateTypeDef
+  HAL_QSPI_GetState (QSPI_HandleTypeDef* hqspi);
+
+  uint32_t
+  HAL_QSPI_GetError (QSPI_HandleTypeDef* hqspi);
+
+  // Call-backs, to be (optionally) overridden by the application
+  void
+  HAL_QSPI_ErrorCallback (QSPI_HandleTypeDef* hqspi);
+
+  void
+  HAL_QSPI_AbortCpltCallback (QSPI_HandleTypeDef* hqspi);
+
+  void
+  HAL_QSPI_CmdCpltCallback (QSPI_HandleTypeDef* hqspi);
+
+  void
+  HAL_QSPI_RxCpltCallback (QSPI_HandleTypeDef* hqspi);
+
+  void
+  HAL_QSPI_TxCpltCallback (QSPI_HandleTypeDef* hqspi);
+
+  void
+  HAL_QSPI_StatusMatchCallback (QSPI_HandleTypeDef* hqspi);
+
+  void
+  HAL_QSPI_TimeOutCallback (QSPI_HandleTypeDef* hqspi);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* HOST_QUADSPI_H_ */
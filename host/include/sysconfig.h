@@ -0,0 +1,83 @@
+/*
+ * sysconfig.h
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Host (Linux) application configuration for the tests in the "test"
+ * directory. Every symbol can be overridden on the compiler command line.
+ */
+
+#ifndef HOST_SYSCONFIG_H_
+#define HOST_SYSCONFIG_H_
+
+// Run qspi_bench() from host/qspi-host-bench.cpp instead of the tests
+#ifndef QSPI_BENCH
+#define QSPI_BENCH false
+#endif
+
+// Run qspi_test_ftl() from host/qspi-host-test-ftl.cpp instead of the tests
+#ifndef QSPI_FTL_TEST
+#define QSPI_FTL_TEST false
+#endif
+
+// Run qspi_test_driver() from host/qspi-host-test-driver.cpp instead of the
+// tests
+#ifndef QSPI_DRIVER_TEST
+#define QSPI_DRIVER_TEST false
+#endif
+
+// Run test_qspi() from test-qspi.cpp (or test-qspi-c-api.c)
+#ifndef QSPI_TEST
+#if QSPI_BENCH == true || QSPI_FTL_TEST == true || QSPI_DRIVER_TEST == true
+#define QSPI_TEST false
+#else
+#define QSPI_TEST true
+#endif
+#endif
+
+// Use the driver's low level API instead of the block device API
+#ifndef FLASH_LOW_LEVEL_TEST
+#define FLASH_LOW_LEVEL_TEST false
+#endif
+
+// Run test_ff() from test-chan-fatfs.cpp (needs the chan-fatfs xpack)
+#ifndef FS_ENABLED
+#define FS_ENABLED false
+#endif
+
+#ifndef FILE_SYSTEM_TEST
+#define FILE_SYSTEM_TEST FS_ENABLED
+#endif
+
+#ifndef CONSOLE_ON_VCP
+#define CONSOLE_ON_VCP false
+#endif
+
+#if FS_ENABLED == true && !defined (M717)
+#define DISCO
+#endif
+
+#endif /* HOST_SYSCONFIG_H_ */
@@ -0,0 +1,370 @@
+/*
+ * qspi-host-bench.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Host (Linux) benchmark: run typical access patterns through the block
+ * device API and report the time they take on the virtual clock of the chip
+ * model (bus cycles, datasheet program/erase times and HAL overheads).
+ */
+
+#include <string.h>
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/posix-io/block-device.h>
+#include <cmsis-plus/posix-io/file-descriptors-manager.h>
+#include <cmsis-plus/diag/trace.h>
+
+#include "sysconfig.h"
+#include "qspi-flash.h"
+#include "qspi-ftl.h"
+#include "qspi-host-bench.h"
+
+#if QSPI_BENCH == true
+
+extern "C"
+{
+  QSPI_HandleTypeDef hqspi;
+}
+
+using namespace os;
+using namespace os::driver::stm32f7;
+
+os::posix::file_descriptors_manager descriptors_manager
+  { 8 };
+
+template class posix::block_device_lockable<qspi_impl, rtos::mutex>;
+using qspi = posix::block_device_lockable<qspi_impl, rtos::mutex>;
+
+os::rtos::mutex flash_mx
+  { "flash_mx" };
+
+qspi flash
+  { "flash", flash_mx, &hqspi };
+
+posix::block_device_implementable<qspi_ftl> ftl
+  { "ftl", flash.impl (), 512 };
+
+void
+HAL_QSPI_StatusMatchCallback (QSPI_HandleTypeDef* phqspi)
+{
+  if (phqspi == &hqspi)
+    {
+      flash.impl ().cb_event ();
+    }
+}
+
+void
+HAL_QSPI_RxCpltCallback (QSPI_HandleTypeDef* phqspi)
+{
+  if (phqspi == &hqspi)
+    {
+      flash.impl ().cb_event ();
+    }
+}
+
+void
+HAL_QSPI_TxCpltCallback (QSPI_HandleTypeDef* phqspi)
+{
+  if (phqspi == &hqspi)
+    {
+      flash.impl ().cb_event ();
+    }
+}
+
+namespace
+{
+  constexpr size_t BENCH_SIZE = 256 * 1024;
+  constexpr size_t UPDATES = 1024;
+
+  void
+  report (const char* name, uint64_t ns, size_t bytes)
+  {
+    trace::printf ("%-32s %12.3f ms", name, ns / 1e6);
+    if (bytes != 0 && ns != 0)
+      {
+        trace::printf (" %10.1f KB/s", (bytes * 1e9) / (ns * 1024.0));
+      }
+    trace::printf ("\n");
+  }
+}
+
+/**
+ * @brief  Run the benchmark on the area at the beginning of the chip.
+ * @param  chip: the chip model wired to hqspi.
+ */
+void
+qspi_bench (qspi_nor_model& chip)
+{
+  // data in the last 64K block, outside the benchmark area, as on a chip in
+  // use; the DTR reads are not enabled on a blank chip (see verify_dtr())
+  for (size_t i = 0; i < 0x10000; i++)
+    {
+      chip.memory ()[chip.size () - 0x10000 + i] = (uint8_t) (i * 13 + 1);
+    }
+
+  posix::block_device* blk_dev =
+      static_cast<posix::block_device*> (posix::open ("/dev/flash", 0));
+  if (blk_dev == nullptr)
+    {
+      trace::printf ("Failed to open the flash device\n");
+      return;
+    }
+
+  size_t block_size = blk_dev->block_physical_size_bytes ();
+  size_t blocks = BENCH_SIZE / block_size;
+  uint8_t* buff = new uint8_t[BENCH_SIZE];
+  uint64_t start;
+
+  for (size_t i = 0; i < BENCH_SIZE; i++)
+    {
+      buff[i] = (uint8_t) (i * 7 + (i >> 8));
+    }
+
+  trace::printf ("Benchmark on %u KB, virtual time\n",
+                 (unsigned) (BENCH_SIZE / 1024));
+
+  // erase the area with 4K sector erases, then with 64K block erases
+  start = chip.now ();
+  for (uint32_t addr = 0; addr < BENCH_SIZE; addr += 0x1000)
+    {
+      flash.impl ().erase_sector (addr / 0x1000);
+    }
+  report ("erase, 4K sectors", chip.now () - start, BENCH_SIZE);
+
+  start = chip.now ();
+  for (uint32_t addr = 0; addr < BENCH_SIZE; addr += 0x10000)
+    {
+      flash.impl ().erase_block64K (addr);
+    }
+  report ("erase, 64K blocks", chip.now () - start, BENCH_SIZE);
+
+  start = chip.now ();
+  flash.impl ().erase_range (0, BENCH_SIZE);
+  report ("erase range, already blank", chip.now () - start, BENCH_SIZE);
+
+  // sequential block writes, on erased and on programmed flash
+  start = chip.now ();
+  for (size_t i = 0; i < blocks; i++)
+    {
+      blk_dev->write_block (buff + i * block_size, i, 1);
+    }
+  report ("write blocks, erased flash", chip.now () - start, BENCH_SIZE);
+
+  for (size_t i = 0; i < BENCH_SIZE; i++)
+    {
+      buff[i] = ~buff[i];
+    }
+  start = chip.now ();
+  for (size_t i = 0; i < blocks; i++)
+    {
+      blk_dev->write_block (buff + i * block_size, i, 1);
+    }
+  report ("rewrite blocks", chip.now () - start, BENCH_SIZE);
+
+  for (size_t i = 0; i < BENCH_SIZE; i++)
+    {
+      buff[i] = ~buff[i];
+    }
+  start = chip.now ();
+  for (size_t i = 0; i < blocks; i += 16)
+    {
+      blk_dev->write_block (buff + i * block_size, i, 16);
+    }
+  report ("rewrite, 16 blocks at a time", chip.now () - start, BENCH_SIZE);
+
+  // updates that only clear bits, e.g. FAT entries or allocation bitmaps
+  for (size_t i = 0; i < BENCH_SIZE; i++)
+    {
+      buff[i] &= 0xF0;
+    }
+  start = chip.now ();
+  for (size_t i = 0; i < blocks; i++)
+    {
+      blk_dev->write_block (buff + i * block_size, i, 1);
+    }
+  report ("rewrite blocks, clear bits only", chip.now () - start, BENCH_SIZE);
+
+  start = chip.now ();
+  for (size_t i = 0; i < blocks; i++)
+    {
+      blk_dev->write_block (buff + i * block_size, i, 1);
+    }
+  report ("rewrite blocks, unchanged", chip.now () - start, BENCH_SIZE);
+
+  // sequential reads, one block and 16 blocks at a time
+  start = chip.now ();
+  for (size_t i = 0; i < blocks; i++)
+    {
+      blk_dev->read_block (buff + i * block_size, i, 1);
+    }
+  report ("read, 1 block", chip.now () - start, BENCH_SIZE);
+
+  start = chip.now ();
+  for (size_t i = 0; i < blocks; i += 16)
+    {
+      blk_dev->read_block (buff + i * block_size, i, 16);
+    }
+  report ("read, 16 blocks", chip.now () - start, BENCH_SIZE);
+
+  start = chip.now ();
+  blk_dev->read_block (buff, 0, blocks);
+  report ("read, all blocks at once", chip.now () - start, BENCH_SIZE);
+  if (memcmp (buff, chip.memory (), BENCH_SIZE) != 0)
+    {
+      trace::printf ("Compare error\n");
+    }
+
+  // small scattered reads, as done by a file system
+  start = chip.now ();
+  for (uint32_t i = 0; i < 256; i++)
+    {
+      flash.impl ().read (((i * 37) % 512) * 512, buff, 512);
+    }
+  report ("read, 256 x 512 bytes", chip.now () - start, 256 * 512);
+
+  // the same reads copied from the memory-mapped window; the model does not
+  // see the loads from the window, their bus cycles are charged here
+  flash.impl ().set_mapped_reads (true);
+  start = chip.now ();
+  for (uint32_t i = 0; i < 256; i++)
+    {
+      flash.impl ().read (((i * 37) % 512) * 512, buff, 512);
+      chip.charge_mapped (((i * 37) % 512) * 512, 512);
+    }
+  report ("read, 256 x 512 bytes, mapped", chip.now () - start, 256 * 512);
+  flash.impl ().set_mapped_reads (false);
+
+  start = chip.now ();
+  flash.impl ().erase_range (0, BENCH_SIZE);
+  report ("erase range, minimum wear", chip.now () - start, BENCH_SIZE);
+
+  blk_dev->write_block (buff, 0, blocks);
+  flash.impl ().set_erase_policy (qspi_impl::erase_max_speed);
+  start = chip.now ();
+  flash.impl ().erase_range (0, BENCH_SIZE);
+  report ("erase range, maximum speed", chip.now () - start, BENCH_SIZE);
+  flash.impl ().set_erase_policy (qspi_impl::erase_min_wear);
+
+  // repeated small updates of the same few blocks (e.g. FAT and directory
+  // entries), written through and with the write-back cache
+  for (int pass = 0; pass < 2; pass++)
+    {
+      start = chip.now ();
+      for (size_t n = 0; n < 16; n++)
+        {
+          for (size_t i = 0; i < 4; i++)
+            {
+              buff[i * block_size + n] ^= 0xFF;
+              blk_dev->write_block (buff + i * block_size, i, 1);
+            }
+        }
+      blk_dev->sync ();
+      report (pass == 0 ? "update 4 blocks x 16, no cache" :
+                          "update 4 blocks x 16, cached",
+              chip.now () - start, 16 * 4 * block_size);
+
+      blk_dev->close ();
+      flash.impl ().set_cache (8, 0);
+      blk_dev->open ();
+    }
+  blk_dev->close ();
+  flash.impl ().set_cache (0, 0);
+
+  // sequential stream of single block reads, with read-ahead; the host HAL
+  // completes the DMA transfers synchronously, so only the saved command
+  // overheads show here, not the overlap with the caller's processing
+  flash.impl ().set_read_ahead (8);
+  blk_dev->open ();
+  start = chip.now ();
+  for (size_t i = 0; i < blocks; i++)
+    {
+      blk_dev->read_block (buff + i * block_size, i, 1);
+    }
+  report ("read, 1 block, read-ahead", chip.now () - start, BENCH_SIZE);
+  if (memcmp (buff, chip.memory (), BENCH_SIZE) != 0)
+    {
+      trace::printf ("Compare error\n");
+    }
+  blk_dev->close ();
+  flash.impl ().set_read_ahead (0);
+  blk_dev->open ();
+
+  // random 512 bytes updates (e.g. FAT and directory sectors), in place
+  // (read, modify and write back the whole block) and through the flash
+  // translation layer
+  srand (1);
+  start = chip.now ();
+  for (size_t n = 0; n < UPDATES; n++)
+    {
+      size_t sector = rand () % (BENCH_SIZE / 512);
+      size_t i = sector * 512 / block_size;
+      blk_dev->read_block (buff + i * block_size, i, 1);
+      buff[sector * 512 + n % 512] ^= 0xFF;
+      blk_dev->write_block (buff + i * block_size, i, 1);
+    }
+  report ("update 1024 x 512 bytes, in place", chip.now () - start,
+          UPDATES * 512);
+
+  const qspi_nor_model::stats_t& stats = chip.stats ();
+  trace::printf ("Totals: read %.3f ms, program %.3f ms, erase %.3f ms, "
+                 "%llu status polls while busy\n",
+                 stats.read_ns / 1e6, stats.program_ns / 1e6,
+                 stats.erase_ns / 1e6, (unsigned long long) stats.busy_polls);
+  blk_dev->close ();
+
+  if (ftl.open () == 0)
+    {
+      for (size_t sector = 0; sector < BENCH_SIZE / 512; sector++)
+        {
+          ftl.write_block (buff + sector * 512, sector, 1);
+        }
+      srand (1);
+      start = chip.now ();
+      for (size_t n = 0; n < UPDATES; n++)
+        {
+          size_t sector = rand () % (BENCH_SIZE / 512);
+          buff[sector * 512 + n % 512] ^= 0xFF;
+          ftl.write_block (buff + sector * 512, sector, 1);
+        }
+      report ("update 1024 x 512 bytes, FTL", chip.now () - start,
+              UPDATES * 512);
+      ftl.read_block (buff + BENCH_SIZE / 2, 0, BENCH_SIZE / 2 / 512);
+      if (memcmp (buff, buff + BENCH_SIZE / 2, BENCH_SIZE / 2) != 0)
+        {
+          trace::printf ("Compare error\n");
+        }
+      qspi_ftl::ftl_stats_t ftl_stats = ftl.impl ().get_stats ();
+      trace::printf ("FTL: %u relocations, %u erases, erase counts %u..%u\n",
+                     ftl_stats.relocations, ftl_stats.erases,
+                     ftl_stats.min_erase_count, ftl_stats.max_erase_count);
+      ftl.close ();
+    }
+
+  delete[] buff;
+}
+
+#endif
@@ -0,0 +1,927 @@
+/*
+ * qspi-host-hal.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file implements the subset of the STM32F7 HAL QSPI API used by the
+ * driver on a host, on top of the qspi_nor_model flash chip model.
+ *
+ * The command is latched in the QUADSPI register block exactly as the HAL
+ * does on the target (CCR, AR, ABR, DLR) and decoded back when the data
+ * phase starts. Interrupt and DMA transfers complete immediately: the
+ * completion call-back is invoked before the HAL function returns, as if
+ * the interrupt fired right away.
+ *
+ * Every HAL call and every interrupt is charged to the virtual clock of the
+ * chip model with the software overheads of its timing table; auto-polling
+ * lets the virtual time run until the chip is no longer busy.
+ *
+ * The writes of the driver to the QUADSPI registers, outside of the HAL
+ * calls, act like on the controller: a command written at register level
+ * starts with the write of CCR or AR, its data phase when the DMA is enabled
+ * (the DMA stream linked to the HAL handle is served), and the enabled
+ * interrupts are raised through HAL_QSPI_IRQHandler() and
+ * HAL_DMA_IRQHandler(), as the vector table does on the target.
+ */
+
+#include "quadspi.h"
+#include "qspi-nor-model.h"
+
+using namespace os::driver::stm32f7;
+
+uint32_t SystemCoreClock = 216000000;
+
+namespace
+{
+  constexpr uint32_t CCR_INSTRUCTION = 0xFFU;
+  constexpr uint32_t CCR_IMODE = 3U << 8;
+  constexpr uint32_t CCR_ADMODE = 3U << 10;
+  constexpr uint32_t CCR_ADSIZE = 3U << 12;
+  constexpr uint32_t CCR_ABMODE = 3U << 14;
+  constexpr uint32_t CCR_ABSIZE = 3U << 16;
+  constexpr uint32_t CCR_DCYC_POS = 18;
+  constexpr uint32_t CCR_DCYC = 0x1FU << CCR_DCYC_POS;
+  constexpr uint32_t CCR_DMODE = 3U << 24;
+  constexpr uint32_t CCR_FMODE = 3U << 26;
+  constexpr uint32_t CCR_SIOO = 1U << 28;
+  constexpr uint32_t CCR_DHHC = 1U << 30;
+  constexpr uint32_t CCR_DDRM = 1U << 31;
+
+  constexpr uint32_t FMODE_INDIRECT_WRITE = 0U << 26;
+  constexpr uint32_t FMODE_INDIRECT_READ = 1U << 26;
+  constexpr uint32_t FMODE_AUTO_POLLING = 2U << 26;
+  constexpr uint32_t FMODE_MEMORY_MAPPED = 3U << 26;
+
+  QUADSPI_TypeDef registers;
+  DMA_Stream_TypeDef dma_stream;
+
+  // DMA2 flag registers, as seen from DMA_HandleTypeDef::StreamBaseAddress
+  struct
+  {
+    volatile uint32_t ISR;
+    volatile uint32_t Reserved0;
+    volatile uint32_t IFCR;
+  } dma_flags;
+
+  // Nesting of the HAL functions; the register writes done by the HAL
+  // itself are not acted upon as register-level commands
+  int hal_depth;
+
+  // The QUADSPI interrupt line, as masked by HAL_NVIC_DisableIRQ(); an
+  // interrupt raised while masked is held pending until unmasked
+  bool irq_masked;
+  QSPI_HandleTypeDef* irq_pending;
+  bool irq_pending_match;
+
+  class hal_scope
+  {
+  public:
+    hal_scope (void)
+    {
+      hal_depth++;
+    }
+
+    ~hal_scope ()
+    {
+      hal_depth--;
+    }
+  };
+
+  /**
+   * @brief  Latch a command into the QUADSPI registers. Like the ST HAL, the
+   *    address and alternate bytes fields are used only if their phase is
+   *    enabled.
+   */
+  void
+  latch (QSPI_HandleTypeDef* hqspi, const QSPI_CommandTypeDef* cmd,
+         uint32_t fmode)
+  {
+    hal_scope scope;
+    QUADSPI_TypeDef* regs = hqspi->Instance;
+    uint32_t ccr = (cmd->Instruction & CCR_INSTRUCTION) | cmd->InstructionMode
+        | ((cmd->DummyCycles << CCR_DCYC_POS) & CCR_DCYC) | cmd->DataMode
+        | cmd->DdrMode | cmd->DdrHoldHalfCycle | cmd->SIOOMode | fmode;
+
+    if (cmd->DataMode != QSPI_DATA_NONE)
+      {
+        regs->DLR = cmd->NbData - 1;
+      }
+    if (cmd->AlternateByteMode != QSPI_ALTERNATE_BYTES_NONE)
+      {
+        regs->ABR = cmd->AlternateBytes;
+        ccr |= cmd->AlternateByteMode | cmd->AlternateBytesSize;
+      }
+    if (cmd->AddressMode != QSPI_ADDRESS_NONE)
+      {
+        ccr |= cmd->AddressMode | cmd->AddressSize;
+        regs->CCR = ccr;
+        regs->AR = cmd->Address;
+      }
+    else
+      {
+        regs->CCR = ccr;
+      }
+    regs->SR |= QUADSPI_SR_TCF;
+  }
+
+  /**
+   * @brief  Decode the command latched in the QUADSPI registers.
+   */
+  QSPI_CommandTypeDef
+  latched (QSPI_HandleTypeDef* hqspi)
+  {
+    QUADSPI_TypeDef* regs = hqspi->Instance;
+    QSPI_CommandTypeDef cmd;
+
+    cmd.Instruction = regs->CCR & CCR_INSTRUCTION;
+    cmd.InstructionMode = regs->CCR & CCR_IMODE;
+    cmd.AddressMode = regs->CCR & CCR_ADMODE;
+    cmd.AddressSize = regs->CCR & CCR_ADSIZE;
+    cmd.AlternateByteMode = regs->CCR & CCR_ABMODE;
+    cmd.AlternateBytesSize = regs->CCR & CCR_ABSIZE;
+    cmd.DummyCycles = (regs->CCR & CCR_DCYC) >> CCR_DCYC_POS;
+    cmd.DataMode = regs->CCR & CCR_DMODE;
+    cmd.DdrMode = regs->CCR & CCR_DDRM;
+    cmd.DdrHoldHalfCycle = regs->CCR & CCR_DHHC;
+    cmd.SIOOMode = regs->CCR & CCR_SIOO;
+    cmd.Address = regs->AR;
+    cmd.AlternateBytes = regs->ABR;
+    cmd.NbData = regs->DLR + 1;
+    return cmd;
+  }
+
+  /**
+   * @brief  Charge a software overhead to the virtual clock of the chip.
+   * @param  hqspi: HAL qspi handle of the controller.
+   * @param  interrupt: true for an interrupt, false for a HAL call.
+   */
+  void
+  charge (QSPI_HandleTypeDef* hqspi, bool interrupt)
+  {
+    qspi_nor_model* chip = qspi_nor_model::attached (hqspi);
+    if (chip != nullptr)
+      {
+        chip->advance (
+            interrupt ?
+                chip->timing ().interrupt_ns : chip->timing ().command_ns);
+      }
+  }
+
+  /**
+   * @brief  Abort the current operation, as the controller does when
+   *    QUADSPI_CR_ABORT is set.
+   */
+  void
+  abort (QSPI_HandleTypeDef* hqspi)
+  {
+    hal_scope scope;
+    qspi_nor_model* chip = qspi_nor_model::attached (hqspi);
+
+    if (chip != nullptr)
+      {
+        chip->unmap ();
+      }
+    hqspi->Instance->CR &= ~(QUADSPI_CR_ABORT | QUADSPI_CR_DMAEN);
+    hqspi->Instance->CCR &= ~CCR_FMODE;
+    hqspi->Instance->SR |= QUADSPI_SR_TCF;
+  }
+
+  /**
+   * @brief  Honour an abort requested by writing QUADSPI_CR_ABORT directly.
+   */
+  void
+  service_abort (QSPI_HandleTypeDef* hqspi)
+  {
+    hal_scope scope;
+    if (hqspi->Instance->CR & QUADSPI_CR_ABORT)
+      {
+        hqspi->Instance->CR &= ~QUADSPI_CR_ABORT;
+        qspi_nor_model* chip = qspi_nor_model::attached (hqspi);
+        if (chip != nullptr)
+          {
+            chip->unmap ();
+          }
+      }
+  }
+
+  HAL_StatusTypeDef
+  check_ready (QSPI_HandleTypeDef* hqspi)
+  {
+    if (hqspi == nullptr || hqspi->Instance == nullptr)
+      {
+        return HAL_ERROR;
+      }
+    service_abort (hqspi);
+    return (hqspi->State == HAL_QSPI_STATE_READY) ? HAL_OK : HAL_BUSY;
+  }
+
+  /**
+   * @brief  Run the data phase of the latched command.
+   */
+  HAL_StatusTypeDef
+  transfer (QSPI_HandleTypeDef* hqspi, uint8_t* pData, bool to_chip)
+  {
+    hal_scope scope;
+    HAL_StatusTypeDef status = check_ready (hqspi);
+
+    if (status == HAL_OK)
+      {
+        if (pData == nullptr)
+          {
+            hqspi->ErrorCode = HAL_QSPI_ERROR_INVALID_PARAM;
+            return HAL_ERROR;
+          }
+
+        QSPI_CommandTypeDef cmd = latched (hqspi);
+        qspi_nor_model* chip = qspi_nor_model::attached (hqspi);
+
+        charge (hqspi, false);
+        hqspi->ErrorCode = HAL_QSPI_ERROR_NONE;
+        hqspi->Instance->CCR = (hqspi->Instance->CCR & ~CCR_FMODE)
+            | (to_chip ? FMODE_INDIRECT_WRITE : FMODE_INDIRECT_READ);
+        if (to_chip)
+          {
+            hqspi->State = HAL_QSPI_STATE_BUSY_INDIRECT_TX;
+            hqspi->pTxBuffPtr = pData;
+            hqspi->TxXferSize = hqspi->TxXferCount = cmd.NbData;
+            if (chip != nullptr)
+              {
+                chip->transmit (&cmd, pData, cmd.NbData);
+              }
+            hqspi->TxXferCount = 0;
+          }
+        else
+          {
+            hqspi->State = HAL_QSPI_STATE_BUSY_INDIRECT_RX;
+            hqspi->pRxBuffPtr = pData;
+            hqspi->RxXferSize = hqspi->RxXferCount = cmd.NbData;
+            if (chip != nullptr)
+              {
+                chip->receive (&cmd, pData, cmd.NbData);
+              }
+            else
+              {
+                for (uint32_t i = 0; i < cmd.NbData; i++)
+                  {
+                    pData[i] = 0xFF;
+                  }
+              }
+            hqspi->RxXferCount = 0;
+          }
+        hqspi->Instance->SR |= QUADSPI_SR_TCF;
+        hqspi->State = HAL_QSPI_STATE_READY;
+      }
+    return status;
+  }
+
+  /**
+   * @brief  Poll the status of the chip until it matches.
+   * @return true if matched, false otherwise.
+   */
+  bool
+  poll (QSPI_HandleTypeDef* hqspi, QSPI_AutoPollingTypeDef* cfg)
+  {
+    QSPI_CommandTypeDef cmd = latched (hqspi);
+    qspi_nor_model* chip = qspi_nor_model::attached (hqspi);
+    uint8_t status[4] =
+      { 0xFF, 0xFF, 0xFF, 0xFF };
+    uint32_t value = 0;
+
+    if (chip != nullptr)
+      {
+        chip->receive (&cmd, status, cfg->StatusBytesSize);
+      }
+    for (uint32_t i = 0; i < cfg->StatusBytesSize && i < 4; i++)
+      {
+        value |= (uint32_t) status[i] << (8 * i);
+      }
+
+    if (cfg->MatchMode == QSPI_MATCH_MODE_OR)
+      {
+        return ((~(value ^ cfg->Match)) & cfg->Mask) != 0;
+      }
+    return ((value ^ cfg->Match) & cfg->Mask) == 0;
+  }
+
+  /**
+   * @brief  Poll the status of the chip until it matches, letting the virtual
+   *    time run while the chip is busy.
+   * @return true if matched, false if the chip is idle and does not match.
+   */
+  bool
+  poll_until_match (QSPI_HandleTypeDef* hqspi, QSPI_AutoPollingTypeDef* cfg)
+  {
+    bool match = poll (hqspi, cfg);
+    qspi_nor_model* chip = qspi_nor_model::attached (hqspi);
+
+    while (match == false && chip != nullptr && chip->is_busy ())
+      {
+        // Let the chip complete its operation, then poll again
+        QSPI_CommandTypeDef polling = latched (hqspi);
+        chip->wait_polling (&polling, cfg->Interval);
+        match = poll (hqspi, cfg);
+      }
+    return match;
+  }
+
+  HAL_StatusTypeDef
+  auto_polling (QSPI_HandleTypeDef* hqspi, QSPI_CommandTypeDef* cmd,
+                QSPI_AutoPollingTypeDef* cfg, bool interrupt)
+  {
+    HAL_StatusTypeDef status = check_ready (hqspi);
+
+    if (status == HAL_OK)
+      {
+        cmd->NbData = cfg->StatusBytesSize;
+        latch (hqspi, cmd, FMODE_AUTO_POLLING);
+        hqspi->Instance->PSMAR = cfg->Match;
+        hqspi->Instance->PSMKR = cfg->Mask;
+        hqspi->Instance->PIR = cfg->Interval;
+        hqspi->State = HAL_QSPI_STATE_BUSY_AUTO_POLLING;
+        charge (hqspi, false);
+
+        bool match = poll_until_match (hqspi, cfg);
+        if (match)
+          {
+            hqspi->Instance->SR |= QUADSPI_SR_SMF;
+            if (cfg->AutomaticStop == QSPI_AUTOMATIC_STOP_ENABLE
+                || interrupt == false)
+              {
+                hqspi->State = HAL_QSPI_STATE_READY;
+              }
+            if (interrupt && irq_masked)
+              {
+                irq_pending = hqspi;
+                irq_pending_match = true;
+              }
+            else if (interrupt)
+              {
+                charge (hqspi, true);
+                HAL_QSPI_StatusMatchCallback (hqspi);
+              }
+          }
+        else if (interrupt == false)
+          {
+            // The chip is idle, its state will never change by itself
+            hqspi->ErrorCode = HAL_QSPI_ERROR_TIMEOUT;
+            hqspi->State = HAL_QSPI_STATE_READY;
+            status = HAL_TIMEOUT;
+          }
+      }
+    return status;
+  }
+
+  /**
+   * @brief  End a DMA transfer of the stream linked to the handle and raise
+   *    its transfer complete interrupt, if enabled.
+   */
+  void
+  dma_complete (QSPI_HandleTypeDef* hqspi)
+  {
+    DMA_HandleTypeDef* hdma = hqspi->hdma;
+
+    hdma->Instance->NDTR = 0;
+    hdma->Instance->CR &= ~DMA_SxCR_EN;
+    if (hdma->Instance->CR & DMA_SxCR_TCIE)
+      {
+        charge (hqspi, true);
+        HAL_DMA_IRQHandler (hdma);
+      }
+  }
+
+  /**
+   * @brief  Run the command latched at register level, when the controller
+   *    would start it.
+   */
+  void
+  start (QSPI_HandleTypeDef* hqspi, qspi_nor_model* chip)
+  {
+    QUADSPI_TypeDef* regs = hqspi->Instance;
+    QSPI_CommandTypeDef cmd = latched (hqspi);
+    DMA_Stream_TypeDef* stream =
+        (hqspi->hdma == nullptr) ? nullptr : hqspi->hdma->Instance;
+    bool dma = (regs->CR & QUADSPI_CR_DMAEN) && stream != nullptr
+        && (stream->CR & DMA_SxCR_EN);
+
+    chip->advance (chip->timing ().register_ns);
+    switch (regs->CCR & CCR_FMODE)
+      {
+      case FMODE_INDIRECT_WRITE:
+        if (cmd.DataMode == QSPI_DATA_NONE)
+          {
+            chip->execute (&cmd);
+            regs->SR |= QUADSPI_SR_TCF;
+          }
+        else if (dma && (stream->CR & DMA_SxCR_DIR) == DMA_SxCR_DIR_0)
+          {
+            chip->transmit (&cmd, (const uint8_t*) stream->M0AR,
+                            (stream->NDTR < cmd.NbData) ?
+                                stream->NDTR : cmd.NbData);
+            dma_complete (hqspi);
+            regs->SR |= QUADSPI_SR_TCF;
+          }
+        break;
+
+      case FMODE_INDIRECT_READ:
+        if (dma && (stream->CR & DMA_SxCR_DIR) == 0)
+          {
+            chip->receive (&cmd, (uint8_t*) stream->M0AR,
+                           (stream->NDTR < cmd.NbData) ?
+                               stream->NDTR : cmd.NbData);
+            regs->SR |= QUADSPI_SR_TCF;
+            dma_complete (hqspi);
+          }
+        break;
+
+      case FMODE_AUTO_POLLING:
+        {
+          QSPI_AutoPollingTypeDef cfg;
+
+          cfg.Match = regs->PSMAR;
+          cfg.Mask = regs->PSMKR;
+          cfg.Interval = regs->PIR;
+          cfg.StatusBytesSize = regs->DLR + 1;
+          cfg.MatchMode = regs->CR & QUADSPI_CR_PMM;
+          cfg.AutomaticStop = regs->CR & QUADSPI_CR_APMS;
+          if (poll_until_match (hqspi, &cfg))
+            {
+              regs->SR |= QUADSPI_SR_SMF;
+            }
+        }
+        break;
+
+      default:
+        break;
+      }
+  }
+
+  /**
+   * @brief  Raise the QUADSPI interrupt if an enabled flag is set.
+   */
+  void
+  raise (QSPI_HandleTypeDef* hqspi)
+  {
+    uint32_t sr = hqspi->Instance->SR;
+    uint32_t cr = hqspi->Instance->CR;
+
+    if (((sr & QUADSPI_SR_TEF) && (cr & QUADSPI_CR_TEIE))
+        || ((sr & QUADSPI_SR_TCF) && (cr & QUADSPI_CR_TCIE))
+        || ((sr & QUADSPI_SR_SMF) && (cr & QUADSPI_CR_SMIE)))
+      {
+        if (irq_masked)
+          {
+            irq_pending = hqspi;
+            return;
+          }
+        charge (hqspi, true);
+        HAL_QSPI_IRQHandler (hqspi);
+      }
+  }
+}
+
+extern "C"
+{
+  /**
+   * @brief  Act on a write to the CR, FCR, CCR or AR register. Outside of the
+   *    HAL, i.e. from a driver working at register level, the command
+   *    latched in CCR starts when CCR is written (no address), or AR is
+   *    written (address, no data to be written), or the DMA is enabled (data
+   *    to be written); an abort is performed at once.
+   * @param  reg: register written.
+   */
+  void
+  qspi_host_register_written (qspi_host_register* reg)
+  {
+    QUADSPI_TypeDef* regs = &registers;
+    qspi_nor_model* chip = qspi_nor_model::attached (regs);
+
+    if (reg == &regs->FCR)
+      {
+        // flags are cleared whoever writes them
+        regs->SR &= ~((uint32_t) regs->FCR
+            & (QUADSPI_SR_TEF | QUADSPI_SR_TCF | QUADSPI_SR_SMF
+                | QUADSPI_SR_TOF));
+        return;
+      }
+    if (hal_depth > 0 || chip == nullptr || chip->handle () == nullptr)
+      {
+        return;
+      }
+
+    hal_scope scope;
+    QSPI_HandleTypeDef* hqspi = chip->handle ();
+    uint32_t fmode = regs->CCR & CCR_FMODE;
+    bool address = (regs->CCR & CCR_ADMODE) != 0;
+    bool data_out = (fmode == FMODE_INDIRECT_WRITE)
+        && (regs->CCR & CCR_DMODE) != 0;
+
+    if (reg == &regs->CR)
+      {
+        if (regs->CR & QUADSPI_CR_ABORT)
+          {
+            abort (hqspi);
+          }
+        else if (data_out && (regs->CR & QUADSPI_CR_DMAEN)
+            && hqspi->hdma != nullptr
+            && (hqspi->hdma->Instance->CR & DMA_SxCR_EN))
+          {
+            start (hqspi, chip);
+          }
+      }
+    else if (fmode != FMODE_MEMORY_MAPPED && data_out == false
+        && (reg == &regs->AR || address == false))
+      {
+        start (hqspi, chip);
+      }
+    raise (hqspi);
+  }
+
+  DMA_Stream_TypeDef*
+  qspi_host_dma_stream (void)
+  {
+    return &dma_stream;
+  }
+
+  QUADSPI_TypeDef*
+  qspi_host_registers (void)
+  {
+    return &registers;
+  }
+
+  uint8_t*
+  qspi_host_mapped_base (void)
+  {
+    qspi_nor_model* chip = qspi_nor_model::attached (&registers);
+    return (chip == nullptr) ? nullptr : chip->memory ();
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Init (QSPI_HandleTypeDef* hqspi)
+  {
+    hal_scope scope;
+    if (hqspi == nullptr || hqspi->Instance == nullptr)
+      {
+        return HAL_ERROR;
+      }
+    hqspi->Instance->CR = (hqspi->Init.ClockPrescaler << 24)
+        | hqspi->Init.SampleShifting | hqspi->Init.DualFlash
+        | hqspi->Init.FlashID | QUADSPI_CR_EN;
+    hqspi->Instance->DCR = (hqspi->Init.FlashSize << 16)
+        | hqspi->Init.ChipSelectHighTime | hqspi->Init.ClockMode;
+    hqspi->Lock = HAL_UNLOCKED;
+    hqspi->ErrorCode = HAL_QSPI_ERROR_NONE;
+    hqspi->State = HAL_QSPI_STATE_READY;
+    return HAL_OK;
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_DeInit (QSPI_HandleTypeDef* hqspi)
+  {
+    hal_scope scope;
+    if (hqspi == nullptr || hqspi->Instance == nullptr)
+      {
+        return HAL_ERROR;
+      }
+    hqspi->Instance->CR = 0;
+    hqspi->State = HAL_QSPI_STATE_RESET;
+    return HAL_OK;
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Command (QSPI_HandleTypeDef* hqspi, QSPI_CommandTypeDef* cmd,
+                    uint32_t Timeout)
+  {
+    (void) Timeout;
+    HAL_StatusTypeDef status = check_ready (hqspi);
+
+    if (status == HAL_OK)
+      {
+        charge (hqspi, false);
+        hqspi->ErrorCode = HAL_QSPI_ERROR_NONE;
+        latch (hqspi, cmd, FMODE_INDIRECT_WRITE);
+        if (cmd->DataMode == QSPI_DATA_NONE)
+          {
+            qspi_nor_model* chip = qspi_nor_model::attached (hqspi);
+            if (chip != nullptr)
+              {
+                chip->execute (cmd);
+              }
+          }
+      }
+    return status;
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Transmit (QSPI_HandleTypeDef* hqspi, uint8_t* pData,
+                     uint32_t Timeout)
+  {
+    (void) Timeout;
+    return transfer (hqspi, pData, true);
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Receive (QSPI_HandleTypeDef* hqspi, uint8_t* pData,
+                    uint32_t Timeout)
+  {
+    (void) Timeout;
+    return transfer (hqspi, pData, false);
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Transmit_IT (QSPI_HandleTypeDef* hqspi, uint8_t* pData)
+  {
+    HAL_StatusTypeDef status = transfer (hqspi, pData, true);
+    if (status == HAL_OK)
+      {
+        charge (hqspi, true);
+        HAL_QSPI_TxCpltCallback (hqspi);
+      }
+    return status;
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Receive_IT (QSPI_HandleTypeDef* hqspi, uint8_t* pData)
+  {
+    HAL_StatusTypeDef status = transfer (hqspi, pData, false);
+    if (status == HAL_OK)
+      {
+        charge (hqspi, true);
+        HAL_QSPI_RxCpltCallback (hqspi);
+      }
+    return status;
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Transmit_DMA (QSPI_HandleTypeDef* hqspi, uint8_t* pData)
+  {
+    return HAL_QSPI_Transmit_IT (hqspi, pData);
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Receive_DMA (QSPI_HandleTypeDef* hqspi, uint8_t* pData)
+  {
+    return HAL_QSPI_Receive_IT (hqspi, pData);
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_AutoPolling (QSPI_HandleTypeDef* hqspi, QSPI_CommandTypeDef* cmd,
+                        QSPI_AutoPollingTypeDef* cfg, uint32_t Timeout)
+  {
+    (void) Timeout;
+    return auto_polling (hqspi, cmd, cfg, false);
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_AutoPolling_IT (QSPI_HandleTypeDef* hqspi,
+                           QSPI_CommandTypeDef* cmd,
+                           QSPI_AutoPollingTypeDef* cfg)
+  {
+    return auto_polling (hqspi, cmd, cfg, true);
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_MemoryMapped (QSPI_HandleTypeDef* hqspi, QSPI_CommandTypeDef* cmd,
+                         QSPI_MemoryMappedTypeDef* cfg)
+  {
+    hal_scope scope;
+    HAL_StatusTypeDef status = check_ready (hqspi);
+
+    if (status == HAL_OK)
+      {
+        charge (hqspi, false);
+        latch (hqspi, cmd, FMODE_MEMORY_MAPPED);
+        if (cfg->TimeOutActivation == QSPI_TIMEOUT_COUNTER_ENABLE)
+          {
+            hqspi->Instance->LPTR = cfg->TimeOutPeriod;
+            hqspi->Instance->CR |= QUADSPI_CR_TCEN;
+          }
+        else
+          {
+            hqspi->Instance->CR &= ~QUADSPI_CR_TCEN;
+          }
+        qspi_nor_model* chip = qspi_nor_model::attached (hqspi);
+        if (chip != nullptr)
+          {
+            chip->map (cmd);
+          }
+        hqspi->State = HAL_QSPI_STATE_BUSY_MEM_MAPPED;
+      }
+    return status;
+  }
+
+  HAL_StatusTypeDef
+  HAL_QSPI_Abort (QSPI_HandleTypeDef* hqspi)
+  {
+    hal_scope scope;
+    if (hqspi == nullptr || hqspi->Instance == nullptr)
+      {
+        return HAL_ERROR;
+      }
+    if (((uint32_t) hqspi->State & HAL_QSPI_STATE_BUSY) != 0)
+      {
+        qspi_nor_model* chip = qspi_nor_model::attached (hqspi);
+        if (chip != nullptr)
+          {
+            chip->unmap ();
+          }
+        hqspi->Instance->CCR &= ~CCR_FMODE;
+      }
+    hqspi->Instance->CR &= ~QUADSPI_CR_ABORT;
+    hqspi->State = HAL_QSPI_STATE_READY;
+    return HAL_OK;
+  }
+
+  void
+  HAL_QSPI_IRQHandler (QSPI_HandleTypeDef* hqspi)
+  {
+    hal_scope scope;
+    QUADSPI_TypeDef* regs = hqspi->Instance;
+    uint32_t flag = regs->SR;
+    uint32_t itsource = regs->CR;
+
+    if ((flag & QUADSPI_SR_TEF) && (itsource & QUADSPI_CR_TEIE))
+      {
+        regs->FCR = QUADSPI_FCR_CTEF;
+        regs->CR &= ~(QUADSPI_CR_SMIE | QUADSPI_CR_TCIE | QUADSPI_CR_TEIE
+            | QUADSPI_CR_FTIE | QUADSPI_CR_DMAEN);
+        hqspi->ErrorCode |= HAL_QSPI_ERROR_TRANSFER;
+        hqspi->State = HAL_QSPI_STATE_READY;
+        HAL_QSPI_ErrorCallback (hqspi);
+      }
+    else if ((flag & QUADSPI_SR_TCF) && (itsource & QUADSPI_CR_TCIE))
+      {
+        regs->FCR = QUADSPI_FCR_CTCF;
+        regs->CR &= ~(QUADSPI_CR_TCIE | QUADSPI_CR_TEIE | QUADSPI_CR_FTIE);
+        if (regs->CR & QUADSPI_CR_DMAEN)
+          {
+            regs->CR &= ~QUADSPI_CR_DMAEN;
+            hqspi->hdma->Instance->CR &= ~DMA_SxCR_EN;
+          }
+        HAL_QSPI_StateTypeDef state = hqspi->State;
+        hqspi->State = HAL_QSPI_STATE_READY;
+        if (state == HAL_QSPI_STATE_BUSY_INDIRECT_TX)
+          {
+            HAL_QSPI_TxCpltCallback (hqspi);
+          }
+        else if (state == HAL_QSPI_STATE_BUSY_INDIRECT_RX)
+          {
+            HAL_QSPI_RxCpltCallback (hqspi);
+          }
+        else
+          {
+            HAL_QSPI_CmdCpltCallback (hqspi);
+          }
+      }
+    else if ((flag & QUADSPI_SR_SMF) && (itsource & QUADSPI_CR_SMIE))
+      {
+        regs->FCR = QUADSPI_FCR_CSMF;
+        if (regs->CR & QUADSPI_CR_APMS)
+          {
+            regs->CR &= ~(QUADSPI_CR_SMIE | QUADSPI_CR_TEIE);
+            hqspi->State = HAL_QSPI_STATE_READY;
+          }
+        HAL_QSPI_StatusMatchCallback (hqspi);
+      }
+  }
+
+  void
+  HAL_NVIC_EnableIRQ (IRQn_Type irqn)
+  {
+    if (irqn == QUADSPI_IRQn && irq_masked)
+      {
+        QSPI_HandleTypeDef* hqspi = irq_pending;
+
+        irq_masked = false;
+        irq_pending = nullptr;
+        if (hqspi != nullptr && irq_pending_match)
+          {
+            irq_pending_match = false;
+            // Not cleared by an abort in between, like a pended interrupt
+            charge (hqspi, true);
+            HAL_QSPI_StatusMatchCallback (hqspi);
+          }
+        else if (hqspi != nullptr)
+          {
+            // The flags may have been cleared by an abort in between
+            raise (hqspi);
+          }
+      }
+  }
+
+  void
+  HAL_NVIC_DisableIRQ (IRQn_Type irqn)
+  {
+    if (irqn == QUADSPI_IRQn)
+      {
+        irq_masked = true;
+      }
+  }
+
+  HAL_StatusTypeDef
+  HAL_DMA_Init (DMA_HandleTypeDef* hdma)
+  {
+    if (hdma == nullptr || hdma->Instance == nullptr)
+      {
+        return HAL_ERROR;
+      }
+    // stream 7 of DMA2: high interrupt registers, bit 22
+    hdma->StreamBaseAddress = (uintptr_t) &dma_flags;
+    hdma->StreamIndex = 22;
+    hdma->Instance->CR = 0;
+    return HAL_OK;
+  }
+
+  void
+  HAL_DMA_IRQHandler (DMA_HandleTypeDef* hdma)
+  {
+    if (hdma->Instance->CR & DMA_SxCR_TCIE)
+      {
+        if ((hdma->Instance->CR & DMA_SxCR_CIRC) == 0)
+          {
+            hdma->Instance->CR &= ~DMA_SxCR_TCIE;
+          }
+        if (hdma->XferCpltCallback != nullptr)
+          {
+            hdma->XferCpltCallback (hdma);
+          }
+      }
+  }
+
+  HAL_QSPI_StateTypeDef
+  HAL_QSPI_GetState (QSPI_HandleTypeDef* hqspi)
+  {
+    return hqspi->State;
+  }
+
+  uint32_t
+  HAL_QSPI_GetError (QSPI_HandleTypeDef* hqspi)
+  {
+    return hqspi->ErrorCode;
+  }
+
+  // Default (weak) call-backs
+  __attribute__((weak)) void
+  HAL_QSPI_ErrorCallback (QSPI_HandleTypeDef* hqspi)
+  {
+    (void) hqspi;
+  }
+
+  __attribute__((weak)) void
+  HAL_QSPI_AbortCpltCallback (QSPI_HandleTypeDef* hqspi)
+  {
+    (void) hqspi;
+  }
+
+  __attribute__((weak)) void
+  HAL_QSPI_CmdCpltCallback (QSPI_HandleTypeDef* hqspi)
+  {
+    (void) hqspi;
+  }
+
+  __attribute__((weak)) void
+  HAL_QSPI_RxCpltCallback (QSPI_HandleTypeDef* hqspi)
+  {
+    (void) hqspi;
+  }
+
+  __attribute__((weak)) void
+  HAL_QSPI_TxCpltCallback (QSPI_HandleTypeDef* hqspi)
+  {
+    (void) hqspi;
+  }
+
+  __attribute__((weak)) void
+  HAL_QSPI_StatusMatchCallback (QSPI_HandleTypeDef* hqspi)
+  {
+    (void) hqspi;
+  }
+
+  __attribute__((weak)) void
+  HAL_QSPI_TimeOutCallback (QSPI_HandleTypeDef* hqspi)
+  {
+    (void) hqspi;
+  }
+}
@@ -0,0 +1,144 @@
+/*
+ * qspi-host-main.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Host (Linux) entry point: wire an emulated flash chip to the QSPI
+ * controller and run the tests from the "test" directory against it.
+ *
+ * Usage: qspi-host [device-name], e.g. W25Q128FV (default) or MT25QL128ABA.
+ * Build with QSPI_BENCH=true to run the benchmark instead of the tests, or
+ * with QSPI_FTL_TEST=true or QSPI_DRIVER_TEST=true to run the translation
+ * layer or the driver feature tests.
+ */
+
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/diag/trace.h>
+
+#include "quadspi.h"
+#include "sysconfig.h"
+#include "qspi-nor-model.h"
+#include "test-qspi-config.h"
+
+#if QSPI_TEST == true
+#if TEST_CPLUSPLUS_API == true
+#include "test-qspi.h"
+#else
+#include "test-qspi-c-api.h"
+#endif
+#endif
+
+#if FILE_SYSTEM_TEST == true
+#include "test-chan-fatfs.h"
+#endif
+
+#if QSPI_BENCH == true
+#include "qspi-host-bench.h"
+#endif
+
+#if QSPI_FTL_TEST == true
+#include "qspi-host-test-ftl.h"
+#endif
+
+#if QSPI_DRIVER_TEST == true
+#include "qspi-host-test-driver.h"
+#endif
+
+using namespace os;
+using namespace os::driver::stm32f7;
+
+extern "C"
+{
+  extern QSPI_HandleTypeDef hqspi;
+}
+
+// DMA stream serving the QUADSPI, as set up by the CubeMX generated
+// HAL_QSPI_MspInit()
+static DMA_HandleTypeDef hdma_quadspi;
+
+int
+os_main (int argc, char* argv[])
+{
+  qspi_nor_model chip
+    { (argc > 1) ? argv[1] : "W25Q128FV" };
+
+  if (chip.device () == nullptr)
+    {
+      return 1;
+    }
+
+  // Same settings as the CubeMX generated MX_QUADSPI_Init()
+  hqspi.Instance = QUADSPI;
+  hqspi.Init.ClockPrescaler = 1;
+  hqspi.Init.FifoThreshold = 4;
+  hqspi.Init.SampleShifting = QSPI_SAMPLE_SHIFTING_HALFCYCLE;
+  hqspi.Init.FlashSize = 23;
+  hqspi.Init.ChipSelectHighTime = QSPI_CS_HIGH_TIME_2_CYCLE;
+  hqspi.Init.ClockMode = QSPI_CLOCK_MODE_0;
+  hqspi.Init.FlashID = QSPI_FLASH_ID_1;
+  hqspi.Init.DualFlash = QSPI_DUALFLASH_DISABLE;
+  if (HAL_QSPI_Init (&hqspi) != HAL_OK)
+    {
+      return 1;
+    }
+  hdma_quadspi.Instance = DMA2_Stream7;
+  if (HAL_DMA_Init (&hdma_quadspi) != HAL_OK)
+    {
+      return 1;
+    }
+  __HAL_LINKDMA (&hqspi, hdma, hdma_quadspi);
+  chip.attach (&hqspi);
+
+  trace::printf ("Emulating %s\n", chip.device ()->device_name);
+
+#if QSPI_TEST == true
+  test_qspi ();
+#endif
+
+#if QSPI_BENCH == true
+  qspi_bench (chip);
+#endif
+
+#if QSPI_FTL_TEST == true
+  if (qspi_test_ftl (chip) != 0)
+    {
+      return 1;
+    }
+#endif
+
+#if QSPI_DRIVER_TEST == true
+  if (qspi_test_driver (chip) != 0)
+    {
+      return 1;
+    }
+#endif
+
+#if FILE_SYSTEM_TEST == true
+  return test_ff ();
+#else
+  return 0;
+#endif
+}
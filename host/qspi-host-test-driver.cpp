@@ -0,0 +1,932 @@
+/*
+ * qspi-host-test-driver.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Host (Linux) test of the driver features: each test exercises one feature
+ * through the public API, in its own area of the chip, and checks the data
+ * and the driver or chip model counters that show the feature at work.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/posix-io/block-device.h>
+#include <cmsis-plus/posix-io/file-descriptors-manager.h>
+#include <cmsis-plus/diag/trace.h>
+
+#include "sysconfig.h"
+#include "qspi-flash.h"
+#include "qspi-descr.h"
+#include "qspi-host-test-driver.h"
+
+#if QSPI_DRIVER_TEST == true
+
+extern "C"
+{
+  QSPI_HandleTypeDef hqspi;
+}
+
+using namespace os;
+using namespace os::driver::stm32f7;
+
+os::posix::file_descriptors_manager descriptors_manager
+  { 8 };
+
+// Registered without an external lock, as needed by the scheduler
+posix::block_device_implementable<qspi_impl> flash
+  { "flash", &hqspi };
+
+// Driver instance served by the controller interrupts (see test_continuous())
+qspi_impl* active = &flash.impl ();
+
+void
+HAL_QSPI_StatusMatchCallback (QSPI_HandleTypeDef* phqspi)
+{
+  if (phqspi == &hqspi)
+    {
+      active->cb_event ();
+    }
+}
+
+void
+HAL_QSPI_RxCpltCallback (QSPI_HandleTypeDef* phqspi)
+{
+  if (phqspi == &hqspi)
+    {
+      active->cb_event ();
+    }
+}
+
+void
+HAL_QSPI_TxCpltCallback (QSPI_HandleTypeDef* phqspi)
+{
+  if (phqspi == &hqspi)
+    {
+      active->cb_event ();
+    }
+}
+
+namespace
+{
+  // Areas of the chip used by the tests, one 64K block or more each
+  constexpr uint32_t DTR_AREA = 0x000000;
+  constexpr uint32_t ARBITRATION_AREA = 0x100000;
+  constexpr uint32_t CACHE_AREA = 0x200000;
+  constexpr uint32_t READ_AHEAD_AREA = 0x300000;
+  constexpr uint32_t IOCTL_AREA = 0x400000;
+  constexpr uint32_t BLANK_MAP_AREA = 0x500000;
+  constexpr uint32_t PARTIAL_AREA = 0x600000;
+  constexpr uint32_t SCHED_AREA = 0x700000;
+
+  constexpr size_t BUFF_SIZE = 0x10000;
+
+  constexpr int SCHED_WRITERS = 4;
+  constexpr int SCHED_READERS = 3;
+  constexpr int SCHED_ROUNDS = 6;
+
+  uint8_t wbuff[BUFF_SIZE];
+  alignas (32) uint8_t rbuff[BUFF_SIZE + 64];
+
+  /**
+   * @brief  Fill a buffer with pseudo-random data.
+   */
+  void
+  fill (uint8_t* p, size_t count, uint32_t seed)
+  {
+    uint32_t x = seed * 2654435761u;
+
+    for (size_t i = 0; i < count; i++)
+      {
+        x = x * 1103515245u + 12345u;
+        p[i] = (uint8_t) (x >> 16);
+      }
+  }
+
+  /**
+   * @brief  Check if a buffer holds only erased bytes.
+   */
+  bool
+  blank (const uint8_t* p, size_t count)
+  {
+    for (size_t i = 0; i < count; i++)
+      {
+        if (p[i] != 0xFF)
+          {
+            return false;
+          }
+      }
+    return true;
+  }
+
+  /**
+   * @brief  Report a failed check.
+   * @return 0 if the condition is true, 1 otherwise.
+   */
+  int
+  expect (bool condition, const char* what)
+  {
+    if (condition == false)
+      {
+        trace::printf ("  %s\n", what);
+        return 1;
+      }
+    return 0;
+  }
+
+  int
+  report (const char* name, int errors)
+  {
+    trace::printf ("%-28s %d errors\n", name, errors);
+    return errors;
+  }
+
+  /**
+   * @brief  DTR reads: not used as long as the chip holds no reference data,
+   *    used with data if the device supports them, and disabled by
+   *    set_dtr_reads(false).
+   * @return Number of errors.
+   */
+  int
+  test_dtr (qspi_nor_model& chip)
+  {
+    qspi_impl& q = flash.impl ();
+    bool ddr = chip.device ()->DDR_support;
+    int errors = 0;
+
+    // a blank chip reads the same with a wrong DTR timing
+    memset (chip.memory (), 0xFF, chip.size ());
+    q.set_dtr_reads (true);
+    errors += expect (q.initialize () == qspi_impl::ok, "initialize failed");
+    errors += expect (q.get_dtr_reads () == false,
+                      "DTR reads in use without reference data");
+    q.uninitialize ();
+
+    fill (chip.memory () + DTR_AREA, BUFF_SIZE, 1);
+    errors += expect (q.initialize () == qspi_impl::ok, "initialize failed");
+    errors += expect (q.get_dtr_reads () == ddr,
+                      "DTR reads not in use with reference data");
+    for (int offset = 0; offset < 3; offset++)
+      {
+        memset (rbuff, 0, sizeof(rbuff));
+        errors += expect (
+            q.read (DTR_AREA + offset * 5, rbuff + offset * 7, BUFF_SIZE - 16)
+                == qspi_impl::ok
+                && memcmp (rbuff + offset * 7, chip.memory () + offset * 5,
+                           BUFF_SIZE - 16) == 0,
+            "wrong data from an unaligned read");
+      }
+    q.set_mapped_reads (true);
+    errors += expect (
+        q.read (DTR_AREA + 100, rbuff, 4096) == qspi_impl::ok
+            && memcmp (rbuff, chip.memory () + 100, 4096) == 0,
+        "wrong data from a memory-mapped read");
+    q.set_mapped_reads (false);
+    q.uninitialize ();
+
+    q.set_dtr_reads (false);
+    errors += expect (q.initialize () == qspi_impl::ok, "initialize failed");
+    errors += expect (q.get_dtr_reads () == false,
+                      "DTR reads in use after set_dtr_reads(false)");
+    q.uninitialize ();
+    q.set_dtr_reads (true);
+
+    return report ("DTR reads:", errors);
+  }
+
+  /**
+   * @brief  Continuous read mode: the reads after the first one are sent
+   *    without instruction, the other commands still reach the chip, the mode
+   *    is left on uninitialize() and a driver restarted while the chip is in
+   *    it (as after an MCU reset) takes the chip out of it.
+   * @return Number of errors.
+   */
+  int
+  test_continuous (qspi_nor_model& chip)
+  {
+    qspi_impl& q = flash.impl ();
+    bool continuous = chip.device ()->continuous_support;
+    int errors = 0;
+
+    for (int pass = 0; pass < 2; pass++)
+      {
+        q.set_continuous_reads (pass == 0);
+        errors += expect (q.initialize () == qspi_impl::ok,
+                          "initialize failed");
+        chip.clear_stats ();
+        srand (1);
+        for (int i = 0; i < 200; i++)
+          {
+            uint32_t address = (rand () % (BUFF_SIZE / 32)) * 32;
+
+            if (q.read (DTR_AREA + address, rbuff, 32) != qspi_impl::ok
+                || memcmp (rbuff, chip.memory () + address, 32) != 0)
+              {
+                errors += expect (false, "wrong data from a short read");
+                break;
+              }
+          }
+        errors += expect (
+            (chip.stats ().continuous_reads > 0) == (continuous && pass == 0),
+            "continuous read mode not used as set");
+
+        // an erase and a program in between
+        fill (wbuff, 256, 2 + pass);
+        errors += expect (
+            q.erase_sector (DTR_AREA / q.get_sector_size ())
+                == qspi_impl::ok
+                && q.write (DTR_AREA, wbuff, 256) == qspi_impl::ok
+                && q.read (DTR_AREA, rbuff, 256) == qspi_impl::ok
+                && memcmp (rbuff, wbuff, 256) == 0,
+            "wrong data after an erase and a program");
+        q.uninitialize ();
+        errors += expect (chip.is_continuous () == false,
+                          "continuous read mode not left on uninitialize()");
+      }
+    q.set_continuous_reads (true);
+
+    // restart with the chip left in continuous read mode
+    q.initialize ();
+    q.read (DTR_AREA, rbuff, 16);
+    if (continuous)
+      {
+        qspi_impl restarted
+          { &hqspi };
+
+        errors += expect (chip.is_continuous (),
+                          "chip not in continuous read mode");
+        active = &restarted;
+        errors += expect (
+            restarted.initialize () == qspi_impl::ok
+                && restarted.read (DTR_AREA, rbuff, 4096) == qspi_impl::ok
+                && memcmp (rbuff, chip.memory () + DTR_AREA, 4096) == 0,
+            "restart in continuous read mode failed");
+        restarted.uninitialize ();
+        active = &flash.impl ();
+      }
+    q.uninitialize ();
+
+    return report ("Continuous reads:", errors);
+  }
+
+  /**
+   * @brief  Memory-mapped mode arbitration: writes and erases called while
+   *    mapped suspend the mode and restore it, the window shows the new
+   *    data; the mapped reads keep the window while idle.
+   * @return Number of errors.
+   */
+  int
+  test_arbitration (qspi_nor_model& chip)
+  {
+    qspi_impl& q = flash.impl ();
+    int errors = 0;
+
+    if (q.initialize () != qspi_impl::ok)
+      {
+        return report ("Arbitration:", expect (false, "initialize failed"));
+      }
+    size_t ss = q.get_sector_size ();
+    uint32_t sector = ARBITRATION_AREA / ss;
+
+    fill (wbuff, ss, 3);
+    errors += expect (q.enter_mem_mapped () == qspi_impl::ok,
+                      "enter_mem_mapped() failed");
+    errors += expect (
+        q.erase_sector (sector) == qspi_impl::ok
+            && q.write_sector (sector, wbuff, ss) == qspi_impl::ok,
+        "write while memory-mapped failed");
+    errors += expect (chip.is_mapped (),
+                      "memory-mapped mode not restored after the write");
+    errors += expect (
+        memcmp ((const uint8_t*) QSPI_BASE + ARBITRATION_AREA, wbuff, ss)
+            == 0,
+        "mapped window not up to date");
+    errors += expect (
+        q.read_sector (sector, rbuff, ss) == qspi_impl::ok
+            && memcmp (rbuff, wbuff, ss) == 0 && chip.is_mapped (),
+        "read while memory-mapped failed");
+    errors += expect (
+        q.exit_mem_mapped () == qspi_impl::ok && chip.is_mapped () == false,
+        "exit_mem_mapped() failed");
+
+    q.set_mapped_reads (true);
+    fill (wbuff, ss, 4);
+    errors += expect (
+        q.erase_sector (sector) == qspi_impl::ok
+            && q.write_sector (sector, wbuff, ss) == qspi_impl::ok
+            && q.read_sector (sector, rbuff, ss) == qspi_impl::ok
+            && memcmp (rbuff, wbuff, ss) == 0,
+        "wrong data with mapped reads");
+    errors += expect (chip.is_mapped (),
+                      "mapped window not kept after a mapped read");
+    q.set_mapped_reads (false);
+    errors += expect (chip.is_mapped () == false,
+                      "mapped window kept after set_mapped_reads(false)");
+    q.uninitialize ();
+
+    return report ("Arbitration:", errors);
+  }
+
+  /**
+   * @brief  Write-back cache: small writes stay in RAM until evicted (least
+   *    recently used first) or synced, and the low-level calls write back or
+   *    drop the cached sectors they access.
+   * @return Number of errors.
+   */
+  int
+  test_cache (qspi_nor_model& chip)
+  {
+    qspi_impl& q = flash.impl ();
+    int errors = 0;
+
+    q.set_cache (4, 0);
+    if (flash.open () != 0)
+      {
+        q.set_cache (0, 0);
+        return report ("Cache:", expect (false, "open failed"));
+      }
+    size_t bs = flash.block_logical_size_bytes ();
+    uint32_t base = CACHE_AREA / bs;
+    const uint8_t* memory = chip.memory () + CACHE_AREA;
+
+    for (uint32_t i = 0; i < 4; i++)
+      {
+        fill (wbuff + i * bs, bs, 10 + i);
+        flash.write_block (wbuff + i * bs, base + i, 1);
+      }
+    errors += expect (memcmp (memory, wbuff, 4 * bs) != 0,
+                      "cached writes reached the flash");
+
+    // the fifth sector evicts the first one
+    fill (wbuff + 4 * bs, bs, 14);
+    flash.write_block (wbuff + 4 * bs, base + 4, 1);
+    errors += expect (memcmp (memory, wbuff, bs) == 0,
+                      "least recently used sector not written back");
+    errors += expect (memcmp (memory + bs, wbuff + bs, bs) != 0,
+                      "more than one sector written back");
+    errors += expect (
+        flash.read_block (rbuff, base, 5) == 5
+            && memcmp (rbuff, wbuff, 5 * bs) == 0,
+        "wrong data read through the cache");
+    flash.sync ();
+    errors += expect (memcmp (memory, wbuff, 5 * bs) == 0,
+                      "cached sectors not written on sync()");
+
+    // the low-level calls see and drop the cached data
+    fill (wbuff, bs, 15);
+    flash.write_block (wbuff, base + 5, 1);
+    errors += expect (
+        q.read (CACHE_AREA + 5 * bs, rbuff, bs) == qspi_impl::ok
+            && memcmp (rbuff, wbuff, bs) == 0
+            && memcmp (memory + 5 * bs, wbuff, bs) == 0,
+        "dirty sector not written back before a low-level read");
+    flash.write_block (wbuff, base + 6, 1);
+    errors += expect (
+        q.erase_sector ((CACHE_AREA + 6 * bs) / q.get_sector_size ())
+            == qspi_impl::ok && flash.read_block (rbuff, base + 6, 1) == 1
+            && blank (rbuff, bs),
+        "cached sector not dropped by a low-level erase");
+
+    flash.close ();
+    q.set_cache (0, 0);
+
+    return report ("Cache:", errors);
+  }
+
+  /**
+   * @brief  Read-ahead: the prefetched blocks are served without a transfer
+   *    and dropped when the blocks are written or erased meanwhile.
+   * @return Number of errors.
+   */
+  int
+  test_read_ahead (qspi_nor_model& chip)
+  {
+    qspi_impl& q = flash.impl ();
+    int errors = 0;
+
+    q.set_read_ahead (8);
+    if (flash.open () != 0)
+      {
+        q.set_read_ahead (0);
+        return report ("Read-ahead:", expect (false, "open failed"));
+      }
+    size_t bs = flash.block_logical_size_bytes ();
+    uint32_t base = READ_AHEAD_AREA / bs;
+
+    fill (wbuff, 16 * bs, 20);
+    flash.write_block (wbuff, base, 16);
+
+    // a sequential stream, then a write in the prefetched window
+    for (uint32_t i = 0; i < 3; i++)
+      {
+        errors += expect (
+            flash.read_block (rbuff, base + i, 1) == 1
+                && memcmp (rbuff, wbuff + i * bs, bs) == 0,
+            "wrong data from a sequential read");
+      }
+    fill (wbuff + 3 * bs, bs, 21);
+    flash.write_block (wbuff + 3 * bs, base + 3, 1);
+    errors += expect (
+        flash.read_block (rbuff, base + 3, 2) == 2
+            && memcmp (rbuff, wbuff + 3 * bs, 2 * bs) == 0,
+        "prefetched block not dropped by a write");
+
+    // blocks announced with ioctl_willneed
+    flash.ioctl (qspi_impl::ioctl_willneed,
+                 (posix::block_device::blknum_t) (base + 8), (size_t) 4);
+    chip.clear_stats ();
+    errors += expect (
+        flash.read_block (rbuff, base + 8, 1) == 1
+            && memcmp (rbuff, wbuff + 8 * bs, bs) == 0,
+        "wrong data from a prefetched block");
+    errors += expect (chip.stats ().bytes_read == 0,
+                      "prefetched block read again from the flash");
+    errors += expect (
+        q.erase_sector ((READ_AHEAD_AREA + 9 * bs) / q.get_sector_size ())
+            == qspi_impl::ok && flash.read_block (rbuff, base + 9, 1) == 1
+            && blank (rbuff, bs),
+        "prefetched block not dropped by a low-level erase");
+    fill (wbuff + 10 * bs, bs, 22);
+    flash.write_block (wbuff + 10 * bs, base + 10, 1);
+    errors += expect (
+        flash.read_block (rbuff, base + 10, 2) == 2
+            && memcmp (rbuff, wbuff + 10 * bs, 2 * bs) == 0,
+        "prefetched block not dropped by a write");
+
+    flash.close ();
+    q.set_read_ahead (0);
+
+    return report ("Read-ahead:", errors);
+  }
+
+  /**
+   * @brief  The ioctl_discard and ioctl_is_blank requests, with the erase
+   *    and page sizes.
+   * @return Number of errors.
+   */
+  int
+  test_ioctl (void)
+  {
+    int errors = 0;
+
+    if (flash.open () != 0)
+      {
+        return report ("Discard and blank:", expect (false, "open failed"));
+      }
+    size_t bs = flash.block_logical_size_bytes ();
+    uint32_t base = IOCTL_AREA / bs;
+    uint32_t sizes[3];
+    uint32_t page;
+    bool is_blank;
+
+    errors += expect (
+        flash.ioctl (qspi_impl::ioctl_get_erase_sizes, sizes) == 0
+            && sizes[0] == bs && sizes[1] == 0x8000 && sizes[2] == 0x10000,
+        "wrong erase sizes");
+    errors += expect (
+        flash.ioctl (qspi_impl::ioctl_get_page_size, &page) == 0
+            && page == 256,
+        "wrong page size");
+
+    fill (wbuff, 12 * bs, 30);
+    flash.write_block (wbuff, base + 4, 12);
+    flash.ioctl (qspi_impl::ioctl_is_blank,
+                 (posix::block_device::blknum_t) (base + 4), (size_t) 1,
+                 &is_blank);
+    errors += expect (is_blank == false, "written block reported blank");
+    flash.ioctl (qspi_impl::ioctl_is_blank,
+                 (posix::block_device::blknum_t) (base + 16), (size_t) 3,
+                 &is_blank);
+    errors += expect (is_blank, "blank blocks not reported blank");
+
+    errors += expect (
+        flash.ioctl (qspi_impl::ioctl_discard,
+                     (posix::block_device::blknum_t) (base + 3), (size_t) 10)
+            == 0,
+        "discard failed");
+    flash.ioctl (qspi_impl::ioctl_is_blank,
+                 (posix::block_device::blknum_t) (base + 3), (size_t) 10,
+                 &is_blank);
+    errors += expect (is_blank, "discarded blocks not blank");
+    errors += expect (
+        flash.read_block (rbuff, base + 13, 3) == 3
+            && memcmp (rbuff, wbuff + 9 * bs, 3 * bs) == 0,
+        "block next to the discarded ones lost");
+    errors += expect (
+        flash.ioctl (qspi_impl::ioctl_discard,
+                     (posix::block_device::blknum_t) (flash.blocks () - 2),
+                     (size_t) 4) != 0,
+        "discard past the end accepted");
+    errors += expect (flash.ioctl (0x1234) != 0, "unknown request accepted");
+
+    flash.close ();
+
+    return report ("Discard and blank:", errors);
+  }
+
+  /**
+   * @brief  Blank page map: built lazily from the chip content, so data
+   *    written before the open is seen; once a block is known, writes into
+   *    its blank pages do not read them back.
+   * @return Number of errors.
+   */
+  int
+  test_blank_map (qspi_nor_model& chip)
+  {
+    qspi_impl& q = flash.impl ();
+    int errors = 0;
+    bool is_blank;
+
+    // data written before the open, behind the driver's back
+    fill (chip.memory () + BLANK_MAP_AREA + 0x1000, 0x1000, 40);
+    if (flash.open () != 0)
+      {
+        return report ("Blank map:", expect (false, "open failed"));
+      }
+    size_t bs = flash.block_logical_size_bytes ();
+    uint32_t base = BLANK_MAP_AREA / bs;
+
+    flash.ioctl (qspi_impl::ioctl_is_blank,
+                 (posix::block_device::blknum_t) (base + 0x1000 / bs),
+                 (size_t) 1, &is_blank);
+    errors += expect (is_blank == false, "data written before open missed");
+
+    // no page read back, a status register read aside
+    chip.clear_stats ();
+    fill (wbuff, bs, 41);
+    flash.write_block (wbuff, base + 0x2000 / bs, 1);
+    errors += expect (
+        chip.stats ().bytes_read < 256 && chip.stats ().sector_erases == 0,
+        "blank block read back or erased");
+
+    fill (wbuff, bs, 42);
+    flash.write_block (wbuff, base + 0x1000 / bs, 1);
+    errors += expect (
+        memcmp (chip.memory () + BLANK_MAP_AREA + 0x1000, wbuff, bs) == 0,
+        "wrong data over the data written before open");
+
+    errors += expect (q.erase_range (BLANK_MAP_AREA, 0x10000) == qspi_impl::ok,
+                      "erase_range() failed");
+    chip.clear_stats ();
+    fill (wbuff, bs, 43);
+    flash.write_block (wbuff, base + 0x3000 / bs, 1);
+    errors += expect (
+        chip.stats ().bytes_read < 256 && chip.stats ().sector_erases == 0
+            && memcmp (chip.memory () + BLANK_MAP_AREA + 0x3000, wbuff, bs)
+                == 0,
+        "erased block read back or erased");
+
+    flash.close ();
+
+    return report ("Blank map:", errors);
+  }
+
+  /**
+   * @brief  512 bytes blocks: random single and multi-block updates, without
+   *    and with the cache, and updates that only clear bits, which need no
+   *    erase.
+   * @return Number of errors.
+   */
+  int
+  test_partial (qspi_nor_model& chip)
+  {
+    qspi_impl& q = flash.impl ();
+    int errors = 0;
+
+    for (int pass = 0; pass < 2; pass++)
+      {
+        uint32_t area = PARTIAL_AREA + pass * BUFF_SIZE;
+        uint8_t* image = wbuff;
+
+        q.set_block_size (512);
+        q.set_cache (pass == 0 ? 0 : 4, 0);
+        if (flash.open () != 0)
+          {
+            errors += expect (false, "open failed");
+            break;
+          }
+        uint32_t base = area / 512;
+        size_t blocks = BUFF_SIZE / 512;
+
+        errors += expect (
+            flash.block_logical_size_bytes () == 512
+                && flash.block_physical_size_bytes ()
+                    == q.get_sector_size (),
+            "wrong block sizes");
+        memcpy (image, chip.memory () + area, BUFF_SIZE);
+        srand (5 + pass);
+        for (int n = 0; n < 60; n++)
+          {
+            uint32_t lba = rand () % blocks;
+
+            fill (image + lba * 512, 512, rand ());
+            flash.write_block (image + lba * 512, base + lba, 1);
+          }
+        for (int n = 0; n < 10; n++)
+          {
+            uint32_t lba = rand () % (blocks - 20);
+            size_t count = 1 + rand () % 19;
+
+            fill (image + lba * 512, count * 512, rand ());
+            flash.write_block (image + lba * 512, base + lba, count);
+          }
+        flash.sync ();
+        errors += expect (
+            flash.read_block (rbuff, base, blocks) == (ssize_t) blocks
+                && memcmp (rbuff, image, BUFF_SIZE) == 0
+                && memcmp (chip.memory () + area, image, BUFF_SIZE) == 0,
+            "wrong data after the updates");
+
+        chip.clear_stats ();
+        for (int n = 0; n < 20; n++)
+          {
+            uint32_t lba = rand () % blocks;
+
+            image[lba * 512 + rand () % 512] &= 0x0F;
+            flash.write_block (image + lba * 512, base + lba, 1);
+          }
+        flash.sync ();
+        errors += expect (
+            chip.stats ().sector_erases == 0
+                && chip.stats ().block32K_erases == 0
+                && chip.stats ().block64K_erases == 0,
+            "erase for updates that only clear bits");
+        errors += expect (memcmp (chip.memory () + area, image, BUFF_SIZE) == 0,
+                          "wrong data after the bit clearing updates");
+        flash.close ();
+      }
+    q.set_cache (0, 0);
+    q.set_block_size (0);
+
+    return report ("512 bytes blocks:", errors);
+  }
+
+  /**
+   * @brief  Polling threshold: the transfers up to the threshold are polled,
+   *    the longer ones use the DMA, except for their partial cache lines;
+   *    the measured threshold is in range.
+   * @return Number of errors.
+   */
+  int
+  test_poll_threshold (qspi_nor_model& chip)
+  {
+    qspi_impl& q = flash.impl ();
+    int errors = 0;
+
+    q.set_poll_threshold (512);
+    errors += expect (q.initialize () == qspi_impl::ok, "initialize failed");
+    errors += expect (q.get_poll_threshold () == 512, "threshold not set");
+
+    q.clear_dma_stats ();
+    q.read (DTR_AREA, rbuff, 512);
+    errors += expect (
+        q.get_dma_stats ().polled == 1 && q.get_dma_stats ().transfers == 0,
+        "short read not polled");
+    q.read (DTR_AREA, rbuff, 1024);
+    errors += expect (
+        q.get_dma_stats ().polled == 1 && q.get_dma_stats ().transfers > 0,
+        "long read polled");
+
+    // the partial cache lines at both ends of a long read are polled
+    q.clear_dma_stats ();
+    q.read (DTR_AREA, rbuff + 1, 1024);
+    errors += expect (
+        q.get_dma_stats ().polled == 2 && q.get_dma_stats ().transfers == 1
+            && memcmp (rbuff + 1, chip.memory () + DTR_AREA, 1024) == 0,
+        "partial lines not polled");
+
+    q.set_poll_threshold (0);
+    q.clear_dma_stats ();
+    q.read (DTR_AREA, rbuff, 64);
+    errors += expect (
+        q.get_dma_stats ().polled == 0 && q.get_dma_stats ().transfers > 0,
+        "read polled with a threshold of 0");
+    q.uninitialize ();
+
+    q.set_poll_threshold (qspi_impl::poll_calibrate);
+    errors += expect (q.initialize () == qspi_impl::ok, "initialize failed");
+    errors += expect (
+        q.get_poll_threshold () >= 32 && q.get_poll_threshold () <= 1024,
+        "measured threshold out of range");
+    q.uninitialize ();
+
+    return report ("Polling threshold:", errors);
+  }
+
+  typedef struct
+  {
+    uint32_t first;             // first block
+    int index;                  // thread index
+    int errors;
+  } sched_job_t;
+
+  bool volatile sched_done = false;
+
+  /**
+   * @brief  Rewrite, in turn, one 512 bytes block in each of 4 sectors; the
+   *    other writers rewrite their neighbours.
+   */
+  void*
+  sched_writer (void* args)
+  {
+    sched_job_t* job = (sched_job_t*) args;
+    uint8_t buff[512];
+
+    for (int round = 1; round <= SCHED_ROUNDS; round++)
+      {
+        for (uint32_t sector = 0; sector < 4; sector++)
+          {
+            uint32_t lba = job->first + sector * 8 + job->index;
+
+            fill (buff, 512, lba * 16 + round);
+            if (flash.write_block (buff, lba, 1) != 1)
+              {
+                job->errors++;
+              }
+          }
+      }
+    return nullptr;
+  }
+
+  /**
+   * @brief  Read pairs of blocks with fixed content until the writers are
+   *    done; the readers cross each other's requests.
+   */
+  void*
+  sched_reader (void* args)
+  {
+    sched_job_t* job = (sched_job_t*) args;
+    uint8_t buff[1024];
+    uint8_t expected[512];
+
+    for (uint32_t i = job->index; sched_done == false; i += SCHED_READERS)
+      {
+        uint32_t lba = (i * 2) % 126;
+
+        if (flash.read_block (buff, job->first + lba, 2) != 2)
+          {
+            job->errors++;
+            continue;
+          }
+        for (uint32_t k = 0; k < 2; k++)
+          {
+            fill (expected, 512, 0x10000 + lba + k);
+            if (memcmp (buff + k * 512, expected, 512) != 0)
+              {
+                job->errors++;
+              }
+          }
+      }
+    return nullptr;
+  }
+
+  /**
+   * @brief  I/O scheduler: concurrent writers of the same sectors and
+   *    readers of adjacent blocks, whose requests are coalesced and merged.
+   * @return Number of errors.
+   */
+  int
+  test_scheduler (void)
+  {
+    qspi_impl& q = flash.impl ();
+    int errors = 0;
+
+    q.set_scheduler (true);
+    q.set_block_size (512);
+    if (flash.open () != 0)
+      {
+        q.set_scheduler (false);
+        q.set_block_size (0);
+        return report ("Scheduler:", expect (false, "open failed"));
+      }
+    uint32_t written = SCHED_AREA / 512;
+    uint32_t fixed = written + 64;
+
+    for (uint32_t lba = 0; lba < 128; lba++)
+      {
+        fill (wbuff + lba * 512, 512, 0x10000 + lba);
+      }
+    flash.write_block (wbuff, fixed, 128);
+    q.clear_sched_stats ();
+
+    sched_job_t writers[SCHED_WRITERS];
+    sched_job_t readers[SCHED_READERS];
+    rtos::thread* threads[SCHED_WRITERS + SCHED_READERS];
+
+    sched_done = false;
+    for (int i = 0; i < SCHED_READERS; i++)
+      {
+        readers[i] =
+          { fixed, i, 0 };
+        threads[SCHED_WRITERS + i] = new rtos::thread
+          { "reader", sched_reader, &readers[i] };
+      }
+    for (int i = 0; i < SCHED_WRITERS; i++)
+      {
+        writers[i] =
+          { written, i, 0 };
+        threads[i] = new rtos::thread
+          { "writer", sched_writer, &writers[i] };
+      }
+    for (int i = 0; i < SCHED_WRITERS; i++)
+      {
+        threads[i]->join ();
+        errors += writers[i].errors;
+      }
+    sched_done = true;
+    for (int i = 0; i < SCHED_READERS; i++)
+      {
+        threads[SCHED_WRITERS + i]->join ();
+        errors += readers[i].errors;
+      }
+    for (rtos::thread* th : threads)
+      {
+        delete th;
+      }
+    errors += expect (errors == 0, "wrong data or failed requests");
+
+    // the last round of every writer
+    for (uint32_t sector = 0; sector < 4; sector++)
+      {
+        for (int i = 0; i < SCHED_WRITERS; i++)
+          {
+            uint32_t lba = written + sector * 8 + i;
+
+            fill (wbuff, 512, lba * 16 + SCHED_ROUNDS);
+            errors += expect (
+                flash.read_block (rbuff, lba, 1) == 1
+                    && memcmp (rbuff, wbuff, 512) == 0,
+                "wrong data after the writes");
+          }
+      }
+    const qspi_impl::sched_stats_t& stats = q.get_sched_stats ();
+    trace::printf ("  %u reads, %u merged, %u writes, %u coalesced\n",
+                   stats.reads, stats.merged, stats.writes, stats.coalesced);
+    errors += expect (stats.merged > 0, "no read merged");
+    errors += expect (stats.coalesced > 0, "no write coalesced");
+
+    flash.close ();
+    q.set_scheduler (false);
+    q.set_block_size (0);
+
+    return report ("Scheduler:", errors);
+  }
+}
+
+/**
+ * @brief  Run the driver feature tests, each in its own area of the chip.
+ * @param  chip: the chip model wired to hqspi.
+ * @return Number of errors.
+ */
+int
+qspi_test_driver (qspi_nor_model& chip)
+{
+  int errors = 0;
+
+  errors += test_dtr (chip);
+  errors += test_continuous (chip);
+  errors += test_arbitration (chip);
+  errors += test_cache (chip);
+  errors += test_read_ahead (chip);
+  errors += test_ioctl ();
+  errors += test_blank_map (chip);
+  errors += test_partial (chip);
+  errors += test_poll_threshold (chip);
+  errors += test_scheduler ();
+
+  if (errors == 0)
+    {
+      trace::printf ("Test passed (0 errors)\n");
+    }
+  else
+    {
+      trace::printf ("Test failed (%d errors)\n", errors);
+    }
+  return errors;
+}
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * qspi-host-test-ftl.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Host (Linux) test of the flash translation layer: power losses during
+ * block writes and checkpoints, followed by a remount, and the spread of the
+ * erase counts after many random rewrites.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/posix-io/block-device.h>
+#include <cmsis-plus/posix-io/file-descriptors-manager.h>
+#include <cmsis-plus/diag/trace.h>
+
+#include "sysconfig.h"
+#include "qspi-flash.h"
+#include "qspi-ftl.h"
+#include "qspi-host-test-ftl.h"
+
+#if QSPI_FTL_TEST == true
+
+extern "C"
+{
+  QSPI_HandleTypeDef hqspi;
+}
+
+using namespace os;
+using namespace os::driver::stm32f7;
+
+os::posix::file_descriptors_manager descriptors_manager
+  { 8 };
+
+template class posix::block_device_lockable<qspi_impl, rtos::mutex>;
+using qspi = posix::block_device_lockable<qspi_impl, rtos::mutex>;
+
+os::rtos::mutex flash_mx
+  { "flash_mx" };
+
+qspi flash
+  { "flash", flash_mx, &hqspi };
+
+posix::block_device_implementable<qspi_ftl> ftl
+  { "ftl", flash.impl (), 512 };
+
+posix::block_device_implementable<qspi_ftl> ftl_4k
+  { "ftl-4k", flash.impl (), 4096 };
+
+void
+HAL_QSPI_StatusMatchCallback (QSPI_HandleTypeDef* phqspi)
+{
+  if (phqspi == &hqspi)
+    {
+      flash.impl ().cb_event ();
+    }
+}
+
+void
+HAL_QSPI_RxCpltCallback (QSPI_HandleTypeDef* phqspi)
+{
+  if (phqspi == &hqspi)
+    {
+      flash.impl ().cb_event ();
+    }
+}
+
+void
+HAL_QSPI_TxCpltCallback (QSPI_HandleTypeDef* phqspi)
+{
+  if (phqspi == &hqspi)
+    {
+      flash.impl ().cb_event ();
+    }
+}
+
+namespace
+{
+  constexpr int LOSS_ROUNDS = 24;
+  constexpr size_t MAX_WRITES = 4000;
+  constexpr uint32_t DISCARDED = 0xFFFFFFFF;
+
+  // Spread allowed between the erase counts (WEAR_LEVEL_THRESHOLD in
+  // qspi-ftl.h, plus the erases done while a move is under way), and the
+  // erase count the most worn unit must reach first; past the threshold, so
+  // that the cold units have to be moved, but not much further
+  constexpr uint32_t WEAR_SPREAD = 64 + 8;
+  constexpr uint32_t WEAR_TARGET = 64 + 16;
+
+  /**
+   * @brief  Sleep of the driver's program and erase waits: the virtual clock
+   *    of the chip model is advanced instead, so the erases take no real
+   *    time.
+   * @param  ticks: time to sleep, in system clock ticks.
+   */
+  void
+  virtual_sleep (uint32_t ticks)
+  {
+    qspi_nor_model* chip = qspi_nor_model::attached (&hqspi);
+
+    if (chip != nullptr)
+      {
+        chip->advance ((uint64_t) ticks * 1000000000u
+            / rtos::sysclock.frequency_hz);
+      }
+  }
+
+  /**
+   * @brief  Fill a block with the content of a version of a logical block;
+   *    version 0 is a block never written (all 0xFF).
+   */
+  void
+  fill (uint8_t* p, size_t count, uint32_t lba, uint32_t version)
+  {
+    uint32_t x = lba * 2654435761u ^ version * 40503u;
+
+    if (version == 0)
+      {
+        memset (p, 0xFF, count);
+        return;
+      }
+    for (size_t i = 0; i < count; i++)
+      {
+        x = x * 1103515245u + 12345u;
+        p[i] = (uint8_t) (x >> 16);
+      }
+  }
+
+  /**
+   * @brief  Pick a logical block, 3 out of 4 in a hot sixteenth of the
+   *    device.
+   */
+  uint32_t
+  pick (size_t blocks)
+  {
+    return (rand () % 4) ? rand () % (blocks / 16) : rand () % blocks;
+  }
+
+  /**
+   * @brief  Check every logical block against its expected version. The
+   *    block written when the power was lost may hold its previous or its
+   *    new version, a discarded block its old version or nothing; the
+   *    expected versions are updated with what is found.
+   * @return Number of blocks with unexpected content.
+   */
+  int
+  verify (posix::block_device& dev, uint32_t* version, uint32_t* previous,
+          uint32_t in_flight, uint8_t* buff, uint8_t* expected)
+  {
+    size_t bs = dev.block_physical_size_bytes ();
+    int errors = 0;
+
+    for (uint32_t lba = 0; lba < dev.blocks (); lba++)
+      {
+        bool found = false;
+
+        if (dev.read_block (buff, lba, 1) != 1)
+          {
+            trace::printf ("Read error at block %u\n", lba);
+            errors++;
+            continue;
+          }
+        if (version[lba] == DISCARDED)
+          {
+            fill (expected, bs, lba, 0);
+            if (memcmp (buff, expected, bs) == 0)
+              {
+                version[lba] = 0;
+                found = true;
+              }
+            else
+              {
+                version[lba] = previous[lba];
+              }
+          }
+        if (found == false)
+          {
+            fill (expected, bs, lba, version[lba]);
+            found = (memcmp (buff, expected, bs) == 0);
+          }
+        if (found == false && lba == in_flight)
+          {
+            fill (expected, bs, lba, version[lba] + 1);
+            if (memcmp (buff, expected, bs) == 0)
+              {
+                version[lba]++;
+                found = true;
+              }
+          }
+        if (found == false)
+          {
+            if (errors < 8)
+              {
+                trace::printf ("Block %u: not version %u\n", lba,
+                               version[lba]);
+              }
+            errors++;
+          }
+      }
+    return errors;
+  }
+
+  /**
+   * @brief  Cut the power during random block writes, or during the
+   *    checkpoint of a sync after a discard, then remount and check that
+   *    every block is found where the mapping says.
+   * @return Number of errors.
+   */
+  int
+  test_power_loss (qspi_nor_model& chip)
+  {
+    int errors = 0;
+    int losses = 0;
+
+    ftl.impl ().set_background_gc (false);
+    if (ftl.open () != 0)
+      {
+        trace::printf ("FTL open failed\n");
+        return 1;
+      }
+    size_t bs = ftl.block_physical_size_bytes ();
+    size_t blocks = ftl.blocks ();
+    uint32_t* version = new uint32_t[blocks] ();
+    uint32_t* previous = new uint32_t[blocks] ();
+    uint8_t* buff = new uint8_t[bs];
+    uint8_t* expected = new uint8_t[bs];
+
+    srand (1);
+    for (int round = 0; round < LOSS_ROUNDS && errors == 0; round++)
+      {
+        uint32_t in_flight = DISCARDED;
+
+        if (round % 4 != 3)
+          {
+            // the power is lost somewhere in the writes, possibly in a
+            // relocation or a unit erase
+            chip.set_power_loss (1 + rand () % (2 * MAX_WRITES));
+            for (size_t n = 0; n < MAX_WRITES; n++)
+              {
+                uint32_t lba = pick (blocks);
+
+                fill (buff, bs, lba, version[lba] + 1);
+                ftl.write_block (buff, lba, 1);
+                if (chip.is_power_lost ())
+                  {
+                    in_flight = lba;
+                    break;
+                  }
+                version[lba]++;
+              }
+          }
+        else
+          {
+            // the power is lost while the checkpoint recording a discard is
+            // written
+            uint32_t first = rand () % (blocks - 16);
+
+            for (uint32_t lba = first; lba < first + 16; lba++)
+              {
+                previous[lba] = version[lba];
+                version[lba] = DISCARDED;
+              }
+            ftl.ioctl (qspi_impl::ioctl_discard,
+                       (posix::block_device::blknum_t) first, (size_t) 16);
+            chip.set_power_loss (rand () % 8);
+            ftl.sync ();
+          }
+
+        // the driver runs on after the loss, nothing more reaches the chip
+        ftl.close ();
+        losses += chip.is_power_lost () ? 1 : 0;
+        chip.power_cycle ();
+        if (ftl.open () != 0)
+          {
+            trace::printf ("Remount %d failed\n", round);
+            errors++;
+            break;
+          }
+        errors += verify (ftl, version, previous, in_flight, buff, expected);
+      }
+
+    // a clean remount after the losses keeps everything
+    ftl.close ();
+    if (errors == 0 && ftl.open () == 0)
+      {
+        errors += verify (ftl, version, previous, DISCARDED, buff, expected);
+        ftl.close ();
+      }
+    if (losses == 0)
+      {
+        trace::printf ("No power loss in %d rounds\n", LOSS_ROUNDS);
+        errors++;
+      }
+    trace::printf ("Power losses: %d rounds out of %d, %d errors\n", losses,
+                   LOSS_ROUNDS, errors);
+
+    delete[] version;
+    delete[] previous;
+    delete[] buff;
+    delete[] expected;
+    return errors;
+  }
+
+  /**
+   * @brief  Rewrite random blocks, mostly from a small hot set, until the
+   *    most worn unit was erased WEAR_TARGET times, and check that the
+   *    static wear leveling keeps the erase counts together, also after a
+   *    remount.
+   * @return Number of errors.
+   */
+  int
+  test_wear (qspi_nor_model& chip)
+  {
+    int errors = 0;
+
+    // a different block size, start from a blank chip
+    memset (chip.memory (), 0xFF, chip.size ());
+    ftl_4k.impl ().set_background_gc (false);
+    if (ftl_4k.open () != 0)
+      {
+        trace::printf ("FTL open failed\n");
+        return 1;
+      }
+    size_t bs = ftl_4k.block_physical_size_bytes ();
+    size_t blocks = ftl_4k.blocks ();
+    uint8_t* buff = new uint8_t[bs];
+    qspi_ftl::ftl_stats_t stats;
+
+    // the cold data fills the device and is never rewritten
+    for (uint32_t lba = 0; lba < blocks; lba++)
+      {
+        fill (buff, bs, lba, 1);
+        ftl_4k.write_block (buff, lba, 1);
+      }
+    srand (2);
+    do
+      {
+        for (int n = 0; n < 1000; n++)
+          {
+            uint32_t lba = rand () % (blocks / 64);
+
+            fill (buff, bs, lba, 2 + n);
+            ftl_4k.write_block (buff, lba, 1);
+          }
+        stats = ftl_4k.impl ().get_stats ();
+        if (stats.max_erase_count - stats.min_erase_count > WEAR_SPREAD)
+          {
+            trace::printf ("Erase counts %u..%u after %u erases\n",
+                           stats.min_erase_count, stats.max_erase_count,
+                           stats.erases);
+            errors++;
+            break;
+          }
+      }
+    while (stats.max_erase_count < WEAR_TARGET);
+    trace::printf ("Wear: %u erases, erase counts %u..%u\n", stats.erases,
+                   stats.min_erase_count, stats.max_erase_count);
+
+    // the erase counts are saved and restored with the mapping
+    ftl_4k.close ();
+    if (ftl_4k.open () != 0)
+      {
+        trace::printf ("FTL reopen failed\n");
+        errors++;
+      }
+    else
+      {
+        qspi_ftl::ftl_stats_t reopened = ftl_4k.impl ().get_stats ();
+
+        if (reopened.min_erase_count != stats.min_erase_count
+            || reopened.max_erase_count != stats.max_erase_count)
+          {
+            trace::printf ("Erase counts %u..%u after the remount\n",
+                           reopened.min_erase_count,
+                           reopened.max_erase_count);
+            errors++;
+          }
+        ftl_4k.close ();
+      }
+
+    delete[] buff;
+    return errors;
+  }
+}
+
+/**
+ * @brief  Run the translation layer tests on the whole chip.
+ * @param  chip: the chip model wired to hqspi.
+ * @return Number of errors.
+ */
+int
+qspi_test_ftl (qspi_nor_model& chip)
+{
+  int errors = 0;
+
+  // the driver sleeps through the erases on the model's virtual clock
+  flash.impl ().set_sleep_hook (virtual_sleep);
+
+  errors += test_power_loss (chip);
+  errors += test_wear (chip);
+
+  flash.impl ().set_sleep_hook (nullptr);
+
+  if (errors == 0)
+    {
+      trace::printf ("Test passed (0 errors)\n");
+    }
+  else
+    {
+      trace::printf ("Test failed (%d errors)\n", errors);
+    }
+  return errors;
+}
+
+#endif
@@ -0,0 +1,1012 @@
+/*
+ * qspi-nor-model.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file implements an in-RAM model of the Winbond and Micron QSPI NOR
+ * flash chips supported by the driver, used to run the driver on a host.
+ */
+
+#include <string.h>
+#include <cmsis-plus/diag/trace.h>
+
+#include "qspi-nor-model.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      qspi_nor_model* qspi_nor_model::attached_[MAX_ATTACHED];
+
+      // Typical datasheet timings, plus the HAL and register-level software
+      // overheads
+      static const qspi_nor_model::timing_t micron_timing =
+        { 120, 8, 50000, 100000, 150000, 38000, 1000, 3000, 200 };
+
+      static const qspi_nor_model::timing_t winbond_timing =
+        { 700, 30, 45000, 120000, 150000, 40000, 1000, 3000, 200 };
+
+      /**
+       * @brief Constructor.
+       * @param device_name: name of the emulated chip, as listed in the
+       *    qspi_manufacturers table (e.g. "W25Q128FV" or "MT25QL128ABA").
+       */
+      qspi_nor_model::qspi_nor_model (const char* device_name)
+      {
+        for (const qspi_manuf_t* pqm = qspi_manufacturers;
+            pqm->manufacturer_ID != 0 && pdevice_ == nullptr; pqm++)
+          {
+            for (const qspi_device_t* pqd = pqm->devices; pqd->device_ID != 0;
+                pqd++)
+              {
+                if (strcmp (pqd->device_name, device_name) == 0)
+                  {
+                    manufacturer_ID_ = pqm->manufacturer_ID;
+                    pdevice_ = pqd;
+                    break;
+                  }
+              }
+          }
+
+        if (pdevice_ != nullptr)
+          {
+            size_ = 1 << (pdevice_->device_ID & 0xFF);
+            memory_ = new uint8_t[size_];
+            memset (memory_, 0xFF, size_);
+            timing_ =
+                (manufacturer_ID_ == MANUF_ID_WINBOND) ?
+                    winbond_timing : micron_timing;
+          }
+        else
+          {
+            trace::printf ("%s(): unknown device %s\n", __func__, device_name);
+          }
+      }
+
+      qspi_nor_model::~qspi_nor_model ()
+      {
+        for (size_t i = 0; i < MAX_ATTACHED; i++)
+          {
+            if (attached_[i] == this)
+              {
+                attached_[i] = nullptr;
+              }
+          }
+        delete[] memory_;
+      }
+
+      /**
+       * @brief  Wire the chip to a QSPI controller.
+       * @param  hqspi: HAL qspi handle of the controller.
+       */
+      void
+      qspi_nor_model::attach (QSPI_HandleTypeDef* hqspi)
+      {
+        hqspi_ = hqspi;
+        for (size_t i = 0; i < MAX_ATTACHED; i++)
+          {
+            if (attached_[i] == nullptr || attached_[i] == this)
+              {
+                attached_[i] = this;
+                break;
+              }
+          }
+      }
+
+      /**
+       * @brief  Find the chip wired to a QSPI controller.
+       * @param  hqspi: HAL qspi handle of the controller.
+       * @return Pointer to the chip model, or nullptr if none is wired.
+       */
+      qspi_nor_model*
+      qspi_nor_model::attached (QSPI_HandleTypeDef* hqspi)
+      {
+        for (size_t i = 0; i < MAX_ATTACHED; i++)
+          {
+            if (attached_[i] != nullptr && attached_[i]->hqspi_ == hqspi)
+              {
+                return attached_[i];
+              }
+          }
+        return nullptr;
+      }
+
+      /**
+       * @brief  Find the chip wired to a QUADSPI register block.
+       * @param  instance: QUADSPI register block.
+       * @return Pointer to the chip model, or nullptr if none is wired.
+       */
+      qspi_nor_model*
+      qspi_nor_model::attached (QUADSPI_TypeDef* instance)
+      {
+        for (size_t i = 0; i < MAX_ATTACHED; i++)
+          {
+            if (attached_[i] != nullptr && attached_[i]->hqspi_ != nullptr
+                && attached_[i]->hqspi_->Instance == instance)
+              {
+                return attached_[i];
+              }
+          }
+        return nullptr;
+      }
+
+      /**
+       * @brief  Simulate a power cycle: all volatile settings are lost, the
+       *    memory array is preserved.
+       */
+      void
+      qspi_nor_model::power_cycle (void)
+      {
+        reset ();
+        power_down_ = false;
+        loss_armed_ = false;
+        power_lost_ = false;
+      }
+
+      /**
+       * @brief  Simulate a power loss in the middle of a program or erase
+       *    operation: the given number of operations complete, the next one
+       *    is torn (only the first half of its page or area is written) and
+       *    the ones after it change nothing, until power_cycle(). The chip
+       *    keeps answering, as if the driver ran on after the loss.
+       * @param  operations: program/erase operations completed before the
+       *    loss.
+       */
+      void
+      qspi_nor_model::set_power_loss (uint32_t operations)
+      {
+        loss_armed_ = true;
+        loss_countdown_ = operations;
+        power_lost_ = false;
+      }
+
+      /**
+       * @brief  Part of a program or erase operation that reaches the memory
+       *    array, according to the simulated power loss.
+       * @param  size: size of the operation.
+       * @return size, half of it for the operation torn by the loss, or 0
+       *    after the loss.
+       */
+      size_t
+      qspi_nor_model::torn_size (size_t size)
+      {
+        if (power_lost_)
+          {
+            return 0;
+          }
+        if (loss_armed_ && loss_countdown_-- == 0)
+          {
+            power_lost_ = true;
+            return size / 2;
+          }
+        return size;
+      }
+
+      /**
+       * @brief  Execute a command without data phase.
+       * @param  cmd: command as issued by the QSPI controller.
+       */
+      void
+      qspi_nor_model::execute (const QSPI_CommandTypeDef* cmd)
+      {
+        uint8_t instruction = (uint8_t) cmd->Instruction;
+        bool reset_enabled = reset_enabled_;
+
+        clock_command (cmd, 0);
+        reset_enabled_ = false;
+        if (accept (cmd) == false)
+          {
+            return;
+          }
+
+        switch (instruction)
+          {
+          case WRITE_ENABLE:
+            wel_ = true;
+            break;
+
+          case WRITE_DISABLE:
+            wel_ = false;
+            break;
+
+          case SECTOR_ERASE:
+          case BLOCK_32K_ERASE:
+          case BLOCK_64K_ERASE:
+            if (wel_ && cmd->AddressMode != QSPI_ADDRESS_NONE)
+              {
+                size_t size =
+                    (instruction == SECTOR_ERASE) ? 0x1000 :
+                    (instruction == BLOCK_32K_ERASE) ? 0x8000 : 0x10000;
+                erase (address_of (cmd) & ~(size - 1), torn_size (size));
+                if (instruction == SECTOR_ERASE)
+                  stats_.sector_erases++;
+                else if (instruction == BLOCK_32K_ERASE)
+                  stats_.block32K_erases++;
+                else
+                  stats_.block64K_erases++;
+                start_busy (
+                    instruction, address_of (cmd) & ~(size - 1), size,
+                    (instruction == SECTOR_ERASE) ? timing_.tSE_us :
+                    (instruction == BLOCK_32K_ERASE) ?
+                        timing_.tBE32_us : timing_.tBE64_us);
+              }
+            wel_ = false;
+            break;
+
+          case CHIP_ERASE:
+          case CHIP_ERASE_ALT:
+            if (wel_)
+              {
+                erase (0, torn_size (size_));
+                stats_.chip_erases++;
+                start_busy (instruction, 0, size_,
+                            (uint64_t) timing_.tCE_ms * 1000);
+              }
+            wel_ = false;
+            break;
+
+          case RESET_ENABLE:
+            reset_enabled_ = true;
+            break;
+
+          case RESET_DEVICE:
+            if (reset_enabled)
+              {
+                reset ();
+              }
+            break;
+
+          case POWER_DOWN:
+            power_down_ = true;
+            break;
+
+          case RELEASE_POWER_DOWN:
+            power_down_ = false;
+            break;
+
+          case SUSPEND:
+            // a chip erase cannot be suspended
+            if (is_busy () && op_instruction_ != CHIP_ERASE
+                && op_instruction_ != CHIP_ERASE_ALT)
+              {
+                op_remaining_ps_ = busy_until_ps_ - now_ps_;
+                busy_until_ps_ = now_ps_;
+                suspended_ = true;
+                status_2_ |= 0x80;
+                stats_.suspends++;
+              }
+            break;
+
+          case RESUME:
+            if (suspended_)
+              {
+                busy_until_ps_ = now_ps_ + op_remaining_ps_;
+                suspended_ = false;
+                status_2_ &= ~0x80;
+              }
+            break;
+
+          default:
+            if (manufacturer_ID_ == MANUF_ID_WINBOND)
+              {
+                if (instruction == WB_VOLATILE_SR_WRITE_ENABLE)
+                  volatile_sr_we_ = true;
+                else if (instruction == WB_ENTER_QPI && (status_2_ & 0x02))
+                  quad_ = true;
+                else if (instruction == WB_EXIT_QPI)
+                  quad_ = false;
+              }
+            else if (manufacturer_ID_ == MANUF_ID_MICRON)
+              {
+                if (instruction == MT_ENTER_QUAD
+                    || instruction == MT_ENTER_QUAD_ALT)
+                  quad_ = true;
+              }
+            break;
+          }
+      }
+
+      /**
+       * @brief  Execute a command with a data phase from the chip.
+       * @param  cmd: command as issued by the QSPI controller.
+       * @param  buff: buffer receiving the data driven by the chip.
+       * @param  count: number of bytes clocked in by the controller.
+       */
+      void
+      qspi_nor_model::receive (const QSPI_CommandTypeDef* cmd, uint8_t* buff,
+                               size_t count)
+      {
+        uint8_t instruction = (uint8_t) cmd->Instruction;
+        uint64_t start_ps = now_ps_;
+
+        clock_command (cmd, count);
+        reset_enabled_ = false;
+        if (accept (cmd) == false)
+          {
+            // nobody drives the bus
+            memset (buff, 0xFF, count);
+            return;
+          }
+
+        if (continuous_)
+          {
+            instruction = continuous_instruction_;
+            stats_.continuous_reads++;
+          }
+
+        switch (instruction)
+          {
+          case JEDEC_ID:
+            memset (buff, 0, count);
+            for (size_t i = 0; i < count && i < 3; i++)
+              {
+                buff[i] =
+                    (i == 0) ? manufacturer_ID_ :
+                    (i == 1) ? (uint8_t) (pdevice_->device_ID >> 8) :
+                        (uint8_t) pdevice_->device_ID;
+              }
+            break;
+
+          case READ_STATUS_REGISTER:
+            memset (buff, (wel_ ? 0x02 : 0x00) | (is_busy () ? 0x01 : 0x00),
+                    count);
+            if (op_pending_ && is_busy () == false && suspended_ == false)
+              {
+                end_busy ();
+              }
+            break;
+
+          case READ_DATA:
+          case FAST_READ_DATA:
+          case FAST_READ_QUAD_OUT:
+          case FAST_READ_QUAD_IN_OUT:
+          case FAST_READ_QUAD_IN_OUT_DTR:
+            if (cmd->AddressMode == QSPI_ADDRESS_NONE
+                || (instruction == FAST_READ_QUAD_IN_OUT_DTR
+                    && pdevice_->DDR_support == false))
+              {
+                memset (buff, 0xFF, count);
+                break;
+              }
+            read_array (
+                address_of (cmd),
+                (instruction == READ_DATA) ? (int) cycles_before_data (cmd) :
+                (instruction == FAST_READ_DATA
+                    || instruction == FAST_READ_QUAD_OUT) ?
+                    (int) cycles_before_data (cmd) - 8 :
+                    fast_read_skew (cmd, instruction),
+                buff, count);
+            if (instruction == FAST_READ_QUAD_IN_OUT
+                || instruction == FAST_READ_QUAD_IN_OUT_DTR)
+              {
+                continuous_ = continuous_mode_bits (cmd);
+                continuous_instruction_ = instruction;
+              }
+            stats_.bytes_read += count;
+            stats_.read_ns += (now_ps_ - start_ps) / 1000;
+            if (trace_)
+              {
+                trace::printf ("[%12.3f ms] read      0x%06X %7u B %10.3f us\n",
+                               start_ps / 1e9, address_of (cmd), (unsigned) count,
+                               (now_ps_ - start_ps) / 1e6);
+              }
+            break;
+
+          default:
+            if (manufacturer_ID_ == MANUF_ID_WINBOND
+                && instruction == WB_READ_STATUS_REGISTER_2)
+              {
+                memset (buff, status_2_, count);
+              }
+            else if (manufacturer_ID_ == MANUF_ID_MICRON
+                && instruction == MT_READ_VOLATILE_CONFIG)
+              {
+                memset (buff, vcr_, count);
+              }
+            else if (manufacturer_ID_ == MANUF_ID_MICRON
+                && instruction == MT_READ_ENH_VOLATILE_CONFIG)
+              {
+                memset (buff, evcr_, count);
+              }
+            else if (manufacturer_ID_ == MANUF_ID_MICRON
+                && instruction == MT_READ_FLAG_STATUS)
+              {
+                // ready, erase suspended
+                memset (buff,
+                        (is_busy () ? 0x00 : 0x80) | (suspended_ ? 0x40 : 0x00),
+                        count);
+              }
+            else
+              {
+                memset (buff, 0xFF, count);
+              }
+            break;
+          }
+      }
+
+      /**
+       * @brief  Execute a command with a data phase to the chip.
+       * @param  cmd: command as issued by the QSPI controller.
+       * @param  buff: data clocked out by the controller.
+       * @param  count: number of bytes clocked out by the controller.
+       */
+      void
+      qspi_nor_model::transmit (const QSPI_CommandTypeDef* cmd,
+                                const uint8_t* buff, size_t count)
+      {
+        uint8_t instruction = (uint8_t) cmd->Instruction;
+
+        clock_command (cmd, count);
+        reset_enabled_ = false;
+        if (accept (cmd) == false || count == 0)
+          {
+            return;
+          }
+
+        switch (instruction)
+          {
+          case PAGE_PROGRAM:
+          case QUAD_PAGE_PROGRAM:
+            if (wel_ && cmd->AddressMode != QSPI_ADDRESS_NONE)
+              {
+                // the page buffer wraps, only the last 256 bytes sent count
+                uint8_t page[PAGE_SIZE];
+                uint32_t address = address_of (cmd);
+                uint32_t base = address & ~(PAGE_SIZE - 1);
+
+                size_t torn;
+
+                memset (page, 0xFF, sizeof(page));
+                for (size_t i = 0; i < count; i++)
+                  {
+                    page[(address + i) & (PAGE_SIZE - 1)] = buff[i];
+                  }
+                torn = torn_size (PAGE_SIZE);
+                for (size_t i = 0; i < torn; i++)
+                  {
+                    memory_[base + i] &= page[i];
+                  }
+                count = (count > PAGE_SIZE) ? PAGE_SIZE : count;
+                stats_.page_programs++;
+                stats_.bytes_programmed += count;
+                start_busy (
+                    instruction, address, count,
+                    timing_.tBP1_us
+                        + ((timing_.tPP_us - timing_.tBP1_us) * (count - 1))
+                            / (PAGE_SIZE - 1));
+              }
+            wel_ = false;
+            break;
+
+          case WRITE_STATUS_REGISTER:
+            if (manufacturer_ID_ == MANUF_ID_WINBOND && count > 1
+                && (wel_ || volatile_sr_we_))
+              {
+                status_2_ = buff[1];
+                if (wel_)
+                  status_2_nv_ = buff[1];
+              }
+            wel_ = false;
+            volatile_sr_we_ = false;
+            break;
+
+          default:
+            if (manufacturer_ID_ == MANUF_ID_WINBOND)
+              {
+                if (instruction == WB_WRITE_STATUS_REGISTER_2)
+                  {
+                    if (wel_ || volatile_sr_we_)
+                      {
+                        status_2_ = buff[0];
+                        if (wel_)
+                          status_2_nv_ = buff[0];
+                      }
+                    wel_ = false;
+                    volatile_sr_we_ = false;
+                  }
+                else if (instruction == WB_SET_READ_PARAMETERS && quad_)
+                  {
+                    read_parameters_ = buff[0];
+                  }
+              }
+            else if (manufacturer_ID_ == MANUF_ID_MICRON)
+              {
+                if (instruction == MT_WRITE_VOLATILE_CONFIG)
+                  {
+                    if (wel_)
+                      vcr_ = buff[0];
+                    wel_ = false;
+                  }
+                else if (instruction == MT_WRITE_ENH_VOLATILE_CONFIG)
+                  {
+                    if (wel_)
+                      {
+                        evcr_ = buff[0];
+                        quad_ = (evcr_ & 0x80) == 0;
+                      }
+                    wel_ = false;
+                  }
+              }
+            break;
+          }
+      }
+
+      /**
+       * @brief  Switch the chip to memory-mapped operation.
+       * @param  cmd: read command the controller will issue on each access.
+       * @return true if the chip will return correct data, false otherwise.
+       */
+      bool
+      qspi_nor_model::map (const QSPI_CommandTypeDef* cmd)
+      {
+        uint8_t instruction;
+
+        mapped_ = true;
+        mapped_skew_ = 0;
+        mapped_cmd_ = *cmd;
+        if (accept (cmd) == false)
+          {
+            return false;
+          }
+        instruction =
+            continuous_ ?
+                continuous_instruction_ : (uint8_t) cmd->Instruction;
+        if (instruction != FAST_READ_QUAD_IN_OUT
+            && (instruction != FAST_READ_QUAD_IN_OUT_DTR
+                || pdevice_->DDR_support == false))
+          {
+            return false;
+          }
+        mapped_skew_ = fast_read_skew (cmd, instruction);
+
+        // the accesses after the first one are decoded correctly only if
+        // both the chip and the controller skip the instruction, or none
+        continuous_ = continuous_mode_bits (cmd);
+        continuous_instruction_ = instruction;
+        if (continuous_ != (cmd->SIOOMode == QSPI_SIOO_INST_ONLY_FIRST_CMD))
+          {
+            return false;
+          }
+        return mapped_skew_ == 0;
+      }
+
+      /**
+       * @brief  Leave memory-mapped operation (chip select released).
+       */
+      void
+      qspi_nor_model::unmap (void)
+      {
+        mapped_ = false;
+      }
+
+      /**
+       * @brief  Account for an access through the memory-mapped window: the
+       *    controller issues the mapped read command for the range (without
+       *    instruction when the chip is in continuous read mode). The data
+       *    itself is read directly from memory().
+       * @param  address: start address of the access.
+       * @param  count: number of bytes accessed.
+       */
+      void
+      qspi_nor_model::charge_mapped (uint32_t address, size_t count)
+      {
+        QSPI_CommandTypeDef cmd = mapped_cmd_;
+        uint64_t start_ps = now_ps_;
+
+        if (mapped_ == false || count == 0)
+          {
+            return;
+          }
+        if (continuous_)
+          {
+            cmd.InstructionMode = QSPI_INSTRUCTION_NONE;
+          }
+        cmd.Address = address;
+        clock_command (&cmd, count);
+        stats_.bytes_read += count;
+        stats_.read_ns += (now_ps_ - start_ps) / 1000;
+        if (trace_)
+          {
+            trace::printf ("[%12.3f ms] mapped    0x%06X %7u B %10.3f us\n",
+                           start_ps / 1e9, address, (unsigned) count,
+                           (now_ps_ - start_ps) / 1e6);
+          }
+      }
+
+      /**
+       * @brief  Check if the chip decodes a command (right protocol, not in
+       *    deep power-down).
+       * @param  cmd: command as issued by the QSPI controller.
+       * @return true if the command is decoded, false if it is ignored.
+       */
+      bool
+      qspi_nor_model::accept (const QSPI_CommandTypeDef* cmd)
+      {
+        bool result = (pdevice_ != nullptr);
+
+        stats_.commands++;
+        if (power_down_ && (uint8_t) cmd->Instruction != RELEASE_POWER_DOWN)
+          {
+            result = false;
+          }
+        else if (continuous_ != (cmd->InstructionMode == QSPI_INSTRUCTION_NONE))
+          {
+            // in continuous read mode the instruction would be taken as the
+            // first address byte; out of it, the first address byte is taken
+            // as the instruction
+            result = false;
+          }
+        else if (continuous_ == false
+            && cmd->InstructionMode
+                != (quad_ ? QSPI_INSTRUCTION_4_LINES : QSPI_INSTRUCTION_1_LINE))
+          {
+            result = false;
+          }
+        else if (is_busy ()
+            && (uint8_t) cmd->Instruction != READ_STATUS_REGISTER
+            && (uint8_t) cmd->Instruction != SUSPEND
+            && (uint8_t) cmd->Instruction != MT_READ_FLAG_STATUS)
+          {
+            result = false;
+          }
+        else if (suspended_
+            && ((uint8_t) cmd->Instruction == SECTOR_ERASE
+                || (uint8_t) cmd->Instruction == BLOCK_32K_ERASE
+                || (uint8_t) cmd->Instruction == BLOCK_64K_ERASE
+                || (uint8_t) cmd->Instruction == CHIP_ERASE
+                || (uint8_t) cmd->Instruction == CHIP_ERASE_ALT))
+          {
+            // no other erase may start while one is suspended
+            result = false;
+          }
+        if (result == false)
+          {
+            stats_.ignored++;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Software reset: restore the power-on volatile settings.
+       */
+      void
+      qspi_nor_model::reset (void)
+      {
+        quad_ = false;
+        wel_ = false;
+        volatile_sr_we_ = false;
+        reset_enabled_ = false;
+        mapped_ = false;
+        continuous_ = false;
+        status_2_ = status_2_nv_;
+        read_parameters_ = 0;
+        vcr_ = 0xFB;
+        evcr_ = 0xFF;
+        busy_until_ps_ = now_ps_;
+        op_pending_ = false;
+        suspended_ = false;
+        status_2_ &= ~0x80;
+      }
+
+      uint32_t
+      qspi_nor_model::address_of (const QSPI_CommandTypeDef* cmd)
+      {
+        return cmd->Address & (size_ - 1);
+      }
+
+      /**
+       * @brief  Clock cycles the chip expects between address and data for
+       *    the quad I/O fast read (mode bits included).
+       */
+      uint8_t
+      qspi_nor_model::read_dummy_cycles (void)
+      {
+        uint8_t cycles;
+
+        if (manufacturer_ID_ == MANUF_ID_WINBOND)
+          {
+            cycles = quad_ ? (((read_parameters_ >> 4) & 3) + 1) * 2 : 6;
+          }
+        else
+          {
+            cycles = vcr_ >> 4;
+            if (cycles == 0 || cycles == 0xF)
+              {
+                cycles = 10;
+              }
+          }
+        return cycles;
+      }
+
+      /**
+       * @brief  Clock cycles the controller spends between address and data
+       *    (alternate bytes plus dummy cycles).
+       */
+      uint8_t
+      qspi_nor_model::cycles_before_data (const QSPI_CommandTypeDef* cmd)
+      {
+        uint32_t cycles = cmd->DummyCycles;
+
+        if (cmd->AlternateByteMode != QSPI_ALTERNATE_BYTES_NONE)
+          {
+            uint32_t bits = ((cmd->AlternateBytesSize >> 16) + 1) * 8;
+            uint32_t lines = 1 << ((cmd->AlternateByteMode >> 14) - 1);
+            uint32_t ddr = (cmd->DdrMode == QSPI_DDR_MODE_ENABLE) ? 2 : 1;
+            cycles += bits / lines / ddr;
+          }
+        return (uint8_t) cycles;
+      }
+
+      /**
+       * @brief  Check if the mode bits of a quad I/O read (first alternate
+       *    byte) keep the chip in, or bring it into, continuous read mode.
+       */
+      bool
+      qspi_nor_model::continuous_mode_bits (const QSPI_CommandTypeDef* cmd)
+      {
+        uint8_t mode;
+
+        if (cmd->AlternateByteMode == QSPI_ALTERNATE_BYTES_NONE)
+          {
+            return false;
+          }
+        mode = (uint8_t) (cmd->AlternateBytes
+            >> (((cmd->AlternateBytesSize >> 16) & 3) * 8));
+        if (manufacturer_ID_ == MANUF_ID_WINBOND)
+          {
+            return (mode & 0x30) == 0x20;
+          }
+        // XIP confirmation bit, DQ0 in the first cycle after the address
+        return (vcr_ & 0x08) == 0 && (mode & 0x10) == 0;
+      }
+
+      /**
+       * @brief  Nibble skew of a quad I/O fast read (SDR or DTR) as seen by
+       *    the controller. A DTR read must be issued in DDR mode; with the
+       *    sample shifting enabled, the controller samples each nibble half a
+       *    cycle late, i.e. the next one.
+       */
+      int
+      qspi_nor_model::fast_read_skew (const QSPI_CommandTypeDef* cmd,
+                                      uint8_t instruction)
+      {
+        bool dtr = (instruction == FAST_READ_QUAD_IN_OUT_DTR);
+        int skew = (int) cycles_before_data (cmd) - (int) read_dummy_cycles ();
+
+        if (dtr != (cmd->DdrMode == QSPI_DDR_MODE_ENABLE))
+          {
+            // address decoded at the wrong rate, data garbled
+            return 3;
+          }
+        if (dtr)
+          {
+            skew *= 2;
+            if (hqspi_ != nullptr
+                && (hqspi_->Instance->CR & QUADSPI_CR_SSHIFT) != 0)
+              {
+                skew += 1;
+              }
+          }
+        return skew;
+      }
+
+      /**
+       * @brief  Read the memory array as seen by the controller: if the
+       *    controller and the chip disagree on the number of cycles before
+       *    data, the data stream is skewed by one nibble per cycle.
+       */
+      void
+      qspi_nor_model::read_array (uint32_t address, int nibble_skew,
+                                  uint8_t* buff, size_t count)
+      {
+        if (nibble_skew == 0)
+          {
+            for (size_t i = 0; i < count;)
+              {
+                size_t chunk = size_ - address;
+                if (chunk > count - i)
+                  chunk = count - i;
+                memcpy (buff + i, memory_ + address, chunk);
+                i += chunk;
+                address = (address + chunk) & (size_ - 1);
+              }
+            return;
+          }
+
+        for (size_t i = 0; i < count; i++)
+          {
+            uint8_t byte = 0;
+            for (int n = 0; n < 2; n++)
+              {
+                long nibble = (long) (2 * i + n) + nibble_skew;
+                uint8_t value = 0xF;
+                if (nibble >= 0)
+                  {
+                    uint8_t b = memory_[(address + nibble / 2) & (size_ - 1)];
+                    value = (nibble & 1) ? (b & 0xF) : (b >> 4);
+                  }
+                byte = (byte << 4) | value;
+              }
+            buff[i] = byte;
+          }
+      }
+
+      void
+      qspi_nor_model::erase (uint32_t address, size_t size)
+      {
+        memset (memory_ + address, 0xFF, size);
+      }
+
+      /**
+       * @brief  Let the virtual time pass while the controller auto-polls the
+       *    status register of a busy chip, up to the last poll before the
+       *    program/erase operation completes.
+       * @param  cmd: the status read command used for polling.
+       * @param  interval: polling interval, in bus clock cycles.
+       */
+      void
+      qspi_nor_model::wait_polling (const QSPI_CommandTypeDef* cmd,
+                                    uint32_t interval)
+      {
+        if (is_busy ())
+          {
+            uint64_t period = (interval + bus_cycles (cmd, 1)) * cycle_ps ();
+            uint64_t polls = (busy_until_ps_ - now_ps_) / period;
+            now_ps_ += polls * period;
+            stats_.busy_polls += polls;
+            if (is_busy ())
+              {
+                // the last polls are run by the controller
+                now_ps_ += interval * cycle_ps ();
+              }
+          }
+      }
+
+      /**
+       * @brief  Duration of a bus clock cycle, in picoseconds.
+       */
+      uint64_t
+      qspi_nor_model::cycle_ps (void)
+      {
+        uint32_t prescaler =
+            (hqspi_ == nullptr) ? 0 : hqspi_->Init.ClockPrescaler;
+        return (1000000000000ULL * (prescaler + 1)) / SystemCoreClock;
+      }
+
+      /**
+       * @brief  Number of bus clock cycles of a command, chip select high time
+       *    included.
+       * @param  cmd: the command.
+       * @param  count: number of data bytes.
+       */
+      uint32_t
+      qspi_nor_model::bus_cycles (const QSPI_CommandTypeDef* cmd, size_t count)
+      {
+        uint32_t cycles = 2 + cmd->DummyCycles;
+        uint32_t ddr = (cmd->DdrMode == QSPI_DDR_MODE_ENABLE) ? 2 : 1;
+        uint32_t mode;
+
+        // instruction phase is always SDR
+        if ((mode = (cmd->InstructionMode >> 8) & 3) != 0)
+          {
+            cycles += 8 >> (mode - 1);
+          }
+        if ((mode = (cmd->AddressMode >> 10) & 3) != 0)
+          {
+            cycles += ((((cmd->AddressSize >> 12) & 3) + 1) * 8 >> (mode - 1))
+                / ddr;
+          }
+        if ((mode = (cmd->AlternateByteMode >> 14) & 3) != 0)
+          {
+            cycles += ((((cmd->AlternateBytesSize >> 16) & 3) + 1) * 8
+                >> (mode - 1)) / ddr;
+          }
+        if ((mode = (cmd->DataMode >> 24) & 3) != 0)
+          {
+            cycles += ((count * 8) >> (mode - 1)) / ddr;
+          }
+        return cycles;
+      }
+
+      /**
+       * @brief  Advance the virtual clock by the duration of a command.
+       */
+      void
+      qspi_nor_model::clock_command (const QSPI_CommandTypeDef* cmd,
+                                     size_t count)
+      {
+        now_ps_ += bus_cycles (cmd, count) * cycle_ps ();
+      }
+
+      /**
+       * @brief  Start a program or erase operation: the chip stays busy for the
+       *    given duration.
+       */
+      void
+      qspi_nor_model::start_busy (uint8_t instruction, uint32_t address,
+                                  size_t count, uint64_t duration_us)
+      {
+        op_start_ps_ = now_ps_;
+        op_instruction_ = instruction;
+        op_address_ = address;
+        op_count_ = count;
+        op_pending_ = true;
+        busy_until_ps_ = now_ps_ + duration_us * 1000000;
+      }
+
+      /**
+       * @brief  Account for a completed program or erase operation, once its
+       *    completion has been observed on the status register.
+       */
+      void
+      qspi_nor_model::end_busy (void)
+      {
+        uint64_t elapsed_ns = (now_ps_ - op_start_ps_) / 1000;
+        const char* name;
+
+        op_pending_ = false;
+        switch (op_instruction_)
+          {
+          case PAGE_PROGRAM:
+          case QUAD_PAGE_PROGRAM:
+            stats_.program_ns += elapsed_ns;
+            name = "program  ";
+            break;
+
+          case SECTOR_ERASE:
+            stats_.erase_ns += elapsed_ns;
+            name = "erase 4K ";
+            break;
+
+          case BLOCK_32K_ERASE:
+            stats_.erase_ns += elapsed_ns;
+            name = "erase 32K";
+            break;
+
+          case BLOCK_64K_ERASE:
+            stats_.erase_ns += elapsed_ns;
+            name = "erase 64K";
+            break;
+
+          default:
+            stats_.erase_ns += elapsed_ns;
+            name = "erase all";
+            break;
+          }
+        if (trace_)
+          {
+            trace::printf ("[%12.3f ms] %s 0x%06X %7u B %10.3f us\n",
+                           op_start_ps_ / 1e9, name, op_address_,
+                           (unsigned) op_count_,
+                           elapsed_ns / 1e3);
+          }
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
@@ -0,0 +1,466 @@
+/*
+ * qspi-nor-model.h
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef QSPI_NOR_MODEL_H_
+#define QSPI_NOR_MODEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "quadspi.h"
+#include "qspi-descr.h"
+
+#if defined (__cplusplus)
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+
+      /**
+       * In-RAM model of a QSPI NOR flash chip. The model decodes the commands
+       * issued by the host HAL the way the real chip would: program can only
+       * clear bits, page programs wrap inside the 256 bytes page, erases work
+       * on aligned 4K, 32K, 64K blocks or the whole chip, and commands sent
+       * in the wrong protocol (SPI vs. QPI), without write enable, while
+       * busy or during deep power-down are ignored. The quad I/O DTR read is
+       * decoded if the device descriptor supports it; it returns correct data
+       * only if issued in DDR mode, without controller sample shifting. The
+       * quad I/O reads enter the continuous read mode as selected by their
+       * mode bits (Winbond M5-4, Micron XIP confirmation bit with the XIP bit
+       * of the volatile configuration register cleared); in this mode the
+       * chip expects the address of the next read, without instruction, and
+       * ignores any other command.
+       *
+       * The model keeps a virtual clock, advanced by the bus cycles of every
+       * command (at the clock set by the controller's prescaler), by the
+       * datasheet program/erase times and by the software overheads of the
+       * HAL. Program and erase operations keep the chip busy (WIP set) until
+       * the virtual clock reaches their completion time. The loads from the
+       * memory-mapped window are not seen by the model; charge_mapped()
+       * accounts for the bus cycles of such an access.
+       *
+       * set_power_loss() simulates a power failure: the given number of
+       * program/erase operations complete, the next one is torn (only its
+       * first half reaches the array) and the later ones change nothing,
+       * until power_cycle().
+       */
+      class qspi_nor_model
+      {
+      public:
+        qspi_nor_model (const char* device_name);
+
+        ~qspi_nor_model ();
+
+        typedef struct
+        {
+          uint32_t commands;          // commands decoded
+          uint32_t ignored;           // commands ignored by the chip
+          uint32_t page_programs;
+          uint32_t sector_erases;
+          uint32_t block32K_erases;
+          uint32_t block64K_erases;
+          uint32_t chip_erases;
+          uint32_t suspends;          // program/erase suspended
+          uint32_t continuous_reads;  // reads without instruction
+          uint64_t busy_polls;        // status polls while busy
+          uint64_t bytes_read;
+          uint64_t bytes_programmed;
+          uint64_t read_ns;           // virtual time spent in reads
+          uint64_t program_ns;        // virtual time spent in page programs
+          uint64_t erase_ns;          // virtual time spent in erases
+        } stats_t;
+
+        typedef struct
+        {
+          uint32_t tPP_us;            // page program time (256 bytes)
+          uint32_t tBP1_us;           // first byte program time
+          uint32_t tSE_us;            // 4K sector erase time
+          uint32_t tBE32_us;          // 32K block erase time
+          uint32_t tBE64_us;          // 64K block erase time
+          uint32_t tCE_ms;            // chip erase time
+          uint32_t command_ns;        // software overhead of a HAL call
+          uint32_t interrupt_ns;      // interrupt and thread wake-up latency
+          uint32_t register_ns;       // software overhead of a command
+                                      // written at register level
+        } timing_t;
+
+        // Bus interface, used by the host HAL
+        void
+        execute (const QSPI_CommandTypeDef* cmd);
+
+        void
+        receive (const QSPI_CommandTypeDef* cmd, uint8_t* buff, size_t count);
+
+        void
+        transmit (const QSPI_CommandTypeDef* cmd, const uint8_t* buff,
+                  size_t count);
+
+        bool
+        map (const QSPI_CommandTypeDef* cmd);
+
+        void
+        unmap (void);
+
+        void
+        charge_mapped (uint32_t address, size_t count);
+
+        // Wiring
+        void
+        attach (QSPI_HandleTypeDef* hqspi);
+
+        static qspi_nor_model*
+        attached (QSPI_HandleTypeDef* hqspi);
+
+        static qspi_nor_model*
+        attached (QUADSPI_TypeDef* instance);
+
+        QSPI_HandleTypeDef*
+        handle (void);
+
+        // Back-door access
+        uint8_t*
+        memory (void);
+
+        size_t
+        size (void);
+
+        const qspi_device_t*
+        device (void);
+
+        uint8_t
+        manufacturer_ID (void);
+
+        bool
+        is_quad (void);
+
+        bool
+        is_power_down (void);
+
+        bool
+        is_mapped (void);
+
+        bool
+        is_continuous (void);
+
+        void
+        power_cycle (void);
+
+        void
+        set_power_loss (uint32_t operations);
+
+        bool
+        is_power_lost (void);
+
+        // Virtual time
+        uint64_t
+        now (void);
+
+        void
+        advance (uint64_t ns);
+
+        bool
+        is_busy (void);
+
+        void
+        wait_polling (const QSPI_CommandTypeDef* cmd, uint32_t interval);
+
+        const timing_t&
+        timing (void);
+
+        void
+        set_timing (const timing_t& timing);
+
+        void
+        set_trace (bool state);
+
+        const stats_t&
+        stats (void);
+
+        void
+        clear_stats (void);
+
+        // Standard command sub-set, as decoded by the chip
+        static constexpr uint8_t JEDEC_ID = 0x9F;
+        static constexpr uint8_t WRITE_ENABLE = 0x06;
+        static constexpr uint8_t WRITE_DISABLE = 0x04;
+        static constexpr uint8_t READ_STATUS_REGISTER = 0x05;
+        static constexpr uint8_t WRITE_STATUS_REGISTER = 0x01;
+        static constexpr uint8_t SECTOR_ERASE = 0x20;
+        static constexpr uint8_t BLOCK_32K_ERASE = 0x52;
+        static constexpr uint8_t BLOCK_64K_ERASE = 0xD8;
+        static constexpr uint8_t CHIP_ERASE = 0xC7;
+        static constexpr uint8_t CHIP_ERASE_ALT = 0x60;
+        static constexpr uint8_t RESET_ENABLE = 0x66;
+        static constexpr uint8_t RESET_DEVICE = 0x99;
+        static constexpr uint8_t POWER_DOWN = 0xB9;
+        static constexpr uint8_t RELEASE_POWER_DOWN = 0xAB;
+        static constexpr uint8_t PAGE_PROGRAM = 0x02;
+        static constexpr uint8_t QUAD_PAGE_PROGRAM = 0x32;
+        static constexpr uint8_t READ_DATA = 0x03;
+        static constexpr uint8_t FAST_READ_DATA = 0x0B;
+        static constexpr uint8_t FAST_READ_QUAD_OUT = 0x6B;
+        static constexpr uint8_t FAST_READ_QUAD_IN_OUT = 0xEB;
+        static constexpr uint8_t FAST_READ_QUAD_IN_OUT_DTR = 0xED;
+        static constexpr uint8_t SUSPEND = 0x75;
+        static constexpr uint8_t RESUME = 0x7A;
+
+        // Winbond specific
+        static constexpr uint8_t WB_VOLATILE_SR_WRITE_ENABLE = 0x50;
+        static constexpr uint8_t WB_READ_STATUS_REGISTER_2 = 0x35;
+        static constexpr uint8_t WB_WRITE_STATUS_REGISTER_2 = 0x31;
+        static constexpr uint8_t WB_ENTER_QPI = 0x38;
+        static constexpr uint8_t WB_EXIT_QPI = 0xFF;
+        static constexpr uint8_t WB_SET_READ_PARAMETERS = 0xC0;
+
+        // Micron specific
+        static constexpr uint8_t MT_READ_VOLATILE_CONFIG = 0x85;
+        static constexpr uint8_t MT_WRITE_VOLATILE_CONFIG = 0x81;
+        static constexpr uint8_t MT_READ_ENH_VOLATILE_CONFIG = 0x65;
+        static constexpr uint8_t MT_WRITE_ENH_VOLATILE_CONFIG = 0x61;
+        static constexpr uint8_t MT_ENTER_QUAD = 0x35;
+        static constexpr uint8_t MT_ENTER_QUAD_ALT = 0x38;
+        static constexpr uint8_t MT_READ_FLAG_STATUS = 0x70;
+
+        static constexpr size_t PAGE_SIZE = 256;
+
+      private:
+        bool
+        accept (const QSPI_CommandTypeDef* cmd);
+
+        void
+        reset (void);
+
+        uint32_t
+        address_of (const QSPI_CommandTypeDef* cmd);
+
+        uint8_t
+        read_dummy_cycles (void);
+
+        uint8_t
+        cycles_before_data (const QSPI_CommandTypeDef* cmd);
+
+        int
+        fast_read_skew (const QSPI_CommandTypeDef* cmd, uint8_t instruction);
+
+        bool
+        continuous_mode_bits (const QSPI_CommandTypeDef* cmd);
+
+        void
+        read_array (uint32_t address, int nibble_skew, uint8_t* buff,
+                    size_t count);
+
+        void
+        erase (uint32_t address, size_t size);
+
+        size_t
+        torn_size (size_t size);
+
+        uint64_t
+        cycle_ps (void);
+
+        uint32_t
+        bus_cycles (const QSPI_CommandTypeDef* cmd, size_t count);
+
+        void
+        clock_command (const QSPI_CommandTypeDef* cmd, size_t count);
+
+        void
+        start_busy (uint8_t instruction, uint32_t address, size_t count,
+                    uint64_t duration_us);
+
+        void
+        end_busy (void);
+
+        static constexpr size_t MAX_ATTACHED = 2;
+        static qspi_nor_model* attached_[MAX_ATTACHED];
+
+        const qspi_device_t* pdevice_ = nullptr;
+        uint8_t manufacturer_ID_ = 0;
+        uint8_t* memory_ = nullptr;
+        size_t size_ = 0;
+        QSPI_HandleTypeDef* hqspi_ = nullptr;
+
+        // Volatile chip state
+        bool quad_ = false;
+        bool power_down_ = false;
+        bool wel_ = false;
+        bool volatile_sr_we_ = false;
+        bool reset_enabled_ = false;
+        bool mapped_ = false;
+        int mapped_skew_ = 0;
+        QSPI_CommandTypeDef mapped_cmd_
+          { };                          // issued on each mapped access
+        bool continuous_ = false;       // continuous read mode
+        uint8_t continuous_instruction_ = 0;  // read continued
+        uint8_t status_2_ = 0;          // Winbond status register 2
+        uint8_t status_2_nv_ = 0;
+        uint8_t read_parameters_ = 0;   // Winbond QPI read parameters
+        uint8_t vcr_ = 0xFB;            // Micron volatile configuration
+        uint8_t evcr_ = 0xFF;           // Micron enhanced volatile config.
+
+        // Virtual time, in picoseconds
+        uint64_t now_ps_ = 0;
+        uint64_t busy_until_ps_ = 0;
+        uint64_t op_start_ps_ = 0;
+        uint8_t op_instruction_ = 0;
+        uint32_t op_address_ = 0;
+        size_t op_count_ = 0;
+        bool op_pending_ = false;
+        bool suspended_ = false;        // program/erase suspended
+        uint64_t op_remaining_ps_ = 0;  // busy time left when suspended
+        bool trace_ = false;
+
+        // Simulated power loss (see set_power_loss())
+        bool loss_armed_ = false;
+        uint32_t loss_countdown_ = 0;   // operations left before the loss
+        bool power_lost_ = false;
+
+        timing_t timing_
+          { };
+
+        stats_t stats_
+          { };
+      };
+
+      inline QSPI_HandleTypeDef*
+      qspi_nor_model::handle (void)
+      {
+        return hqspi_;
+      }
+
+      inline uint8_t*
+      qspi_nor_model::memory (void)
+      {
+        return memory_;
+      }
+
+      inline size_t
+      qspi_nor_model::size (void)
+      {
+        return size_;
+      }
+
+      inline const qspi_device_t*
+      qspi_nor_model::device (void)
+      {
+        return pdevice_;
+      }
+
+      inline uint8_t
+      qspi_nor_model::manufacturer_ID (void)
+      {
+        return manufacturer_ID_;
+      }
+
+      inline bool
+      qspi_nor_model::is_quad (void)
+      {
+        return quad_;
+      }
+
+      inline bool
+      qspi_nor_model::is_power_down (void)
+      {
+        return power_down_;
+      }
+
+      inline bool
+      qspi_nor_model::is_mapped (void)
+      {
+        return mapped_;
+      }
+
+      inline bool
+      qspi_nor_model::is_continuous (void)
+      {
+        return continuous_;
+      }
+
+      inline uint64_t
+      qspi_nor_model::now (void)
+      {
+        return now_ps_ / 1000;
+      }
+
+      inline void
+      qspi_nor_model::advance (uint64_t ns)
+      {
+        now_ps_ += ns * 1000;
+      }
+
+      inline bool
+      qspi_nor_model::is_power_lost (void)
+      {
+        return power_lost_;
+      }
+
+      inline bool
+      qspi_nor_model::is_busy (void)
+      {
+        return now_ps_ < busy_until_ps_;
+      }
+
+      inline const qspi_nor_model::timing_t&
+      qspi_nor_model::timing (void)
+      {
+        return timing_;
+      }
+
+      inline void
+      qspi_nor_model::set_timing (const timing_t& timing)
+      {
+        timing_ = timing;
+      }
+
+      inline void
+      qspi_nor_model::set_trace (bool state)
+      {
+        trace_ = state;
+      }
+
+      inline const qspi_nor_model::stats_t&
+      qspi_nor_model::stats (void)
+      {
+        return stats_;
+      }
+
+      inline void
+      qspi_nor_model::clear_stats (void)
+      {
+        stats_ = stats_t
+          { };
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
+
+#endif // (__cplusplus)
+
+#endif /* QSPI_NOR_MODEL_H_ */
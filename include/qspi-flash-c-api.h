@@ -50,6 +50,15 @@ extern "C"
     qspi_type_not_found,
   } qspi_result_t;
 
+  typedef enum
+  {
+    qspi_erase_min_wear = 0,
+    qspi_erase_max_speed,
+  } qspi_erase_policy_t;
+
+  // qspi_set_poll_threshold(): measure the threshold at initialization
+#define QSPI_POLL_CALIBRATE ((size_t) -1)
+
   typedef struct
   {
     ;
@@ -83,6 +92,19 @@ extern "C"
   qspi_result_t
   qspi_exit_mem_mapped (qspi_t* qspi_instance);
 
+  void
+  qspi_set_mapped_reads (qspi_t* qspi_instance, bool state);
+
+  void
+  qspi_set_dtr_reads (qspi_t* qspi_instance, bool state);
+
+  void
+  qspi_set_continuous_reads (qspi_t* qspi_instance, bool state);
+
+  const uint8_t*
+  qspi_get_mapped_address (qspi_t* qspi_instance, uint32_t address,
+                           size_t count);
+
   qspi_result_t
   qspi_read (qspi_t* qspi_instance, uint32_t address, uint8_t* buff,
              size_t count);
@@ -111,6 +133,30 @@ extern "C"
   qspi_result_t
   qspi_erase_chip (qspi_t* qspi_instance);
 
+  qspi_result_t
+  qspi_erase_range (qspi_t* qspi_instance, uint32_t address, size_t count);
+
+  void
+  qspi_set_erase_policy (qspi_t* qspi_instance, qspi_erase_policy_t policy);
+
+  void
+  qspi_set_cache (qspi_t* qspi_instance, size_t sectors, uint32_t idle_flush);
+
+  void
+  qspi_set_read_ahead (qspi_t* qspi_instance, size_t sectors);
+
+  void
+  qspi_set_pre_erase (qspi_t* qspi_instance, bool state);
+
+  void
+  qspi_set_block_size (qspi_t* qspi_instance, size_t size);
+
+  void
+  qspi_set_poll_threshold (qspi_t* qspi_instance, size_t bytes);
+
+  void
+  qspi_set_scheduler (qspi_t* qspi_instance, bool state);
+
   qspi_result_t
   qspi_reset_chip (qspi_t* qspi_instance);
 
@@ -44,6 +44,7 @@ namespace os
     namespace stm32f7
     {
       typedef struct qspi_device_s qspi_device_t;
+      typedef struct qspi_duration_s qspi_duration_t;
       class qspi_intern;
 
       class qspi_impl : public os::posix::block_device_impl
@@ -62,6 +63,79 @@ namespace os
           type_not_found = 10,        // qspi specific errors
         } qspi_result_t;
 
+        typedef enum
+        {
+          erase_min_wear,             // never erase a sector without need
+          erase_max_speed,            // use the fastest erase cover
+        } erase_policy_t;
+
+        typedef enum
+        {
+          advice_normal,              // read ahead when a sequential stream
+                                      // is detected
+          advice_sequential,          // always read ahead, full window
+          advice_random,              // never read ahead
+        } advice_t;
+
+        typedef struct
+        {
+          uint32_t pages;             // pages programmed
+          uint32_t last;              // duration of the last page
+          uint32_t min;               // shortest page
+          uint32_t max;               // longest page
+          uint64_t total;             // sum of all page durations
+        } program_stats_t;            // durations in hrclock ticks
+
+        typedef struct
+        {
+          uint32_t transfers;         // DMA transfers
+          uint32_t zero_copy;         // coherent buffers, no maintenance
+          uint32_t bounced;           // through the driver's DMA buffer
+          uint32_t maintained;        // with data cache maintenance
+          uint64_t maintenance;       // hrclock ticks spent in maintenance
+          uint32_t polled;            // short transfers, without DMA
+        } dma_stats_t;
+
+        typedef struct
+        {
+          uint32_t reads;             // read requests
+          uint32_t merged;            // read requests merged into another one
+          uint32_t interleaved;       // read requests served during a write
+          uint32_t writes;            // write requests
+          uint32_t coalesced;         // write requests coalesced with another
+          uint32_t wait_max;          // longest read request
+          uint64_t wait_total;        // sum of the read request durations
+        } sched_stats_t;              // durations in hrclock ticks
+
+        // set_sleep_hook(): replaces the sleep of the program and erase
+        // waits, given in system clock ticks
+        typedef void
+        (*sleep_hook_t) (uint32_t ticks);
+
+        // set_poll_threshold(): measure the threshold at initialization
+        static constexpr size_t poll_calibrate = (size_t) -1;
+
+        // Driver specific do_vioctl() requests
+        enum
+        {
+          // (advice_t advice): set the read-ahead policy
+          ioctl_advise = 0x5100,
+          // (blknum_t blknum, size_t nblocks): start reading these blocks
+          // ahead, they are about to be requested
+          ioctl_willneed,
+          // (blknum_t blknum, size_t nblocks): the content of these blocks is
+          // no longer needed, erase them
+          ioctl_discard,
+          // (uint32_t* sizes): returns the sizes (bytes) of the erase units,
+          // sizes[0] the sector, sizes[1] and sizes[2] the 32K and 64K blocks
+          ioctl_get_erase_sizes,
+          // (blknum_t blknum, size_t nblocks, bool* blank): returns true if
+          // all these blocks are blank (erased)
+          ioctl_is_blank,
+          // (uint32_t* size): returns the program page size (bytes)
+          ioctl_get_page_size,
+        };
+
         virtual bool
         do_is_opened (void) override;
 
@@ -104,6 +178,27 @@ namespace os
         qspi_result_t
         exit_mem_mapped (void);
 
+        void
+        set_mapped_reads (bool state);
+
+        bool
+        get_mapped_reads (void);
+
+        void
+        set_dtr_reads (bool state);
+
+        bool
+        get_dtr_reads (void);
+
+        void
+        set_continuous_reads (bool state);
+
+        bool
+        get_continuous_reads (void);
+
+        const uint8_t*
+        get_mapped_address (uint32_t address, size_t count);
+
         qspi_result_t
         read (uint32_t address, uint8_t* buff, size_t count);
 
@@ -128,6 +223,54 @@ namespace os
         qspi_result_t
         erase_chip (void);
 
+        qspi_result_t
+        erase_range (uint32_t address, size_t count);
+
+        void
+        set_erase_policy (erase_policy_t policy);
+
+        void
+        set_block_size (size_t size);
+
+        void
+        set_cache (size_t sectors, os::rtos::clock::duration_t idle_flush);
+
+        void
+        set_read_ahead (size_t sectors);
+
+        void
+        set_pre_erase (bool state);
+
+        void
+        set_poll_threshold (size_t bytes);
+
+        void
+        set_scheduler (bool state);
+
+        void
+        set_sleep_hook (sleep_hook_t hook);
+
+        size_t
+        get_poll_threshold (void);
+
+        const program_stats_t&
+        get_program_stats (void);
+
+        void
+        clear_program_stats (void);
+
+        const dma_stats_t&
+        get_dma_stats (void);
+
+        void
+        clear_dma_stats (void);
+
+        const sched_stats_t&
+        get_sched_stats (void);
+
+        void
+        clear_sched_stats (void);
+
         qspi_result_t
         reset_chip (void);
 
@@ -180,23 +323,413 @@ namespace os
         static constexpr uint8_t FAST_READ_DATA = 0x0B;
         static constexpr uint8_t FAST_READ_QUAD_OUT = 0x6B;
         static constexpr uint8_t FAST_READ_QUAD_IN_OUT = 0xEB;
+        static constexpr uint8_t FAST_READ_QUAD_IN_OUT_DTR = 0xED;
+
+        static constexpr uint8_t PROGRAM_ERASE_SUSPEND = 0x75;
+        static constexpr uint8_t PROGRAM_ERASE_RESUME = 0x7A;
 
         // Some timeouts
         static constexpr uint32_t one_ms = 1000
             / os::rtos::sysclock.frequency_hz;
         static constexpr uint32_t one_sec = 1000 * one_ms;
         static constexpr uint32_t TIMEOUT = 10 * one_ms;
-        static constexpr uint32_t WRITE_TIMEOUT = 50 * one_ms;
-        static constexpr uint32_t ERASE_TIMEOUT = 2 * one_sec;
-        static constexpr uint32_t CHIP_ERASE_TIMEOUT = 200 * one_sec;
+
+        static constexpr size_t PAGE_SIZE = 256;
+        static constexpr size_t MIN_SECTOR_SIZE = 0x1000;
+        static constexpr size_t BLOCK_64K_SIZE = 0x10000;
+
+        // Program and erase waits: the part of the expected duration slept
+        // before polling (in 1/256), the status polls per expected duration,
+        // the weight of a measured duration in the expected one (1/2^n) and
+        // the lower limit of the expected duration (1/n of the typical one)
+        static constexpr uint32_t READY_SLEEP = 192;
+        static constexpr uint32_t READY_POLLS = 32;
+        static constexpr uint32_t READY_WEIGHT_SHIFT = 3;
+        static constexpr uint32_t READY_MIN_DIV = 4;
+
+        // Largest DMA transfer (the DMA counter is 16 bits wide), multiple of
+        // the cache line size
+        static constexpr size_t DMA_MAX_TRANSFER = 0xFFE0;
+
+        // Polling threshold limits (bytes): the lower one is the size of
+        // the controller FIFO, the upper one bounds the time the CPU is kept
+        // busy; POLL_SAMPLES measurements are taken of each transfer
+        static constexpr size_t POLL_MIN_THRESHOLD = 32;
+        static constexpr size_t POLL_MAX_THRESHOLD = 1024;
+        static constexpr int POLL_SAMPLES = 4;
+
+        // I/O scheduler: size of the buffer the adjacent reads are merged in
+        // (at least a sector) and the read requests served in a row while a
+        // write waits
+        static constexpr size_t SCHED_MERGE_SIZE = 0x2000;
+        static constexpr int SCHED_READ_BURST = 8;
+
+        // Erase suspension: the time an erase runs after a resume before it
+        // can be suspended again (us), and the suspensions allowed per
+        // erase; beyond them, the readers wait for the end of the erase
+        static constexpr uint32_t ERASE_RUN_MIN = 1000;
+        static constexpr int ERASE_SUSPENDS_MAX = 32;
+
+        // Background eraser: delay before a failed erase is retried
+        static constexpr uint32_t PRE_ERASE_BACKOFF = one_sec;
+
+        // Idle bus cycles before the chip select is released in memory-mapped
+        // mode
+        static constexpr uint32_t MAPPED_IDLE_TIMEOUT = 0x40;
 
         QSPI_HandleTypeDef* hqspi_;
         os::rtos::semaphore_binary semaphore_
           { "qspi", 0 };
 
       private:
+        // Program and erase operations, waited for with wait_ready()
+        typedef enum
+        {
+          op_program,
+          op_sector_erase,
+          op_block32_erase,
+          op_block64_erase,
+          op_chip_erase,
+          op_count
+        } operation_t;
+
+        typedef struct
+        {
+          uint32_t sector;
+          uint32_t stamp;             // last use, for LRU eviction
+          bool valid;
+          bool dirty;
+          uint8_t* data;
+        } cache_entry_t;
+
+        // Block device request queued to the I/O scheduler, on the stack of
+        // the calling thread
+        typedef struct sched_request_s
+        {
+          struct sched_request_s* next;
+          uint8_t* buff;
+          blknum_t blknum;
+          size_t nblocks;
+          ssize_t result;
+          os::rtos::clock::timestamp_t time;  // submission, in hrclock ticks
+          os::rtos::semaphore_binary* done;
+        } sched_request_t;
+
+        // Command templates, copied and patched with the address and the
+        // data count when issued (see qspi-commands.cpp)
+        typedef struct
+        {
+          QSPI_CommandTypeDef spi;              // instruction only, 1 line
+          QSPI_CommandTypeDef quad;             // instruction only, 4 lines
+          QSPI_CommandTypeDef jedec_id;
+          QSPI_CommandTypeDef write_enable;
+          QSPI_CommandTypeDef power_down;
+          QSPI_CommandTypeDef release_power_down;
+          QSPI_CommandTypeDef reset_enable;
+          QSPI_CommandTypeDef reset_device;
+          QSPI_CommandTypeDef suspend;
+          QSPI_CommandTypeDef resume;
+          QSPI_CommandTypeDef program;
+          QSPI_CommandTypeDef erase_sector;
+          QSPI_CommandTypeDef erase_32k;
+          QSPI_CommandTypeDef erase_64k;
+          QSPI_CommandTypeDef erase_chip;
+          QSPI_CommandTypeDef status;           // polled with ready
+          QSPI_AutoPollingTypeDef ready;        // busy bit cleared
+          QSPI_CommandTypeDef continuous_exit;
+          QSPI_CommandTypeDef read;             // fast read
+          QSPI_CommandTypeDef read_continuous;  // chip in continuous read mode
+          QSPI_CommandTypeDef mapped;           // memory-mapped fast read
+        } commands_t;
+
+        void
+        build_commands (void);
+
+        void
+        build_read_commands (void);
+
+        qspi_result_t
+        io_command (QSPI_CommandTypeDef* sCommand);
+
+        qspi_result_t
+        io_receive_dma (uint8_t* buff, size_t count);
+
+        qspi_result_t
+        io_transmit_dma (const uint8_t* buff, size_t count);
+
+        qspi_result_t
+        io_receive (uint8_t* buff, size_t count);
+
+        qspi_result_t
+        io_transmit (const uint8_t* buff, size_t count);
+
+        qspi_result_t
+        io_poll_it (QSPI_CommandTypeDef* sCommand,
+                    QSPI_AutoPollingTypeDef* sConfig);
+
+        void
+        io_abort (void);
+
+        qspi_result_t
+        verify_dtr (void);
+
+        void
+        set_sample_shifting (void);
+
+        qspi_result_t
+        continuous_exit (void);
+
+        qspi_result_t
+        map (void);
+
+        qspi_result_t
+        leave_mapped (void);
+
+        qspi_result_t
+        indirect_mode (void);
+
+        qspi_result_t
+        suspend_mapped (void);
+
+        qspi_result_t
+        resume_mapped (qspi_result_t result);
+
+        void
+        invalidate_mapped (uint32_t address, size_t count);
+
+        const uint8_t*
+        mapped_address (uint32_t address, size_t count);
+
+        qspi_result_t
+        read_flash (uint32_t address, uint8_t* buff, size_t count);
+
+        qspi_result_t
+        read_mapped (uint32_t address, uint8_t* buff, size_t count);
+
+        qspi_result_t
+        read_indirect (uint32_t address, uint8_t* buff, size_t count);
+
+        qspi_result_t
+        read_dma (uint32_t address, uint8_t* buff, size_t count);
+
+        qspi_result_t
+        send_read (uint32_t address, size_t count);
+
+        qspi_result_t
+        start_read (uint32_t address, uint8_t* buff, size_t count);
+
+        qspi_result_t
+        read_polled (uint32_t address, uint8_t* buff, size_t count);
+
+        void
+        calibrate_polling (void);
+
+        uint32_t
+        transfer_timeout (size_t count);
+
+        qspi_result_t
+        write_flash (uint32_t address, const uint8_t* buff, size_t count);
+
+        qspi_result_t
+        program_page (uint32_t address, const uint8_t* buff, size_t count);
+
+        qspi_result_t
+        program_start (uint32_t address, const uint8_t* buff, size_t count);
+
+        qspi_result_t
+        program_wait (void);
+
+        qspi_result_t
+        update_block (uint32_t address, const uint8_t* buff, size_t count,
+                      bool must_erase);
+
+        qspi_result_t
+        update_partial (uint32_t address, const uint8_t* buff, size_t count);
+
+        bool
+        classify_sector (uint32_t address, const uint8_t* buff, size_t count,
+                         bool must_erase, uint32_t& changed,
+                         uint32_t& non_blank);
+
+        qspi_result_t
+        check_blank (uint32_t address, size_t count, bool& blank);
+
+        qspi_result_t
+        erase_flash_range (uint32_t address, size_t count);
+
+        qspi_result_t
+        erase_cover (uint32_t base, uint32_t need, uint32_t allowed,
+                     const uint32_t* extra, uint32_t& erased);
+
+        bool
+        use_block_erase (uint32_t need, uint32_t allowed, const uint32_t* extra,
+                         size_t first, size_t count, uint32_t block_cost);
+
+        qspi_result_t
+        cache_open (void);
+
+        qspi_result_t
+        cache_close (void);
+
+        cache_entry_t*
+        cache_find (uint32_t sector);
+
+        cache_entry_t*
+        cache_get (uint32_t sector, bool load);
+
+        qspi_result_t
+        cache_drop (uint32_t address, size_t count);
+
+        qspi_result_t
+        cache_write_back (uint32_t address, size_t count, bool drop);
+
         qspi_result_t
-        page_write (uint32_t address, uint8_t* buff, size_t count);
+        cache_flush_entry (cache_entry_t* entry);
+
+        qspi_result_t
+        cache_flush (void);
+
+        static void*
+        cache_flusher (void* args);
+
+        qspi_result_t
+        ra_open (void);
+
+        void
+        ra_close (void);
+
+        void
+        ra_start (blknum_t blknum, size_t nblocks);
+
+        void
+        ra_wait (void);
+
+        void
+        ra_drop (uint32_t address, size_t count);
+
+        const uint8_t*
+        ra_find (blknum_t blknum);
+
+        void
+        ra_update (blknum_t blknum, size_t nblocks);
+
+        qspi_result_t
+        pre_erase_open (void);
+
+        void
+        pre_erase_close (void);
+
+        void
+        blank_scan (uint32_t block);
+
+        bool
+        blank_test (uint32_t address, size_t count);
+
+        void
+        blank_mark (uint32_t address, size_t count, bool state);
+
+        void
+        pre_erase_queue (uint32_t address, size_t count);
+
+        void
+        pre_erase_cancel (uint32_t address, size_t count);
+
+        bool
+        pre_erase_next (qspi_result_t& result);
+
+        static void*
+        pre_eraser (void* args);
+
+        void
+        lock_write (void);
+
+        void
+        unlock_write (void);
+
+        qspi_result_t
+        lock_area (uint32_t address, size_t count, bool modify);
+
+        void
+        unlock_area (void);
+
+        qspi_result_t
+        erase_yield (operation_t op, os::rtos::clock::timestamp_t start);
+
+        qspi_result_t
+        erase_poll_start (void);
+
+        uint32_t
+        erase_ticks_left (operation_t op, os::rtos::clock::timestamp_t start);
+
+        qspi_result_t
+        erase_suspend (void);
+
+        qspi_result_t
+        erase_resume (void);
+
+        void
+        ready_open (void);
+
+        const qspi_duration_t&
+        datasheet_duration (operation_t op);
+
+        static operation_t
+        erase_operation (uint8_t which);
+
+        uint32_t
+        ready_timeout (operation_t op);
+
+        uint32_t
+        ready_sleep_ticks (operation_t op, os::rtos::clock::timestamp_t start);
+
+        void
+        ready_sleep (operation_t op, os::rtos::clock::timestamp_t start);
+
+        qspi_result_t
+        ready_poll (operation_t op);
+
+        void
+        ready_update (operation_t op, os::rtos::clock::timestamp_t start);
+
+        qspi_result_t
+        wait_ready (operation_t op, os::rtos::clock::timestamp_t start);
+
+        ssize_t
+        read_blocks (uint8_t* buff, blknum_t blknum, size_t nblocks);
+
+        qspi_result_t
+        fetch_blocks (uint8_t* buff, blknum_t blknum, size_t nblocks);
+
+        ssize_t
+        write_blocks (const uint8_t* buff, blknum_t blknum, size_t nblocks);
+
+        qspi_result_t
+        sched_open (void);
+
+        void
+        sched_close (void);
+
+        ssize_t
+        sched_submit (uint8_t* buff, blknum_t blknum, size_t nblocks,
+                      bool write);
+
+        bool
+        sched_conflict (const sched_request_t* req);
+
+        bool
+        sched_ready (void);
+
+        bool
+        sched_read (bool nested);
+
+        bool
+        sched_write (void);
+
+        void
+        sched_yield (void);
+
+        static void*
+        io_scheduler (void* args);
 
         qspi_result_t
         read_JEDEC_ID (void);
@@ -204,6 +737,27 @@ namespace os
         qspi_result_t
         erase (uint32_t address, uint8_t which);
 
+        qspi_result_t
+        erase_area (uint32_t address, uint8_t which);
+
+        void
+        dma_open (void);
+
+        void
+        dma_close (void);
+
+        bool
+        dma_coherent (const uint8_t* ptr, size_t len);
+
+        void
+        dma_prepare_rx (uint8_t* buff, size_t count);
+
+        void
+        dma_complete_rx (uint8_t* buff, size_t count);
+
+        const uint8_t*
+        dma_prepare_tx (const uint8_t* buff, size_t count);
+
         void
         invalidate_dcache (uint8_t* ptr, size_t len);
 
@@ -220,8 +774,124 @@ namespace os
         const char* pmanufacturer_ = nullptr;
         const qspi_device_t* pdevice_ = nullptr;
         bool volatile is_opened_ = false;
-        uint8_t lbuff_[256];
-
+        bool mapped_ = false;           // controller in memory-mapped mode
+        bool keep_mapped_ = false;      // enter_mem_mapped() was called
+        bool mapped_reads_ = false;     // serve reads from the mapped window
+        bool dtr_allowed_ = true;       // set_dtr_reads()
+        bool dtr_ = false;              // reads in DTR mode
+        uint8_t dummy_cycles_ = 0;      // set in the chip for the fast reads
+        bool continuous_allowed_ = true;  // set_continuous_reads()
+        bool continuous_ = false;       // reads in continuous read mode
+        bool in_continuous_ = false;    // chip in continuous read mode, the
+                                        // next read goes without instruction
+        uint8_t suspended_ = 0;         // nested operations in indirect mode
+        erase_policy_t erase_policy_ = erase_min_wear;
+        commands_t cmds_;
+        alignas (32) uint8_t lbuff_[PAGE_SIZE];
+
+        // Bounce buffer from the DMA pool, taken while initialized
+        uint8_t* dma_buff_ = nullptr;
+        dma_stats_t dma_stats_
+          { };
+
+        // Short transfers done by polling
+        size_t poll_request_ = poll_calibrate;  // set_poll_threshold()
+        size_t poll_threshold_ = POLL_MIN_THRESHOLD;
+
+        // Logical blocks smaller than a sector
+        size_t block_size_ = 0;         // requested by set_block_size()
+        uint8_t* sector_buff_ = nullptr;  // read-modify-write of a sector
+
+        // Expected program and erase durations (us), from the device
+        // description, refined with the measured ones
+        uint32_t expected_us_[op_count] =
+          { };
+        sleep_hook_t sleep_hook_ = nullptr;
+
+        // Page being programmed in the background
+        bool program_pending_ = false;
+        uint32_t program_address_ = 0;
+        size_t program_count_ = 0;
+        os::rtos::clock::timestamp_t program_time_ = 0;
+        program_stats_t program_stats_
+          { };
+
+        // Block device locking: io_mx_ protects the controller and the
+        // driver state, write_mx_ serializes the writers, which release io_mx_
+        // while the chip erases, to let the readers in
+        os::rtos::mutex io_mx_
+          { "qspi-io" };
+        os::rtos::mutex write_mx_
+          { "qspi-write" };
+        bool yield_io_ = false;         // io_mx_ held by a writer
+        bool erase_busy_ = false;       // a writer waits for an erase
+        bool erase_suspended_ = false;  // erase suspended by a reader
+        bool volatile erase_polling_ = false;
+        bool erase_disturbed_ = false;  // suspended by a reader
+        operation_t erase_op_ = op_sector_erase;  // erase a writer waits for
+        qspi_result_t erase_result_ = ok;  // failure of a reader's resume
+        int erase_suspends_ = 0;        // suspensions of the current erase
+        os::rtos::clock::timestamp_t erase_held_ = 0;  // time suspended
+        os::rtos::clock::timestamp_t erase_mark_ = 0;  // last suspend/resume
+        os::rtos::semaphore_binary erase_sem_
+          { "qspi-erase", 0 };
+        uint32_t flux_address_ = 0;     // area being rewritten by a writer
+        size_t flux_count_ = 0;
+
+        // Write-back sector cache
+        size_t cache_sectors_ = 0;      // requested by set_cache()
+        os::rtos::clock::duration_t cache_idle_ = 0;
+        size_t cache_count_ = 0;        // allocated entries
+        cache_entry_t* cache_ = nullptr;
+        uint8_t* cache_data_ = nullptr;
+        uint32_t cache_stamp_ = 0;
+        os::rtos::semaphore_binary cache_sem_
+          { "qspi-cache", 0 };
+        os::rtos::thread* flusher_ = nullptr;
+        bool volatile flusher_stop_ = false;
+
+        // Read-ahead buffer
+        size_t ra_sectors_ = 0;         // requested by set_read_ahead()
+        size_t ra_limit_ = 0;           // buffer size, in blocks
+        uint8_t* ra_alloc_ = nullptr;
+        uint8_t* ra_buff_ = nullptr;    // cache line aligned in ra_alloc_
+        blknum_t ra_first_ = 0;         // first block in the buffer
+        size_t ra_count_ = 0;           // blocks in the buffer
+        size_t ra_used_ = 0;            // blocks consumed, up to the highest
+                                        // one served from the buffer
+        size_t ra_window_ = 0;          // current read-ahead size, in blocks
+        blknum_t ra_next_ = 0;          // next block of a sequential stream
+        bool ra_pending_ = false;       // transfer to the buffer in progress
+        advice_t advice_ = advice_normal;
+
+        // Known blank pages and background eraser
+        bool pre_erase_ = false;        // requested by set_pre_erase()
+        uint32_t* blank_map_ = nullptr;   // bit set: page known blank
+        uint32_t* blank_known_ = nullptr; // bit set: 64K block scanned
+        uint32_t* discard_map_ = nullptr; // bit set: sector queued for erase
+        os::rtos::semaphore_binary eraser_sem_
+          { "qspi-pre-erase", 0 };
+        os::rtos::thread* eraser_ = nullptr;
+        bool volatile eraser_stop_ = false;
+
+        // I/O scheduler thread, owner of the controller for the block reads
+        // and writes
+        bool sched_ = false;            // requested by set_scheduler()
+        os::rtos::thread* scheduler_ = nullptr;
+        bool volatile sched_stop_ = false;
+        bool volatile sched_writing_ = false;  // executing a write request
+        blknum_t sched_first_ = 0;      // blocks of the write request
+        size_t sched_count_ = 0;
+        sched_request_t* volatile sched_reads_ = nullptr;
+        sched_request_t* sched_writes_ = nullptr;
+        uint8_t* sched_alloc_ = nullptr;
+        uint8_t* sched_buff_ = nullptr;   // cache line aligned in sched_alloc_
+        sched_stats_t sched_stats_
+          { };
+        os::rtos::mutex sched_mx_
+          { "qspi-sched" };
+        os::rtos::semaphore_binary sched_sem_
+          { "qspi-sched", 0 };
       };
 
       class qspi_intern
@@ -237,6 +907,12 @@ namespace os
         virtual qspi_impl::qspi_result_t
         enter_quad_mode (qspi_impl* pq) = 0;
 
+        virtual qspi_impl::qspi_result_t
+        suspend_erase (qspi_impl* pq);
+
+        virtual qspi_impl::qspi_result_t
+        resume_erase (qspi_impl* pq);
+
       };
 
       inline void
@@ -254,28 +930,74 @@ namespace os
         return (pimpl == nullptr) ? error : pimpl->enter_quad_mode (this);
       }
 
+      // Erase suspend is optional, by default it is not supported
+      inline qspi_impl::qspi_result_t
+      qspi_intern::suspend_erase (qspi_impl* pq)
+      {
+        (void) pq;
+        return qspi_impl::error;
+      }
+
       inline qspi_impl::qspi_result_t
-      qspi_impl::exit_mem_mapped (void)
+      qspi_intern::resume_erase (qspi_impl* pq)
+      {
+        (void) pq;
+        return qspi_impl::error;
+      }
+
+      inline bool
+      qspi_impl::get_mapped_reads (void)
+      {
+        return mapped_reads_;
+      }
+
+      inline bool
+      qspi_impl::get_dtr_reads (void)
+      {
+        return dtr_;
+      }
+
+      inline bool
+      qspi_impl::get_continuous_reads (void)
+      {
+        return continuous_;
+      }
+
+      inline size_t
+      qspi_impl::get_poll_threshold (void)
+      {
+        return poll_threshold_;
+      }
+
+      inline const qspi_impl::program_stats_t&
+      qspi_impl::get_program_stats (void)
+      {
+        return program_stats_;
+      }
+
+      inline void
+      qspi_impl::clear_program_stats (void)
       {
-        return ((qspi_impl::qspi_result_t) (HAL_QSPI_Abort (hqspi_)));
+        program_stats_ = program_stats_t
+          { };
       }
 
       inline qspi_impl::qspi_result_t
       qspi_impl::erase_block32K (uint32_t address)
       {
-        return erase (address, BLOCK_32K_ERASE);
+        return erase_area (address, BLOCK_32K_ERASE);
       }
 
       inline qspi_impl::qspi_result_t
       qspi_impl::erase_block64K (uint32_t address)
       {
-        return erase (address, BLOCK_64K_ERASE);
+        return erase_area (address, BLOCK_64K_ERASE);
       }
 
       inline qspi_impl::qspi_result_t
       qspi_impl::erase_chip (void)
       {
-        return erase (0, CHIP_ERASE);
+        return erase_area (0, CHIP_ERASE);
       }
 
       inline const char*
@@ -284,20 +1006,50 @@ namespace os
         return pmanufacturer_;
       }
 
+      inline const qspi_impl::dma_stats_t&
+      qspi_impl::get_dma_stats (void)
+      {
+        return dma_stats_;
+      }
+
+      inline void
+      qspi_impl::clear_dma_stats (void)
+      {
+        dma_stats_ = dma_stats_t
+          { };
+      }
+
+      inline const qspi_impl::sched_stats_t&
+      qspi_impl::get_sched_stats (void)
+      {
+        return sched_stats_;
+      }
+
+      inline void
+      qspi_impl::clear_sched_stats (void)
+      {
+        sched_stats_ = sched_stats_t
+          { };
+      }
+
+      // The maintenance covers all the cache lines touched by the buffer,
+      // from the line of the first byte to the line of the last one
       inline void
       qspi_impl::invalidate_dcache (uint8_t* ptr, size_t len)
       {
-        uint32_t* aligned_buff = (uint32_t*) (((uint32_t) ptr) & 0xFFFFFFE0);
-        uint32_t aligned_count = (uint32_t) (len & 0xFFFFFFE0) + 32;
-        SCB_CleanInvalidateDCache_by_Addr (aligned_buff, aligned_count);
+        uintptr_t start = ((uintptr_t) ptr) & ~(uintptr_t) 0x1F;
+        uint32_t aligned_count = (uint32_t) ((((uintptr_t) ptr + len + 0x1F)
+            & ~(uintptr_t) 0x1F) - start);
+        SCB_CleanInvalidateDCache_by_Addr ((uint32_t*) start, aligned_count);
       }
 
       inline void
       qspi_impl::clean_dcache (uint8_t* ptr, size_t len)
       {
-        uint32_t* aligned_buff = (uint32_t*) (((uint32_t) (ptr)) & 0xFFFFFFE0);
-        uint32_t aligned_count = (uint32_t) (len & 0xFFFFFFE0) + 32;
-        SCB_CleanDCache_by_Addr (aligned_buff, aligned_count);
+        uintptr_t start = ((uintptr_t) ptr) & ~(uintptr_t) 0x1F;
+        uint32_t aligned_count = (uint32_t) ((((uintptr_t) ptr + len + 0x1F)
+            & ~(uintptr_t) 0x1F) - start);
+        SCB_CleanDCache_by_Addr ((uint32_t*) start, aligned_count);
       }
 
     } /* namespace stm32f7 */
@@ -0,0 +1,250 @@
+/*
+ * qspi-ftl.h
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef QSPI_FTL_H_
+#define QSPI_FTL_H_
+
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/posix-io/block-device.h>
+#include "qspi-flash.h"
+
+#if defined (__cplusplus)
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      /**
+       * Log-structured flash translation layer, exposed as a block device on
+       * top of the qspi_impl low level API. Blocks are written out of place,
+       * appended to the active 64K erase unit; a RAM table maps the logical
+       * blocks to their current copy. Full units are reclaimed by a garbage
+       * collector and the erases are spread over all the units (wear
+       * leveling). The table is rebuilt at open from the last checkpoint and
+       * the units written after it.
+       */
+      class qspi_ftl : public os::posix::block_device_impl
+      {
+      public:
+        qspi_ftl (qspi_impl& flash, size_t block_size = 4096);
+
+        ~qspi_ftl ();
+
+        typedef struct
+        {
+          uint32_t writes;            // blocks written by the user
+          uint32_t relocations;       // blocks moved by the garbage collector
+          uint32_t erases;            // units erased
+          uint32_t checkpoints;       // checkpoints written
+          uint32_t min_erase_count;   // least erased unit
+          uint32_t max_erase_count;   // most erased unit
+          uint32_t free_units;        // erased units, ready to be written
+        } ftl_stats_t;
+
+        virtual bool
+        do_is_opened (void) override;
+
+        virtual int
+        do_vopen (const char* path, int oflag, std::va_list args) override;
+
+        virtual ssize_t
+        do_read_block (void* buf, blknum_t blknum, std::size_t nblocks)
+            override;
+
+        virtual ssize_t
+        do_write_block (const void* buf, blknum_t blknum, std::size_t nblocks)
+            override;
+
+        virtual int
+        do_vioctl (int request, std::va_list args) override;
+
+        virtual void
+        do_sync (void) override;
+
+        virtual int
+        do_close (void) override;
+
+        void
+        set_background_gc (bool state);
+
+        ftl_stats_t
+        get_stats (void);
+
+      protected:
+        static constexpr size_t UNIT_SIZE = 0x10000;    // 64K erase unit
+        static constexpr size_t HEADER_SIZE = 32;       // unit header area
+        static constexpr size_t CP_PAYLOAD = 256;       // checkpoint tables
+        static constexpr uint32_t UNIT_MAGIC = 0x4C544651;        // "QFTL"
+        static constexpr uint32_t CHECKPOINT_MAGIC = 0x50435451;  // "QTCP"
+        static constexpr uint16_t NO_SLOT = 0xFFFF;
+        static constexpr uint16_t NO_UNIT = 0xFFFF;
+
+        // Units kept erased for the garbage collector's own writes
+        static constexpr size_t GC_RESERVE = 2;
+        // Minimum number of spare units (not counted in the capacity)
+        static constexpr size_t MIN_SPARE_UNITS = 4;
+        // Erase count spread that triggers a static wear leveling move
+        static constexpr uint32_t WEAR_LEVEL_THRESHOLD = 64;
+        // Units activated between two automatic checkpoints
+        static constexpr uint32_t CHECKPOINT_INTERVAL = 128;
+
+      private:
+        typedef enum
+        {
+          unit_unknown,               // no header, content unknown
+          unit_free,                  // erased
+          unit_active,                // being written
+          unit_full,                  // all slots written
+        } unit_state_t;
+
+        typedef struct
+        {
+          uint32_t erase_count;
+          uint32_t sequence;          // activation order
+          uint16_t valid;             // slots holding current blocks
+          uint16_t used;              // slots written
+          uint8_t state;
+        } unit_t;
+
+        typedef struct
+        {
+          uint32_t magic;
+          uint32_t sequence;
+          uint32_t erase_count;
+          uint32_t block_size;
+          uint32_t check;
+        } unit_header_t;
+
+        typedef struct
+        {
+          uint32_t magic;
+          uint32_t counter;           // checkpoint number
+          uint32_t sequence;          // unit sequence when written
+          uint32_t used;              // slots of that unit in the map
+          uint32_t block_size;
+          uint32_t blocks;
+          uint32_t crc;               // of the payload
+          uint32_t check;
+        } checkpoint_header_t;
+
+        qspi_impl::qspi_result_t
+        mount (void);
+
+        bool
+        load_checkpoint (uint32_t& sequence, uint16_t& used);
+
+        void
+        replay_unit (uint16_t unit, uint16_t from, bool last);
+
+        void
+        unmount (void);
+
+        qspi_impl::qspi_result_t
+        write_one (uint32_t lba, const uint8_t* data, bool gc);
+
+        qspi_impl::qspi_result_t
+        activate (bool gc);
+
+        qspi_impl::qspi_result_t
+        erase_unit (uint16_t unit);
+
+        bool
+        gc_step (bool wear_level);
+
+        bool
+        wear_spread (void);
+
+        qspi_impl::qspi_result_t
+        checkpoint (void);
+
+        void
+        unmap (uint32_t lba);
+
+        bool
+        is_blank (uint32_t address, size_t count);
+
+        uint32_t
+        unit_address (uint16_t unit);
+
+        static uint32_t
+        crc32 (uint32_t crc, const uint8_t* data, size_t count);
+
+        static void*
+        collector (void* args);
+
+        qspi_impl& flash_;
+        size_t block_size_;
+        bool volatile is_opened_ = false;
+
+        // Geometry
+        uint16_t units_count_ = 0;      // data units
+        uint16_t cp_units_ = 0;         // units of a checkpoint area
+        uint16_t slots_ = 0;            // slots per unit
+        uint16_t reserved_ = 0;         // slots taken by the header/summary
+
+        // State
+        uint16_t* map_ = nullptr;       // logical block -> slot
+        unit_t* units_ = nullptr;
+        uint8_t* buffer_ = nullptr;     // one block, for the relocations
+        uint32_t* entries_ = nullptr;   // summary of a unit
+        uint16_t active_ = NO_UNIT;
+        uint16_t free_units_ = 0;
+        uint32_t sequence_ = 0;         // last unit sequence
+        uint32_t cp_counter_ = 0;       // last checkpoint number
+        uint32_t since_cp_ = 0;         // units activated since
+        bool trimmed_ = false;          // blocks discarded since
+        ftl_stats_t stats_
+          { };
+
+        // Background garbage collector
+        bool background_gc_ = true;     // requested by set_background_gc()
+        os::rtos::mutex mx_
+          { "qspi-ftl" };
+        os::rtos::semaphore_binary gc_sem_
+          { "qspi-gc", 0 };
+        os::rtos::thread* collector_ = nullptr;
+        bool volatile collector_stop_ = false;
+        uint16_t gc_target_ = 0;        // free units kept by the collector
+        bool wear_leveling_ = false;    // static wear leveling move
+      };
+
+      inline uint32_t
+      qspi_ftl::unit_address (uint16_t unit)
+      {
+        // the data units follow the two checkpoint areas
+        return (2 * cp_units_ + unit) * UNIT_SIZE;
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
+
+#endif // (__cplusplus)
+
+#endif /* QSPI_FTL_H_ */
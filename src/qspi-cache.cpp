@@ -0,0 +1,355 @@
+/*
+ * qspi-cache.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file implements the optional write-back sector cache of the block
+ * device: a small number of sectors kept in RAM, with dirty tracking and LRU
+ * eviction, flushed on sync, close, eviction or after an idle period.
+ */
+
+#include <new>
+#include <string.h>
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/diag/trace.h>
+#include "qspi-flash.h"
+#include "qspi-descr.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      /**
+       * @brief  Configure the write-back sector cache. The setting is applied
+       *    the next time the block device is opened.
+       * @param  sectors: number of sectors kept in RAM; 0 disables the cache.
+       * @param  idle_flush: the dirty sectors are flushed when no block write
+       *    occurred for this time (in system clock ticks); 0 disables the
+       *    idle flush, the sectors are then written only on sync, close or
+       *    eviction.
+       */
+      void
+      qspi_impl::set_cache (size_t sectors, rtos::clock::duration_t idle_flush)
+      {
+        cache_sectors_ = sectors;
+        cache_idle_ = idle_flush;
+      }
+
+      /**
+       * @brief  Allocate the cache and start the idle flush thread.
+       * @return qspi::ok if successful, or qspi::error if out of memory.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::cache_open (void)
+      {
+        cache_ = new (std::nothrow) cache_entry_t[cache_sectors_];
+        cache_data_ =
+            new (std::nothrow) uint8_t[cache_sectors_ * pdevice_->sector_size];
+        if (cache_ == nullptr || cache_data_ == nullptr)
+          {
+            delete[] cache_;
+            delete[] cache_data_;
+            cache_ = nullptr;
+            cache_data_ = nullptr;
+            return error;
+          }
+
+        for (size_t i = 0; i < cache_sectors_; i++)
+          {
+            cache_[i].valid = false;
+            cache_[i].dirty = false;
+            cache_[i].data = cache_data_ + i * pdevice_->sector_size;
+          }
+        cache_count_ = cache_sectors_;
+
+        if (cache_idle_ != 0)
+          {
+            flusher_stop_ = false;
+            flusher_ = new (std::nothrow) rtos::thread
+              { "qspi-flush", cache_flusher, this };
+          }
+        return ok;
+      }
+
+      /**
+       * @brief  Flush the cache, stop the idle flush thread and release the
+       *    memory.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::cache_close (void)
+      {
+        qspi_impl::qspi_result_t result;
+
+        if (flusher_ != nullptr)
+          {
+            flusher_stop_ = true;
+            cache_sem_.post ();
+            flusher_->join ();
+            delete flusher_;
+            flusher_ = nullptr;
+          }
+
+        lock_write ();
+        result = cache_flush ();
+        delete[] cache_;
+        delete[] cache_data_;
+        cache_ = nullptr;
+        cache_data_ = nullptr;
+        cache_count_ = 0;
+        unlock_write ();
+
+        return result;
+      }
+
+      /**
+       * @brief  Look for a sector in the cache.
+       * @param  sector: sector number.
+       * @return Pointer to the cache entry, or nullptr if not cached.
+       */
+      qspi_impl::cache_entry_t*
+      qspi_impl::cache_find (uint32_t sector)
+      {
+        for (size_t i = 0; i < cache_count_; i++)
+          {
+            if (cache_[i].valid && cache_[i].sector == sector)
+              {
+                return &cache_[i];
+              }
+          }
+        return nullptr;
+      }
+
+      /**
+       * @brief  Get the cache entry of a sector about to be written. If the
+       *    sector is not cached, the least recently used entry is recycled
+       *    (and flushed first, if dirty).
+       * @param  sector: sector number.
+       * @param  load: true if the sector is only partially overwritten; a
+       *    recycled entry is then filled with the flash content first.
+       * @return Pointer to the cache entry, or nullptr if the flush of the
+       *    evicted sector or the load failed.
+       */
+      qspi_impl::cache_entry_t*
+      qspi_impl::cache_get (uint32_t sector, bool load)
+      {
+        cache_entry_t* entry = cache_find (sector);
+
+        if (entry == nullptr)
+          {
+            // take a free entry, or else the least recently used one
+            entry = &cache_[0];
+            for (size_t i = 0; i < cache_count_ && entry->valid; i++)
+              {
+                if (cache_[i].valid == false
+                    || cache_[i].stamp < entry->stamp)
+                  {
+                    entry = &cache_[i];
+                  }
+              }
+            if (entry->valid && entry->dirty && cache_flush_entry (entry) != ok)
+              {
+                return nullptr;
+              }
+            entry->valid = false;
+            if (load
+                && read_flash (sector * pdevice_->sector_size, entry->data,
+                               pdevice_->sector_size) != ok)
+              {
+                return nullptr;
+              }
+            entry->sector = sector;
+            entry->valid = true;
+            entry->dirty = false;
+          }
+        entry->stamp = ++cache_stamp_;
+        return entry;
+      }
+
+      /**
+       * @brief  Drop the cached copies of a range, about to be overwritten
+       *    directly in flash. The dirty sectors only partially covered by the
+       *    range are written to flash first, to keep the rest of their data.
+       * @param  address: start address of the range.
+       * @param  count: size of the range, in bytes.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::cache_drop (uint32_t address, size_t count)
+      {
+        qspi_impl::qspi_result_t result = ok;
+        size_t sector_size = pdevice_->sector_size;
+
+        for (size_t i = 0; i < cache_count_; i++)
+          {
+            uint32_t start = cache_[i].sector * sector_size;
+
+            if (cache_[i].valid == false || start >= address + count
+                || start + sector_size <= address)
+              {
+                continue;
+              }
+            if (cache_[i].dirty
+                && (start < address || start + sector_size > address + count)
+                && (result = cache_flush_entry (&cache_[i])) != ok)
+              {
+                break;
+              }
+            cache_[i].valid = false;
+            cache_[i].dirty = false;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Write the dirty cached copies of a range to flash, before it
+       *    is accessed with the low-level API.
+       * @param  address: start address of the range.
+       * @param  count: size of the range, in bytes.
+       * @param  drop: true to also drop the copies, the range is about to be
+       *    modified.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::cache_write_back (uint32_t address, size_t count, bool drop)
+      {
+        qspi_impl::qspi_result_t result = ok;
+        size_t sector_size = pdevice_->sector_size;
+
+        for (size_t i = 0; i < cache_count_ && result == ok; i++)
+          {
+            uint32_t start = cache_[i].sector * sector_size;
+
+            if (cache_[i].valid == false || start >= address + count
+                || start + sector_size <= address)
+              {
+                continue;
+              }
+            if (cache_[i].dirty)
+              {
+                result = cache_flush_entry (&cache_[i]);
+              }
+            if (drop && result == ok)
+              {
+                cache_[i].valid = false;
+              }
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Write a dirty cache entry to flash.
+       * @param  entry: the cache entry.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::cache_flush_entry (cache_entry_t* entry)
+      {
+        qspi_impl::qspi_result_t result;
+
+        if ((result = suspend_mapped ()) == ok)
+          {
+            result = update_block (entry->sector * pdevice_->sector_size,
+                                   entry->data, pdevice_->sector_size, false);
+          }
+        result = resume_mapped (result);
+        if (result == ok)
+          {
+            entry->dirty = false;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Write all the dirty cache entries to flash, in ascending
+       *    sector order.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::cache_flush (void)
+      {
+        qspi_impl::qspi_result_t result;
+        cache_entry_t* entry;
+
+        if ((result = suspend_mapped ()) == ok)
+          {
+            do
+              {
+                entry = nullptr;
+                for (size_t i = 0; i < cache_count_; i++)
+                  {
+                    if (cache_[i].valid && cache_[i].dirty
+                        && (entry == nullptr
+                            || cache_[i].sector < entry->sector))
+                      {
+                        entry = &cache_[i];
+                      }
+                  }
+                if (entry != nullptr)
+                  {
+                    result = cache_flush_entry (entry);
+                  }
+              }
+            while (entry != nullptr && result == ok);
+          }
+        return resume_mapped (result);
+      }
+
+      /**
+       * @brief  Idle flush thread: flush the cache once no block write occurred
+       *    for the configured idle time.
+       * @param  args: pointer to the qspi_impl object.
+       */
+      void*
+      qspi_impl::cache_flusher (void* args)
+      {
+        qspi_impl* pq = static_cast<qspi_impl*> (args);
+
+        while (pq->flusher_stop_ == false)
+          {
+            // wait for a write, then for the end of the write activity
+            pq->cache_sem_.wait ();
+            while (pq->flusher_stop_ == false
+                && pq->cache_sem_.timed_wait (pq->cache_idle_)
+                    == rtos::result::ok)
+              {
+                ;
+              }
+            if (pq->flusher_stop_ == false)
+              {
+                pq->lock_write ();
+                pq->cache_flush ();
+                pq->unlock_write ();
+              }
+          }
+        return nullptr;
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
@@ -0,0 +1,193 @@
+/*
+ * qspi-commands.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file implements the command templates of the driver: every command
+ * sent to the flash is described once, when the driver is constructed or
+ * initialized, and issued by copying its template and patching the address
+ * and the data count. The fast read templates depend on the read mode
+ * selected for the chip (SDR/DTR, continuous) and are rebuilt when it
+ * changes.
+ */
+
+#include <cmsis-plus/rtos/os.h>
+#include "qspi-flash.h"
+#include "qspi-descr.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      /**
+       * @brief  Fill in a command with only an instruction: no address, no
+       *    alternate bytes, no data, SDR.
+       * @param  sCommand: command to be filled in.
+       * @param  instruction: instruction code.
+       * @param  lines: instruction mode (QSPI_INSTRUCTION_1_LINE or
+       *    QSPI_INSTRUCTION_4_LINES).
+       */
+      static void
+      instruction_only (QSPI_CommandTypeDef* sCommand, uint8_t instruction,
+                        uint32_t lines)
+      {
+        sCommand->Instruction = instruction;
+        sCommand->Address = 0;
+        sCommand->AlternateBytes = 0;
+        sCommand->AddressSize = QSPI_ADDRESS_24_BITS;
+        sCommand->AlternateBytesSize = QSPI_ALTERNATE_BYTES_8_BITS;
+        sCommand->DummyCycles = 0;
+        sCommand->InstructionMode = lines;
+        sCommand->AddressMode = QSPI_ADDRESS_NONE;
+        sCommand->AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
+        sCommand->DataMode = QSPI_DATA_NONE;
+        sCommand->NbData = 0;
+        sCommand->DdrMode = QSPI_DDR_MODE_DISABLE;
+        sCommand->DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+        sCommand->SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
+      }
+
+      /**
+       * @brief  Build the templates of the commands that do not depend on the
+       *    chip: the standard command sub-set, in SPI mode (before the chip
+       *    is switched to quad mode) and in QPI mode.
+       */
+      void
+      qspi_impl::build_commands (void)
+      {
+        // Base commands, the vendors patch the instruction and the data mode
+        instruction_only (&cmds_.spi, 0, QSPI_INSTRUCTION_1_LINE);
+        instruction_only (&cmds_.quad, 0, QSPI_INSTRUCTION_4_LINES);
+
+        instruction_only (&cmds_.jedec_id, JEDEC_ID, QSPI_INSTRUCTION_1_LINE);
+        cmds_.jedec_id.DataMode = QSPI_DATA_1_LINE;
+        cmds_.jedec_id.NbData = 3;
+
+        instruction_only (&cmds_.write_enable, WRITE_ENABLE,
+                          QSPI_INSTRUCTION_4_LINES);
+        instruction_only (&cmds_.power_down, POWER_DOWN,
+                          QSPI_INSTRUCTION_4_LINES);
+        instruction_only (&cmds_.release_power_down, RELEASE_POWER_DOWN,
+                          QSPI_INSTRUCTION_4_LINES);
+        instruction_only (&cmds_.reset_enable, RESET_ENABLE,
+                          QSPI_INSTRUCTION_4_LINES);
+        instruction_only (&cmds_.reset_device, RESET_DEVICE,
+                          QSPI_INSTRUCTION_4_LINES);
+        instruction_only (&cmds_.suspend, PROGRAM_ERASE_SUSPEND,
+                          QSPI_INSTRUCTION_4_LINES);
+        instruction_only (&cmds_.resume, PROGRAM_ERASE_RESUME,
+                          QSPI_INSTRUCTION_4_LINES);
+
+        instruction_only (&cmds_.program, PAGE_PROGRAM,
+                          QSPI_INSTRUCTION_4_LINES);
+        cmds_.program.AddressMode = QSPI_ADDRESS_4_LINES;
+        cmds_.program.DataMode = QSPI_DATA_4_LINES;
+
+        instruction_only (&cmds_.erase_sector, SECTOR_ERASE,
+                          QSPI_INSTRUCTION_4_LINES);
+        cmds_.erase_sector.AddressMode = QSPI_ADDRESS_4_LINES;
+        cmds_.erase_32k = cmds_.erase_sector;
+        cmds_.erase_32k.Instruction = BLOCK_32K_ERASE;
+        cmds_.erase_64k = cmds_.erase_sector;
+        cmds_.erase_64k.Instruction = BLOCK_64K_ERASE;
+        instruction_only (&cmds_.erase_chip, CHIP_ERASE,
+                          QSPI_INSTRUCTION_4_LINES);
+
+        // Status register polled until the busy bit is cleared
+        instruction_only (&cmds_.status, READ_STATUS_REGISTER,
+                          QSPI_INSTRUCTION_4_LINES);
+        cmds_.status.DataMode = QSPI_DATA_4_LINES;
+        cmds_.ready.Match = 0;
+        cmds_.ready.Mask = 1;
+        cmds_.ready.MatchMode = QSPI_MATCH_MODE_AND;
+        cmds_.ready.StatusBytesSize = 1;
+        cmds_.ready.Interval = 0x10;
+        cmds_.ready.AutomaticStop = QSPI_AUTOMATIC_STOP_ENABLE;
+
+        // Read without instruction and with all the mode bits set, which
+        // ends the continuous read mode (see continuous_exit())
+        instruction_only (&cmds_.continuous_exit, 0, QSPI_INSTRUCTION_NONE);
+        cmds_.continuous_exit.Address = 0x00FFFF;
+        cmds_.continuous_exit.AddressMode = QSPI_ADDRESS_4_LINES;
+        cmds_.continuous_exit.AlternateByteMode = QSPI_ALTERNATE_BYTES_4_LINES;
+        cmds_.continuous_exit.AlternateBytes = 0xFF;
+        cmds_.continuous_exit.DataMode = QSPI_DATA_4_LINES;
+        cmds_.continuous_exit.NbData = 1;
+      }
+
+      /**
+       * @brief  Build the templates of the fast read (quad I/O, SDR or DTR),
+       *    from the device descriptor and the current read mode (dtr_,
+       *    dummy_cycles_, continuous_). In continuous read mode, the mode bits
+       *    keep the chip in it and, once in, the instruction is omitted
+       *    (read_continuous); the memory-mapped mode sends it only with the
+       *    first access.
+       */
+      void
+      qspi_impl::build_read_commands (void)
+      {
+        QSPI_CommandTypeDef* sCommand = &cmds_.read;
+
+        instruction_only (sCommand, FAST_READ_QUAD_IN_OUT,
+                          QSPI_INSTRUCTION_4_LINES);
+        sCommand->AddressMode = QSPI_ADDRESS_4_LINES;
+        sCommand->AlternateByteMode = pdevice_->alt_bytes_mode;
+        sCommand->AlternateBytesSize = pdevice_->alt_bytes_size;
+        sCommand->AlternateBytes =
+            continuous_ ? pdevice_->alt_bytes_continuous : pdevice_->alt_bytes;
+        sCommand->DataMode = QSPI_DATA_4_LINES;
+        if (dtr_)
+          {
+            // Address, alt bytes and data on both clock edges, the output
+            // hold delayed by a quarter cycle
+            sCommand->DdrMode = QSPI_DDR_MODE_ENABLE;
+            sCommand->DdrHoldHalfCycle = QSPI_DDR_HHC_HALF_CLK_DELAY;
+            sCommand->DummyCycles = dummy_cycles_
+                - (pdevice_->alt_bytes_cycles + 1) / 2;
+            sCommand->Instruction = FAST_READ_QUAD_IN_OUT_DTR;
+          }
+        else
+          {
+            sCommand->DummyCycles = dummy_cycles_ - pdevice_->alt_bytes_cycles;
+          }
+
+        cmds_.read_continuous = cmds_.read;
+        cmds_.read_continuous.InstructionMode = QSPI_INSTRUCTION_NONE;
+
+        cmds_.mapped = cmds_.read;
+        if (continuous_)
+          {
+            // the instruction goes only with the first access, the chip
+            // stays in continuous read mode for the next ones
+            cmds_.mapped.SIOOMode = QSPI_SIOO_INST_ONLY_FIRST_CMD;
+          }
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
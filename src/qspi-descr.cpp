@@ -38,41 +38,65 @@ namespace os
     namespace stm32f7
     {
 
-      // Micron devices; accepted dummy cycles can be between 1 and 14
+      // Micron devices; accepted dummy cycles can be between 1 and 14, the
+      // same setting applies to the SDR and DTR reads; the XIP confirmation
+      // bit is sent in the alt bytes (first dummy cycle, DQ0); the page
+      // program and erase durations are those of the MT25QL128ABA datasheet
       const qspi_device_t micron_devices[] =
         {
-          { 0xBA18, 4096, "MT25QL128ABA", 0, QSPI_ALTERNATE_BYTES_NONE,
-          QSPI_ALTERNATE_BYTES_8_BITS, 8, 0, true },
+          { 0xBA18, 4096, "MT25QL128ABA", 0xFF, QSPI_ALTERNATE_BYTES_4_LINES,
+          QSPI_ALTERNATE_BYTES_8_BITS, 8, 2, true, 8, true, 0x00,
+          { 120, 1800 }, { 50000, 400000 }, { 100000, 1000000 },
+          { 150000, 1000000 }, { 38000000, 114000000 } },
 
-          { 0xBB18, 4096, "MT25QL128ABA", 0, QSPI_ALTERNATE_BYTES_NONE,
-          QSPI_ALTERNATE_BYTES_8_BITS, 8, 0, true },
+          { 0xBB18, 4096, "MT25QL128ABA", 0xFF, QSPI_ALTERNATE_BYTES_4_LINES,
+          QSPI_ALTERNATE_BYTES_8_BITS, 8, 2, true, 8, true, 0x00,
+          { 120, 1800 }, { 50000, 400000 }, { 100000, 1000000 },
+          { 150000, 1000000 }, { 38000000, 114000000 } },
 
           { } //
         };
 
-      // Winbond devices; accepted dummy cycles can be either 2, 4, 6 or 8
+      // Winbond devices; accepted dummy cycles can be either 2, 4, 6 or 8;
+      // the mode bits M5-4 = 10 keep the chip in continuous read mode; the
+      // page program and erase durations are those of the datasheets (tPP,
+      // tSE, tBE1, tBE2, tCE)
       const qspi_device_t winbond_devices[] =
         {
           { 0x4016, 4096, "W25Q32FV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
-          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false },
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false, 0, true, 0x20,
+          { 700, 3000 }, { 45000, 400000 }, { 120000, 1600000 },
+          { 150000, 2000000 }, { 10000000, 50000000 } },
 
           { 0x6016, 4096, "W25Q32FV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
-          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false },
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false, 0, true, 0x20,
+          { 700, 3000 }, { 45000, 400000 }, { 120000, 1600000 },
+          { 150000, 2000000 }, { 10000000, 50000000 } },
 
           { 0x4017, 4096, "W25Q64FV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
-          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false },
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false, 0, true, 0x20,
+          { 700, 3000 }, { 45000, 400000 }, { 120000, 1600000 },
+          { 150000, 2000000 }, { 20000000, 100000000 } },
 
           { 0x6017, 4096, "W25Q64FV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
-          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false },
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false, 0, true, 0x20,
+          { 700, 3000 }, { 45000, 400000 }, { 120000, 1600000 },
+          { 150000, 2000000 }, { 20000000, 100000000 } },
 
           { 0x4018, 4096, "W25Q128FV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
-          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false },
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false, 0, true, 0x20,
+          { 700, 3000 }, { 45000, 400000 }, { 120000, 1600000 },
+          { 150000, 2000000 }, { 40000000, 200000000 } },
 
           { 0x6018, 4096, "W25Q128FV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
-          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false },
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, false, 0, true, 0x20,
+          { 700, 3000 }, { 45000, 400000 }, { 120000, 1600000 },
+          { 150000, 2000000 }, { 40000000, 200000000 } },
 
           { 0x7018, 4096, "W25Q128JV", 0xF, QSPI_ALTERNATE_BYTES_4_LINES,
-          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, true },
+          QSPI_ALTERNATE_BYTES_8_BITS, 6, 2, true, 8, true, 0x20,
+          { 700, 3000 }, { 45000, 400000 }, { 120000, 1600000 },
+          { 150000, 2000000 }, { 40000000, 200000000 } },
 
           { } //
         };
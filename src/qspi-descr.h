@@ -42,6 +42,13 @@ namespace os
 #define MANUF_ID_MICRON 0x20
 #define MANUF_ID_WINBOND 0xEF
 
+      // Typical and maximum duration of an operation (us), from the datasheet
+      typedef struct qspi_duration_s
+      {
+        uint32_t typical;
+        uint32_t maximum;
+      } qspi_duration_t;
+
       typedef struct qspi_device_s
       {
         uint16_t device_ID;
@@ -54,7 +61,17 @@ namespace os
         uint32_t alt_bytes_size;  // 8, 16 or 32 bits
         uint8_t dummy_cycles;     // dummy cycles
         uint8_t alt_bytes_cycles; // alt bytes cycles to subtract from dummy cycles
-        bool DDR_support;         // dual data rate (not used for now)
+        bool DDR_support;         // quad I/O DTR fast read
+        uint8_t DDR_dummy_cycles; // dummy cycles in DTR mode
+        bool continuous_support;  // continuous read (XIP) mode
+        uint8_t alt_bytes_continuous; // mode bits to stay in continuous read
+
+        // program and erase durations
+        qspi_duration_t tPP;      // page program
+        qspi_duration_t tSE;      // 4K sector erase
+        qspi_duration_t tBE32;    // 32K block erase
+        qspi_duration_t tBE64;    // 64K block erase
+        qspi_duration_t tCE;      // chip erase
       } qspi_device_t;
 
       typedef struct qspi_manuf_s
@@ -0,0 +1,300 @@
+/*
+ * qspi-dma.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file implements the DMA buffers and the data cache maintenance of the
+ * transfers. The driver instances take their bounce buffer from a static
+ * pool of cache line aligned buffers; define QSPI_DMA_SECTION with the name
+ * of a linker section in DTCM or in an MPU non-cacheable region to place the
+ * pool there, which makes its buffers coherent with the DMA.
+ */
+
+#include <string.h>
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/diag/trace.h>
+#include "qspi-flash.h"
+
+#if !defined (QSPI_DMA_BUFFERS)
+#define QSPI_DMA_BUFFERS 2
+#endif
+
+#if !defined (QSPI_DMA_BUFFER_SIZE)
+#define QSPI_DMA_BUFFER_SIZE 512
+#endif
+
+#if defined (QSPI_DMA_SECTION)
+#define QSPI_DMA_ATTRIBUTES __attribute__ ((aligned (32), section (QSPI_DMA_SECTION)))
+#define QSPI_DMA_COHERENT true
+#else
+#define QSPI_DMA_ATTRIBUTES __attribute__ ((aligned (32)))
+#define QSPI_DMA_COHERENT false
+#endif
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      static_assert (QSPI_DMA_BUFFER_SIZE >= 256
+                         && (QSPI_DMA_BUFFER_SIZE & 0x1F) == 0,
+                     "QSPI_DMA_BUFFER_SIZE must hold a page, in cache lines");
+
+      namespace
+      {
+        constexpr bool pool_coherent = QSPI_DMA_COHERENT;
+        uint8_t pool[QSPI_DMA_BUFFERS][QSPI_DMA_BUFFER_SIZE] QSPI_DMA_ATTRIBUTES;
+        bool pool_used[QSPI_DMA_BUFFERS];
+      }
+
+      /**
+       * @brief  Take a buffer from the DMA pool, if none is held yet. If the
+       *    pool is exhausted, the transfers work directly with the caller's
+       *    buffers.
+       */
+      void
+      qspi_impl::dma_open (void)
+      {
+        rtos::scheduler::critical_section scs;
+
+        for (size_t i = 0; i < QSPI_DMA_BUFFERS && dma_buff_ == nullptr; i++)
+          {
+            if (pool_used[i] == false)
+              {
+                pool_used[i] = true;
+                dma_buff_ = pool[i];
+              }
+          }
+      }
+
+      /**
+       * @brief  Return the buffer to the DMA pool.
+       */
+      void
+      qspi_impl::dma_close (void)
+      {
+        rtos::scheduler::critical_section scs;
+
+        for (size_t i = 0; i < QSPI_DMA_BUFFERS; i++)
+          {
+            if (dma_buff_ == pool[i])
+              {
+                pool_used[i] = false;
+              }
+          }
+        dma_buff_ = nullptr;
+      }
+
+      /**
+       * @brief  Check if the DMA can access a buffer without data cache
+       *    maintenance.
+       * @param  ptr: buffer address.
+       * @param  len: buffer size.
+       * @return true if the buffer is in DTCM (not cached) or in the pool
+       *    placed in a non-cacheable section.
+       */
+      bool
+      qspi_impl::dma_coherent (const uint8_t* ptr, size_t len)
+      {
+        return (ptr + len) < (const uint8_t*) SRAM1_BASE
+            || (pool_coherent && ptr >= pool[0]
+                && ptr + len <= pool[0] + sizeof(pool));
+      }
+
+      /**
+       * @brief  Prepare a buffer for a DMA transfer from the flash. The data
+       *    cache lines entirely in the buffer are only invalidated, the
+       *    partial lines at its ends are cleaned first.
+       * @param  buff: destination buffer.
+       * @param  count: transfer size.
+       */
+      void
+      qspi_impl::dma_prepare_rx (uint8_t* buff, size_t count)
+      {
+        rtos::clock::timestamp_t start;
+
+        dma_stats_.transfers++;
+        if (dma_coherent (buff, count))
+          {
+            dma_stats_.zero_copy++;
+            return;
+          }
+
+        start = rtos::hrclock.now ();
+        if (buff == dma_buff_ || (((uintptr_t) buff | count) & 0x1F) == 0)
+          {
+            // whole lines (the bounce buffer has no other user)
+            SCB_InvalidateDCache_by_Addr (
+                (uint32_t*) buff, (int32_t) ((count + 0x1F) & ~0x1F));
+          }
+        else
+          {
+            invalidate_dcache (buff, count);
+          }
+        dma_stats_.maintained++;
+        dma_stats_.maintenance += rtos::hrclock.now () - start;
+      }
+
+      /**
+       * @brief  Complete a DMA transfer from the flash: the data cache lines
+       *    entirely in the buffer are invalidated again, as the speculative
+       *    reads of the core may have loaded them while the transfer was
+       *    running. The partial lines at the ends of a buffer cannot be
+       *    invalidated without losing the neighbouring data; read_indirect()
+       *    reads them by polling.
+       * @param  buff: destination buffer.
+       * @param  count: transfer size.
+       */
+      void
+      qspi_impl::dma_complete_rx (uint8_t* buff, size_t count)
+      {
+        rtos::clock::timestamp_t start;
+        uintptr_t first;
+        uintptr_t last;
+
+        if (dma_coherent (buff, count))
+          {
+            return;
+          }
+
+        start = rtos::hrclock.now ();
+        if (buff == dma_buff_)
+          {
+            // whole lines (the bounce buffer has no other user)
+            first = (uintptr_t) buff;
+            last = ((uintptr_t) buff + count + 0x1F) & ~(uintptr_t) 0x1F;
+          }
+        else
+          {
+            first = ((uintptr_t) buff + 0x1F) & ~(uintptr_t) 0x1F;
+            last = ((uintptr_t) buff + count) & ~(uintptr_t) 0x1F;
+          }
+        if (last > first)
+          {
+            SCB_InvalidateDCache_by_Addr ((uint32_t*) first,
+                                          (int32_t) (last - first));
+          }
+        dma_stats_.maintenance += rtos::hrclock.now () - start;
+      }
+
+      /**
+       * @brief  Prepare a buffer for a DMA transfer to the flash. The data is
+       *    staged in the bounce buffer if the pool is coherent, otherwise the
+       *    data cache lines of the buffer are cleaned.
+       * @param  buff: source buffer.
+       * @param  count: transfer size, at most a page.
+       * @return The buffer to be transferred.
+       */
+      const uint8_t*
+      qspi_impl::dma_prepare_tx (const uint8_t* buff, size_t count)
+      {
+        rtos::clock::timestamp_t start;
+
+        dma_stats_.transfers++;
+        if (dma_coherent (buff, count))
+          {
+            dma_stats_.zero_copy++;
+            return buff;
+          }
+        if (pool_coherent && dma_buff_ != nullptr)
+          {
+            memcpy (dma_buff_, buff, count);
+            dma_stats_.bounced++;
+            return dma_buff_;
+          }
+
+        start = rtos::hrclock.now ();
+        clean_dcache ((uint8_t*) buff, count);
+        dma_stats_.maintained++;
+        dma_stats_.maintenance += rtos::hrclock.now () - start;
+        return buff;
+      }
+
+      /**
+       * @brief  Read from flash in indirect mode, by polling up to the polling
+       *    threshold, with DMA otherwise. If the buffer is cached and does not
+       *    start or end on a cache line boundary, a short read goes through
+       *    the bounce buffer; otherwise the partial lines (less than 32 bytes
+       *    each) are read by polling, so that the maintenance of the lines
+       *    never touches the caller's neighbouring data, and the rest of the
+       *    data is transferred in place by DMA.
+       * @param  address: start address in flash where to read from.
+       * @param  buff: buffer where to copy data to.
+       * @param  count: amount of data to be retrieved from flash.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read_indirect (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = ok;
+        size_t head = (0x20 - ((uintptr_t) buff & 0x1F)) & 0x1F;
+        size_t tail = ((uintptr_t) buff + count) & 0x1F;
+
+        if (count <= poll_threshold_)
+          {
+            return read_polled (address, buff, count);
+          }
+        if (dma_buff_ == nullptr || (head == 0 && tail == 0)
+            || dma_coherent (buff, count))
+          {
+            return read_dma (address, buff, count);
+          }
+
+        if (count <= QSPI_DMA_BUFFER_SIZE)
+          {
+            // small read, entirely through the bounce buffer
+            result = read_dma (address, dma_buff_, count);
+            if (result == ok)
+              {
+                memcpy (buff, dma_buff_, count);
+              }
+            dma_stats_.bounced++;
+            return result;
+          }
+
+        // the partial lines are read by polling, straight into the caller's
+        // buffer, and only the whole lines by DMA
+        if (head > 0)
+          {
+            result = read_polled (address, buff, head);
+          }
+        if (result == ok)
+          {
+            result = read_dma (address + head, buff + head,
+                               count - head - tail);
+          }
+        if (result == ok && tail > 0)
+          {
+            result = read_polled (address + count - tail, buff + count - tail,
+                                  tail);
+          }
+        return result;
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
@@ -134,6 +134,59 @@ qspi_exit_mem_mapped (qspi_t* qspi_instance)
   return (qspi_result_t) (((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).exit_mem_mapped ());
 }
 
+/**
+ * @brief  Select if reads are served from the memory-mapped window.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  state: true to read through the memory-mapped window, false to use
+ *      indirect (DMA) reads.
+ */
+void
+qspi_set_mapped_reads (qspi_t* qspi_instance, bool state)
+{
+  ((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).set_mapped_reads (
+      state);
+}
+
+/**
+ * @brief  Select the DTR quad I/O reads, used if the chip supports them.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  state: true to use the DTR reads when possible, false to always read
+ *      in SDR mode.
+ */
+void
+qspi_set_dtr_reads (qspi_t* qspi_instance, bool state)
+{
+  ((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).set_dtr_reads (state);
+}
+
+/**
+ * @brief  Select the continuous read (XIP) mode, used if the chip supports it.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  state: true to use the continuous read mode when possible, false to
+ *      send the instruction with every read.
+ */
+void
+qspi_set_continuous_reads (qspi_t* qspi_instance, bool state)
+{
+  ((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).set_continuous_reads (
+      state);
+}
+
+/**
+ * @brief  Return a pointer to flash data, inside the memory-mapped window.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  address: address in flash.
+ * @param  count: number of bytes that will be accessed.
+ * @return Pointer to the data, or NULL if the memory-mapped mode could not be
+ *      entered.
+ */
+const uint8_t*
+qspi_get_mapped_address (qspi_t* qspi_instance, uint32_t address, size_t count)
+{
+  return ((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).get_mapped_address (
+      address, count);
+}
+
 /**
  * @brief  Read a block of data from the flash.
  * @param  qspi_instance: pointer to the qspi object.
@@ -247,6 +300,108 @@ qspi_erase_chip (qspi_t* qspi_instance)
   return (qspi_result_t) (((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).erase_chip ());
 }
 
+/**
+ * @brief  Erase a range of the flash, using the largest erase units allowed by
+ *      the alignment of the range and by the erase policy.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  address: start address of the range (extended to a sector boundary).
+ * @param  count: size of the range.
+ * @return qspi_ok if successful, a qspi error otherwise.
+ */
+qspi_result_t
+qspi_erase_range (qspi_t* qspi_instance, uint32_t address, size_t count)
+{
+  return (qspi_result_t) (((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).erase_range (
+      address, count));
+}
+
+/**
+ * @brief  Select the policy used to choose between sector and block erases.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  policy: qspi_erase_min_wear or qspi_erase_max_speed.
+ */
+void
+qspi_set_erase_policy (qspi_t* qspi_instance, qspi_erase_policy_t policy)
+{
+  ((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).set_erase_policy (
+      (qspi_impl::erase_policy_t) policy);
+}
+
+/**
+ * @brief  Configure the write-back sector cache, applied at the next open.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  sectors: number of cached sectors, 0 disables the cache.
+ * @param  idle_flush: idle time before the dirty sectors are flushed, in
+ *    system clock ticks; 0 disables the idle flush.
+ */
+void
+qspi_set_cache (qspi_t* qspi_instance, size_t sectors, uint32_t idle_flush)
+{
+  ((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).set_cache (
+      sectors, idle_flush);
+}
+
+/**
+ * @brief  Configure the read-ahead buffer, applied at the next open.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  sectors: maximum number of sectors read ahead, 0 disables it.
+ */
+void
+qspi_set_read_ahead (qspi_t* qspi_instance, size_t sectors)
+{
+  ((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).set_read_ahead (
+      sectors);
+}
+
+/**
+ * @brief  Enable or disable the background eraser, applied at the next open.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  state: if true, the discarded blocks are erased in the background.
+ */
+void
+qspi_set_pre_erase (qspi_t* qspi_instance, bool state)
+{
+  ((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).set_pre_erase (state);
+}
+
+/**
+ * @brief  Select the logical block size, applied at the next open.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  size: block size in bytes, from 512 to the sector size; 0 for the
+ *    sector size.
+ */
+void
+qspi_set_block_size (qspi_t* qspi_instance, size_t size)
+{
+  ((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).set_block_size (size);
+}
+
+/**
+ * @brief  Set the size of the largest transfers done by polling instead of
+ *    DMA.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  bytes: the threshold in bytes, 0 for DMA transfers only, or
+ *    QSPI_POLL_CALIBRATE to measure it at the next initialization.
+ */
+void
+qspi_set_poll_threshold (qspi_t* qspi_instance, size_t bytes)
+{
+  ((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).set_poll_threshold (
+      bytes);
+}
+
+/**
+ * @brief  Enable or disable the I/O scheduler, applied at the next open.
+ * @param  qspi_instance: pointer to the qspi object.
+ * @param  state: if true, the block reads and writes are executed by a driver
+ *    thread, the reads first.
+ */
+void
+qspi_set_scheduler (qspi_t* qspi_instance, bool state)
+{
+  ((reinterpret_cast<qspi_c*> (qspi_instance))->impl ()).set_scheduler (state);
+}
+
 /**
  * @brief  Software reset the flash chip.
  * @param  qspi_instance: pointer to the qspi object.
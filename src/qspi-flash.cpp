@@ -32,6 +32,7 @@
  * a QSPI flash device.
  */
 
+#include <string.h>
 #include <cmsis-plus/rtos/os.h>
 #include <cmsis-plus/diag/trace.h>
 #include "qspi-flash.h"
@@ -53,6 +54,7 @@ namespace os
       {
         trace::printf ("%s(%p) @%p\n", __func__, hqspi, this);
         hqspi_ = hqspi;
+        build_commands ();
       }
 
       qspi_impl::~qspi_impl ()
@@ -107,16 +109,50 @@ namespace os
                 break;
               }
 
-            num_blocks_ = qspi_impl::get_sector_count ();
-            block_logical_size_bytes_ = qspi_impl::get_sector_size ();
             block_physical_size_bytes_ = qspi_impl::get_sector_size ();
+            block_logical_size_bytes_ =
+                (block_size_ == 0) ? block_physical_size_bytes_ : block_size_;
 
-            if (num_blocks_ == 0 || block_physical_size_bytes_ == 0)
+            if (qspi_impl::get_sector_count () == 0
+                || block_physical_size_bytes_ == 0)
               {
+                qspi_impl::uninitialize ();
                 errno = EIO;
                 break;
               }
 
+            if (block_logical_size_bytes_ < 512
+                || block_logical_size_bytes_ > block_physical_size_bytes_
+                || (block_logical_size_bytes_ & (block_logical_size_bytes_ - 1))
+                    != 0)
+              {
+                qspi_impl::uninitialize ();
+                errno = EINVAL;
+                break;
+              }
+            num_blocks_ = qspi_impl::get_sector_count ()
+                * (block_physical_size_bytes_ / block_logical_size_bytes_);
+
+            if ((block_logical_size_bytes_ < block_physical_size_bytes_
+                && (sector_buff_ =
+                    new (std::nothrow) uint8_t[block_physical_size_bytes_])
+                    == nullptr)
+                || (cache_sectors_ > 0 && cache_open () != ok)
+                || (ra_sectors_ > 0 && ra_open () != ok)
+                || pre_erase_open () != ok
+                || (sched_ && sched_open () != ok))
+              {
+                sched_close ();
+                cache_close ();
+                ra_close ();
+                pre_erase_close ();
+                delete[] sector_buff_;
+                sector_buff_ = nullptr;
+                qspi_impl::uninitialize ();
+                errno = ENOMEM;
+                break;
+              }
+
             is_opened_ = true;
             result = 0;
           }
@@ -136,15 +172,11 @@ namespace os
       qspi_impl::do_read_block (void* buf, posix::block_device::blknum_t blknum,
                                 std::size_t nblocks)
       {
-        // compute the block's address and the total bytes to be read
-        uint32_t address = block_logical_size_bytes_ * blknum;
-        size_t count = block_logical_size_bytes_ * nblocks;
-
-        if (qspi_impl::read (address, (uint8_t*) buf, count) != ok)
+        if (scheduler_ != nullptr)
           {
-            nblocks = 0;
+            return sched_submit ((uint8_t*) buf, blknum, nblocks, false);
           }
-        return nblocks;
+        return read_blocks ((uint8_t*) buf, blknum, nblocks);
       }
 
       /**
@@ -159,110 +191,362 @@ namespace os
                                  posix::block_device::blknum_t blknum,
                                  std::size_t nblocks)
       {
-        // compute the block's address and the total bytes to be written
+        if (scheduler_ != nullptr)
+          {
+            return sched_submit ((uint8_t*) buf, blknum, nblocks, true);
+          }
+        return write_blocks ((const uint8_t*) buf, blknum, nblocks);
+      }
+
+      /**
+       * @brief  Read blocks, serialized with the writers: while a writer
+       *    waits for an erase, the erase is suspended for the read, unless
+       *    the blocks are being rewritten.
+       * @param  buff: buffer where the data will be returned.
+       * @param  blknum: the block number.
+       * @param  nblocks: number of blocks to read.
+       * @return Number of blocks read.
+       */
+      ssize_t
+      qspi_impl::read_blocks (uint8_t* buff, blknum_t blknum, size_t nblocks)
+      {
         uint32_t address = block_logical_size_bytes_ * blknum;
         size_t count = block_logical_size_bytes_ * nblocks;
-        bool to_write = false;
+        bool waited = false;
 
-        // check if we really need to write
-        uint8_t* p = (uint8_t*) buf;
-        for (posix::block_device::blknum_t i = 0; i < count; i++)
+        io_mx_.lock ();
+        if (erase_busy_
+            && ((address < flux_address_ + flux_count_
+                && address + count > flux_address_) || erase_suspend () != ok))
           {
-            if (*p++ != 0xFF)
-              {
-                to_write = true;
-                break;  // yes, we have data to write
-              }
+            // the blocks are being rewritten (or the erase cannot be
+            // suspended), wait for the writer to finish
+            io_mx_.unlock ();
+            write_mx_.lock ();
+            io_mx_.lock ();
+            waited = true;
           }
 
-        int i = nblocks;
-        if (to_write == false)
+        if (fetch_blocks (buff, blknum, nblocks) != ok)
           {
-            // nothing to write, only erase then quit
-            while (i--)
-              {
-                qspi_impl::erase_sector (blknum++);
-              }
+            nblocks = 0;
           }
-        else
+        if (erase_suspended_)
           {
-            uint32_t sector_256 = 0;
-            p = (uint8_t*) buf;
-            bool to_erase = false;
-
-            do
-              {
-                bool valid_data = false;
+            erase_resume ();
+          }
+        else if (nblocks > 0)
+          {
+            ra_update (blknum, nblocks);
+          }
+        io_mx_.unlock ();
+        if (waited)
+          {
+            write_mx_.unlock ();
+          }
+        return nblocks;
+      }
 
-                if (qspi_impl::read (address + (sector_256 * sizeof(lbuff_)),
-                                     lbuff_, sizeof(lbuff_)) != ok)
-                  {
-                    break;  // read error, exit
-                  }
+      /**
+       * @brief  Copy blocks to a buffer: the cached and read-ahead sectors
+       *    are served from RAM, the runs of missing sectors are read from
+       *    flash with a single request each. io_mx_ must be held.
+       * @param  buff: buffer where the data will be returned.
+       * @param  blknum: the block number.
+       * @param  nblocks: number of blocks to read.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::fetch_blocks (uint8_t* buff, blknum_t blknum, size_t nblocks)
+      {
+        uint32_t address = block_logical_size_bytes_ * blknum;
+        uint8_t* p = buff;
+        size_t sector_size = block_physical_size_bytes_;
+        cache_entry_t* entry;
+        const uint8_t* pra;
+        size_t run;
 
-                // check if we need to erase before write
-                for (int j = 0; j < (int) sizeof(lbuff_); j++, p++)
+        for (size_t i = 0; i < nblocks; i += run)
+          {
+            run = 1;
+            if ((entry = cache_find (address / sector_size)) != nullptr)
+              {
+                memcpy (p, entry->data + address % sector_size,
+                        block_logical_size_bytes_);
+                entry->stamp = ++cache_stamp_;
+              }
+            else if ((pra = ra_find (blknum + i)) != nullptr)
+              {
+                memcpy (p, pra, block_logical_size_bytes_);
+              }
+            else
+              {
+                while (i + run < nblocks
+                    && cache_find (
+                        (address + run * block_logical_size_bytes_)
+                            / sector_size) == nullptr
+                    && ra_find (blknum + i + run) == nullptr)
                   {
-                    if (*p != lbuff_[j] && lbuff_[j] != 0xFF)
-                      {
-                        // yes, we must erase before write
-                        to_erase = true;
-                        break;
-                      }
-                    if (*p != 0xFF && *p != lbuff_[j])
-                      {
-                        valid_data = true;
-                      }
+                    run++;
                   }
-                if (to_erase)
+                if (read_flash (address, p, run * block_logical_size_bytes_)
+                    != ok)
                   {
-                    break;
+                    return error;
                   }
+              }
+            address += run * block_logical_size_bytes_;
+            p += run * block_logical_size_bytes_;
+          }
+        return ok;
+      }
+
+      /**
+       * @brief  Write blocks, serialized with the other writers; large
+       *    writes go to flash, the small ones to the write-back cache, if
+       *    enabled.
+       * @param  buff: buffer with the data to be written.
+       * @param  blknum: the block number.
+       * @param  nblocks: number of blocks to be written.
+       * @return Number of blocks written.
+       */
+      ssize_t
+      qspi_impl::write_blocks (const uint8_t* buff, blknum_t blknum,
+                               size_t nblocks)
+      {
+        uint32_t address = block_logical_size_bytes_ * blknum;
+        size_t count = block_logical_size_bytes_ * nblocks;
+        const uint8_t* p = buff;
+        size_t sector_size = block_physical_size_bytes_;
+        cache_entry_t* entry;
+        qspi_impl::qspi_result_t result;
 
-                // sector already erased, just write but only if whole data != 0xFF
-                if (valid_data)
+        lock_write ();
+        if (cache_count_ > 0)
+          {
+            if (count < cache_count_ * sector_size)
+              {
+                // small writes are coalesced in the cache and written to
+                // flash later; the sectors only partially written are read
+                // into the cache first
+                for (size_t i = 0; i < nblocks; i++)
                   {
-                    if (qspi_impl::write (
-                        address + (sector_256 * sizeof(lbuff_)),
-                        (uint8_t*) buf + (sector_256 * sizeof(lbuff_)),
-                        sizeof(lbuff_)) != ok)
+                    if ((entry = cache_get (
+                        address / sector_size,
+                        block_logical_size_bytes_ < sector_size)) == nullptr)
                       {
                         nblocks = 0;
                         break;
                       }
+                    memcpy (entry->data + address % sector_size, p,
+                            block_logical_size_bytes_);
+                    entry->dirty = true;
+                    address += block_logical_size_bytes_;
+                    p += block_logical_size_bytes_;
                   }
-                sector_256++;
+                unlock_write ();
+                cache_sem_.post ();
+                return nblocks;
               }
-            while (p < ((uint8_t*) buf + count));
-
-            if (to_erase == true && nblocks)
+            // large writes go directly to flash, replacing the cached copies
+            if (cache_drop (address, count) != ok)
               {
-                // write without erase did not work
-                // so erase first the blocks to be written
-                while (i--)
-                  {
-                    qspi_impl::erase_sector (blknum++);
-                  }
+                unlock_write ();
+                return 0;
+              }
+          }
 
-                if (qspi_impl::write (address, (uint8_t*) buf, count) != ok)
-                  {
-                    nblocks = 0;
-                  }
+        // keep the controller in indirect mode for the whole operation
+        suspend_mapped ();
+
+        // the request is planned and executed one 64K block at a time, the
+        // parts of sectors one sector at a time
+        while (count > 0)
+          {
+            size_t size;
+
+            if ((address & (sector_size - 1)) != 0 || count < sector_size)
+              {
+                size = sector_size - (address & (sector_size - 1));
+                size = (size > count) ? count : size;
+                result = update_partial (address, p, size);
+              }
+            else
+              {
+                size = BLOCK_64K_SIZE - (address & (BLOCK_64K_SIZE - 1));
+                size = (size > count) ? count : size;
+                size &= ~(sector_size - 1);
+                result = update_block (address, p, size, false);
+              }
+            if (result != ok)
+              {
+                nblocks = 0;
+                break;
               }
+            address += size;
+            p += size;
+            count -= size;
           }
+
+        resume_mapped (ok);
+        unlock_write ();
         return nblocks;
       }
 
       /**
        * @brief Control the device parameters.
-       * @param request: command to the device.
+       * @param request: command to the device (ioctl_advise, ioctl_willneed,
+       *    ioctl_discard, ioctl_get_erase_sizes, ioctl_is_blank,
+       *    ioctl_get_page_size).
        * @param args: command's parameter(s).
        * @return 0 if successfull, -1 otherwise.
        */
       int
       qspi_impl::do_vioctl (int request, std::va_list args)
       {
-        return -1;
+        int result = 0;
+        blknum_t blknum;
+        size_t nblocks;
+        uint32_t address;
+        size_t count;
+        uint32_t* sizes;
+        bool* blank;
+        bool write_access = (request == ioctl_discard
+            || request == ioctl_is_blank);
+
+        // the requests accessing the flash content are serialized with the
+        // writers
+        if (write_access)
+          {
+            lock_write ();
+          }
+        else
+          {
+            io_mx_.lock ();
+          }
+        switch (request)
+          {
+          case ioctl_advise:
+            advice_ = (advice_t) va_arg (args, int);
+            break;
+
+          case ioctl_willneed:
+            blknum = va_arg (args, blknum_t);
+            nblocks = va_arg (args, size_t);
+            if (ra_limit_ > 0 && mapped_reads_ == false
+                && keep_mapped_ == false)
+              {
+                ra_start (blknum, (nblocks > ra_limit_) ? ra_limit_ : nblocks);
+              }
+            break;
+
+          case ioctl_discard:
+            blknum = va_arg (args, blknum_t);
+            nblocks = va_arg (args, size_t);
+            if (blknum + nblocks > num_blocks_ || blknum + nblocks < blknum)
+              {
+                errno = EINVAL;
+                result = -1;
+                break;
+              }
+            address = blknum * block_logical_size_bytes_;
+            count = nblocks * block_logical_size_bytes_;
+            if (cache_count_ > 0 && cache_drop (address, count) != ok)
+              {
+                errno = EIO;
+                result = -1;
+                break;
+              }
+            if (discard_map_ != nullptr)
+              {
+                // leave the erase to the background eraser
+                pre_erase_queue (address, count);
+                break;
+              }
+            // only whole sectors can be erased; the readers of the discarded
+            // blocks wait for the erase
+            flux_address_ = (address + block_physical_size_bytes_ - 1)
+                & ~(block_physical_size_bytes_ - 1);
+            count = (address + count) & ~(block_physical_size_bytes_ - 1);
+            if (count > flux_address_)
+              {
+                flux_count_ = count - flux_address_;
+                if (erase_flash_range (flux_address_, flux_count_) != ok)
+                  {
+                    errno = EIO;
+                    result = -1;
+                  }
+                flux_count_ = 0;
+              }
+            break;
+
+          case ioctl_get_erase_sizes:
+            sizes = va_arg (args, uint32_t*);
+            sizes[0] = block_physical_size_bytes_;
+            sizes[1] = BLOCK_64K_SIZE / 2;
+            sizes[2] = BLOCK_64K_SIZE;
+            break;
+
+          case ioctl_is_blank:
+            blknum = va_arg (args, blknum_t);
+            nblocks = va_arg (args, size_t);
+            blank = va_arg (args, bool*);
+            if (blknum + nblocks > num_blocks_ || blknum + nblocks < blknum)
+              {
+                errno = EINVAL;
+                result = -1;
+                break;
+              }
+            *blank = true;
+            for (size_t i = 0; i < nblocks && *blank; i++)
+              {
+                address = (blknum + i) * block_logical_size_bytes_;
+                cache_entry_t* entry = cache_find (
+                    address / block_physical_size_bytes_);
+
+                if (entry != nullptr)
+                  {
+                    // the cached copy is the current content
+                    const uint8_t* pd = entry->data
+                        + address % block_physical_size_bytes_;
+                    for (size_t j = 0; j < block_logical_size_bytes_; j++)
+                      {
+                        if (pd[j] != 0xFF)
+                          {
+                            *blank = false;
+                            break;
+                          }
+                      }
+                  }
+                else if (check_blank (address, block_logical_size_bytes_,
+                                      *blank) != ok)
+                  {
+                    errno = EIO;
+                    result = -1;
+                    break;
+                  }
+              }
+            break;
+
+          case ioctl_get_page_size:
+            sizes = va_arg (args, uint32_t*);
+            *sizes = PAGE_SIZE;
+            break;
+
+          default:
+            errno = ENOTTY;
+            result = -1;
+            break;
+          }
+        if (write_access)
+          {
+            unlock_write ();
+          }
+        else
+          {
+            io_mx_.unlock ();
+          }
+        return result;
       }
 
       /**
@@ -271,7 +555,12 @@ namespace os
       void
       qspi_impl::do_sync (void)
       {
-        ;
+        if (cache_count_ > 0)
+          {
+            lock_write ();
+            cache_flush ();
+            unlock_write ();
+          }
       }
 
       /**
@@ -281,7 +570,18 @@ namespace os
       int
       qspi_impl::do_close (void)
       {
-        if (qspi_impl::uninitialize () != ok)
+        qspi_impl::qspi_result_t result = ok;
+
+        sched_close ();
+        if (cache_count_ > 0)
+          {
+            result = cache_close ();
+          }
+        ra_close ();
+        pre_erase_close ();
+        delete[] sector_buff_;
+        sector_buff_ = nullptr;
+        if (qspi_impl::uninitialize () != ok || result != ok)
           {
             errno = EIO;
             return -1;
@@ -295,447 +595,1741 @@ namespace os
       //------------- End of POSIX interface ---------------------------
 
       /**
-       * @brief  Read the flash chip ID and initialize the internal structures accordingly.
-       * @return qspi_impl::ok if successful, or a qspi_impl error if the flash could not be identified
-       * 	 or it is not supported by the driver.
+       * @brief  Read the flash chip ID and initialize the internal structures accordingly.
+       * @return qspi_impl::ok if successful, or a qspi_impl error if the flash could not be identified
+       * 	 or it is not supported by the driver.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::initialize (void)
+      {
+        qspi_impl::qspi_result_t result;
+
+        // Read flash device ID
+        if ((result = qspi_impl::read_JEDEC_ID ()) != ok)
+          {
+            // Flash device might be in deep sleep, or left in continuous read
+            // mode (e.g. by a reset of the MCU)
+            in_continuous_ = true;
+            continuous_exit ();
+            qspi_impl::sleep (false);
+
+            // Reset and try reading ID again
+            if ((result = qspi_impl::reset_chip ()) == ok)
+              {
+                result = qspi_impl::read_JEDEC_ID ();
+              }
+          }
+
+        // If all OK, switch flash device in quad mode, with DTR reads if the
+        // chip supports them
+        if (result == ok)
+          {
+            ready_open ();
+            dtr_ = dtr_allowed_ && pdevice_->DDR_support;
+            continuous_ = continuous_allowed_ && pdevice_->continuous_support;
+            dummy_cycles_ =
+                dtr_ ? pdevice_->DDR_dummy_cycles : pdevice_->dummy_cycles;
+            build_read_commands ();
+            set_sample_shifting ();
+            result = enter_quad_mode ();
+          }
+
+        if (result == ok && dtr_ && verify_dtr () != ok)
+          {
+            // Fall back to SDR reads, with the SDR dummy cycles
+            trace::printf ("%s(): using SDR reads\n", __func__);
+            dtr_ = false;
+            dummy_cycles_ = pdevice_->dummy_cycles;
+            build_read_commands ();
+            set_sample_shifting ();
+            if ((result = qspi_impl::reset_chip ()) == ok)
+              {
+                result = enter_quad_mode ();
+              }
+          }
+
+        if (result == ok)
+          {
+            dma_open ();
+            if (poll_request_ == poll_calibrate)
+              {
+                calibrate_polling ();
+              }
+            else
+              {
+                poll_threshold_ = poll_request_;
+              }
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Set flash device to default state.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::uninitialize (void)
+      {
+        pimpl = nullptr;
+        keep_mapped_ = false;
+        dma_close ();
+        qspi_impl::sleep (false);
+        dtr_ = false;
+        set_sample_shifting ();
+        return qspi_impl::reset_chip ();
+      }
+
+      /**
+       * @brief  Select the DTR (dual transfer rate) quad I/O reads, used if
+       *    the chip supports them; applied at the next initialization.
+       * @param  state: true to use the DTR reads when possible (default), false
+       *    to always read in SDR mode.
+       */
+      void
+      qspi_impl::set_dtr_reads (bool state)
+      {
+        dtr_allowed_ = state;
+      }
+
+      /**
+       * @brief  Select the continuous read mode (XIP), used if the chip
+       *    supports it; applied at the next initialization. In this mode the
+       *    reads following the first one are sent without the instruction,
+       *    and the memory-mapped mode sends it only once.
+       * @param  state: true to use the continuous read mode when possible
+       *    (default), false to send the instruction with every read.
+       */
+      void
+      qspi_impl::set_continuous_reads (bool state)
+      {
+        continuous_allowed_ = state;
+      }
+
+      /**
+       * @brief  Take the chip out of the continuous read mode, if it is in,
+       *    before sending a command other than a read. A read is started
+       *    without instruction and with all the mode bits set, which ends the
+       *    mode of both vendors (Winbond M5-4, Micron XIP confirmation bit),
+       *    in SDR and in DTR mode. The first address byte (0x00) is not a
+       *    valid instruction, so a chip that is not in continuous read mode
+       *    ignores the command.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::continuous_exit (void)
+      {
+        qspi_impl::qspi_result_t result = ok;
+        uint8_t data;
+
+        if (in_continuous_)
+          {
+            // the data is not needed, the mode bits are latched before it
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (
+                hqspi_, &cmds_.continuous_exit, TIMEOUT);
+            if (result == ok)
+              {
+                result = (qspi_impl::qspi_result_t) HAL_QSPI_Receive (
+                    hqspi_, &data, TIMEOUT);
+              }
+            in_continuous_ = false;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Check that the data read in DTR mode is correct: a reference
+       *    is read in SDR mode, then in DTR mode, and the two are compared.
+       *    The reference is the first half page of the first 64K block whose
+       *    data is not made of a single repeated byte: a blank or uniformly
+       *    filled area reads the same with a wrong timing, or from a chip that
+       *    ignores the DTR read command. The chip must already be configured
+       *    for the DTR reads.
+       * @return qspi::ok if the data matches, a qspi error if it does not or
+       *    if no reference was found (DTR reads unverified).
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::verify_dtr (void)
+      {
+        constexpr size_t count = PAGE_SIZE / 2;
+        uint32_t size = get_sector_count () * pdevice_->sector_size;
+        uint32_t address;
+        qspi_impl::qspi_result_t result;
+        size_t i = count;
+
+        // the continuous read mode, if entered, is left before switching the
+        // read mode
+        result = continuous_exit ();
+        dtr_ = false;
+        build_read_commands ();
+        for (address = 0; address < size && result == ok && i == count;
+            address += BLOCK_64K_SIZE)
+          {
+            result = read_polled (address, lbuff_, count);
+            for (i = 1; i < count && lbuff_[i] == lbuff_[0]; i++)
+              {
+                ;
+              }
+          }
+        if (result == ok && i == count)
+          {
+            trace::printf ("%s(): no reference data, DTR reads unverified\n",
+                           __func__);
+            result = error;
+          }
+        address -= BLOCK_64K_SIZE;
+
+        if (result == ok)
+          {
+            result = continuous_exit ();
+          }
+        dtr_ = true;
+        build_read_commands ();
+        if (result == ok)
+          {
+            result = read_dma (address, lbuff_ + count, count);
+          }
+        if (result == ok && memcmp (lbuff_, lbuff_ + count, count) != 0)
+          {
+            trace::printf ("%s(): DTR data mismatch at 0x%08X\n", __func__,
+                           (unsigned) address);
+            result = error;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Set the controller's sample shifting: none in DTR mode (as
+       *    required by the controller), the application's setting otherwise.
+       *    The controller must be idle.
+       */
+      void
+      qspi_impl::set_sample_shifting (void)
+      {
+        hqspi_->Instance->CR = (hqspi_->Instance->CR & ~QUADSPI_CR_SSHIFT)
+            | (dtr_ ? QSPI_SAMPLE_SHIFTING_NONE : hqspi_->Init.SampleShifting);
+      }
+
+      /**
+       * @brief  Read the memory parameters (manufacturer and type).
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read_JEDEC_ID (void)
+      {
+        qspi_impl::qspi_result_t result = error;
+        uint8_t buff[3];
+
+        // Initiate read
+        result = indirect_mode ();
+        if (result == ok)
+          {
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (
+                hqspi_, &cmds_.jedec_id, TIMEOUT);
+          }
+        if (result == ok)
+          {
+            // three bytes, read by polling
+            result = io_receive (buff, sizeof(buff));
+            if (result == ok)
+              {
+                manufacturer_ID_ = buff[0];
+                memory_type_ = buff[1] << 8;
+                memory_type_ += buff[2];
+
+                // Do we know this device?
+                result = type_not_found;
+                for (const qspi_manuf_t* pqm = qspi_manufacturers;
+                    pqm->manufacturer_ID != 0; pqm++)
+                  {
+                    if (pqm->manufacturer_ID == manufacturer_ID_)
+                      {
+                        // Manufacturer found
+                        for (const qspi_device_t* pqd = pqm->devices;
+                            pqd->device_ID != 0; pqd++)
+                          {
+                            if (pqd->device_ID == memory_type_)
+                              {
+                                // Device found, initialize class
+                                pmanufacturer_ = pqm->manufacturer_name;
+                                pdevice_ = pqd;
+                                pimpl = pqm->qspi_factory ();
+                                result = ok;
+                                break;
+                              }
+                          }
+                      }
+                  }
+              }
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Switch the flash chip into or out of deep sleep.
+       * @param  state: if true, enter deep sleep; if false, exit deep sleep.
+       * @return qspi::ok if successful, an error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::sleep (bool state)
+      {
+        qspi_impl::qspi_result_t result = error;
+
+        // Enable/disable deep sleep
+        result = indirect_mode ();
+        if (result == ok)
+          {
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (
+                hqspi_,
+                state ? &cmds_.power_down : &cmds_.release_power_down,
+                TIMEOUT);
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Map the flash to the addressing space of the controller, starting at
+       * 	address 0x90000000. The driver keeps the flash mapped from now on: the
+       * 	memory-mapped mode is suspended during write/erase operations and
+       * 	re-entered when they complete, until exit_mem_mapped() is called.
+       * @return qspi::ok if successful, false otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::enter_mem_mapped (void)
+      {
+        qspi_impl::qspi_result_t result;
+
+        lock_write ();
+        keep_mapped_ = true;
+        result = mapped_ ? ok : map ();
+        unlock_write ();
+        return result;
+      }
+
+      /**
+       * @brief  Exit memory-mapped mode.
+       * @return qspi::ok if successful, false otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::exit_mem_mapped (void)
+      {
+        qspi_impl::qspi_result_t result;
+
+        lock_write ();
+        ra_wait ();
+        keep_mapped_ = false;
+        mapped_ = false;
+        result = (qspi_impl::qspi_result_t) HAL_QSPI_Abort (hqspi_);
+        unlock_write ();
+        return result;
+      }
+
+      /**
+       * @brief  Switch the controller to memory-mapped mode. The timeout counter
+       * 	releases the chip select after MAPPED_IDLE_TIMEOUT idle cycles, so that
+       * 	the flash can enter stand-by between accesses.
+       * @return qspi::ok if successful, false otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::map (void)
+      {
+        qspi_impl::qspi_result_t result = error;
+        QSPI_CommandTypeDef sCommand;
+        QSPI_MemoryMappedTypeDef sMemMappedCfg;
+
+        ra_wait ();
+        if (pdevice_ != nullptr)
+          {
+            // once in continuous read mode, the chip expects no instruction
+            sCommand = cmds_.mapped;
+            if (in_continuous_)
+              {
+                sCommand.InstructionMode = QSPI_INSTRUCTION_NONE;
+              }
+
+            sMemMappedCfg.TimeOutActivation = QSPI_TIMEOUT_COUNTER_ENABLE;
+            sMemMappedCfg.TimeOutPeriod = MAPPED_IDLE_TIMEOUT;
+
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_MemoryMapped (
+                hqspi_, &sCommand, &sMemMappedCfg);
+            mapped_ = (result == ok);
+            in_continuous_ = in_continuous_ || (mapped_ && continuous_);
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Select how reads are performed. When enabled, the controller is
+       *    left in memory-mapped mode while idle and all reads (read, read_sector
+       *    and the block device reads) are copied from the mapped window; the
+       *    memory-mapped mode is entered lazily by the first read, and
+       *    suspended only while a command (write, erase, etc.) is sent to the
+       *    flash.
+       * @param  state: true to read through the memory-mapped window, false to
+       *    use indirect (DMA) reads.
+       */
+      void
+      qspi_impl::set_mapped_reads (bool state)
+      {
+        lock_write ();
+        mapped_reads_ = state;
+        if (state == false && keep_mapped_ == false)
+          {
+            leave_mapped ();
+          }
+        unlock_write ();
+      }
+
+      /**
+       * @brief  Return a pointer to flash data, inside the memory-mapped window.
+       *    The controller is switched to memory-mapped mode if needed. The
+       *    pointer stays valid until the next write, erase or other command sent
+       *    to the flash, unless enter_mem_mapped() was called; while the block
+       *    device is open, its writers and background threads may send such
+       *    commands at any time.
+       * @param  address: address in flash.
+       * @param  count: number of bytes that will be accessed.
+       * @return Pointer to the data, or nullptr if the memory-mapped mode could
+       *    not be entered.
+       */
+      const uint8_t*
+      qspi_impl::get_mapped_address (uint32_t address, size_t count)
+      {
+        const uint8_t* pf = nullptr;
+
+        if (lock_area (address, count, false) == ok)
+          {
+            pf = mapped_address (address, count);
+          }
+        unlock_area ();
+        return pf;
+      }
+
+      /**
+       * @brief  Return a pointer to flash data, inside the memory-mapped window,
+       *    without locking (see get_mapped_address()). io_mx_ must be held.
+       * @param  address: address in flash.
+       * @param  count: number of bytes that will be accessed.
+       * @return Pointer to the data, or nullptr if the memory-mapped mode could
+       *    not be entered.
+       */
+      const uint8_t*
+      qspi_impl::mapped_address (uint32_t address, size_t count)
+      {
+        uint8_t* pf = nullptr;
+
+        if (pdevice_ != nullptr && suspended_ == 0
+            && (mapped_ == true || map () == ok))
+          {
+            pf = (uint8_t*) QSPI_BASE + address;
+          }
+        return pf;
+      }
+
+      /**
+       * @brief  Switch the controller to indirect mode, for a read: if it is
+       *    in memory-mapped mode, exit it. The chip may stay in continuous
+       *    read mode.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::leave_mapped (void)
+      {
+        qspi_impl::qspi_result_t result = ok;
+
+        ra_wait ();
+        if (mapped_)
+          {
+            mapped_ = false;
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Abort (hqspi_);
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Make sure the controller is in indirect mode, i.e. able to send
+       *    commands to the flash. If it is in memory-mapped mode, exit it, and
+       *    take the chip out of the continuous read mode.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::indirect_mode (void)
+      {
+        qspi_impl::qspi_result_t result = leave_mapped ();
+
+        if (result == ok)
+          {
+            result = continuous_exit ();
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Suspend the memory-mapped mode for the duration of an operation
+       *    that must send commands to the flash. Calls may be nested, each one
+       *    must be paired with a call to resume_mapped().
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::suspend_mapped (void)
+      {
+        suspended_++;
+        return indirect_mode ();
+      }
+
+      /**
+       * @brief  End an operation started with suspend_mapped(). When the
+       *    outermost operation ends, the memory-mapped mode is re-entered if it
+       *    was requested by enter_mem_mapped().
+       * @param  result: result of the operation.
+       * @return The result of the operation if it failed, otherwise the result
+       *    of re-entering memory-mapped mode.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::resume_mapped (qspi_result_t result)
+      {
+        if (suspended_ > 0)
+          {
+            suspended_--;
+          }
+        if (suspended_ == 0 && keep_mapped_ && mapped_ == false)
+          {
+            qspi_impl::qspi_result_t map_result = map ();
+            if (result == ok)
+              {
+                result = map_result;
+              }
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Invalidate the data cache lines of the memory-mapped window
+       *    covering an area modified by a program or erase operation, and the
+       *    read-ahead data overlapping it.
+       * @param  address: start address of the modified area.
+       * @param  count: size of the modified area.
+       */
+      void
+      qspi_impl::invalidate_mapped (uint32_t address, size_t count)
+      {
+        invalidate_dcache ((uint8_t*) QSPI_BASE + address, count);
+        ra_drop (address, count);
+      }
+
+      /**
+       * @brief  Read a block of data from the memory-mapped window.
+       * @param  address: start address in flash where to read from.
+       * @param  buff: buffer where to copy data to.
+       * @param  count: amount of data to be retrieved from flash.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read_mapped (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = error;
+        const uint8_t* pf = mapped_address (address, count);
+
+        if (pf != nullptr)
+          {
+            memcpy (buff, pf, count);
+            result = ok;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Read a block of data from the flash. Like the other low-level
+       *    calls, it is serialized with the block device and its background
+       *    threads (see lock_area()).
+       * @param  address: start address in flash where to read from.
+       * @param  buff: buffer where to copy data to.
+       * @param  count: amount of data to be retrieved from flash.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = lock_area (address, count, false);
+
+        if (result == ok)
+          {
+            result = read_flash (address, buff, count);
+          }
+        unlock_area ();
+        return result;
+      }
+
+      /**
+       * @brief  Read a block of data from the flash, without locking (see
+       *    read()). io_mx_ must be held.
+       * @param  address: start address in flash where to read from.
+       * @param  buff: buffer where to copy data to.
+       * @param  count: amount of data to be retrieved from flash.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read_flash (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result;
+
+        if (mapped_reads_ && suspended_ == 0)
+          {
+            result = read_mapped (address, buff, count);
+          }
+        else
+          {
+            // the chip can stay in continuous read mode
+            suspended_++;
+            if ((result = leave_mapped ()) == ok)
+              {
+                result = read_indirect (address, buff, count);
+              }
+            result = resume_mapped (result);
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Read a block of data from the flash in indirect mode, with DMA
+       *    directly into the buffer.
+       * @param  address: start address in flash where to read from.
+       * @param  buff: buffer where to copy data to.
+       * @param  count: amount of data to be retrieved from flash.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read_dma (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = ok;
+
+        /**
+         * The transfer is split into chunks the DMA can handle. The first
+         * chunk ends on a cache line boundary, so that the cache lines of
+         * the next chunk can be invalidated while the DMA transfer of the
+         * current chunk is running.
+         */
+        size_t chunk = DMA_MAX_TRANSFER - ((uintptr_t) buff & 0x1F);
+        chunk = (chunk > count) ? count : chunk;
+
+        /**
+         * Flush and clean the data cache to mitigate incoherence before
+         * a DMA transfer (DTCM RAM is not cached)
+         */
+        dma_prepare_rx (buff, chunk);
+
+        while (count > 0 && result == ok)
+          {
+            result = start_read (address, buff, chunk);
+            if (result == ok)
+              {
+                // Prepare the next chunk while the DMA transfer runs
+                size_t next = count - chunk;
+                next = (next > DMA_MAX_TRANSFER) ? DMA_MAX_TRANSFER : next;
+                if (next > 0)
+                  {
+                    dma_prepare_rx (buff + chunk, next);
+                  }
+
+                result =
+                    (semaphore_.timed_wait (transfer_timeout (chunk))
+                        == rtos::result::ok) ? ok : timeout;
+                if (result == ok)
+                  {
+                    dma_complete_rx (buff, chunk);
+                  }
+
+                address += chunk;
+                buff += chunk;
+                count -= chunk;
+                chunk = next;
+              }
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Send a read command, without its data phase.
+       * @param  address: start address in flash where to read from.
+       * @param  count: amount of data.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::send_read (uint32_t address, size_t count)
+      {
+        qspi_impl::qspi_result_t result = error;
+        QSPI_CommandTypeDef sCommand;
+
+        if (pdevice_ != nullptr)
+          {
+            sCommand = in_continuous_ ? cmds_.read_continuous : cmds_.read;
+            sCommand.Address = address;
+            sCommand.NbData = count;
+
+            result = io_command (&sCommand);
+            if (result != ok)
+              {
+                /**
+                 * This is a workaround for the QSPI peripheral bug described in
+                 * the ST document ES0290 Rev 7, section 2.4.1.
+                 * Abort the QSPI operation, then retry
+                 */
+                io_abort ();
+                result = io_command (&sCommand);
+              }
+            if (result == ok)
+              {
+                in_continuous_ = continuous_;
+              }
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Send a read command and start the DMA transfer of its data,
+       *    without waiting for it to end; the semaphore is posted when the
+       *    transfer is complete.
+       * @param  address: start address in flash where to read from.
+       * @param  buff: buffer where to copy data to, already invalidated in the
+       *    data cache.
+       * @param  count: amount of data, at most DMA_MAX_TRANSFER bytes.
+       * @return qspi::ok if the transfer was started, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::start_read (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = send_read (address, count);
+
+        if (result == ok)
+          {
+            // drop a stale post, left by an interrupt of an aborted operation
+            semaphore_.reset ();
+            result = io_receive_dma (buff, count);
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Compute the deadline of a data transfer, from the amount of
+       *    data and the bus clock (4 data lines, 2 cycles per byte).
+       * @param  count: number of bytes to transfer.
+       * @return Timeout, in system clock ticks.
+       */
+      uint32_t
+      qspi_impl::transfer_timeout (size_t count)
+      {
+        uint32_t bus_hz = SystemCoreClock / (hqspi_->Init.ClockPrescaler + 1);
+        uint32_t ms = (uint32_t) ((((uint64_t) count * 2 * 1000) + bus_hz - 1)
+            / bus_hz);
+
+        // allow twice the transfer time on top of the fixed timeout
+        return TIMEOUT + 2 * ms * one_ms;
+      }
+
+      /**
+       * @brief  Write data to flash.
+       * @param  address: start address in flash where to write data to.
+       * @param  buff: source data to be written.
+       * @param  count: amount of data to be written.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::write (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = lock_area (address, count, true);
+
+        if (result == ok)
+          {
+            result = write_flash (address, buff, count);
+          }
+        unlock_area ();
+        return result;
+      }
+
+      /**
+       * @brief  Write data to flash, without locking (see write()). The
+       *    writer lock must be held.
+       * @param  address: start address in flash where to write data to.
+       * @param  buff: source data to be written.
+       * @param  count: amount of data to be written.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::write_flash (uint32_t address, const uint8_t* buff,
+                              size_t count)
+      {
+        qspi_impl::qspi_result_t result = error;
+        size_t in_block_count;
+
+        if (pdevice_ != nullptr && (result = suspend_mapped ()) == ok)
+          {
+            do
+              {
+                in_block_count = 0x100 - (address & 0xFF);
+                if (in_block_count > count)
+                  {
+                    in_block_count = count;
+                  }
+                else if (in_block_count == 0)
+                  {
+                    in_block_count = (count > 0x100) ? 0x100 : count;
+                  }
+                result = program_page (address, buff, in_block_count);
+                address += in_block_count;
+                buff += in_block_count;
+                count -= in_block_count;
+              }
+            while (count > 0 && result == ok);
+
+            // wait for the last page (or the one that was programming when an
+            // error occurred)
+            qspi_impl::qspi_result_t pending = program_wait ();
+            result = (result == ok) ? pending : result;
+          }
+        if (pdevice_ != nullptr)
+          {
+            result = resume_mapped (result);
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Queue a page for programming (max. 256 bytes). The page data is
+       *    prepared while the previous page is being programmed, then the page
+       *    is started as soon as the chip is ready; the call returns while the
+       *    chip is busy programming it. The last page of a sequence must be
+       *    followed by a call to program_wait().
+       * @param  address: address of the page in flash.
+       * @param  buff: buffer of the source data; it must stay unchanged until
+       *    the page is programmed.
+       * @param  count: number of bytes to be written (max 256).
+       * @return qspi::ok if successful, a qspi error otherwise (including a
+       *    failure of the previous page).
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::program_page (uint32_t address, const uint8_t* buff,
+                               size_t count)
+      {
+        qspi_impl::qspi_result_t result;
+
+        // let the reads queued to the I/O scheduler in between the pages
+        if (sched_writing_ && sched_reads_ != nullptr)
+          {
+            result = program_wait ();
+            if (result != ok)
+              {
+                return result;
+              }
+            sched_yield ();
+          }
+
+        /**
+         *  Clean the data cache (or stage the data in the coherent bounce
+         *  buffer) to mitigate incoherence before DMA transfers; the previous
+         *  page has already been transferred. The short pages are written by
+         *  polling, from the cache.
+         */
+        if (count > poll_threshold_)
+          {
+            buff = dma_prepare_tx (buff, count);
+          }
+
+        result = program_wait ();
+        if (result == ok)
+          {
+            result = program_start (address, buff, count);
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Send a page to the flash, without waiting for the end of the
+       *    programming (see program_wait()).
+       * @param  address: address of the page in flash.
+       * @param  buff: buffer of the source data, already cleaned in the data
+       *    cache.
+       * @param  count: number of bytes to be written (max 256).
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::program_start (uint32_t address, const uint8_t* buff,
+                                size_t count)
+      {
+        qspi_impl::qspi_result_t result = error;
+        QSPI_CommandTypeDef sCommand;
+
+        program_time_ = rtos::hrclock.now ();
+        blank_mark (address, count, false);
+
+        // Enable write
+        result = indirect_mode ();
+        if (result == ok)
+          {
+            result = io_command (&cmds_.write_enable);
+          }
+        if (result == ok)
+          {
+            // Initiate write
+            sCommand = cmds_.program;
+            sCommand.Address = address;
+            sCommand.NbData = count;
+            result = io_command (&sCommand);
+            if (result == ok && count <= poll_threshold_)
+              {
+                result = io_transmit (buff, count);
+                dma_stats_.polled++;
+              }
+            else if (result == ok)
+              {
+                semaphore_.reset ();
+                result = io_transmit_dma (buff, count);
+                if (result == ok)
+                  {
+                    result =
+                        (semaphore_.timed_wait (transfer_timeout (count))
+                            == rtos::result::ok) ? ok : timeout;
+                  }
+              }
+            if (result == ok)
+              {
+                // the end of the programming is waited for later
+                program_pending_ = true;
+                program_address_ = address;
+                program_count_ = count;
+              }
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Wait for the end of the page being programmed, if any (see
+       *    wait_ready()), and account its duration in the programming
+       *    statistics.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::program_wait (void)
+      {
+        qspi_impl::qspi_result_t result = ok;
+        uint32_t ticks;
+
+        if (program_pending_)
+          {
+            program_pending_ = false;
+            result = wait_ready (op_program, program_time_);
+            invalidate_mapped (program_address_, program_count_);
+            if (result == ok)
+              {
+                ticks = (uint32_t) (rtos::hrclock.now () - program_time_);
+                program_stats_.pages++;
+                program_stats_.last = ticks;
+                program_stats_.total += ticks;
+                if (ticks > program_stats_.max)
+                  {
+                    program_stats_.max = ticks;
+                  }
+                if (ticks < program_stats_.min || program_stats_.pages == 1)
+                  {
+                    program_stats_.min = ticks;
+                  }
+              }
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Erase a sector (4K), block (32K), large block (64K) or whole flash.
+       * @param  address: address of the block to be erased.
+       * @param  which: command to erase, can be either SECTOR_ERASE, BLOCK_32K_ERASE,
+       * 	BLOCK_64K_ERASE or CHIP_ERASE.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::erase (uint32_t address, uint8_t which)
+      {
+        qspi_impl::qspi_result_t result = error;
+        QSPI_CommandTypeDef sCommand;
+        operation_t op = erase_operation (which);
+        rtos::clock::timestamp_t start;
+        size_t size;
+
+        if (pdevice_ != nullptr)
+          {
+            // Enable write
+            result = suspend_mapped ();
+            if (result == ok)
+              {
+                result = io_command (&cmds_.write_enable);
+              }
+            if (result == ok)
+              {
+                // Initiate erase
+                sCommand =
+                    (which == SECTOR_ERASE) ? cmds_.erase_sector :
+                    (which == BLOCK_32K_ERASE) ? cmds_.erase_32k :
+                    (which == BLOCK_64K_ERASE) ? cmds_.erase_64k :
+                                                 cmds_.erase_chip;
+                sCommand.Address = address;
+                start = rtos::hrclock.now ();
+                result = io_command (&sCommand);
+                if (result == ok)
+                  {
+                    if (yield_io_ && which != CHIP_ERASE
+                        && keep_mapped_ == false && mapped_reads_ == false)
+                      {
+                        // let the readers in while the chip erases
+                        result = erase_yield (op, start);
+                      }
+                    else
+                      {
+                        result = wait_ready (op, start);
+                      }
+                    if (which == CHIP_ERASE)
+                      {
+                        address = 0;
+                        size = get_sector_count () * pdevice_->sector_size;
+                      }
+                    else
+                      {
+                        size =
+                            (which == SECTOR_ERASE) ? pdevice_->sector_size :
+                            (which == BLOCK_32K_ERASE) ? 0x8000 : 0x10000;
+                        address &= ~(size - 1);
+                      }
+                    invalidate_mapped (address, size);
+                    if (result == ok)
+                      {
+                        blank_mark (address, size, true);
+                      }
+                  }
+              }
+            result = resume_mapped (result);
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Select the policy used to choose between sector (4K) and block
+       *    (32K, 64K) erases.
+       * @param  policy: erase_min_wear to never erase a sector that does not
+       *    need it (block erases are used only when all the sectors of the
+       *    block must be erased), or erase_max_speed to use a block erase
+       *    whenever it is estimated to be faster, even if some sectors of the
+       *    block are erased (and reprogrammed) without need.
+       */
+      void
+      qspi_impl::set_erase_policy (erase_policy_t policy)
+      {
+        erase_policy_ = policy;
+      }
+
+      /**
+       * @brief  Select the logical block size of the block device, applied
+       *    the next time it is opened.
+       * @param  size: block size in bytes, a power of 2 between 512 and the
+       *    sector size; 0 (default) for the sector size. With blocks smaller
+       *    than a sector, a block write programs only the pages of the block
+       *    when the bits allow it, otherwise the rest of the sector is read
+       *    back and the whole sector rewritten.
+       */
+      void
+      qspi_impl::set_block_size (size_t size)
+      {
+        block_size_ = size;
+      }
+
+      /**
+       * @brief  Lock the block device for a write access. Writers are
+       *    serialized; while one of them waits for an erase, it releases the
+       *    controller to the readers (see erase_yield()).
+       */
+      void
+      qspi_impl::lock_write (void)
+      {
+        write_mx_.lock ();
+        io_mx_.lock ();
+        yield_io_ = true;
+      }
+
+      /**
+       * @brief  Unlock the block device after a write access.
+       */
+      void
+      qspi_impl::unlock_write (void)
+      {
+        yield_io_ = false;
+        io_mx_.unlock ();
+        write_mx_.unlock ();
+      }
+
+      /**
+       * @brief  Lock the driver for a call of the low-level API, like a block
+       *    device write, and make the block device state consistent with the
+       *    flash area accessed: the dirty cached sectors overlapping it are
+       *    written to flash; if the area is modified, the cached copies are
+       *    dropped, its sectors leave the background eraser queue and the
+       *    block device readers wait for it. Must be paired with
+       *    unlock_area(), even if it fails.
+       * @param  address: start address of the area.
+       * @param  count: size of the area.
+       * @param  modify: true if the area is written or erased.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::lock_area (uint32_t address, size_t count, bool modify)
+      {
+        qspi_impl::qspi_result_t result = ok;
+
+        lock_write ();
+        if (cache_count_ > 0)
+          {
+            result = cache_write_back (address, count, modify);
+          }
+        if (modify)
+          {
+            pre_erase_cancel (address, count);
+            flux_address_ = address;
+            flux_count_ = count;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Unlock the driver after a call of the low-level API.
+       */
+      void
+      qspi_impl::unlock_area (void)
+      {
+        flux_count_ = 0;
+        unlock_write ();
+      }
+
+      /**
+       * @brief  Wait for the end of an erase started by a writer, with the
+       *    controller released: a reader may meanwhile suspend the erase,
+       *    read and resume it. The writer sleeps for most of the expected
+       *    duration of the erase before polling the status register. When
+       *    the writer is the I/O scheduler, it serves the reads itself. The
+       *    deadline of the erase is counted from its start, extended by the
+       *    time it spent suspended.
+       * @param  op: the erase operation.
+       * @param  start: start of the erase, in hrclock ticks.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::erase_yield (operation_t op, rtos::clock::timestamp_t start)
+      {
+        qspi_impl::qspi_result_t result = ok;
+        uint32_t ticks;
+        bool woken;
+
+        erase_busy_ = true;
+        erase_disturbed_ = false;
+        erase_op_ = op;
+        erase_result_ = ok;
+        erase_suspends_ = 0;
+        erase_held_ = 0;
+        if (sched_writing_)
+          {
+            // the I/O scheduler sleeps on erase_sem_, a read request wakes it
+            // up to serve the read with the erase suspended; the reads queued
+            // before the erase started are served first
+            erase_sem_.reset ();
+            sched_yield ();
+            while (erase_polling_ == false && erase_result_ == ok
+                && (ticks = ready_sleep_ticks (op, start + erase_held_)) > 0)
+              {
+                io_mx_.unlock ();
+                woken = (erase_sem_.timed_wait (ticks) == rtos::result::ok);
+                io_mx_.lock ();
+                if (woken)
+                  {
+                    sched_yield ();
+                  }
+              }
+          }
+        else
+          {
+            io_mx_.unlock ();
+            ready_sleep (op, start);
+            io_mx_.lock ();
+          }
+
+        // a reader that suspended the erase has already restarted the polling
+        result = erase_result_;
+        if (result == ok && erase_polling_ == false)
+          {
+            result = erase_poll_start ();
+          }
+        while (result == ok)
+          {
+            sched_yield ();
+            ticks = erase_ticks_left (op, start);
+            io_mx_.unlock ();
+            result =
+                (ticks > 0
+                    && erase_sem_.timed_wait (ticks) == rtos::result::ok) ?
+                    ok : qspi_impl::timeout;
+            io_mx_.lock ();
+
+            // a reader failed to resume the erase
+            if (result == ok)
+              {
+                result = erase_result_;
+              }
+            // the polling is still running if woken up by a read request
+            if (erase_polling_ == false)
+              {
+                break;
+              }
+          }
+        if (result == ok && erase_disturbed_ == false)
+          {
+            ready_update (op, start);
+          }
+        erase_polling_ = false;
+        erase_busy_ = false;
+        return result;
+      }
+
+      /**
+       * @brief  Compute the time left before the deadline of the erase a
+       *    writer waits for (see ready_timeout()), counted from its start and
+       *    extended by the time it spent suspended.
+       * @param  op: the erase operation.
+       * @param  start: start of the erase, in hrclock ticks.
+       * @return Time left, in system clock ticks (0 if past the deadline).
+       */
+      uint32_t
+      qspi_impl::erase_ticks_left (operation_t op,
+                                   rtos::clock::timestamp_t start)
+      {
+        uint64_t elapsed_us = (rtos::hrclock.now () - start - erase_held_)
+            * 1000000 / rtos::hrclock.input_clock_frequency_hz ();
+        uint64_t timeout_us = (uint64_t) ready_timeout (op) * 1000000
+            / rtos::sysclock.frequency_hz;
+
+        return (timeout_us > elapsed_us) ?
+            (uint32_t) ((timeout_us - elapsed_us) * rtos::sysclock.frequency_hz
+                / 1000000) + 1 :
+            0;
+      }
+
+      /**
+       * @brief  Start polling the status register in the background, until
+       *    the erase is complete; the end is signaled on erase_sem_.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::erase_poll_start (void)
+      {
+        erase_sem_.reset ();
+        erase_polling_ = true;
+        qspi_impl::qspi_result_t result = ready_poll (erase_op_);
+        if (result != ok)
+          {
+            erase_polling_ = false;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Suspend the erase a writer is waiting for, so that a reader
+       *    can access the flash. If the chip cannot suspend it, or it was
+       *    resumed less than ERASE_RUN_MIN ago, or it was already suspended
+       *    ERASE_SUSPENDS_MAX times, the erase goes on undisturbed.
+       * @return qspi::ok if the erase is suspended, a qspi error otherwise.
        */
       qspi_impl::qspi_result_t
-      qspi_impl::initialize (void)
+      qspi_impl::erase_suspend (void)
       {
-        qspi_impl::qspi_result_t result;
-
-        // Read flash device ID
-        if ((result = qspi_impl::read_JEDEC_ID ()) != ok)
+        qspi_impl::qspi_result_t result = error;
+        rtos::clock::timestamp_t now = rtos::hrclock.now ();
+
+        if (pimpl != nullptr && erase_result_ == ok
+            && erase_suspends_ < ERASE_SUSPENDS_MAX
+            && (erase_suspends_ == 0
+                || (now - erase_mark_) * 1000000
+                    / rtos::hrclock.input_clock_frequency_hz ()
+                    >= ERASE_RUN_MIN))
           {
-            // Flash device might be in deep sleep
-            qspi_impl::sleep (false);
-
-            // Reset and try reading ID again
-            if ((result = qspi_impl::reset_chip ()) == ok)
+            // stop the status polling of the writer, with the interrupt
+            // masked: a status match in between would otherwise be taken
+            // for the end of the next transfer
+            HAL_NVIC_DisableIRQ (QUADSPI_IRQn);
+            erase_polling_ = false;
+            HAL_QSPI_Abort (hqspi_);
+            HAL_NVIC_EnableIRQ (QUADSPI_IRQn);
+            result = pimpl->suspend_erase (this);
+            if (result == ok)
               {
-                result = qspi_impl::read_JEDEC_ID ();
+                erase_suspended_ = true;
+                erase_disturbed_ = true;
+                erase_suspends_++;
+                erase_mark_ = rtos::hrclock.now ();
+              }
+            else if ((erase_result_ = erase_poll_start ()) != ok)
+              {
+                // the writer would not see the end of the erase
+                erase_sem_.post ();
               }
           }
+        return result;
+      }
 
-        // If all OK, switch flash device in quad mode
+      /**
+       * @brief  Resume the erase suspended by erase_suspend() and restart the
+       *    status polling on behalf of the writer. On failure, the writer is
+       *    woken up and returns the error.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::erase_resume (void)
+      {
+        qspi_impl::qspi_result_t result;
+        rtos::clock::timestamp_t now;
+
+        erase_suspended_ = false;
+        continuous_exit ();
+        result = pimpl->resume_erase (this);
+        now = rtos::hrclock.now ();
+        erase_held_ += now - erase_mark_;
+        erase_mark_ = now;
         if (result == ok)
-          result = enter_quad_mode ();
-
+          {
+            result = erase_poll_start ();
+          }
+        if (result != ok)
+          {
+            erase_result_ = result;
+            erase_sem_.post ();
+          }
         return result;
       }
 
       /**
-       * @brief  Set flash device to default state.
+       * @brief  Erase a range of the flash, using the largest erase units
+       *    allowed by the alignment of the range and by the erase policy. With
+       *    the erase_min_wear policy, sectors already blank are not erased.
+       * @param  address: start address of the range; the range is extended to
+       *    sector boundaries.
+       * @param  count: size of the range.
        * @return qspi::ok if successful, or a qspi error otherwise.
        */
       qspi_impl::qspi_result_t
-      qspi_impl::uninitialize (void)
+      qspi_impl::erase_range (uint32_t address, size_t count)
       {
-        pimpl = nullptr;
-        qspi_impl::sleep (false);
-        return qspi_impl::reset_chip ();
+        qspi_impl::qspi_result_t result = lock_area (address, count, true);
+
+        if (result == ok)
+          {
+            result = erase_flash_range (address, count);
+          }
+        unlock_area ();
+        return result;
       }
 
       /**
-       * @brief  Read the memory parameters (manufacturer and type).
+       * @brief  Erase a range of the flash, without locking (see
+       *    erase_range()). The writer lock must be held.
+       * @param  address: start address of the range; the range is extended to
+       *    sector boundaries.
+       * @param  count: size of the range.
        * @return qspi::ok if successful, or a qspi error otherwise.
        */
       qspi_impl::qspi_result_t
-      qspi_impl::read_JEDEC_ID (void)
+      qspi_impl::erase_flash_range (uint32_t address, size_t count)
       {
         qspi_impl::qspi_result_t result = error;
-        uint8_t buff[3];
-        QSPI_CommandTypeDef sCommand;
+        uint32_t extra[BLOCK_64K_SIZE / MIN_SECTOR_SIZE] =
+          { };
 
-        // Read command settings
-        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
-        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-        sCommand.InstructionMode = QSPI_INSTRUCTION_1_LINE;
-        sCommand.AddressMode = QSPI_ADDRESS_NONE;
-        sCommand.DataMode = QSPI_DATA_1_LINE;
-        sCommand.DummyCycles = 0;
-        sCommand.NbData = 3;
-        sCommand.Instruction = JEDEC_ID;
-
-        // Initiate read and wait for the event
-        result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, &sCommand,
-                                                              TIMEOUT);
-        if (result == ok)
+        if (pdevice_ != nullptr && (result = suspend_mapped ()) == ok)
           {
-            result = (qspi_impl::qspi_result_t) HAL_QSPI_Receive_IT (hqspi_,
-                                                                     buff);
-            if (result == ok)
+            size_t sector_size = pdevice_->sector_size;
+            uint32_t end = (address + count + sector_size - 1)
+                & ~(sector_size - 1);
+
+            address &= ~(sector_size - 1);
+            while (address < end && result == ok)
               {
-                if (semaphore_.timed_wait (TIMEOUT) == rtos::result::ok)
+                uint32_t base = address & ~(BLOCK_64K_SIZE - 1);
+                uint32_t limit =
+                    (end - base > BLOCK_64K_SIZE) ? base + BLOCK_64K_SIZE : end;
+                uint32_t need = 0;
+                uint32_t allowed = 0;
+                uint32_t erased;
+
+                for (; address < limit; address += sector_size)
                   {
-                    manufacturer_ID_ = buff[0];
-                    memory_type_ = buff[1] << 8;
-                    memory_type_ += buff[2];
-
-                    // Do we know this device?
-                    result = type_not_found;
-                    for (const qspi_manuf_t* pqm = qspi_manufacturers;
-                        pqm->manufacturer_ID != 0; pqm++)
+                    uint32_t bit = 1 << ((address - base) / sector_size);
+                    bool blank = false;
+
+                    allowed |= bit;
+                    if (erase_policy_ == erase_min_wear
+                        && (result = check_blank (address, sector_size, blank))
+                            != ok)
                       {
-                        if (pqm->manufacturer_ID == manufacturer_ID_)
-                          {
-                            // Manufacturer found
-                            for (const qspi_device_t* pqd = pqm->devices;
-                                pqd->device_ID != 0; pqd++)
-                              {
-                                if (pqd->device_ID == memory_type_)
-                                  {
-                                    // Device found, initialize class
-                                    pmanufacturer_ = pqm->manufacturer_name;
-                                    pdevice_ = pqd;
-                                    pimpl = pqm->qspi_factory ();
-                                    result = ok;
-                                    break;
-                                  }
-                              }
-                          }
+                        break;
+                      }
+                    if (blank == false)
+                      {
+                        need |= bit;
                       }
                   }
-                else
+                if (result == ok)
                   {
-                    result = timeout;
+                    // erasing a blank sector costs no reprogramming
+                    result = erase_cover (base, need, allowed, extra, erased);
                   }
               }
+            result = resume_mapped (result);
           }
         return result;
       }
 
       /**
-       * @brief  Switch the flash chip into or out of deep sleep.
-       * @param  state: if true, enter deep sleep; if false, exit deep sleep.
-       * @return qspi::ok if successful, an error otherwise.
+       * @brief  Check if a range of the flash is blank (all 0xFF).
+       * @param  address: start address of the range.
+       * @param  count: size of the range, multiple of the page size.
+       * @param  blank: returns true if the range is blank.
+       * @return qspi::ok if successful, or a qspi error otherwise.
        */
       qspi_impl::qspi_result_t
-      qspi_impl::sleep (bool state)
+      qspi_impl::check_blank (uint32_t address, size_t count, bool& blank)
       {
-        qspi_impl::qspi_result_t result = error;
-        QSPI_CommandTypeDef sCommand;
+        qspi_impl::qspi_result_t result = ok;
 
-        // Initial command settings
-        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
-        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-        sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
-        sCommand.AddressMode = QSPI_ADDRESS_NONE;
-        sCommand.DataMode = QSPI_DATA_NONE;
-        sCommand.DummyCycles = 0;
-
-        // Enable/disable deep sleep
-        sCommand.Instruction = state ? POWER_DOWN : RELEASE_POWER_DOWN;
-        result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, &sCommand,
-                                                              TIMEOUT);
+        blank = true;
+        for (uint32_t a = address; a < address + count && blank;
+            a += PAGE_SIZE)
+          {
+            // the pages known to be blank are not read
+            if (blank_test (a, PAGE_SIZE))
+              {
+                continue;
+              }
+            if ((result = read_flash (a, lbuff_, PAGE_SIZE)) != ok)
+              {
+                break;
+              }
+            for (size_t j = 0; j < PAGE_SIZE; j++)
+              {
+                if (lbuff_[j] != 0xFF)
+                  {
+                    blank = false;
+                    break;
+                  }
+              }
+          }
         return result;
       }
 
       /**
-       * @brief  Map the flash to the addressing space of the controller, starting at
-       * 	address 0x90000000.
-       * @return qspi::ok if successful, false otherwise.
+       * @brief  Erase the sectors of a 64K block that need it, covering them
+       *    with 64K, 32K or 4K erases according to the erase policy.
+       * @param  base: address of the 64K block.
+       * @param  need: bit mask of the sectors (inside the block) to be erased.
+       * @param  allowed: bit mask of the sectors that may be erased, i.e. whose
+       *    content will be rewritten or discarded.
+       * @param  extra: for each sector that does not need an erase, the cost
+       *    (in us) of reprogramming it if it is erased by a block erase.
+       * @param  erased: returns the bit mask of the erased sectors.
+       * @return qspi::ok if successful, or a qspi error otherwise.
        */
       qspi_impl::qspi_result_t
-      qspi_impl::enter_mem_mapped (void)
+      qspi_impl::erase_cover (uint32_t base, uint32_t need, uint32_t allowed,
+                              const uint32_t* extra, uint32_t& erased)
       {
-        qspi_impl::qspi_result_t result = error;
-        QSPI_CommandTypeDef sCommand;
-        QSPI_MemoryMappedTypeDef sMemMappedCfg;
+        qspi_impl::qspi_result_t result = ok;
+        size_t sector_size = pdevice_->sector_size;
+        size_t sectors = BLOCK_64K_SIZE / sector_size;
 
-        if (pdevice_ != nullptr)
+        erased = 0;
+        if (need == 0)
           {
-            sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-            sCommand.AlternateByteMode = pdevice_->alt_bytes_mode;
-            sCommand.AlternateBytesSize = pdevice_->alt_bytes_size;
-            sCommand.AlternateBytes = pdevice_->alt_bytes;
-            sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-            sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-            sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-            sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
-            sCommand.AddressMode = QSPI_ADDRESS_4_LINES;
-            sCommand.DataMode = QSPI_DATA_4_LINES;
-            sCommand.DummyCycles = pdevice_->dummy_cycles
-                - pdevice_->alt_bytes_cycles;
-            sCommand.Instruction = FAST_READ_QUAD_IN_OUT;
-
-            sMemMappedCfg.TimeOutActivation = QSPI_TIMEOUT_COUNTER_DISABLE;
+            return ok;
+          }
 
-            result = (qspi_impl::qspi_result_t) HAL_QSPI_MemoryMapped (
-                hqspi_, &sCommand, &sMemMappedCfg);
+        // try a 64K erase first, then a 32K erase for each half
+        if (use_block_erase (need, allowed, extra, 0, sectors,
+                             expected_us_[op_block64_erase]))
+          {
+            result = erase (base, BLOCK_64K_ERASE);
+            erased = (1 << sectors) - 1;
+          }
+        else if (sectors >= 2)
+          {
+            size_t half = sectors / 2;
+            for (size_t first = 0; first < sectors && result == ok;
+                first += half)
+              {
+                if (use_block_erase (need, allowed, extra, first, half,
+                                     expected_us_[op_block32_erase]))
+                  {
+                    result = erase (base + first * sector_size,
+                                    BLOCK_32K_ERASE);
+                    erased |= ((1 << half) - 1) << first;
+                  }
+              }
+          }
+
+        // erase the remaining sectors one by one
+        for (size_t i = 0; i < sectors && result == ok; i++)
+          {
+            if ((need & ~erased) & (1 << i))
+              {
+                result = erase (base + i * sector_size, SECTOR_ERASE);
+                erased |= (1 << i);
+              }
           }
         return result;
       }
 
       /**
-       * @brief  Read a block of data from the flash.
-       * @param  address: start address in flash where to read from.
-       * @param  buff: buffer where to copy data to.
-       * @param  count: amount of data to be retrieved from flash.
-       * @return qspi::ok if successful, a qspi error otherwise.
+       * @brief  Decide if a group of sectors should be erased with a single
+       *    block erase, according to the erase policy.
+       * @param  need: bit mask of the sectors to be erased.
+       * @param  allowed: bit mask of the sectors that may be erased.
+       * @param  extra: reprogramming cost of each sector, if erased without need.
+       * @param  first: first sector of the block.
+       * @param  count: number of sectors in the block.
+       * @param  block_cost: expected duration of the block erase, in us.
+       * @return true if the block erase should be used.
        */
-      qspi_impl::qspi_result_t
-      qspi_impl::read (uint32_t address, uint8_t* buff, size_t count)
+      bool
+      qspi_impl::use_block_erase (uint32_t need, uint32_t allowed,
+                                  const uint32_t* extra, size_t first,
+                                  size_t count, uint32_t block_cost)
       {
-        qspi_impl::qspi_result_t result = error;
-        QSPI_CommandTypeDef sCommand;
+        uint32_t mask = ((1 << count) - 1) << first;
+        uint32_t sectors_cost = 0;
 
-        if (pdevice_ != nullptr)
+        if ((need & mask) == 0 || (allowed & mask) != mask)
           {
-            // Read command settings
-            sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-            sCommand.AlternateByteMode = pdevice_->alt_bytes_mode;
-            sCommand.AlternateBytesSize = pdevice_->alt_bytes_size;
-            sCommand.AlternateBytes = pdevice_->alt_bytes;
-            sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-            sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-            sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-            sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
-            sCommand.AddressMode = QSPI_ADDRESS_4_LINES;
-            sCommand.DataMode = QSPI_DATA_4_LINES;
-            sCommand.DummyCycles = pdevice_->dummy_cycles
-                - pdevice_->alt_bytes_cycles;
-            sCommand.Address = address;
-            sCommand.NbData = count;
-            sCommand.Instruction = FAST_READ_QUAD_IN_OUT;
+            return false;
+          }
+        if (erase_policy_ == erase_min_wear)
+          {
+            return (need & mask) == mask;
+          }
 
-            // Initiate read, then wait for the event
-            result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, //
-                &sCommand, TIMEOUT);
-            if (result != ok)
+        // erase_max_speed: compare the estimated durations
+        for (size_t i = first; i < first + count; i++)
+          {
+            if (need & (1 << i))
               {
-                /**
-                 * This is a workaround for the QSPI peripheral bug described in
-                 * the ST document ES0290 Rev 7, section 2.4.1.
-                 * Abort the QSPI operation, then retry
-                 */
-                hqspi_->Instance->CR |= QUADSPI_CR_ABORT;
-                hqspi_->State = HAL_QSPI_STATE_READY;
-                result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, //
-                    &sCommand, TIMEOUT);
+                sectors_cost += expected_us_[op_sector_erase];
               }
-            if (result == ok)
+            else
               {
-                /**
-                 * Flush and clean the data cache to mitigate incoherence before
-                 * a DMA transfer (DTCM RAM is not cached)
-                 */
-                if ((buff + count) >= (uint8_t*) SRAM1_BASE)
-                  {
-                    invalidate_dcache (buff, count);
-                  }
-                result = (qspi_impl::qspi_result_t) HAL_QSPI_Receive_DMA (
-                    hqspi_, buff);
-                if (result == ok)
-                  {
-                    result =
-                        (semaphore_.timed_wait (TIMEOUT) == rtos::result::ok) ?
-                            ok : timeout;
-                  }
+                block_cost += extra[i];
               }
           }
-        return result;
+        return block_cost <= sectors_cost;
       }
 
       /**
-       * @brief  Write data to flash.
-       * @param  address: start address in flash where to write data to.
-       * @param  buff: source data to be written.
-       * @param  count: amount of data to be written.
-       * @return qspi::ok if successful, a qspi error otherwise.
+       * @brief  Update the content of the sectors of a 64K block with the least
+       *    flash operations. Each page of each sector is first classified as
+       *    unchanged, program-only (only 1 to 0 bit transitions,
+       *    (old & new) == new), needing an erase, or blank (all 0xFF). Then the
+       *    sectors that need it are erased (see erase_cover()), the changed
+       *    pages of the sectors not erased are programmed, and only the
+       *    non-blank pages of the erased sectors are programmed.
+       * @param  address: address in flash, at a sector boundary.
+       * @param  buff: new content.
+       * @param  count: number of bytes, whole sectors inside a 64K block.
+       * @param  must_erase: true if the sectors are already known to need an
+       *    erase; their old content is not read back.
+       * @return qspi::ok if successful, or a qspi error otherwise.
        */
       qspi_impl::qspi_result_t
-      qspi_impl::write (uint32_t address, uint8_t* buff, size_t count)
+      qspi_impl::update_block (uint32_t address, const uint8_t* buff,
+                               size_t count, bool must_erase)
       {
-        qspi_impl::qspi_result_t result = error;
-        size_t in_block_count;
-
-        if (pdevice_ != nullptr)
+        qspi_impl::qspi_result_t result = ok;
+        size_t sector_size = pdevice_->sector_size;
+        size_t pages = sector_size / PAGE_SIZE;
+        uint32_t base = address & ~(BLOCK_64K_SIZE - 1);
+        size_t first = (address - base) / sector_size;
+        size_t last = first + count / sector_size;
+        uint32_t changed[BLOCK_64K_SIZE / MIN_SECTOR_SIZE];
+        uint32_t non_blank[BLOCK_64K_SIZE / MIN_SECTOR_SIZE];
+        uint32_t extra[BLOCK_64K_SIZE / MIN_SECTOR_SIZE] =
+          { };
+        uint32_t need = 0;
+        uint32_t allowed = 0;
+        uint32_t erased;
+
+        // classify the pages of each sector
+        for (size_t i = first; i < last; i++)
           {
-            do
+            const uint8_t* pn = buff + (i - first) * sector_size;
+
+            if (classify_sector (base + i * sector_size, pn, sector_size,
+                                 must_erase, changed[i], non_blank[i]))
               {
-                in_block_count = 0x100 - (address & 0xFF);
-                if (in_block_count > count)
-                  {
-                    in_block_count = count;
-                  }
-                else if (in_block_count == 0)
+                need |= (1 << i);
+              }
+            allowed |= (1 << i);
+
+            // an erase without need implies reprogramming the unchanged pages
+            for (size_t j = 0; j < pages; j++)
+              {
+                if ((non_blank[i] & ~changed[i]) & (1 << j))
                   {
-                    in_block_count = (count > 0x100) ? 0x100 : count;
+                    extra[i] += expected_us_[op_program];
                   }
-                if ((result = page_write (address, buff, in_block_count)) != ok)
+              }
+          }
+
+        // the sectors are rewritten, no need to erase them in the background
+        pre_erase_cancel (address, count);
+
+        // erase, then program; the readers must not see the block meanwhile
+        flux_address_ = base;
+        flux_count_ = BLOCK_64K_SIZE;
+        result = erase_cover (base, need, allowed, extra, erased);
+        for (size_t i = first; i < last && result == ok; i++)
+          {
+            uint32_t to_program =
+                (erased & (1 << i)) ? non_blank[i] : changed[i];
+            const uint8_t* pn = buff + (i - first) * sector_size;
+
+            for (size_t j = 0; j < pages && result == ok; j++)
+              {
+                if (to_program & (1 << j))
                   {
-                    break;
+                    result = program_page (
+                        base + i * sector_size + j * PAGE_SIZE,
+                        pn + j * PAGE_SIZE, PAGE_SIZE);
                   }
-                address += in_block_count;
-                buff += in_block_count;
-                count -= in_block_count;
               }
-            while (count > 0);
           }
-        return result;
+
+        // the pages are programmed back to back, wait for the last one
+        qspi_impl::qspi_result_t pending = program_wait ();
+        flux_count_ = 0;
+        return (result == ok) ? pending : result;
       }
 
       /**
-       * @brief  Write a page of data to the flash (max. 256 bytes).
-       * @param  address: address of the page in flash.
-       * @param  buff: buffer of the source data.
-       * @param  count: number of bytes to be written (max 256).
-       * @return qspi::ok if successful, a qspi error otherwise.
+       * @brief  Write a part of a sector. If only 1 to 0 bit transitions are
+       *    needed, the changed pages of the part are programmed and nothing
+       *    else is transferred; otherwise the rest of the sector is read into
+       *    the sector buffer and the whole sector is rewritten.
+       * @param  address: start address, in the sector.
+       * @param  buff: new content of the part.
+       * @param  count: number of bytes, a multiple of the page size, not
+       *    beyond the end of the sector.
+       * @return qspi::ok if successful, or a qspi error otherwise.
        */
       qspi_impl::qspi_result_t
-      qspi_impl::page_write (uint32_t address, uint8_t* buff, size_t count)
+      qspi_impl::update_partial (uint32_t address, const uint8_t* buff,
+                                 size_t count)
       {
-        qspi_impl::qspi_result_t result = error;
-        QSPI_CommandTypeDef sCommand;
-        QSPI_AutoPollingTypeDef sConfig;
-
-        // Initial command settings
-        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
-        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-        sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
-        sCommand.AddressMode = QSPI_ADDRESS_NONE;
-        sCommand.DataMode = QSPI_DATA_NONE;
-        sCommand.DummyCycles = 0;
+        qspi_impl::qspi_result_t result = ok;
+        size_t sector_size = pdevice_->sector_size;
+        uint32_t sector = address & ~(sector_size - 1);
+        uint32_t changed;
+        uint32_t non_blank;
 
-        // Enable write
-        sCommand.Instruction = WRITE_ENABLE;
-        result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, &sCommand,
-                                                              TIMEOUT);
-        if (result == ok)
+        if (classify_sector (address, buff, count, false, changed, non_blank))
           {
-            // Initiate write
-            sCommand.Instruction = PAGE_PROGRAM;
-            sCommand.AddressMode = QSPI_ADDRESS_4_LINES;
-            sCommand.DataMode = QSPI_DATA_4_LINES;
-            sCommand.Address = address;
-            sCommand.NbData = count;
-            result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, //
-                &sCommand, TIMEOUT);
+            // the erase need is known, the rest of the sector is read once
+            result = read_flash (sector, sector_buff_, sector_size);
             if (result == ok)
               {
-                /**
-                 *  Clean the data cache to mitigate incoherence before DMA transfers
-                 *  (DTCM RAM is not cached)
-                 */
-                if ((buff + count) >= (uint8_t*) SRAM1_BASE)
-                  {
-                    clean_dcache (buff, count);
-                  }
-                result = (qspi_impl::qspi_result_t) HAL_QSPI_Transmit_DMA (
-                    hqspi_, buff);
-                if (result == ok)
-                  {
-                    if (semaphore_.timed_wait (TIMEOUT) == rtos::result::ok)
-                      {
-                        // Set auto-polling and wait for the event
-                        sCommand.AddressMode = QSPI_ADDRESS_NONE;
-                        sCommand.DataMode = QSPI_DATA_4_LINES;
-                        sCommand.Instruction = READ_STATUS_REGISTER;
-                        sConfig.Match = 0;
-                        sConfig.Mask = 1;
-                        sConfig.MatchMode = QSPI_MATCH_MODE_AND;
-                        sConfig.StatusBytesSize = 1;
-                        sConfig.Interval = 0x10;
-                        sConfig.AutomaticStop = QSPI_AUTOMATIC_STOP_ENABLE;
-                        result =
-                            (qspi_impl::qspi_result_t) HAL_QSPI_AutoPolling_IT (
-                                hqspi_, &sCommand, &sConfig);
-                        if (result == ok)
-                          {
-                            result =
-                                (semaphore_.timed_wait (WRITE_TIMEOUT)
-                                    == rtos::result::ok) ? ok : timeout;
-                          }
-                      }
-                    else
-                      {
-                        result = timeout;
-                      }
-                  }
+                memcpy (sector_buff_ + (address - sector), buff, count);
+                result = update_block (sector, sector_buff_, sector_size,
+                                       true);
               }
+            return result;
           }
-        return result;
+
+        pre_erase_cancel (address, count);
+        flux_address_ = address;
+        flux_count_ = count;
+        for (size_t j = 0; j < count / PAGE_SIZE && result == ok; j++)
+          {
+            if (changed & (1 << j))
+              {
+                result = program_page (address + j * PAGE_SIZE,
+                                       buff + j * PAGE_SIZE, PAGE_SIZE);
+              }
+          }
+        qspi_impl::qspi_result_t pending = program_wait ();
+        flux_count_ = 0;
+        return (result == ok) ? pending : result;
       }
 
       /**
-       * @brief  Erase a sector (4K), block (32K), large block (64K) or whole flash.
-       * @param  address: address of the block to be erased.
-       * @param  which: command to erase, can be either SECTOR_ERASE, BLOCK_32K_ERASE,
-       * 	BLOCK_64K_ERASE or CHIP_ERASE.
-       * @return qspi::ok if successful, or a qspi error otherwise.
+       * @brief  Compare the new content of a sector (or of a part of it) with
+       *    the flash content.
+       * @param  address: address of the sector (or of the part) in flash.
+       * @param  buff: new content of the sector.
+       * @param  count: number of bytes, a multiple of the page size.
+       * @param  must_erase: true if the sector is already known to need an
+       *    erase; the flash is not read, only the non-blank pages are
+       *    returned.
+       * @param  changed: returns the bit mask of the changed pages.
+       * @param  non_blank: returns the bit mask of the pages that are not all
+       *    0xFF in the new content.
+       * @return true if the sector must be erased, false otherwise. A read error
+       *    is reported as an erase need, as the old content is unknown.
        */
-      qspi_impl::qspi_result_t
-      qspi_impl::erase (uint32_t address, uint8_t which)
+      bool
+      qspi_impl::classify_sector (uint32_t address, const uint8_t* buff,
+                                  size_t count, bool must_erase,
+                                  uint32_t& changed, uint32_t& non_blank)
       {
-        qspi_impl::qspi_result_t result = error;
-        QSPI_CommandTypeDef sCommand;
-        QSPI_AutoPollingTypeDef sConfig;
+        size_t pages = count / PAGE_SIZE;
+        bool to_erase = must_erase;
 
-        if (pdevice_ != nullptr)
+        changed = 0;
+        non_blank = 0;
+        for (size_t i = 0; i < pages; i++)
           {
-            // Initial command settings
-            sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-            sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
-            sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-            sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-            sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-            sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
-            sCommand.AddressMode = QSPI_ADDRESS_NONE;
-            sCommand.DataMode = QSPI_DATA_NONE;
-            sCommand.DummyCycles = 0;
+            const uint8_t* pn = buff + i * PAGE_SIZE;
 
-            // Enable write
-            sCommand.Instruction = WRITE_ENABLE;
-            result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, //
-                &sCommand, TIMEOUT);
-            if (result == ok)
+            for (size_t j = 0; j < PAGE_SIZE; j++)
               {
-                // Initiate erase
-                sCommand.Instruction = which;
-                sCommand.AddressMode =
-                    (which == CHIP_ERASE) ? QSPI_ADDRESS_NONE : //
-                        QSPI_ADDRESS_4_LINES;
-                sCommand.DataMode = QSPI_DATA_NONE;
-                sCommand.Address = address;
-                result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, //
-                    &sCommand, TIMEOUT);
-                if (result == ok)
+                if (pn[j] != 0xFF)
                   {
-                    // Set auto-polling and wait for the event
-                    sCommand.Instruction = READ_STATUS_REGISTER;
-                    sCommand.AddressMode = QSPI_ADDRESS_NONE;
-                    sCommand.DataMode = QSPI_DATA_4_LINES;
-                    sConfig.Match = 0;
-                    sConfig.Mask = 1;
-                    sConfig.MatchMode = QSPI_MATCH_MODE_AND;
-                    sConfig.StatusBytesSize = 1;
-                    sConfig.Interval = 0x10;
-                    sConfig.AutomaticStop = QSPI_AUTOMATIC_STOP_ENABLE;
-                    result =
-                        (qspi_impl::qspi_result_t) HAL_QSPI_AutoPolling_IT (
-                            hqspi_, &sCommand, &sConfig);
-                    if (result == ok)
+                    non_blank |= (1 << i);
+                    break;
+                  }
+              }
+
+            // a page known to be blank is not read back; once an erase is
+            // needed, the old content does not matter
+            if (blank_test (address + i * PAGE_SIZE, PAGE_SIZE))
+              {
+                changed |= (non_blank & (1 << i));
+              }
+            else if (to_erase == false)
+              {
+                if (read_flash (address + i * PAGE_SIZE, lbuff_, PAGE_SIZE)
+                    != ok)
+                  {
+                    to_erase = true;
+                    continue;
+                  }
+                for (size_t j = 0; j < PAGE_SIZE; j++)
+                  {
+                    if (pn[j] != lbuff_[j])
                       {
-                        result =
-                            (semaphore_.timed_wait (
-                                (which == CHIP_ERASE) ? CHIP_ERASE_TIMEOUT : //
-                                    ERASE_TIMEOUT) == rtos::result::ok) ?
-                                ok : timeout;
+                        changed |= (1 << i);
+                        if ((lbuff_[j] & pn[j]) != pn[j])
+                          {
+                            to_erase = true;
+                            break;
+                          }
                       }
                   }
               }
           }
-        return result;
+        return to_erase;
       }
 
       /**
@@ -772,7 +2366,37 @@ namespace os
       qspi_impl::qspi_result_t
       qspi_impl::erase_sector (uint32_t sector)
       {
-        return erase (sector * pdevice_->sector_size, SECTOR_ERASE);
+        return erase_area (sector * pdevice_->sector_size, SECTOR_ERASE);
+      }
+
+      /**
+       * @brief  Erase a sector, block or the whole flash for the low-level
+       *    API, locked like a block device write.
+       * @param  address: address in the erase unit.
+       * @param  which: erase command (see erase()).
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::erase_area (uint32_t address, uint8_t which)
+      {
+        qspi_impl::qspi_result_t result = error;
+        size_t size;
+
+        if (pdevice_ != nullptr)
+          {
+            size =
+                (which == SECTOR_ERASE) ? pdevice_->sector_size :
+                (which == BLOCK_32K_ERASE) ? 0x8000 :
+                (which == BLOCK_64K_ERASE) ? 0x10000 :
+                    get_sector_count () * pdevice_->sector_size;
+            address = (which == CHIP_ERASE) ? 0 : address & ~(size - 1);
+            if ((result = lock_area (address, size, true)) == ok)
+              {
+                result = erase (address, which);
+              }
+            unlock_area ();
+          }
+        return result;
       }
 
       /**
@@ -783,29 +2407,19 @@ namespace os
       qspi_impl::reset_chip (void)
       {
         qspi_impl::qspi_result_t result = busy;
-        QSPI_CommandTypeDef sCommand;
-
-        // Initial command settings
-        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
-        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-        sCommand.InstructionMode = QSPI_INSTRUCTION_4_LINES;
-        sCommand.AddressMode = QSPI_ADDRESS_NONE;
-        sCommand.DataMode = QSPI_DATA_NONE;
-        sCommand.DummyCycles = 0;
 
         // Enable reset
-        sCommand.Instruction = RESET_ENABLE;
-        result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, &sCommand,
-                                                              TIMEOUT);
+        result = indirect_mode ();
+        if (result == ok)
+          {
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (
+                hqspi_, &cmds_.reset_enable, TIMEOUT);
+          }
         if (result == ok)
           {
             // Send reset command
-            sCommand.Instruction = RESET_DEVICE;
-            result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, //
-                &sCommand, TIMEOUT);
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (
+                hqspi_, &cmds_.reset_device, TIMEOUT);
           }
         return result;
       }
@@ -855,7 +2469,16 @@ namespace os
       void
       qspi_impl::cb_event (void)
       {
-        semaphore_.post ();
+        if (erase_polling_)
+          {
+            // end of an erase a writer waits for, with the controller released
+            erase_polling_ = false;
+            erase_sem_.post ();
+          }
+        else
+          {
+            semaphore_.post ();
+          }
       }
 
     } /* namespace stm32f7 */
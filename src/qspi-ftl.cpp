@@ -0,0 +1,1121 @@
+/*
+ * qspi-ftl.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file implements the log-structured flash translation layer. The chip
+ * is divided into 64K units; the first units hold two checkpoint areas,
+ * written alternately, the others hold the data. A data unit starts with a
+ * header (magic, activation sequence, erase count) followed by the summary:
+ * one 32-bit entry per slot, recording the logical block written in it. The
+ * blocks are appended to the active unit, the data first, then the summary
+ * entry, so that an interrupted write leaves the previous copy in effect.
+ */
+
+#include <new>
+#include <string.h>
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/diag/trace.h>
+#include "qspi-ftl.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      /**
+       * @brief Constructor.
+       * @param flash: the flash driver; its block device must not be opened
+       *    while the translation layer is.
+       * @param block_size: logical block size, a power of 2 between 512 and
+       *    4096 bytes. The flash must be reformatted if it is changed.
+       */
+      qspi_ftl::qspi_ftl (qspi_impl& flash, size_t block_size) :
+          flash_ (flash), //
+          block_size_ (block_size)
+      {
+        trace::printf ("%s(%p) @%p\n", __func__, &flash, this);
+      }
+
+      qspi_ftl::~qspi_ftl ()
+      {
+        trace::printf ("%s(%p) @%p\n", __func__, this);
+      }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+      //----------------- POSIX interface ------------------------------
+
+      /**
+       * @brief Check if the device is opened
+       * @return Returns true if the device is already opened, false otherwise
+       */
+      bool
+      qspi_ftl::do_is_opened (void)
+      {
+        return is_opened_;
+      }
+
+      /**
+       * @brief Open the block device: initialize the flash and rebuild the
+       *    mapping table. A blank (or foreign) flash is formatted on the fly.
+       * @param path: path to the device.
+       * @param oflag: flags.
+       * @param args: arguments list.
+       * @return 0 if the device was successfully opened, -1 otherwise.
+       */
+      int
+      qspi_ftl::do_vopen (const char* path, int oflag, std::va_list args)
+      {
+        if (is_opened_)
+          {
+            errno = EEXIST; // already opened
+            return -1;
+          }
+
+        if (block_size_ < 512 || block_size_ > 4096
+            || (block_size_ & (block_size_ - 1)) != 0)
+          {
+            errno = EINVAL;
+            return -1;
+          }
+
+        if (flash_.initialize () != qspi_impl::ok)
+          {
+            errno = EIO;
+            return -1;
+          }
+
+        if (mount () != qspi_impl::ok)
+          {
+            unmount ();
+            flash_.uninitialize ();
+            errno = EIO;
+            return -1;
+          }
+        block_logical_size_bytes_ = block_size_;
+        block_physical_size_bytes_ = block_size_;
+
+        if (background_gc_)
+          {
+            rtos::thread::attributes attr;
+            attr.th_priority = rtos::thread::priority::low;
+            collector_stop_ = false;
+            collector_ = new (std::nothrow) rtos::thread
+              { "qspi-gc", collector, this, attr };
+          }
+
+        is_opened_ = true;
+        return 0;
+      }
+
+      /**
+       * @brief Read a block of data.
+       * @param buf: buffer where the data will be returned.
+       * @param blknum: the block number.
+       * @param nblocks: number of blocks to read.
+       * @return Number of blocks read.
+       */
+      ssize_t
+      qspi_ftl::do_read_block (void* buf, blknum_t blknum, std::size_t nblocks)
+      {
+        uint8_t* p = (uint8_t*) buf;
+        size_t run;
+
+        if (blknum + nblocks > num_blocks_)
+          {
+            errno = EINVAL;
+            return -1;
+          }
+
+        mx_.lock ();
+        for (size_t i = 0; i < nblocks; i += run)
+          {
+            uint16_t slot = map_[blknum + i];
+
+            run = 1;
+            if (slot == NO_SLOT)
+              {
+                // never written or discarded
+                memset (p, 0xFF, block_size_);
+              }
+            else
+              {
+                // blocks written one after the other are read at once
+                while (i + run < nblocks && map_[blknum + i + run] == slot + run
+                    && (slot + run) % slots_ != 0)
+                  {
+                    run++;
+                  }
+                if (flash_.read (
+                    unit_address (slot / slots_) + (slot % slots_) * block_size_,
+                    p, run * block_size_) != qspi_impl::ok)
+                  {
+                    nblocks = 0;
+                    break;
+                  }
+              }
+            p += run * block_size_;
+          }
+        mx_.unlock ();
+        return nblocks;
+      }
+
+      /**
+       * @brief Write data to the block device. Each block is appended to the
+       *    active unit; the data is on flash when the call returns.
+       * @param buf: buffer with the data to be written.
+       * @param blknum: the block number.
+       * @param nblocks: number of blocks to be written.
+       * @return Number of blocks written.
+       */
+      ssize_t
+      qspi_ftl::do_write_block (const void* buf, blknum_t blknum,
+                                std::size_t nblocks)
+      {
+        const uint8_t* p = (const uint8_t*) buf;
+
+        if (blknum + nblocks > num_blocks_)
+          {
+            errno = EINVAL;
+            return -1;
+          }
+
+        mx_.lock ();
+        for (size_t i = 0; i < nblocks; i++)
+          {
+            if (write_one (blknum + i, p, false) != qspi_impl::ok)
+              {
+                nblocks = 0;
+                break;
+              }
+            stats_.writes++;
+            p += block_size_;
+          }
+        if (since_cp_ >= CHECKPOINT_INTERVAL)
+          {
+            checkpoint ();
+          }
+        mx_.unlock ();
+        return nblocks;
+      }
+
+      /**
+       * @brief Control the device parameters.
+       * @param request: command to the device (qspi_impl::ioctl_discard).
+       * @param args: command's parameter(s).
+       * @return 0 if successfull, -1 otherwise.
+       */
+      int
+      qspi_ftl::do_vioctl (int request, std::va_list args)
+      {
+        int result = 0;
+        blknum_t blknum;
+        size_t nblocks;
+
+        mx_.lock ();
+        switch (request)
+          {
+          case qspi_impl::ioctl_discard:
+            // the discarded blocks are dropped from the map; the space is
+            // reclaimed by the garbage collector
+            blknum = va_arg (args, blknum_t);
+            nblocks = va_arg (args, size_t);
+            if (blknum + nblocks > num_blocks_)
+              {
+                errno = EINVAL;
+                result = -1;
+                break;
+              }
+            for (size_t i = 0; i < nblocks; i++)
+              {
+                unmap (blknum + i);
+              }
+            trimmed_ = true;
+            break;
+
+          default:
+            errno = ENOTTY;
+            result = -1;
+            break;
+          }
+        mx_.unlock ();
+        return result;
+      }
+
+      /**
+       * @brief Synch (flush) the data to the device. The written blocks are
+       *    already on flash; only the discards need a checkpoint to persist.
+       */
+      void
+      qspi_ftl::do_sync (void)
+      {
+        mx_.lock ();
+        if (trimmed_)
+          {
+            checkpoint ();
+          }
+        mx_.unlock ();
+      }
+
+      /**
+       * @brief Close the block device, writing a checkpoint if needed.
+       * @return 0 if successfull, -1 otherwise.
+       */
+      int
+      qspi_ftl::do_close (void)
+      {
+        qspi_impl::qspi_result_t result = qspi_impl::ok;
+
+        if (collector_ != nullptr)
+          {
+            collector_stop_ = true;
+            gc_sem_.post ();
+            collector_->join ();
+            delete collector_;
+            collector_ = nullptr;
+          }
+
+        mx_.lock ();
+        if (since_cp_ > 0 || trimmed_ || cp_counter_ == 0)
+          {
+            result = checkpoint ();
+          }
+        unmount ();
+        mx_.unlock ();
+        if (flash_.uninitialize () != qspi_impl::ok
+            || result != qspi_impl::ok)
+          {
+            errno = EIO;
+            return -1;
+          }
+
+        is_opened_ = false;
+        return 0;
+      }
+
+#pragma GCC diagnostic pop
+
+      //------------- End of POSIX interface ---------------------------
+
+      /**
+       * @brief  Enable or disable the background garbage collector (enabled
+       *    by default), applied at the next open. When disabled, the units
+       *    are reclaimed by the writers, when no erased unit is left.
+       * @param  state: true to collect in a low priority thread.
+       */
+      void
+      qspi_ftl::set_background_gc (bool state)
+      {
+        background_gc_ = state;
+      }
+
+      /**
+       * @brief  Return the translation layer statistics.
+       * @return The counters and the current spread of the erase counts.
+       */
+      qspi_ftl::ftl_stats_t
+      qspi_ftl::get_stats (void)
+      {
+        ftl_stats_t stats;
+
+        mx_.lock ();
+        stats = stats_;
+        stats.min_erase_count = 0xFFFFFFFF;
+        stats.max_erase_count = 0;
+        for (uint16_t u = 0; u < units_count_; u++)
+          {
+            if (units_[u].erase_count < stats.min_erase_count)
+              {
+                stats.min_erase_count = units_[u].erase_count;
+              }
+            if (units_[u].erase_count > stats.max_erase_count)
+              {
+                stats.max_erase_count = units_[u].erase_count;
+              }
+          }
+        stats.free_units = free_units_;
+        mx_.unlock ();
+        return stats;
+      }
+
+      /**
+       * @brief  Compute the geometry, allocate the tables and rebuild the
+       *    mapping table from the last valid checkpoint and the units
+       *    activated since.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::mount (void)
+      {
+        unit_header_t header;
+        size_t total = flash_.get_sector_count () * flash_.get_sector_size ()
+            / UNIT_SIZE;
+        size_t spare;
+        uint32_t cp_sequence = 0;
+        uint16_t cp_used = 0;
+        uint32_t max_sequence = 0;
+
+        // geometry: the checkpoint holds the erase counts and the map
+        slots_ = UNIT_SIZE / block_size_;
+        reserved_ = (HEADER_SIZE + slots_ * sizeof(uint32_t) + block_size_ - 1)
+            / block_size_;
+        cp_units_ = (CP_PAYLOAD + total * sizeof(uint32_t)
+            + total * (slots_ - reserved_) * sizeof(uint16_t) + UNIT_SIZE - 1)
+            / UNIT_SIZE;
+        if (total <= 2 * cp_units_)
+          {
+            return qspi_impl::error;
+          }
+        units_count_ = total - 2 * cp_units_;
+        spare = units_count_ / 8;
+        spare = (spare < MIN_SPARE_UNITS) ? MIN_SPARE_UNITS : spare;
+        if (units_count_ <= spare + GC_RESERVE
+            || (size_t) units_count_ * slots_ >= NO_SLOT)
+          {
+            return qspi_impl::error;
+          }
+        num_blocks_ = (units_count_ - spare) * (slots_ - reserved_);
+        gc_target_ = GC_RESERVE + spare / 2;
+
+        map_ = new (std::nothrow) uint16_t[num_blocks_];
+        units_ = new (std::nothrow) unit_t[units_count_];
+        buffer_ = new (std::nothrow) uint8_t[block_size_];
+        entries_ = new (std::nothrow) uint32_t[slots_];
+        if (map_ == nullptr || units_ == nullptr || buffer_ == nullptr
+            || entries_ == nullptr)
+          {
+            return qspi_impl::error;
+          }
+
+        // read the unit headers
+        for (uint16_t u = 0; u < units_count_; u++)
+          {
+            unit_t* pu = &units_[u];
+
+            pu->erase_count = 0;
+            pu->sequence = 0;
+            pu->valid = 0;
+            pu->used = 0;
+            pu->state = unit_unknown;
+            if (flash_.read (unit_address (u), (uint8_t*) &header,
+                             sizeof(header)) != qspi_impl::ok)
+              {
+                return qspi_impl::error;
+              }
+            if (header.magic == UNIT_MAGIC
+                && header.check
+                    == (header.magic ^ header.sequence ^ header.erase_count
+                        ^ header.block_size))
+              {
+                if (header.block_size != block_size_)
+                  {
+                    // formatted with another block size
+                    return qspi_impl::error;
+                  }
+                pu->erase_count = header.erase_count;
+                pu->sequence = header.sequence;
+                pu->used = slots_;
+                pu->state = unit_full;
+                if (header.sequence > max_sequence)
+                  {
+                    max_sequence = header.sequence;
+                  }
+              }
+          }
+
+        if (load_checkpoint (cp_sequence, cp_used) == false)
+          {
+            // no checkpoint, replay all the units
+            for (size_t i = 0; i < num_blocks_; i++)
+              {
+                map_[i] = NO_SLOT;
+              }
+            cp_sequence = 1;
+            cp_used = reserved_;
+          }
+
+        // replay the units activated since the checkpoint, in order
+        active_ = NO_UNIT;
+        for (uint32_t next = cp_sequence;;)
+          {
+            uint16_t unit = NO_UNIT;
+
+            for (uint16_t u = 0; u < units_count_; u++)
+              {
+                if (units_[u].state == unit_full && units_[u].sequence >= next
+                    && (unit == NO_UNIT
+                        || units_[u].sequence < units_[unit].sequence))
+                  {
+                    unit = u;
+                  }
+              }
+            if (unit == NO_UNIT)
+              {
+                break;
+              }
+            // the checkpoint already has the first blocks of the unit that
+            // was active then, possibly discarded since
+            replay_unit (unit,
+                         (units_[unit].sequence == cp_sequence) ?
+                             cp_used : reserved_,
+                         units_[unit].sequence == max_sequence);
+            next = units_[unit].sequence + 1;
+          }
+        sequence_ = (max_sequence > cp_sequence) ? max_sequence : cp_sequence;
+
+        // drop the blocks of the units erased since the checkpoint, count the
+        // valid slots
+        free_units_ = 0;
+        for (size_t i = 0; i < num_blocks_; i++)
+          {
+            if (map_[i] != NO_SLOT)
+              {
+                if (map_[i] >= units_count_ * slots_
+                    || units_[map_[i] / slots_].state == unit_unknown)
+                  {
+                    map_[i] = NO_SLOT;
+                  }
+                else
+                  {
+                    units_[map_[i] / slots_].valid++;
+                  }
+              }
+          }
+        for (uint16_t u = 0; u < units_count_; u++)
+          {
+            if (units_[u].state == unit_unknown)
+              {
+                free_units_++;
+              }
+          }
+        since_cp_ = 0;
+        trimmed_ = false;
+        return qspi_impl::ok;
+      }
+
+      /**
+       * @brief  Load the most recent valid checkpoint: the erase counts (the
+       *    highest of the checkpoint and of the unit header is kept) and the
+       *    mapping table.
+       * @param  sequence: returns the unit sequence at the checkpoint time.
+       * @param  used: returns the slots of that unit already in the map.
+       * @return true if a valid checkpoint was found.
+       */
+      bool
+      qspi_ftl::load_checkpoint (uint32_t& sequence, uint16_t& used)
+      {
+        checkpoint_header_t header[2];
+        bool valid[2];
+
+        for (int a = 0; a < 2; a++)
+          {
+            checkpoint_header_t* ph = &header[a];
+
+            valid[a] = flash_.read (a * cp_units_ * UNIT_SIZE, (uint8_t*) ph,
+                                    sizeof(*ph)) == qspi_impl::ok
+                && ph->magic == CHECKPOINT_MAGIC
+                && ph->check
+                    == (ph->magic ^ ph->counter ^ ph->sequence ^ ph->used
+                        ^ ph->block_size ^ ph->blocks ^ ph->crc)
+                && ph->block_size == block_size_ && ph->blocks == num_blocks_;
+          }
+
+        // try the most recent one first
+        int first = (valid[1] && (!valid[0] || header[1].counter > header[0].counter)) ?
+            1 : 0;
+        for (int n = 0; n < 2; n++)
+          {
+            int a = (first + n) % 2;
+            uint32_t base = a * cp_units_ * UNIT_SIZE + CP_PAYLOAD;
+            size_t counts = units_count_ * sizeof(uint32_t);
+            uint32_t crc = 0;
+
+            if (valid[a] == false)
+              {
+                continue;
+              }
+
+            // check the payload, then load it
+            for (size_t offset = 0; offset < counts; offset += block_size_)
+              {
+                size_t size =
+                    (counts - offset > block_size_) ?
+                        block_size_ : counts - offset;
+                if (flash_.read (base + offset, buffer_, size)
+                    != qspi_impl::ok)
+                  {
+                    return false;
+                  }
+                crc = crc32 (crc, buffer_, size);
+              }
+            if (flash_.read (base + counts, (uint8_t*) map_,
+                             num_blocks_ * sizeof(uint16_t)) != qspi_impl::ok)
+              {
+                return false;
+              }
+            crc = crc32 (crc, (uint8_t*) map_, num_blocks_ * sizeof(uint16_t));
+            if (crc != header[a].crc)
+              {
+                continue;
+              }
+
+            for (uint16_t u = 0; u < units_count_;
+                u += block_size_ / sizeof(uint32_t))
+              {
+                size_t size = (units_count_ - u) * sizeof(uint32_t);
+                size = (size > block_size_) ? block_size_ : size;
+                if (flash_.read (base + u * sizeof(uint32_t), buffer_, size)
+                    != qspi_impl::ok)
+                  {
+                    return false;
+                  }
+                for (size_t i = 0; i < size / sizeof(uint32_t); i++)
+                  {
+                    uint32_t count = ((uint32_t*) buffer_)[i];
+                    if (count > units_[u + i].erase_count)
+                      {
+                        units_[u + i].erase_count = count;
+                      }
+                  }
+              }
+            cp_counter_ = header[a].counter;
+            sequence = header[a].sequence;
+            used = header[a].used;
+            return true;
+          }
+        return false;
+      }
+
+      /**
+       * @brief  Apply the summary of a unit to the mapping table. A unit
+       *    activated after the checkpoint may have been erased and rewritten
+       *    since, so the blocks previously mapped to it are dropped first.
+       * @param  unit: unit number.
+       * @param  from: first slot not yet in the map; beyond reserved_ only for
+       *    the unit that was active when the checkpoint was written.
+       * @param  last: true for the most recently activated unit, which may be
+       *    only partially written and becomes the active unit.
+       */
+      void
+      qspi_ftl::replay_unit (uint16_t unit, uint16_t from, bool last)
+      {
+        uint32_t first = unit * slots_;
+        uint16_t used = from;
+
+        for (size_t i = 0; i < num_blocks_ && from == reserved_; i++)
+          {
+            if (map_[i] != NO_SLOT && map_[i] >= first
+                && map_[i] < first + slots_)
+              {
+                map_[i] = NO_SLOT;
+              }
+          }
+
+        if (flash_.read (unit_address (unit) + HEADER_SIZE, (uint8_t*) entries_,
+                         slots_ * sizeof(uint32_t)) != qspi_impl::ok)
+          {
+            return;
+          }
+        for (uint16_t i = from; i < slots_; i++)
+          {
+            uint32_t entry = entries_[i];
+            uint32_t lba = entry & 0xFFFF;
+
+            if (entry == 0xFFFFFFFF)
+              {
+                continue;
+              }
+            // a corrupted entry (interrupted program) is skipped
+            used = i + 1;
+            if ((entry >> 16) == (~lba & 0xFFFF) && lba < num_blocks_)
+              {
+                map_[lba] = first + i;
+              }
+          }
+
+        if (last)
+          {
+            // skip the slots whose write was interrupted before the summary
+            while (used < slots_
+                && is_blank (unit_address (unit) + used * block_size_,
+                             block_size_) == false)
+              {
+                used++;
+              }
+            units_[unit].used = used;
+            if (used < slots_)
+              {
+                units_[unit].state = unit_active;
+                active_ = unit;
+              }
+          }
+      }
+
+      /**
+       * @brief  Release the tables.
+       */
+      void
+      qspi_ftl::unmount (void)
+      {
+        delete[] map_;
+        delete[] units_;
+        delete[] buffer_;
+        delete[] entries_;
+        map_ = nullptr;
+        units_ = nullptr;
+        buffer_ = nullptr;
+        entries_ = nullptr;
+        num_blocks_ = 0;
+        units_count_ = 0;
+      }
+
+      /**
+       * @brief  Append a block to the active unit and map it.
+       * @param  lba: logical block number.
+       * @param  data: block content.
+       * @param  gc: true when called by the garbage collector, which may use
+       *    the reserved erased units.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::write_one (uint32_t lba, const uint8_t* data, bool gc)
+      {
+        qspi_impl::qspi_result_t result = qspi_impl::ok;
+        uint32_t entry = lba | ((~lba & 0xFFFF) << 16);
+
+        if (active_ == NO_UNIT && (result = activate (gc)) != qspi_impl::ok)
+          {
+            return result;
+          }
+
+        unit_t* pu = &units_[active_];
+        uint16_t i = pu->used++;
+
+        // data first, then the summary entry that validates it
+        result = flash_.write (unit_address (active_) + i * block_size_,
+                               (uint8_t*) data, block_size_);
+        if (result == qspi_impl::ok)
+          {
+            result = flash_.write (
+                unit_address (active_) + HEADER_SIZE + i * sizeof(uint32_t),
+                (uint8_t*) &entry, sizeof(entry));
+          }
+        if (result == qspi_impl::ok)
+          {
+            unmap (lba);
+            map_[lba] = active_ * slots_ + i;
+            pu->valid++;
+          }
+        if (pu->used == slots_)
+          {
+            pu->state = unit_full;
+            active_ = NO_UNIT;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Select the erased unit with the lowest erase count (dynamic
+       *    wear leveling) and make it the active unit; the cold blocks moved
+       *    by the static wear leveling get the most erased unit instead. The
+       *    writers first reclaim units if only the reserved ones are left.
+       * @param  gc: true when called by the garbage collector.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::activate (bool gc)
+      {
+        qspi_impl::qspi_result_t result;
+        unit_header_t header;
+        uint16_t unit = NO_UNIT;
+
+        if (gc == false)
+          {
+            while (free_units_ <= GC_RESERVE)
+              {
+                if (gc_step (false) == false)
+                  {
+                    return qspi_impl::error;
+                  }
+              }
+            if (collector_ == nullptr && wear_spread ())
+              {
+                gc_step (true);
+              }
+            if (active_ != NO_UNIT)
+              {
+                // the collector activated a unit that still has room
+                return qspi_impl::ok;
+              }
+          }
+
+        for (uint16_t u = 0; u < units_count_; u++)
+          {
+            if ((units_[u].state == unit_free
+                || units_[u].state == unit_unknown)
+                && (unit == NO_UNIT
+                    || (wear_leveling_ ?
+                        units_[u].erase_count > units_[unit].erase_count :
+                        units_[u].erase_count < units_[unit].erase_count)))
+              {
+                unit = u;
+              }
+          }
+        if (unit == NO_UNIT)
+          {
+            return qspi_impl::error;
+          }
+
+        if (units_[unit].state == unit_unknown
+            && is_blank (unit_address (unit), UNIT_SIZE) == false
+            && (result = erase_unit (unit)) != qspi_impl::ok)
+          {
+            return result;
+          }
+
+        header.magic = UNIT_MAGIC;
+        header.sequence = ++sequence_;
+        header.erase_count = units_[unit].erase_count;
+        header.block_size = block_size_;
+        header.check = header.magic ^ header.sequence ^ header.erase_count
+            ^ header.block_size;
+        result = flash_.write (unit_address (unit), (uint8_t*) &header,
+                               sizeof(header));
+        if (result != qspi_impl::ok)
+          {
+            // the unit content is now unknown
+            units_[unit].state = unit_unknown;
+            return result;
+          }
+
+        units_[unit].sequence = header.sequence;
+        units_[unit].used = reserved_;
+        units_[unit].valid = 0;
+        units_[unit].state = unit_active;
+        active_ = unit;
+        free_units_--;
+        since_cp_++;
+
+        if (collector_ != nullptr && free_units_ < gc_target_)
+          {
+            gc_sem_.post ();
+          }
+        return qspi_impl::ok;
+      }
+
+      /**
+       * @brief  Erase a unit and count the erase.
+       * @param  unit: unit number.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::erase_unit (uint16_t unit)
+      {
+        qspi_impl::qspi_result_t result = flash_.erase_block64K (
+            unit_address (unit));
+
+        if (result == qspi_impl::ok)
+          {
+            units_[unit].erase_count++;
+            units_[unit].state = unit_free;
+            units_[unit].used = 0;
+            units_[unit].valid = 0;
+            stats_.erases++;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Reclaim a full unit: move its valid blocks to the active unit
+       *    and erase it.
+       * @param  wear_level: if true, reclaim the least erased unit (static
+       *    wear leveling, its cold blocks move to a more worn unit), otherwise
+       *    the unit with the fewest valid blocks.
+       * @return true if a unit was reclaimed.
+       */
+      bool
+      qspi_ftl::gc_step (bool wear_level)
+      {
+        uint16_t victim = NO_UNIT;
+
+        for (uint16_t u = 0; u < units_count_; u++)
+          {
+            unit_t* pu = &units_[u];
+
+            if (pu->state != unit_full)
+              {
+                continue;
+              }
+            if (victim == NO_UNIT
+                || (wear_level ?
+                    pu->erase_count < units_[victim].erase_count :
+                    (pu->valid < units_[victim].valid
+                        || (pu->valid == units_[victim].valid
+                            && pu->erase_count < units_[victim].erase_count))))
+              {
+                victim = u;
+              }
+          }
+        if (victim == NO_UNIT
+            || (wear_level == false && units_[victim].valid >= slots_ - reserved_))
+          {
+            return false;
+          }
+
+        if (flash_.read (unit_address (victim) + HEADER_SIZE,
+                         (uint8_t*) entries_, slots_ * sizeof(uint32_t))
+            != qspi_impl::ok)
+          {
+            return false;
+          }
+        wear_leveling_ = wear_level;
+        for (uint16_t i = reserved_; i < slots_; i++)
+          {
+            uint32_t entry = entries_[i];
+            uint32_t lba = entry & 0xFFFF;
+
+            if ((entry >> 16) != (~lba & 0xFFFF) || lba >= num_blocks_
+                || map_[lba] != victim * slots_ + i)
+              {
+                // free, corrupted or superseded
+                continue;
+              }
+            // activate first, the blank check uses the block buffer
+            if ((active_ == NO_UNIT && activate (true) != qspi_impl::ok)
+                || flash_.read (unit_address (victim) + i * block_size_,
+                                buffer_, block_size_) != qspi_impl::ok
+                || write_one (lba, buffer_, true) != qspi_impl::ok)
+              {
+                wear_leveling_ = false;
+                return false;
+              }
+            stats_.relocations++;
+          }
+        wear_leveling_ = false;
+
+        if (erase_unit (victim) != qspi_impl::ok)
+          {
+            units_[victim].state = unit_unknown;
+          }
+        free_units_++;
+        return true;
+      }
+
+      /**
+       * @brief  Check if the erase counts are spread enough to justify a
+       *    static wear leveling move.
+       * @return true if the most erased unit was erased WEAR_LEVEL_THRESHOLD
+       *    times more than the least erased full unit.
+       */
+      bool
+      qspi_ftl::wear_spread (void)
+      {
+        uint32_t min = 0xFFFFFFFF;
+        uint32_t max = 0;
+
+        for (uint16_t u = 0; u < units_count_; u++)
+          {
+            if (units_[u].state == unit_full && units_[u].erase_count < min)
+              {
+                min = units_[u].erase_count;
+              }
+            if (units_[u].erase_count > max)
+              {
+                max = units_[u].erase_count;
+              }
+          }
+        return min != 0xFFFFFFFF && max - min > WEAR_LEVEL_THRESHOLD
+            && free_units_ > GC_RESERVE;
+      }
+
+      /**
+       * @brief  Write a checkpoint (erase counts and mapping table) to the
+       *    older checkpoint area. The header, with the payload CRC, is written
+       *    last; until then the other area stays in effect.
+       * @return qspi::ok if successful, or a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_ftl::checkpoint (void)
+      {
+        qspi_impl::qspi_result_t result = qspi_impl::ok;
+        checkpoint_header_t header;
+        uint32_t area = ((cp_counter_ + 1) % 2) * cp_units_ * UNIT_SIZE;
+        uint32_t address = area + CP_PAYLOAD;
+        uint32_t crc = 0;
+
+        for (uint16_t u = 0; u < cp_units_ && result == qspi_impl::ok; u++)
+          {
+            result = flash_.erase_block64K (area + u * UNIT_SIZE);
+          }
+
+        // the erase counts are staged in the block buffer
+        for (uint16_t u = 0; u < units_count_ && result == qspi_impl::ok;)
+          {
+            size_t n = 0;
+            for (; u < units_count_ && n < block_size_ / sizeof(uint32_t);
+                u++, n++)
+              {
+                ((uint32_t*) buffer_)[n] = units_[u].erase_count;
+              }
+            result = flash_.write (address, buffer_, n * sizeof(uint32_t));
+            crc = crc32 (crc, buffer_, n * sizeof(uint32_t));
+            address += n * sizeof(uint32_t);
+          }
+        if (result == qspi_impl::ok)
+          {
+            result = flash_.write (address, (uint8_t*) map_,
+                                   num_blocks_ * sizeof(uint16_t));
+            crc = crc32 (crc, (uint8_t*) map_, num_blocks_ * sizeof(uint16_t));
+          }
+        if (result == qspi_impl::ok)
+          {
+            header.magic = CHECKPOINT_MAGIC;
+            header.counter = cp_counter_ + 1;
+            header.sequence = sequence_;
+            header.used = (active_ != NO_UNIT) ? units_[active_].used : slots_;
+            header.block_size = block_size_;
+            header.blocks = num_blocks_;
+            header.crc = crc;
+            header.check = header.magic ^ header.counter ^ header.sequence
+                ^ header.used ^ header.block_size ^ header.blocks ^ header.crc;
+            result = flash_.write (area, (uint8_t*) &header, sizeof(header));
+          }
+        if (result == qspi_impl::ok)
+          {
+            cp_counter_++;
+            since_cp_ = 0;
+            trimmed_ = false;
+            stats_.checkpoints++;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Drop the mapping of a logical block.
+       * @param  lba: logical block number.
+       */
+      void
+      qspi_ftl::unmap (uint32_t lba)
+      {
+        if (map_[lba] != NO_SLOT)
+          {
+            units_[map_[lba] / slots_].valid--;
+            map_[lba] = NO_SLOT;
+          }
+      }
+
+      /**
+       * @brief  Check if a range of the flash is blank (all 0xFF).
+       * @param  address: start address.
+       * @param  count: size of the range, multiple of the block size.
+       * @return true if the range is blank, false if it is not or if it
+       *    could not be read.
+       */
+      bool
+      qspi_ftl::is_blank (uint32_t address, size_t count)
+      {
+        for (size_t offset = 0; offset < count; offset += block_size_)
+          {
+            if (flash_.read (address + offset, buffer_, block_size_)
+                != qspi_impl::ok)
+              {
+                return false;
+              }
+            for (size_t i = 0; i < block_size_ / sizeof(uint32_t); i++)
+              {
+                if (((uint32_t*) buffer_)[i] != 0xFFFFFFFF)
+                  {
+                    return false;
+                  }
+              }
+          }
+        return true;
+      }
+
+      /**
+       * @brief  Update a CRC-32 (IEEE 802.3) with a buffer.
+       * @param  crc: CRC of the previous data, 0 to start.
+       * @param  data: the data.
+       * @param  count: number of bytes.
+       * @return The updated CRC.
+       */
+      uint32_t
+      qspi_ftl::crc32 (uint32_t crc, const uint8_t* data, size_t count)
+      {
+        crc = ~crc;
+        while (count--)
+          {
+            crc ^= *data++;
+            for (int k = 0; k < 8; k++)
+              {
+                crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+              }
+          }
+        return ~crc;
+      }
+
+      /**
+       * @brief  Background garbage collector thread: keep gc_target_ erased
+       *    units ready for the writers and level the wear.
+       * @param  args: pointer to the qspi_ftl object.
+       */
+      void*
+      qspi_ftl::collector (void* args)
+      {
+        qspi_ftl* pf = static_cast<qspi_ftl*> (args);
+        bool more;
+
+        while (pf->collector_stop_ == false)
+          {
+            pf->gc_sem_.wait ();
+            do
+              {
+                pf->mx_.lock ();
+                more = false;
+                if (pf->collector_stop_ == false)
+                  {
+                    if (pf->free_units_ < pf->gc_target_)
+                      {
+                        more = pf->gc_step (false);
+                      }
+                    else if (pf->wear_spread ())
+                      {
+                        more = pf->gc_step (true);
+                      }
+                  }
+                pf->mx_.unlock ();
+              }
+            while (more);
+          }
+        return nullptr;
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
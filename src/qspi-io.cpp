@@ -0,0 +1,424 @@
+/*
+ * qspi-io.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file implements the backend of the hot operations of the driver
+ * (reads, page programs, erases and their status polling): sending a
+ * command, starting its DMA data phase and starting the status polling.
+ *
+ * By default the backend calls the ST HAL, which is the reference. When
+ * QSPI_LL_BACKEND is defined, the QUADSPI registers (CCR, AR, ABR, DLR) and
+ * the DMA stream linked to the HAL handle are written directly: no HAL state
+ * machine, lock or busy-wait for the end of the commands without data (the
+ * next command waits for the controller instead). The completions are still
+ * signaled through the HAL call-backs: a read completes in the DMA stream
+ * interrupt, which must be routed to HAL_DMA_IRQHandler(), programs and
+ * status polling in the QUADSPI interrupt, routed to HAL_QSPI_IRQHandler(),
+ * as the HAL DMA and IT functions require anyway. The other commands
+ * (initialization, vendor specific, memory-mapped mode) always go through
+ * the HAL. The short transfers are done by polling, through the HAL in
+ * both cases.
+ */
+
+#include <cmsis-plus/rtos/os.h>
+#include "qspi-flash.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+#if defined (QSPI_LL_BACKEND)
+
+      namespace
+      {
+        // Interrupt status and flag clear registers of the DMA controller,
+        // for the stream pointed to by DMA_HandleTypeDef::StreamBaseAddress
+        typedef struct
+        {
+          volatile uint32_t ISR;
+          volatile uint32_t Reserved0;
+          volatile uint32_t IFCR;
+        } dma_base_t;
+
+        // Controller polls before giving up waiting for it to be idle
+        constexpr uint32_t IDLE_SPINS = 10000;
+
+        /**
+         * @brief  Wait for the controller to finish the previous command.
+         * @param  regs: QUADSPI registers.
+         * @return true if idle, false if still busy.
+         */
+        bool
+        wait_idle (QUADSPI_TypeDef* regs)
+        {
+          for (uint32_t i = 0; i < IDLE_SPINS; i++)
+            {
+              if ((regs->SR & QUADSPI_SR_BUSY) == 0)
+                {
+                  return true;
+                }
+            }
+          return false;
+        }
+
+        /**
+         * @brief  Write a command to the QUADSPI registers, as the HAL does:
+         *    the command starts with the write of CCR, or of AR if it has an
+         *    address, unless it has data to be written.
+         * @param  regs: QUADSPI registers.
+         * @param  sCommand: command.
+         * @param  fmode: functional mode (QUADSPI_CCR_FMODE bits).
+         */
+        void
+        latch (QUADSPI_TypeDef* regs, const QSPI_CommandTypeDef* sCommand,
+               uint32_t fmode)
+        {
+          uint32_t ccr = sCommand->Instruction | sCommand->InstructionMode
+              | (sCommand->DummyCycles << QUADSPI_CCR_DCYC_Pos)
+              | sCommand->DataMode | sCommand->DdrMode
+              | sCommand->DdrHoldHalfCycle | sCommand->SIOOMode | fmode;
+
+          if (sCommand->DataMode != QSPI_DATA_NONE)
+            {
+              regs->DLR = sCommand->NbData - 1;
+            }
+          if (sCommand->AlternateByteMode != QSPI_ALTERNATE_BYTES_NONE)
+            {
+              regs->ABR = sCommand->AlternateBytes;
+              ccr |= sCommand->AlternateByteMode
+                  | sCommand->AlternateBytesSize;
+            }
+          regs->FCR = QUADSPI_FCR_CTCF | QUADSPI_FCR_CTEF | QUADSPI_FCR_CSMF;
+          if (sCommand->AddressMode != QSPI_ADDRESS_NONE)
+            {
+              regs->CCR = ccr | sCommand->AddressMode | sCommand->AddressSize;
+              regs->AR = sCommand->Address;
+            }
+          else
+            {
+              regs->CCR = ccr;
+            }
+        }
+
+        /**
+         * @brief  Program the DMA stream for a transfer between memory and
+         *    the QUADSPI data register, and enable it.
+         * @param  hqspi: HAL qspi handle.
+         * @param  buff: memory buffer.
+         * @param  count: number of bytes.
+         * @param  direction: DMA_SxCR_DIR bits.
+         * @param  interrupts: stream interrupts to enable.
+         */
+        void
+        dma_start (QSPI_HandleTypeDef* hqspi, const uint8_t* buff,
+                   size_t count, uint32_t direction, uint32_t interrupts)
+        {
+          DMA_HandleTypeDef* hdma = hqspi->hdma;
+          DMA_Stream_TypeDef* stream = hdma->Instance;
+
+          stream->CR = (stream->CR
+              & ~(DMA_SxCR_DIR | DMA_SxCR_TCIE | DMA_SxCR_HTIE
+                  | DMA_SxCR_TEIE | DMA_SxCR_DMEIE)) | direction | interrupts;
+          stream->NDTR = count;
+          stream->PAR = (uintptr_t) &hqspi->Instance->DR;
+          stream->M0AR = (uintptr_t) buff;
+          ((dma_base_t*) hdma->StreamBaseAddress)->IFCR = 0x3FU
+              << hdma->StreamIndex;
+          stream->CR |= DMA_SxCR_EN;
+        }
+
+        /**
+         * @brief  DMA stream transfer complete call-back of a read: all the
+         *    data is in memory, the read is complete.
+         * @param  hdma: HAL DMA handle, linked to the HAL qspi handle.
+         */
+        void
+        dma_rx_complete (DMA_HandleTypeDef* hdma)
+        {
+          QSPI_HandleTypeDef* hqspi = (QSPI_HandleTypeDef*) hdma->Parent;
+
+          hqspi->Instance->CR &= ~QUADSPI_CR_DMAEN;
+          hqspi->Instance->FCR = QUADSPI_FCR_CTCF;
+          hqspi->State = HAL_QSPI_STATE_READY;
+          HAL_QSPI_RxCpltCallback (hqspi);
+        }
+
+        /**
+         * @brief  DMA stream error call-back: the transfer is aborted, the
+         *    driver times out waiting for it.
+         * @param  hdma: HAL DMA handle, linked to the HAL qspi handle.
+         */
+        void
+        dma_error (DMA_HandleTypeDef* hdma)
+        {
+          QSPI_HandleTypeDef* hqspi = (QSPI_HandleTypeDef*) hdma->Parent;
+
+          hqspi->Instance->CR &= ~(QUADSPI_CR_DMAEN | QUADSPI_CR_TCIE
+              | QUADSPI_CR_TEIE);
+          hqspi->Instance->CR |= QUADSPI_CR_ABORT;
+          hqspi->ErrorCode |= HAL_QSPI_ERROR_DMA;
+          hqspi->State = HAL_QSPI_STATE_READY;
+          HAL_QSPI_ErrorCallback (hqspi);
+        }
+      }
+
+      /**
+       * @brief  Send a command. Without data, the command is only started;
+       *    with data, the data phase is started by io_receive_dma() or
+       *    io_transmit_dma().
+       * @param  sCommand: command.
+       * @return qspi::ok if successful, qspi::busy if the controller is in
+       *    use.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::io_command (QSPI_CommandTypeDef* sCommand)
+      {
+        if (hqspi_->State != HAL_QSPI_STATE_READY
+            || wait_idle (hqspi_->Instance) == false)
+          {
+            return busy;
+          }
+        latch (hqspi_->Instance, sCommand, 0);
+        return ok;
+      }
+
+      /**
+       * @brief  Start the DMA read of the data of the last command; the
+       *    completion is signaled by HAL_QSPI_RxCpltCallback().
+       * @param  buff: buffer where to copy data to, already invalidated in the
+       *    data cache.
+       * @param  count: number of bytes, as set in the command.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::io_receive_dma (uint8_t* buff, size_t count)
+      {
+        QUADSPI_TypeDef* regs = hqspi_->Instance;
+
+        hqspi_->hdma->XferCpltCallback = dma_rx_complete;
+        hqspi_->hdma->XferErrorCallback = dma_error;
+        dma_start (hqspi_, buff, count, 0, DMA_SxCR_TCIE | DMA_SxCR_TEIE);
+
+        // switching to indirect read and rewriting the address starts it
+        hqspi_->State = HAL_QSPI_STATE_BUSY_INDIRECT_RX;
+        regs->CR |= QUADSPI_CR_DMAEN;
+        regs->CCR = (regs->CCR & ~QUADSPI_CCR_FMODE) | QUADSPI_CCR_FMODE_0;
+        if ((regs->CCR & QUADSPI_CCR_ADMODE) != 0)
+          {
+            regs->AR = regs->AR;
+          }
+        return ok;
+      }
+
+      /**
+       * @brief  Start the DMA write of the data of the last command; the
+       *    completion is signaled by HAL_QSPI_TxCpltCallback().
+       * @param  buff: source data, already cleaned from the data cache.
+       * @param  count: number of bytes, as set in the command.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::io_transmit_dma (const uint8_t* buff, size_t count)
+      {
+        QUADSPI_TypeDef* regs = hqspi_->Instance;
+
+        hqspi_->hdma->XferErrorCallback = dma_error;
+        dma_start (hqspi_, buff, count, DMA_SxCR_DIR_0, DMA_SxCR_TEIE);
+
+        // the command starts when the DMA fills the FIFO, it is complete
+        // when all the data is sent
+        hqspi_->State = HAL_QSPI_STATE_BUSY_INDIRECT_TX;
+        regs->CR |= QUADSPI_CR_TCIE | QUADSPI_CR_TEIE;
+        regs->CR |= QUADSPI_CR_DMAEN;
+        return ok;
+      }
+
+      /**
+       * @brief  Start the automatic polling of a status register; the match is
+       *    signaled by HAL_QSPI_StatusMatchCallback().
+       * @param  sCommand: command reading the status register.
+       * @param  sConfig: polling configuration.
+       * @return qspi::ok if successful, qspi::busy if the controller is in
+       *    use.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::io_poll_it (QSPI_CommandTypeDef* sCommand,
+                             QSPI_AutoPollingTypeDef* sConfig)
+      {
+        QUADSPI_TypeDef* regs = hqspi_->Instance;
+        QSPI_CommandTypeDef sPoll = *sCommand;
+
+        if (hqspi_->State != HAL_QSPI_STATE_READY || wait_idle (regs) == false)
+          {
+            return busy;
+          }
+        regs->PSMAR = sConfig->Match;
+        regs->PSMKR = sConfig->Mask;
+        regs->PIR = sConfig->Interval;
+        regs->CR = (regs->CR & ~(QUADSPI_CR_PMM | QUADSPI_CR_APMS))
+            | sConfig->MatchMode | sConfig->AutomaticStop;
+        hqspi_->State = HAL_QSPI_STATE_BUSY_AUTO_POLLING;
+        sPoll.NbData = sConfig->StatusBytesSize;
+        latch (regs, &sPoll, QUADSPI_CCR_FMODE_1);
+
+        // a match already found raises the interrupt as soon as enabled
+        regs->CR |= QUADSPI_CR_SMIE | QUADSPI_CR_TEIE;
+        return ok;
+      }
+
+      /**
+       * @brief  Abort the current operation of the controller.
+       */
+      void
+      qspi_impl::io_abort (void)
+      {
+        hqspi_->Instance->CR &= ~QUADSPI_CR_DMAEN;
+        hqspi_->Instance->CR |= QUADSPI_CR_ABORT;
+        for (uint32_t i = 0;
+            i < IDLE_SPINS && (hqspi_->Instance->CR & QUADSPI_CR_ABORT) != 0;
+            i++)
+          {
+            ;
+          }
+        hqspi_->State = HAL_QSPI_STATE_READY;
+      }
+
+#else
+
+      /**
+       * @brief  Send a command. Without data, the HAL waits for it to be
+       *    sent; with data, the data phase is started by io_receive_dma() or
+       *    io_transmit_dma().
+       * @param  sCommand: command.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::io_command (QSPI_CommandTypeDef* sCommand)
+      {
+        return (qspi_impl::qspi_result_t) HAL_QSPI_Command (hqspi_, sCommand,
+                                                            TIMEOUT);
+      }
+
+      /**
+       * @brief  Start the DMA read of the data of the last command; the
+       *    completion is signaled by HAL_QSPI_RxCpltCallback().
+       * @param  buff: buffer where to copy data to, already invalidated in the
+       *    data cache.
+       * @param  count: number of bytes, as set in the command.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::io_receive_dma (uint8_t* buff, size_t count)
+      {
+        return (qspi_impl::qspi_result_t) HAL_QSPI_Receive_DMA (hqspi_, buff);
+      }
+
+      /**
+       * @brief  Start the DMA write of the data of the last command; the
+       *    completion is signaled by HAL_QSPI_TxCpltCallback().
+       * @param  buff: source data, already cleaned from the data cache.
+       * @param  count: number of bytes, as set in the command.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::io_transmit_dma (const uint8_t* buff, size_t count)
+      {
+        return (qspi_impl::qspi_result_t) HAL_QSPI_Transmit_DMA (
+            hqspi_, (uint8_t*) buff);
+      }
+
+      /**
+       * @brief  Start the automatic polling of a status register; the match is
+       *    signaled by HAL_QSPI_StatusMatchCallback().
+       * @param  sCommand: command reading the status register.
+       * @param  sConfig: polling configuration.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::io_poll_it (QSPI_CommandTypeDef* sCommand,
+                             QSPI_AutoPollingTypeDef* sConfig)
+      {
+        return (qspi_impl::qspi_result_t) HAL_QSPI_AutoPolling_IT (hqspi_,
+                                                                   sCommand,
+                                                                   sConfig);
+      }
+
+      /**
+       * @brief  Abort the current operation of the controller. This is a
+       *    workaround for the QSPI peripheral bug described in the ST
+       *    document ES0290 Rev 7, section 2.4.1: the HAL state is reset by
+       *    hand, HAL_QSPI_Abort() would wait for the busy flag.
+       */
+      void
+      qspi_impl::io_abort (void)
+      {
+        hqspi_->Instance->CR |= QUADSPI_CR_ABORT;
+        hqspi_->State = HAL_QSPI_STATE_READY;
+      }
+
+#endif
+
+      /**
+       * @brief  Read the data of the last command by polling the controller
+       *    FIFO, for the short transfers; the HAL polled transfer is already a
+       *    register loop, it is used by both backends.
+       * @param  buff: buffer where to copy data to.
+       * @param  count: number of bytes, as set in the command.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::io_receive (uint8_t* buff, size_t count)
+      {
+        return (qspi_impl::qspi_result_t) HAL_QSPI_Receive (hqspi_, buff,
+                                                            TIMEOUT);
+      }
+
+      /**
+       * @brief  Write the data of the last command by polling the controller
+       *    FIFO, for the short transfers.
+       * @param  buff: source data.
+       * @param  count: number of bytes, as set in the command.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::io_transmit (const uint8_t* buff, size_t count)
+      {
+        return (qspi_impl::qspi_result_t) HAL_QSPI_Transmit (hqspi_,
+                                                             (uint8_t*) buff,
+                                                             TIMEOUT);
+      }
+
+#pragma GCC diagnostic pop
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
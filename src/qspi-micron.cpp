@@ -56,16 +56,8 @@ namespace os
         qspi_impl::qspi_result_t result = qspi_impl::busy;
         uint8_t datareg;
 
-        // Initial command settings
-        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
-        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-        sCommand.InstructionMode = QSPI_INSTRUCTION_1_LINE;
-        sCommand.AddressMode = QSPI_ADDRESS_NONE;
-        sCommand.DataMode = QSPI_DATA_NONE;
-        sCommand.DummyCycles = 0;
+        // The chip is still in SPI mode
+        sCommand = pq->cmds_.spi;
         sCommand.NbData = 1;
 
         // Enable volatile write
@@ -81,9 +73,10 @@ namespace os
                 pq->hqspi_, &sCommand, qspi_impl::TIMEOUT);
             if (result == qspi_impl::ok)
               {
-                // Compute dummy cycles
-                datareg = (pq->pdevice_->dummy_cycles << 4);
-                datareg |= 0xB;
+                // Compute dummy cycles; XIP enabled (bit 3 cleared) for the
+                // continuous reads
+                datareg = (pq->dummy_cycles_ << 4);
+                datareg |= pq->continuous_ ? 0x3 : 0xB;
                 result = (qspi_impl::qspi_result_t) HAL_QSPI_Transmit (
                     pq->hqspi_, &datareg, qspi_impl::TIMEOUT);
                 if (result == qspi_impl::ok)
@@ -124,6 +117,47 @@ namespace os
         return result;
       }
 
+      /**
+       * @brief  Suspend the erase in progress. The area being erased must not
+       *    be read until the erase is resumed and complete.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_micron::suspend_erase (qspi_impl* pq)
+      {
+        QSPI_CommandTypeDef sCommand;
+        QSPI_AutoPollingTypeDef sConfig;
+        qspi_impl::qspi_result_t result;
+
+        result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (
+            pq->hqspi_, &pq->cmds_.suspend, qspi_impl::TIMEOUT);
+        if (result == qspi_impl::ok)
+          {
+            // The chip is suspended when the flag status register reports it
+            // ready (erase suspend latency, 30 us max)
+            sCommand = pq->cmds_.status;
+            sCommand.Instruction = READ_FLAG_STATUS_REGISTER;
+            sConfig = pq->cmds_.ready;
+            sConfig.Match = 0x80;
+            sConfig.Mask = 0x80;
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_AutoPolling (
+                pq->hqspi_, &sCommand, &sConfig, qspi_impl::TIMEOUT);
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Resume the erase suspended with suspend_erase().
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_micron::resume_erase (qspi_impl* pq)
+      {
+        return (qspi_impl::qspi_result_t) HAL_QSPI_Command (pq->hqspi_,
+                                                            &pq->cmds_.resume,
+                                                            qspi_impl::TIMEOUT);
+      }
+
     } /* namespace stm32f7 */
   } /* namespace driver */
 } /* namespace os */
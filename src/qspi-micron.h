@@ -48,6 +48,12 @@ namespace os
         virtual qspi_impl::qspi_result_t
         enter_quad_mode (qspi_impl* pq) override;
 
+        virtual qspi_impl::qspi_result_t
+        suspend_erase (qspi_impl* pq) override;
+
+        virtual qspi_impl::qspi_result_t
+        resume_erase (qspi_impl* pq) override;
+
       private:
         // Micron/ST specific commands
         static constexpr uint8_t READ_VOLATILE_STATUS_REGISTER = 0x85;
@@ -55,6 +61,7 @@ namespace os
         static constexpr uint8_t WRITE_VOLATILE_STATUS_REGISTER = 0x81;
         static constexpr uint8_t WRITE_ENH_VOLATILE_STATUS_REGISTER = 0x61;
         static constexpr uint8_t ENTER_QUAD_MODE = 0x38;
+        static constexpr uint8_t READ_FLAG_STATUS_REGISTER = 0x70;
 
       };
 
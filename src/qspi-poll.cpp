@@ -0,0 +1,156 @@
+/*
+ * qspi-poll.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file implements the completion of the short transfers by polling:
+ * a DMA transfer waited for on the semaphore costs the DMA setup, the data
+ * cache maintenance, an interrupt and two context switches, which is more
+ * than the whole transfer of a few bytes takes on the bus. The transfers up
+ * to a threshold are done by the CPU through the controller FIFO instead,
+ * busy-waiting for their end. The threshold is measured when the driver is
+ * initialized: the CPU time a polled transfer spends on the bus must not
+ * exceed the overhead saved by not using the DMA.
+ */
+
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/diag/trace.h>
+#include "qspi-flash.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      /**
+       * @brief  Set the size of the largest transfers done by polling.
+       * @param  bytes: the threshold, in bytes; 0 uses the DMA for all the
+       *    transfers except the chip identification. poll_calibrate (the
+       *    default) measures the threshold at the next initialization.
+       */
+      void
+      qspi_impl::set_poll_threshold (size_t bytes)
+      {
+        poll_request_ = bytes;
+        if (bytes != poll_calibrate)
+          {
+            poll_threshold_ = bytes;
+          }
+      }
+
+      /**
+       * @brief  Read a short block of data from the flash in indirect mode,
+       *    by polling: no DMA, no cache maintenance, no context switch.
+       * @param  address: start address in flash where to read from.
+       * @param  buff: buffer where to copy data to.
+       * @param  count: amount of data to be retrieved from flash.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::read_polled (uint32_t address, uint8_t* buff, size_t count)
+      {
+        qspi_impl::qspi_result_t result = send_read (address, count);
+
+        if (result == ok)
+          {
+            result = io_receive (buff, count);
+            dma_stats_.polled++;
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Measure the polling threshold. The beginning of the flash is
+       *    read a few times by polling, with two sizes, and by DMA, and the
+       *    shortest durations are kept:
+       *    - the difference of the polled reads gives the bus time per byte;
+       *    - the difference of the DMA and polled reads of the same size
+       *    gives the overhead of the DMA transfer and of the wait.
+       *    The threshold is the size whose bus time equals this overhead,
+       *    limited to POLL_MIN_THRESHOLD .. POLL_MAX_THRESHOLD.
+       */
+      void
+      qspi_impl::calibrate_polling (void)
+      {
+        constexpr size_t small = POLL_MIN_THRESHOLD;
+        constexpr size_t large = sizeof(lbuff_);
+        uint64_t polled_small = UINT64_MAX;
+        uint64_t polled_large = UINT64_MAX;
+        uint64_t dma_large = UINT64_MAX;
+        uint64_t ticks;
+        rtos::clock::timestamp_t start;
+        qspi_impl::qspi_result_t result = ok;
+
+        poll_threshold_ = POLL_MIN_THRESHOLD;
+        for (int i = 0; i < POLL_SAMPLES && result == ok; i++)
+          {
+            start = rtos::hrclock.now ();
+            result = read_polled (0, lbuff_, small);
+            ticks = rtos::hrclock.now () - start;
+            polled_small = (ticks < polled_small) ? ticks : polled_small;
+
+            if (result == ok)
+              {
+                start = rtos::hrclock.now ();
+                result = read_polled (0, lbuff_, large);
+                ticks = rtos::hrclock.now () - start;
+                polled_large = (ticks < polled_large) ? ticks : polled_large;
+              }
+
+            if (result == ok)
+              {
+                start = rtos::hrclock.now ();
+                result = read_dma (0, lbuff_, large);
+                ticks = rtos::hrclock.now () - start;
+                dma_large = (ticks < dma_large) ? ticks : dma_large;
+              }
+          }
+
+        if (result == ok && dma_large > polled_large)
+          {
+            if (polled_large > polled_small)
+              {
+                ticks = (dma_large - polled_large) * (large - small)
+                    / (polled_large - polled_small);
+                poll_threshold_ =
+                    (ticks > POLL_MAX_THRESHOLD) ? POLL_MAX_THRESHOLD :
+                    (ticks < POLL_MIN_THRESHOLD) ? POLL_MIN_THRESHOLD :
+                                                   (size_t) ticks;
+              }
+            else
+              {
+                // the bus time is below the clock resolution
+                poll_threshold_ = POLL_MAX_THRESHOLD;
+              }
+          }
+        trace::printf ("%s(): transfers up to %u bytes polled\n", __func__,
+                       (unsigned) poll_threshold_);
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
@@ -0,0 +1,416 @@
+/*
+ * qspi-pre-erase.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file implements the map of the pages known to be blank, which lets
+ * the block writes program them without reading them back first, and the
+ * optional background eraser, which erases the discarded sectors while the
+ * device is idle.
+ */
+
+#include <new>
+#include <string.h>
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/diag/trace.h>
+#include "qspi-flash.h"
+#include "qspi-descr.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      /**
+       * @brief  Enable or disable the background eraser. The setting is
+       *    applied the next time the block device is opened.
+       * @param  state: if true, the blocks discarded with ioctl_discard are
+       *    queued and erased by a low priority thread, instead of being erased
+       *    by the caller.
+       */
+      void
+      qspi_impl::set_pre_erase (bool state)
+      {
+        pre_erase_ = state;
+      }
+
+      /**
+       * @brief  Allocate the blank page and sector maps and start the
+       *    background eraser. The blank page map is built lazily, one 64K
+       *    block at a time; without it (out of memory), the pages are read
+       *    back before being written, as usual.
+       * @return qspi::ok if successful, or qspi::error if out of memory for
+       *    the background eraser.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::pre_erase_open (void)
+      {
+        size_t words = (get_sector_count () + 31) / 32;
+        size_t blocks = get_sector_count () * pdevice_->sector_size
+            / BLOCK_64K_SIZE;
+
+        blank_map_ = new (std::nothrow) uint32_t[words
+            * (pdevice_->sector_size / PAGE_SIZE)];
+        blank_known_ = new (std::nothrow) uint32_t[(blocks + 31) / 32];
+        if (blank_map_ == nullptr || blank_known_ == nullptr)
+          {
+            trace::printf ("%s(): no blank page map\n", __func__);
+            delete[] blank_map_;
+            delete[] blank_known_;
+            blank_map_ = nullptr;
+            blank_known_ = nullptr;
+          }
+        else
+          {
+            memset (blank_known_, 0, ((blocks + 31) / 32) * sizeof(uint32_t));
+          }
+
+        if (pre_erase_)
+          {
+            discard_map_ = new (std::nothrow) uint32_t[words];
+            if (discard_map_ == nullptr)
+              {
+                pre_erase_close ();
+                return error;
+              }
+            memset (discard_map_, 0, words * sizeof(uint32_t));
+
+            rtos::thread::attributes attr;
+            attr.th_priority = rtos::thread::priority::low;
+            eraser_stop_ = false;
+            eraser_ = new (std::nothrow) rtos::thread
+              { "qspi-pre-erase", pre_eraser, this, attr };
+          }
+        return ok;
+      }
+
+      /**
+       * @brief  Stop the background eraser and release the maps. The
+       *    discarded sectors not yet erased are left as they are.
+       */
+      void
+      qspi_impl::pre_erase_close (void)
+      {
+        if (eraser_ != nullptr)
+          {
+            eraser_stop_ = true;
+            eraser_sem_.post ();
+            eraser_->join ();
+            delete eraser_;
+            eraser_ = nullptr;
+          }
+
+        lock_write ();
+        delete[] blank_map_;
+        delete[] blank_known_;
+        delete[] discard_map_;
+        blank_map_ = nullptr;
+        blank_known_ = nullptr;
+        discard_map_ = nullptr;
+        unlock_write ();
+      }
+
+      /**
+       * @brief  Build the blank page map of a 64K block, the first time it is
+       *    needed, by scanning it through the memory-mapped window, whose
+       *    data cache lines are invalidated first. The controller is then put
+       *    back in the mode the caller expects. If the window is not
+       *    available, the block is read back one page at a time; pages that
+       *    cannot be read are left unknown and will be read again before
+       *    being written.
+       * @param  block: the 64K block number.
+       */
+      void
+      qspi_impl::blank_scan (uint32_t block)
+      {
+        constexpr size_t pages = BLOCK_64K_SIZE / PAGE_SIZE;
+        uint32_t first = block * pages;
+        const uint8_t* pf = nullptr;
+
+        memset (blank_map_ + first / 32, 0, pages / 8);
+        if (mapped_ || map () == ok)
+          {
+            pf = (const uint8_t*) QSPI_BASE + block * BLOCK_64K_SIZE;
+            invalidate_dcache ((uint8_t*) pf, BLOCK_64K_SIZE);
+          }
+        for (size_t page = first; page < first + pages; page++)
+          {
+            const uint32_t* pw;
+            size_t j;
+
+            if (pf != nullptr)
+              {
+                pw = (const uint32_t*) (pf + (page - first) * PAGE_SIZE);
+              }
+            else if (read_flash (page * PAGE_SIZE, lbuff_, PAGE_SIZE) == ok)
+              {
+                pw = (const uint32_t*) lbuff_;
+              }
+            else
+              {
+                continue;
+              }
+            for (j = 0; j < PAGE_SIZE / 4; j++)
+              {
+                if (pw[j] != 0xFFFFFFFF)
+                  {
+                    break;
+                  }
+              }
+            if (j == PAGE_SIZE / 4)
+              {
+                blank_map_[page / 32] |= (1 << (page % 32));
+              }
+          }
+        blank_known_[block / 32] |= (1 << (block % 32));
+
+        // the caller may be about to send commands to the flash
+        if (pf != nullptr && suspended_ > 0)
+          {
+            indirect_mode ();
+          }
+        else if (pf != nullptr && keep_mapped_ == false
+            && mapped_reads_ == false)
+          {
+            leave_mapped ();
+          }
+      }
+
+      /**
+       * @brief  Check if a range of the flash is known to be blank.
+       * @param  address: start address of the range.
+       * @param  count: size of the range.
+       * @return true if all the pages of the range are blank, according to the
+       *    scan of their 64K block and to the erases and programs done since.
+       */
+      bool
+      qspi_impl::blank_test (uint32_t address, size_t count)
+      {
+        if (blank_map_ == nullptr || count == 0)
+          {
+            return false;
+          }
+        for (uint32_t block = address / BLOCK_64K_SIZE;
+            block <= (address + count - 1) / BLOCK_64K_SIZE; block++)
+          {
+            if ((blank_known_[block / 32] & (1 << (block % 32))) == 0)
+              {
+                blank_scan (block);
+              }
+          }
+        for (uint32_t page = address / PAGE_SIZE;
+            page <= (address + count - 1) / PAGE_SIZE; page++)
+          {
+            if ((blank_map_[page / 32] & (1 << (page % 32))) == 0)
+              {
+                return false;
+              }
+          }
+        return true;
+      }
+
+      /**
+       * @brief  Update the blank page map.
+       * @param  address: start address of the range.
+       * @param  count: size of the range; when marking as blank, it must be
+       *    made of whole pages.
+       * @param  state: true if the range was just erased, false if it was
+       *    programmed.
+       */
+      void
+      qspi_impl::blank_mark (uint32_t address, size_t count, bool state)
+      {
+        if (blank_map_ != nullptr && count > 0)
+          {
+            for (uint32_t page = address / PAGE_SIZE;
+                page <= (address + count - 1) / PAGE_SIZE; page++)
+              {
+                if (state)
+                  {
+                    blank_map_[page / 32] |= (1 << (page % 32));
+                  }
+                else
+                  {
+                    blank_map_[page / 32] &= ~(1 << (page % 32));
+                  }
+              }
+            // the 64K blocks entirely erased need no scan
+            uint32_t block = (address + BLOCK_64K_SIZE - 1) / BLOCK_64K_SIZE;
+            for (; state && block < (address + count) / BLOCK_64K_SIZE;
+                block++)
+              {
+                blank_known_[block / 32] |= (1 << (block % 32));
+              }
+          }
+      }
+
+      /**
+       * @brief  Queue the whole sectors of a range for the background eraser.
+       *    Sectors already erased are not queued.
+       * @param  address: start address of the range.
+       * @param  count: size of the range.
+       */
+      void
+      qspi_impl::pre_erase_queue (uint32_t address, size_t count)
+      {
+        size_t sector_size = pdevice_->sector_size;
+
+        for (uint32_t s = (address + sector_size - 1) / sector_size;
+            s < (address + count) / sector_size; s++)
+          {
+            if (blank_test (s * sector_size, sector_size) == false)
+              {
+                discard_map_[s / 32] |= (1 << (s % 32));
+              }
+          }
+        eraser_sem_.post ();
+      }
+
+      /**
+       * @brief  Remove the sectors of a range from the background eraser
+       *    queue, as they are about to be rewritten.
+       * @param  address: start address of the range.
+       * @param  count: size of the range.
+       */
+      void
+      qspi_impl::pre_erase_cancel (uint32_t address, size_t count)
+      {
+        if (discard_map_ != nullptr && count > 0)
+          {
+            size_t sector_size = pdevice_->sector_size;
+
+            for (uint32_t s = address / sector_size;
+                s <= (address + count - 1) / sector_size; s++)
+              {
+                discard_map_[s / 32] &= ~(1 << (s % 32));
+              }
+          }
+      }
+
+      /**
+       * @brief  Erase the queued sectors of the first 64K block that has any,
+       *    coalescing them into block erases when the erase policy allows it.
+       *    If the erase fails, the sectors are queued again.
+       * @param  result: returns qspi::ok if successful, a qspi error
+       *    otherwise.
+       * @return true if a block was processed, false if the queue is empty.
+       */
+      bool
+      qspi_impl::pre_erase_next (qspi_result_t& result)
+      {
+        size_t sector_size = pdevice_->sector_size;
+        size_t sectors = BLOCK_64K_SIZE / sector_size;
+        size_t words = (get_sector_count () + 31) / 32;
+        uint32_t extra[BLOCK_64K_SIZE / MIN_SECTOR_SIZE] =
+          { };
+        uint32_t need = 0;
+        uint32_t erased;
+        size_t w;
+
+        result = ok;
+        for (w = 0; w < words && discard_map_[w] == 0; w++)
+          {
+            ;
+          }
+        if (w == words)
+          {
+            return false;
+          }
+
+        // collect the queued sectors of the block
+        uint32_t first = (w * 32 + __builtin_ctz (discard_map_[w])) / sectors
+            * sectors;
+        for (size_t i = 0; i < sectors; i++)
+          {
+            uint32_t s = first + i;
+            if (discard_map_[s / 32] & (1 << (s % 32)))
+              {
+                need |= (1 << i);
+                discard_map_[s / 32] &= ~(1 << (s % 32));
+              }
+          }
+
+        // the discarded sectors may all be erased, the others are left alone
+        if ((result = suspend_mapped ()) == ok)
+          {
+            result = erase_cover (first * sector_size, need, need, extra,
+                                  erased);
+          }
+        result = resume_mapped (result);
+        if (result != ok)
+          {
+            // queue the sectors again; those already erased are known blank
+            // and will not be erased twice
+            for (size_t i = 0; i < sectors; i++)
+              {
+                uint32_t s = first + i;
+                if ((need & (1 << i))
+                    && blank_test (s * sector_size, sector_size) == false)
+                  {
+                    discard_map_[s / 32] |= (1 << (s % 32));
+                  }
+              }
+          }
+        return true;
+      }
+
+      /**
+       * @brief  Background eraser thread: erase the queued sectors, one 64K
+       *    block at a time, releasing the device between blocks. After a
+       *    failed erase, it waits PRE_ERASE_BACKOFF before retrying.
+       * @param  args: pointer to the qspi_impl object.
+       */
+      void*
+      qspi_impl::pre_eraser (void* args)
+      {
+        qspi_impl* pq = static_cast<qspi_impl*> (args);
+        qspi_impl::qspi_result_t result = ok;
+        bool more;
+
+        while (pq->eraser_stop_ == false)
+          {
+            pq->eraser_sem_.wait ();
+            do
+              {
+                pq->lock_write ();
+                more = (pq->eraser_stop_ == false)
+                    && pq->pre_erase_next (result);
+                pq->unlock_write ();
+                if (more && result != ok)
+                  {
+                    // woken up early by close() or by new sectors
+                    pq->eraser_sem_.timed_wait (PRE_ERASE_BACKOFF);
+                  }
+              }
+            while (more);
+          }
+        return nullptr;
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
@@ -0,0 +1,261 @@
+/*
+ * qspi-read-ahead.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file implements the read-ahead of the block device: when a sequential
+ * stream of block reads is detected (or announced with do_vioctl()), the next
+ * blocks are transferred by DMA into a buffer while the caller processes the
+ * data, and the following reads are served from this buffer.
+ */
+
+#include <new>
+#include <string.h>
+#include <cmsis-plus/rtos/os.h>
+#include <cmsis-plus/diag/trace.h>
+#include "qspi-flash.h"
+#include "qspi-descr.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      /**
+       * @brief  Configure the read-ahead buffer. The setting is applied the
+       *    next time the block device is opened.
+       * @param  sectors: maximum number of sectors read ahead; 0 disables the
+       *    read-ahead. The value is limited to what a single DMA transfer can
+       *    handle.
+       */
+      void
+      qspi_impl::set_read_ahead (size_t sectors)
+      {
+        ra_sectors_ = sectors;
+      }
+
+      /**
+       * @brief  Allocate the read-ahead buffer. If out of memory, the block
+       *    device works without read-ahead.
+       * @return qspi::ok.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::ra_open (void)
+      {
+        ra_limit_ = DMA_MAX_TRANSFER / block_logical_size_bytes_;
+        ra_limit_ = (ra_sectors_ < ra_limit_) ? ra_sectors_ : ra_limit_;
+        ra_alloc_ = new (std::nothrow) uint8_t[ra_limit_
+            * block_logical_size_bytes_ + 0x1F];
+        if (ra_alloc_ == nullptr)
+          {
+            // read-ahead disabled
+            ra_limit_ = 0;
+          }
+        else
+          {
+            // the buffer starts on a cache line, the data cache maintenance
+            // does not touch the neighbouring heap blocks
+            ra_buff_ = (uint8_t*) (((uintptr_t) ra_alloc_ + 0x1F)
+                & ~(uintptr_t) 0x1F);
+          }
+        ra_count_ = 0;
+        ra_used_ = 0;
+        ra_window_ = (ra_limit_ > 2) ? 2 : ra_limit_;
+        ra_next_ = 0;
+        ra_pending_ = false;
+        return ok;
+      }
+
+      /**
+       * @brief  Wait for a pending read-ahead and release the buffer.
+       */
+      void
+      qspi_impl::ra_close (void)
+      {
+        ra_wait ();
+        delete[] ra_alloc_;
+        ra_alloc_ = nullptr;
+        ra_buff_ = nullptr;
+        ra_limit_ = 0;
+        ra_count_ = 0;
+      }
+
+      /**
+       * @brief  Start reading blocks into the read-ahead buffer. The DMA
+       *    transfer runs in the background; any other access to the flash
+       *    waits for it to end (see indirect_mode() and map()).
+       * @param  blknum: first block.
+       * @param  nblocks: number of blocks, at most the buffer size.
+       */
+      void
+      qspi_impl::ra_start (blknum_t blknum, size_t nblocks)
+      {
+        size_t size;
+
+        if (erase_busy_)
+          {
+            // a writer waits for an erase, the flash is not readable
+            return;
+          }
+        if (blknum + nblocks > num_blocks_)
+          {
+            nblocks = (blknum < num_blocks_) ? num_blocks_ - blknum : 0;
+          }
+        ra_count_ = 0;
+        if (nblocks > 0 && leave_mapped () == ok)
+          {
+            size = nblocks * block_logical_size_bytes_;
+            dma_prepare_rx (ra_buff_, size);
+            if (start_read (blknum * block_logical_size_bytes_, ra_buff_, size)
+                == ok)
+              {
+                ra_first_ = blknum;
+                ra_count_ = nblocks;
+                ra_used_ = 0;
+                ra_pending_ = true;
+              }
+          }
+      }
+
+      /**
+       * @brief  Wait for the end of a pending read-ahead transfer. If the
+       *    transfer failed, the buffer content is dropped, otherwise its data
+       *    cache lines are invalidated again.
+       */
+      void
+      qspi_impl::ra_wait (void)
+      {
+        if (ra_pending_)
+          {
+            ra_pending_ = false;
+            if (semaphore_.timed_wait (
+                transfer_timeout (ra_count_ * block_logical_size_bytes_))
+                != rtos::result::ok)
+              {
+                ra_count_ = 0;
+              }
+            else
+              {
+                dma_complete_rx (ra_buff_,
+                                 ra_count_ * block_logical_size_bytes_);
+              }
+          }
+      }
+
+      /**
+       * @brief  Drop the read-ahead buffer if it overlaps an area of the flash
+       *    that was programmed or erased.
+       * @param  address: start address of the modified area.
+       * @param  count: size of the modified area.
+       */
+      void
+      qspi_impl::ra_drop (uint32_t address, size_t count)
+      {
+        uint32_t first = ra_first_ * block_logical_size_bytes_;
+
+        if (ra_count_ > 0
+            && address < first + ra_count_ * block_logical_size_bytes_
+            && address + count > first)
+          {
+            ra_count_ = 0;
+          }
+      }
+
+      /**
+       * @brief  Look for a block in the read-ahead buffer.
+       * @param  blknum: block number.
+       * @return Pointer to the block data, or nullptr if not in the buffer.
+       */
+      const uint8_t*
+      qspi_impl::ra_find (blknum_t blknum)
+      {
+        if (ra_count_ > 0 && blknum >= ra_first_
+            && blknum < ra_first_ + ra_count_)
+          {
+            ra_wait ();
+            if (ra_count_ > 0)
+              {
+                // rereads of a block do not count, only how far the buffer
+                // was consumed
+                if (blknum - ra_first_ + 1 > ra_used_)
+                  {
+                    ra_used_ = blknum - ra_first_ + 1;
+                  }
+                return ra_buff_
+                    + (blknum - ra_first_) * block_logical_size_bytes_;
+              }
+          }
+        return nullptr;
+      }
+
+      /**
+       * @brief  Track the block reads and start the next read-ahead when a
+       *    sequential stream reached the end of the buffer. The window grows
+       *    while the read-ahead blocks are all used and shrinks when they are
+       *    discarded unused.
+       * @param  blknum: first block just read.
+       * @param  nblocks: number of blocks just read.
+       */
+      void
+      qspi_impl::ra_update (blknum_t blknum, size_t nblocks)
+      {
+        bool sequential = (blknum == ra_next_);
+
+        ra_next_ = blknum + nblocks;
+        if (ra_limit_ == 0 || mapped_reads_ || keep_mapped_
+            || advice_ == advice_random
+            || (advice_ == advice_normal && sequential == false))
+          {
+            return;
+          }
+
+        // the next blocks are already in the buffer (or on their way)
+        if (ra_count_ > 0 && ra_next_ >= ra_first_
+            && ra_next_ < ra_first_ + ra_count_)
+          {
+            return;
+          }
+
+        if (advice_ == advice_sequential)
+          {
+            ra_window_ = ra_limit_;
+          }
+        else if (ra_count_ > 0 && ra_used_ >= ra_count_)
+          {
+            ra_window_ =
+                (ra_window_ * 2 > ra_limit_) ? ra_limit_ : ra_window_ * 2;
+          }
+        else if (ra_count_ > 0 && ra_used_ == 0 && ra_window_ > 1)
+          {
+            ra_window_ /= 2;
+          }
+        ra_start (ra_next_, ra_window_);
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
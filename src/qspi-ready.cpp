@@ -0,0 +1,250 @@
+/*
+ * qspi-ready.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This file implements the waits for the end of the page programs and of
+ * the erases. The calling thread first sleeps for most of the expected
+ * duration of the operation, with the controller idle, then the status
+ * register is polled by the controller, at an interval that is a fraction of
+ * the expected duration, until the chip is ready. The expected durations
+ * start from the typical ones of the device description and follow the
+ * measured ones; the timeouts are derived from the maximum durations.
+ */
+
+#include <cmsis-plus/rtos/os.h>
+#include "qspi-flash.h"
+#include "qspi-descr.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      /**
+       * @brief  Initialize the expected durations of the operations with the
+       *    typical ones of the device.
+       */
+      void
+      qspi_impl::ready_open (void)
+      {
+        for (int op = 0; op < op_count; op++)
+          {
+            expected_us_[op] = datasheet_duration ((operation_t) op).typical;
+          }
+      }
+
+      /**
+       * @brief  Return the durations of an operation, from the device
+       *    description.
+       * @param  op: the operation.
+       * @return The typical and maximum durations.
+       */
+      const qspi_duration_t&
+      qspi_impl::datasheet_duration (operation_t op)
+      {
+        switch (op)
+          {
+          case op_program:
+            return pdevice_->tPP;
+          case op_sector_erase:
+            return pdevice_->tSE;
+          case op_block32_erase:
+            return pdevice_->tBE32;
+          case op_block64_erase:
+            return pdevice_->tBE64;
+          default:
+            return pdevice_->tCE;
+          }
+      }
+
+      /**
+       * @brief  Return the operation of an erase command.
+       * @param  which: SECTOR_ERASE, BLOCK_32K_ERASE, BLOCK_64K_ERASE or
+       *    CHIP_ERASE.
+       * @return The operation.
+       */
+      qspi_impl::operation_t
+      qspi_impl::erase_operation (uint8_t which)
+      {
+        return (which == SECTOR_ERASE) ? op_sector_erase :
+               (which == BLOCK_32K_ERASE) ? op_block32_erase :
+               (which == BLOCK_64K_ERASE) ? op_block64_erase : op_chip_erase;
+      }
+
+      /**
+       * @brief  Compute the deadline of an operation: its maximum duration,
+       *    plus half of it and the command timeout as margin.
+       * @param  op: the operation.
+       * @return Timeout, in system clock ticks.
+       */
+      uint32_t
+      qspi_impl::ready_timeout (operation_t op)
+      {
+        uint32_t ms = (datasheet_duration (op).maximum + 999) / 1000;
+
+        return TIMEOUT + (ms + ms / 2) * one_ms;
+      }
+
+      /**
+       * @brief  Compute the time left to sleep before polling the end of an
+       *    operation: the most part (READY_SLEEP / 256) of its expected
+       *    duration, counted from its start.
+       * @param  op: the operation.
+       * @param  start: start of the operation, in hrclock ticks.
+       * @return Time left, in system clock ticks (0 if less than a tick).
+       */
+      uint32_t
+      qspi_impl::ready_sleep_ticks (operation_t op,
+                                    rtos::clock::timestamp_t start)
+      {
+        uint64_t elapsed_us = (rtos::hrclock.now () - start) * 1000000
+            / rtos::hrclock.input_clock_frequency_hz ();
+        uint64_t sleep_us = (uint64_t) expected_us_[op] * READY_SLEEP / 256;
+
+        return (sleep_us > elapsed_us) ?
+            (uint32_t) ((sleep_us - elapsed_us) * rtos::sysclock.frequency_hz
+                / 1000000) :
+            0;
+      }
+
+      /**
+       * @brief  Replace the sleep of the program and erase waits, e.g. by the
+       *    advance of a virtual clock when the chip is emulated. The status
+       *    register is still polled afterwards.
+       * @param  hook: function called with the time to sleep, in system clock
+       *    ticks, or nullptr to sleep on the system clock.
+       */
+      void
+      qspi_impl::set_sleep_hook (sleep_hook_t hook)
+      {
+        sleep_hook_ = hook;
+      }
+
+      /**
+       * @brief  Sleep for the most part of the expected duration of an
+       *    operation (see ready_sleep_ticks()); nothing is done if this is
+       *    less than a system clock tick.
+       * @param  op: the operation.
+       * @param  start: start of the operation, in hrclock ticks.
+       */
+      void
+      qspi_impl::ready_sleep (operation_t op, rtos::clock::timestamp_t start)
+      {
+        uint32_t ticks = ready_sleep_ticks (op, start);
+
+        if (ticks > 0 && sleep_hook_ != nullptr)
+          {
+            sleep_hook_ (ticks);
+          }
+        else if (ticks > 0)
+          {
+            rtos::sysclock.sleep_for (ticks);
+          }
+      }
+
+      /**
+       * @brief  Start the automatic polling of the status register, until
+       *    the chip is ready, at an interval of about 1 / READY_POLLS of the
+       *    expected duration of the operation.
+       * @param  op: the operation.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::ready_poll (operation_t op)
+      {
+        QSPI_AutoPollingTypeDef sConfig = cmds_.ready;
+        uint32_t bus_hz = SystemCoreClock / (hqspi_->Init.ClockPrescaler + 1);
+        uint64_t cycles = (uint64_t) expected_us_[op] * (bus_hz / 1000000)
+            / READY_POLLS;
+
+        // the interval register is 16 bits wide
+        sConfig.Interval =
+            (cycles > 0xFFFF) ? 0xFFFF :
+            (cycles < cmds_.ready.Interval) ? cmds_.ready.Interval :
+                                              (uint32_t) cycles;
+        semaphore_.reset ();
+        return io_poll_it (&cmds_.status, &sConfig);
+      }
+
+      /**
+       * @brief  Refine the expected duration of an operation with its
+       *    measured duration, limited to the maximum one and to a fraction
+       *    (1 / READY_MIN_DIV) of the typical one.
+       * @param  op: the operation, just completed.
+       * @param  start: start of the operation, in hrclock ticks.
+       */
+      void
+      qspi_impl::ready_update (operation_t op, rtos::clock::timestamp_t start)
+      {
+        const qspi_duration_t& limits = datasheet_duration (op);
+        int64_t measured = (int64_t) ((rtos::hrclock.now () - start) * 1000000
+            / rtos::hrclock.input_clock_frequency_hz ());
+        int64_t expected = expected_us_[op];
+
+        expected += (measured - expected) >> READY_WEIGHT_SHIFT;
+        if (expected > limits.maximum)
+          {
+            expected = limits.maximum;
+          }
+        else if (expected < limits.typical / READY_MIN_DIV)
+          {
+            expected = limits.typical / READY_MIN_DIV;
+          }
+        expected_us_[op] = (uint32_t) expected;
+      }
+
+      /**
+       * @brief  Wait for the end of a program or erase operation: sleep for
+       *    most of its expected duration, then poll the status register.
+       * @param  op: the operation.
+       * @param  start: start of the operation, in hrclock ticks.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::wait_ready (operation_t op, rtos::clock::timestamp_t start)
+      {
+        qspi_impl::qspi_result_t result;
+
+        ready_sleep (op, start);
+        result = ready_poll (op);
+        if (result == ok)
+          {
+            result =
+                (semaphore_.timed_wait (ready_timeout (op))
+                    == rtos::result::ok) ? ok : timeout;
+          }
+        if (result == ok)
+          {
+            ready_update (op, start);
+          }
+        return result;
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
@@ -0,0 +1,485 @@
+/*
+ * qspi-sched.cpp
+ *
+ * Copyright (c) 2016-2020 Lix N. Paulian (lix@paulian.net)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom
+ * the Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * This file implements the optional I/O scheduler: a driver thread executes
+ * the block device reads and writes, queued by the calling threads, which
+ * wait for their completion. The reads are served before the writes, the
+ * adjacent (or overlapping) queued reads are merged into a single transfer
+ * and the queued writes to the same sector are coalesced into a single
+ * sector update. While a write is executed, the queued reads that do not
+ * touch it are served between its page programs and, with the erase
+ * suspended, during its erases.
+ */
+
+#include <new>
+#include <string.h>
+#include <cmsis-plus/rtos/os.h>
+#include "qspi-flash.h"
+
+namespace os
+{
+  namespace driver
+  {
+    namespace stm32f7
+    {
+      /**
+       * @brief  Enable or disable the I/O scheduler. The setting is applied
+       *    the next time the block device is opened.
+       * @param  state: if true, the block reads and writes are executed by a
+       *    driver thread, the reads first.
+       */
+      void
+      qspi_impl::set_scheduler (bool state)
+      {
+        sched_ = state;
+      }
+
+      /**
+       * @brief  Allocate the merge buffer and start the scheduler thread.
+       * @return qspi::ok if successful, or qspi::error if out of memory.
+       */
+      qspi_impl::qspi_result_t
+      qspi_impl::sched_open (void)
+      {
+        // the buffer starts on a cache line, the data cache maintenance does
+        // not touch the neighbouring heap blocks
+        sched_alloc_ = new (std::nothrow) uint8_t[SCHED_MERGE_SIZE + 0x1F];
+        if (sched_alloc_ == nullptr)
+          {
+            return error;
+          }
+        sched_buff_ = (uint8_t*) (((uintptr_t) sched_alloc_ + 0x1F)
+            & ~(uintptr_t) 0x1F);
+        sched_reads_ = nullptr;
+        sched_writes_ = nullptr;
+
+        rtos::thread::attributes attr;
+        attr.th_priority = rtos::thread::priority::above_normal;
+        sched_stop_ = false;
+        scheduler_ = new (std::nothrow) rtos::thread
+          { "qspi-sched", io_scheduler, this, attr };
+        return (scheduler_ == nullptr) ? error : ok;
+      }
+
+      /**
+       * @brief  Stop the scheduler thread, once the queued requests are
+       *    executed, and release the merge buffer.
+       */
+      void
+      qspi_impl::sched_close (void)
+      {
+        if (scheduler_ != nullptr)
+          {
+            sched_stop_ = true;
+            sched_sem_.post ();
+            scheduler_->join ();
+            delete scheduler_;
+            scheduler_ = nullptr;
+          }
+        delete[] sched_alloc_;
+        sched_alloc_ = nullptr;
+        sched_buff_ = nullptr;
+      }
+
+      /**
+       * @brief  Queue a block request to the scheduler thread and wait for its
+       *    completion.
+       * @param  buff: buffer of the data.
+       * @param  blknum: the block number.
+       * @param  nblocks: number of blocks.
+       * @param  write: true for a write, false for a read.
+       * @return Number of blocks transferred.
+       */
+      ssize_t
+      qspi_impl::sched_submit (uint8_t* buff, blknum_t blknum, size_t nblocks,
+                               bool write)
+      {
+        rtos::semaphore_binary done
+          { "qspi-request", 0 };
+        sched_request_t req;
+        sched_request_t** pp;
+
+        req.next = nullptr;
+        req.buff = buff;
+        req.blknum = blknum;
+        req.nblocks = nblocks;
+        req.result = 0;
+        req.time = rtos::hrclock.now ();
+        req.done = &done;
+
+        sched_mx_.lock ();
+        for (pp = write ? &sched_writes_ : (sched_request_t**) &sched_reads_;
+            *pp != nullptr; pp = &(*pp)->next)
+          {
+            ;
+          }
+        *pp = &req;
+        sched_mx_.unlock ();
+
+        sched_sem_.post ();
+        if (write == false && sched_writing_)
+          {
+            // wake up the scheduler if it is waiting for an erase; a post
+            // outside of the wait would end the sleep of the next erase
+            io_mx_.lock ();
+            if (sched_writing_ && erase_busy_)
+              {
+                erase_sem_.post ();
+              }
+            io_mx_.unlock ();
+          }
+        done.wait ();
+        return req.result;
+      }
+
+      /**
+       * @brief  Check if a queued read touches the write being executed, or
+       *    the area being rewritten; such a read must wait for the write.
+       * @param  req: the read request.
+       * @return true if the read must wait, false otherwise.
+       */
+      bool
+      qspi_impl::sched_conflict (const sched_request_t* req)
+      {
+        uint32_t address = req->blknum * block_logical_size_bytes_;
+        size_t count = req->nblocks * block_logical_size_bytes_;
+
+        return sched_writing_
+            && ((req->blknum < sched_first_ + sched_count_
+                && req->blknum + req->nblocks > sched_first_)
+                || (address < flux_address_ + flux_count_
+                    && address + count > flux_address_));
+      }
+
+      /**
+       * @brief  Check if any queued read can be served during the write being
+       *    executed.
+       * @return true if a read is ready, false otherwise.
+       */
+      bool
+      qspi_impl::sched_ready (void)
+      {
+        bool ready = false;
+
+        sched_mx_.lock ();
+        for (sched_request_t* req = sched_reads_;
+            req != nullptr && ready == false; req = req->next)
+          {
+            ready = (sched_conflict (req) == false);
+          }
+        sched_mx_.unlock ();
+        return ready;
+      }
+
+      /**
+       * @brief  Serve the first queued read, merged with the queued reads
+       *    adjacent to it or overlapping it, as long as they fit in the merge
+       *    buffer.
+       * @param  nested: true if called during a write, with io_mx_ held; the
+       *    reads touching the write are left in the queue.
+       * @return true if a read was served, false if none is queued.
+       */
+      bool
+      qspi_impl::sched_read (bool nested)
+      {
+        size_t max_blocks = SCHED_MERGE_SIZE / block_logical_size_bytes_;
+        sched_request_t** pp;
+        sched_request_t* req;
+        sched_request_t* run;
+        blknum_t first;
+        blknum_t last;
+        uint32_t merged = 0;
+        bool grown;
+
+        sched_mx_.lock ();
+        for (pp = (sched_request_t**) &sched_reads_; (req = *pp) != nullptr;
+            pp = &req->next)
+          {
+            if (nested == false || sched_conflict (req) == false)
+              {
+                break;
+              }
+          }
+        if (req == nullptr)
+          {
+            sched_mx_.unlock ();
+            return false;
+          }
+        *pp = req->next;
+        req->next = nullptr;
+        run = req;
+        first = req->blknum;
+        last = req->blknum + req->nblocks;
+
+        // the union of the reads stays contiguous and, if the reads do not
+        // touch the write, so does it
+        do
+          {
+            grown = false;
+            for (pp = (sched_request_t**) &sched_reads_;
+                (req = *pp) != nullptr && last - first <= max_blocks;)
+              {
+                blknum_t f = (req->blknum < first) ? req->blknum : first;
+                blknum_t l =
+                    (req->blknum + req->nblocks > last) ?
+                        req->blknum + req->nblocks : last;
+
+                if (req->blknum <= last && req->blknum + req->nblocks >= first
+                    && l - f <= max_blocks
+                    && (nested == false || sched_conflict (req) == false))
+                  {
+                    *pp = req->next;
+                    req->next = run;
+                    run = req;
+                    first = f;
+                    last = l;
+                    merged++;
+                    grown = true;
+                  }
+                else
+                  {
+                    pp = &req->next;
+                  }
+              }
+          }
+        while (grown);
+        sched_mx_.unlock ();
+
+        // a single read goes directly to its buffer
+        uint8_t* buff = (merged == 0) ? run->buff : sched_buff_;
+        bool success =
+            nested ? (fetch_blocks (buff, first, last - first) == ok) :
+                (read_blocks (buff, first, last - first)
+                    == (ssize_t) (last - first));
+
+        sched_stats_.reads += merged + 1;
+        sched_stats_.merged += merged;
+        sched_stats_.interleaved += nested ? merged + 1 : 0;
+        while (run != nullptr)
+          {
+            req = run;
+            run = run->next;
+            if (success && merged > 0)
+              {
+                memcpy (req->buff,
+                        sched_buff_
+                            + (req->blknum - first) * block_logical_size_bytes_,
+                        req->nblocks * block_logical_size_bytes_);
+              }
+            req->result = success ? (ssize_t) req->nblocks : 0;
+
+            uint32_t ticks = (uint32_t) (rtos::hrclock.now () - req->time);
+            sched_stats_.wait_total += ticks;
+            if (ticks > sched_stats_.wait_max)
+              {
+                sched_stats_.wait_max = ticks;
+              }
+            req->done->post ();
+          }
+        return true;
+      }
+
+      /**
+       * @brief  Execute the first queued write. If it is inside a sector,
+       *    the following queued writes inside the same sector are coalesced
+       *    with it, up to the first write that overlaps the sector partly, and
+       *    the sector is updated once.
+       * @return true if a write was executed, false if none is queued.
+       */
+      bool
+      qspi_impl::sched_write (void)
+      {
+        size_t per_sector = block_physical_size_bytes_
+            / block_logical_size_bytes_;
+        sched_request_t** pp;
+        sched_request_t* req;
+        sched_request_t* head;
+        sched_request_t* tail;
+        blknum_t sector;
+        uint32_t covered = 0;
+        uint32_t coalesced = 0;
+        ssize_t result;
+
+        sched_mx_.lock ();
+        if ((head = sched_writes_) == nullptr)
+          {
+            sched_mx_.unlock ();
+            return false;
+          }
+        sched_writes_ = head->next;
+        head->next = nullptr;
+        tail = head;
+        sector = head->blknum / per_sector * per_sector;
+        if (head->blknum + head->nblocks <= sector + per_sector)
+          {
+            for (pp = &sched_writes_; (req = *pp) != nullptr;)
+              {
+                if (req->blknum >= sector
+                    && req->blknum + req->nblocks <= sector + per_sector)
+                  {
+                    *pp = req->next;
+                    req->next = nullptr;
+                    tail->next = req;
+                    tail = req;
+                    coalesced++;
+                  }
+                else if (req->blknum < sector + per_sector
+                    && req->blknum + req->nblocks > sector)
+                  {
+                    break;
+                  }
+                else
+                  {
+                    pp = &req->next;
+                  }
+              }
+          }
+        sched_mx_.unlock ();
+
+        if (coalesced == 0)
+          {
+            sched_first_ = head->blknum;
+            sched_count_ = head->nblocks;
+            sched_writing_ = true;
+            result = write_blocks (head->buff, head->blknum, head->nblocks);
+          }
+        else if (per_sector == 1)
+          {
+            // the last write replaces the whole sector
+            sched_first_ = sector;
+            sched_count_ = 1;
+            sched_writing_ = true;
+            result = write_blocks (tail->buff, sector, 1);
+          }
+        else
+          {
+            // the new content of the sector is built in the sector buffer;
+            // the blocks not written are read first
+            for (req = head; req != nullptr; req = req->next)
+              {
+                covered |= ((1 << req->nblocks) - 1) << (req->blknum - sector);
+              }
+            result = (ssize_t) per_sector;
+            if (covered != (uint32_t) ((1 << per_sector) - 1))
+              {
+                result = read_blocks (sector_buff_, sector, per_sector);
+              }
+            for (req = head; req != nullptr; req = req->next)
+              {
+                memcpy (sector_buff_
+                            + (req->blknum - sector) * block_logical_size_bytes_,
+                        req->buff, req->nblocks * block_logical_size_bytes_);
+              }
+            sched_first_ = sector;
+            sched_count_ = per_sector;
+            sched_writing_ = true;
+            if (result == (ssize_t) per_sector)
+              {
+                result = write_blocks (sector_buff_, sector, per_sector);
+              }
+          }
+        sched_writing_ = false;
+
+        sched_stats_.writes += coalesced + 1;
+        sched_stats_.coalesced += coalesced;
+        while (head != nullptr)
+          {
+            req = head;
+            head = head->next;
+            req->result = (coalesced == 0) ? result :
+                          (result > 0) ? (ssize_t) req->nblocks : 0;
+            req->done->post ();
+          }
+        return true;
+      }
+
+      /**
+       * @brief  Serve the queued reads that do not touch the write being
+       *    executed by the scheduler, between two page programs or with the
+       *    erase suspended. io_mx_ must be held. Nothing is done if the erase
+       *    cannot be suspended.
+       */
+      void
+      qspi_impl::sched_yield (void)
+      {
+        if (sched_writing_ == false || sched_ready () == false
+            || (erase_busy_ && erase_suspend () != ok))
+          {
+            return;
+          }
+        for (int i = 0; i < SCHED_READ_BURST && sched_read (true); i++)
+          {
+            ;
+          }
+        if (erase_suspended_)
+          {
+            erase_resume ();
+          }
+      }
+
+      /**
+       * @brief  Scheduler thread: serve the queued reads first, but let a
+       *    write through after SCHED_READ_BURST reads in a row.
+       * @param  args: pointer to the qspi_impl object.
+       */
+      void*
+      qspi_impl::io_scheduler (void* args)
+      {
+        qspi_impl* pq = static_cast<qspi_impl*> (args);
+        int burst = 0;
+
+        for (;;)
+          {
+            if (burst < SCHED_READ_BURST && pq->sched_read (false))
+              {
+                burst++;
+              }
+            else if (pq->sched_write ())
+              {
+                burst = 0;
+              }
+            else if (burst > 0)
+              {
+                burst = 0;
+              }
+            else if (pq->sched_stop_)
+              {
+                break;
+              }
+            else
+              {
+                pq->sched_sem_.wait ();
+              }
+          }
+        return nullptr;
+      }
+
+    } /* namespace stm32f7 */
+  } /* namespace driver */
+} /* namespace os */
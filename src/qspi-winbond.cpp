@@ -56,16 +56,8 @@ namespace os
         qspi_impl::qspi_result_t result = qspi_impl::busy;
         uint8_t datareg;
 
-        // Initial command settings
-        sCommand.AddressSize = QSPI_ADDRESS_24_BITS;
-        sCommand.AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
-        sCommand.DdrMode = QSPI_DDR_MODE_DISABLE;
-        sCommand.DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
-        sCommand.SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
-        sCommand.InstructionMode = QSPI_INSTRUCTION_1_LINE;
-        sCommand.AddressMode = QSPI_ADDRESS_NONE;
-        sCommand.DataMode = QSPI_DATA_NONE;
-        sCommand.DummyCycles = 0;
+        // The chip is still in SPI mode
+        sCommand = pq->cmds_.spi;
         sCommand.NbData = 1;
 
         // Enable volatile write
@@ -78,7 +70,7 @@ namespace os
             sCommand.DataMode = QSPI_DATA_1_LINE;
             sCommand.Instruction = WRITE_STATUS_REGISTER_2;
             result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (
-                pq->hqspi_, &sCommand, qspi_impl::WRITE_TIMEOUT);
+                pq->hqspi_, &sCommand, qspi_impl::TIMEOUT);
             if (result == qspi_impl::ok)
               {
                 datareg = 2;
@@ -100,7 +92,7 @@ namespace os
                         if (result == qspi_impl::ok)
                           {
                             // Compute and set number of dummy cycles
-                            datareg = (pq->pdevice_->dummy_cycles / 2) - 1;
+                            datareg = (pq->dummy_cycles_ / 2) - 1;
                             datareg <<= 4;
                             result =
                                 (qspi_impl::qspi_result_t) HAL_QSPI_Transmit (
@@ -113,6 +105,40 @@ namespace os
         return result;
       }
 
+      /**
+       * @brief  Suspend the erase in progress. The area being erased must not
+       *    be read until the erase is resumed and complete.
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_winbond::suspend_erase (qspi_impl* pq)
+      {
+        qspi_impl::qspi_result_t result;
+
+        result = (qspi_impl::qspi_result_t) HAL_QSPI_Command (
+            pq->hqspi_, &pq->cmds_.suspend, qspi_impl::TIMEOUT);
+        if (result == qspi_impl::ok)
+          {
+            // The chip is suspended when BUSY clears (tSUS, 20 us max)
+            result = (qspi_impl::qspi_result_t) HAL_QSPI_AutoPolling (
+                pq->hqspi_, &pq->cmds_.status, &pq->cmds_.ready,
+                qspi_impl::TIMEOUT);
+          }
+        return result;
+      }
+
+      /**
+       * @brief  Resume the erase suspended with suspend_erase().
+       * @return qspi::ok if successful, a qspi error otherwise.
+       */
+      qspi_impl::qspi_result_t
+      qspi_winbond::resume_erase (qspi_impl* pq)
+      {
+        return (qspi_impl::qspi_result_t) HAL_QSPI_Command (pq->hqspi_,
+                                                            &pq->cmds_.resume,
+                                                            qspi_impl::TIMEOUT);
+      }
+
     } /* namespace stm32f7 */
   } /* namespace driver */
 } /* namespace os */
@@ -48,6 +48,12 @@ namespace os
         virtual qspi_impl::qspi_result_t
         enter_quad_mode (qspi_impl* pq) override;
 
+        virtual qspi_impl::qspi_result_t
+        suspend_erase (qspi_impl* pq) override;
+
+        virtual qspi_impl::qspi_result_t
+        resume_erase (qspi_impl* pq) override;
+
       private:
         // Winbond specific commands
         static constexpr uint8_t VOLATILE_SR_WRITE_ENABLE = 0x50;
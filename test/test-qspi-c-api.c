@@ -92,7 +92,7 @@ void
 test_qspi (void)
 {
   int i;
-  uint8_t* pf = (uint8_t*) 0x90000000; // memory-mapped flash address
+  uint8_t* pf = (uint8_t*) QSPI_BASE; // memory-mapped flash address
   int sector_size;
   int sector_count;
 
@@ -208,7 +208,7 @@ test_qspi (void)
 
 #else
       uint32_t i;
-      uint8_t* pf = (uint8_t*) 0x90000000; // memory-mapped flash address
+      uint8_t* pf = (uint8_t*) QSPI_BASE; // memory-mapped flash address
 
       // read memory parameters and initialize system
       if (flash.impl ().initialize () != qspi_impl::ok)